@@ -0,0 +1,2 @@
+-- ANALYZE of a large foreign table
+ANALYZE fdw_bench.narrow;
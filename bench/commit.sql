@@ -0,0 +1,7 @@
+-- transaction touching two servers, so that two remote transactions are
+-- committed
+\setrandom id 1 :rows
+BEGIN;
+SELECT v FROM fdw_bench.narrow WHERE id = :id;
+SELECT v FROM fdw_bench.narrow_b WHERE id = :id;
+COMMIT;
@@ -0,0 +1,3 @@
+-- selective scan, with the condition pushed down
+\setrandom lo 1 :rows
+SELECT count(*) FROM fdw_bench.narrow WHERE id BETWEEN :lo AND :lo + 999;
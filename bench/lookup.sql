@@ -0,0 +1,5 @@
+-- nested loop doing one parameterized remote lookup per outer row
+SET enable_hashjoin = off;
+SET enable_mergejoin = off;
+SET enable_material = off;
+SELECT count(*) FROM fdw_bench.keys k JOIN fdw_bench.narrow n ON n.id = k.id;
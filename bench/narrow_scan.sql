@@ -0,0 +1,2 @@
+-- full scan of a table of narrow rows
+SELECT count(*) FROM fdw_bench.narrow;
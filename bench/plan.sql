@@ -0,0 +1,3 @@
+-- planning with remote estimates; EXPLAIN plans without executing
+\setrandom v 0 999
+EXPLAIN SELECT * FROM fdw_bench.narrow_est WHERE v = :v;
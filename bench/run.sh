@@ -0,0 +1,115 @@
+#!/bin/sh
+#
+# Benchmark driver for postgres_fdw; see bench/README.
+#
+# Runs each pgbench script of this directory against the local database
+# and reports, per case: transactions per second, rows fetched per second,
+# round trips per transaction, and the median and 99th percentile of the
+# transaction latency.  The rows and round trips come from
+# postgres_fdw_stats, which sees the pgbench sessions only if postgres_fdw
+# is in shared_preload_libraries of the local server; otherwise they are
+# reported as "-".
+#
+# contrib/postgres_fdw/bench/run.sh
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+
+# local database, reached through the usual libpq environment variables
+: ${BENCH_DB:=fdw_bench}
+# remote database
+: ${BENCH_REMOTE_HOST:=localhost}
+: ${BENCH_REMOTE_PORT:=5432}
+: ${BENCH_REMOTE_DB:=fdw_bench_remote}
+: ${BENCH_REMOTE_USER:=$(whoami)}
+# rows of the narrow table (the wide one has a tenth of them)
+: ${BENCH_ROWS:=1000000}
+# cases to run, and for how long, with how many clients
+: ${BENCH_CASES:=narrow_scan wide_scan filter lookup analyze plan commit}
+: ${BENCH_DURATION:=30}
+: ${BENCH_CLIENTS:=1}
+# options to add to both foreign servers, e.g. "fetch_size '1000', prefetch
+# 'true'"; they stay until the servers are set up again
+: ${BENCH_SERVER_OPTIONS:=}
+# network latency to add, in ms, and the interface to add it to
+: ${BENCH_LATENCY:=0}
+: ${BENCH_LATENCY_DEV:=lo}
+# set to skip creating the tables, when they are there already
+: ${BENCH_SKIP_SETUP:=}
+# where to keep the pgbench logs
+: ${BENCH_WORK:=${TMPDIR:-/tmp}/fdw_bench.$$}
+
+local_psql()
+{
+	psql -X -q -v ON_ERROR_STOP=1 -d "$BENCH_DB" "$@"
+}
+
+if [ -z "$BENCH_SKIP_SETUP" ]; then
+	echo "setting up tables of $BENCH_ROWS rows..."
+	psql -X -q -v ON_ERROR_STOP=1 -h "$BENCH_REMOTE_HOST" \
+		-p "$BENCH_REMOTE_PORT" -U "$BENCH_REMOTE_USER" \
+		-v rows="$BENCH_ROWS" -d "$BENCH_REMOTE_DB" \
+		-f "$BENCH_DIR/setup_remote.sql"
+	local_psql -v host="$BENCH_REMOTE_HOST" -v port="$BENCH_REMOTE_PORT" \
+		-v dbname="$BENCH_REMOTE_DB" -v user="$BENCH_REMOTE_USER" \
+		-v rows="$BENCH_ROWS" -f "$BENCH_DIR/setup_local.sql"
+fi
+
+if [ -n "$BENCH_SERVER_OPTIONS" ]; then
+	local_psql -c "ALTER SERVER fdw_bench_a OPTIONS (ADD $BENCH_SERVER_OPTIONS)"
+	local_psql -c "ALTER SERVER fdw_bench_b OPTIONS (ADD $BENCH_SERVER_OPTIONS)"
+fi
+
+# Delay every packet on the interface; on lo, that's both directions, so
+# the round trip time grows by twice the delay.
+cleanup()
+{
+	if [ "$BENCH_LATENCY" != 0 ]; then
+		tc qdisc del dev "$BENCH_LATENCY_DEV" root netem || true
+	fi
+	rm -rf "$BENCH_WORK"
+}
+trap cleanup EXIT
+if [ "$BENCH_LATENCY" != 0 ]; then
+	tc qdisc add dev "$BENCH_LATENCY_DEV" root netem delay "${BENCH_LATENCY}ms"
+fi
+
+shared_stats=$(local_psql -A -t -c "SELECT current_setting('shared_preload_libraries') LIKE '%postgres_fdw%'")
+
+mkdir -p "$BENCH_WORK"
+printf "%-12s %10s %12s %10s %10s %10s\n" \
+	case tps rows/s trips/xact p50_ms p99_ms
+
+for case in $BENCH_CASES; do
+	dir="$BENCH_WORK/$case"
+	mkdir -p "$dir"
+
+	local_psql -c "SELECT postgres_fdw_stats_reset()" > /dev/null
+
+	(cd "$dir" && pgbench -n -l -f "$BENCH_DIR/$case.sql" \
+		-D rows="$BENCH_ROWS" -c "$BENCH_CLIENTS" -j "$BENCH_CLIENTS" \
+		-T "$BENCH_DURATION" "$BENCH_DB" > pgbench.out 2>&1) || {
+		cat "$dir/pgbench.out" >&2
+		exit 1
+	}
+
+	tps=$(sed -n 's/^tps = \([0-9.]*\) (excluding.*/\1/p' "$dir/pgbench.out")
+	xacts=$(sed -n 's/^number of transactions actually processed: \([0-9]*\).*/\1/p' "$dir/pgbench.out")
+
+	# the third field of the log lines is the latency in microseconds
+	cat "$dir"/pgbench_log.* | awk '{ print $3 }' | sort -n > "$dir/latency"
+	p50=$(awk '{ v[NR] = $1 } END { i = int(NR * 0.50); if (i < 1) i = 1; printf "%.3f", v[i] / 1000 }' "$dir/latency")
+	p99=$(awk '{ v[NR] = $1 } END { i = int(NR * 0.99); if (i < 1) i = 1; printf "%.3f", v[i] / 1000 }' "$dir/latency")
+
+	if [ "$shared_stats" = t ]; then
+		rows_s=$(local_psql -A -t -c "SELECT round(coalesce(sum(rows_fetched), 0) / $BENCH_DURATION.0) FROM postgres_fdw_stats WHERE srvname LIKE 'fdw_bench_%'")
+		trips=$(local_psql -A -t -c "SELECT round(coalesce(sum(round_trips), 0) / greatest($xacts, 1)::numeric, 2) FROM postgres_fdw_stats WHERE srvname LIKE 'fdw_bench_%'")
+	else
+		rows_s=-
+		trips=-
+	fi
+
+	printf "%-12s %10s %12s %10s %10s %10s\n" \
+		"$case" "$tps" "$rows_s" "$trips" "$p50" "$p99"
+done
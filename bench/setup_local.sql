@@ -0,0 +1,60 @@
+-- Foreign servers and tables used by the benchmarks, created in the local
+-- database.  Set the psql variables host, port, dbname and user to reach
+-- the remote database, and rows as for setup_remote.sql.  The two servers
+-- point to the same database, but use separate connections.
+
+CREATE EXTENSION IF NOT EXISTS postgres_fdw;
+
+DROP SCHEMA IF EXISTS fdw_bench CASCADE;
+DROP SERVER IF EXISTS fdw_bench_a CASCADE;
+DROP SERVER IF EXISTS fdw_bench_b CASCADE;
+
+CREATE SERVER fdw_bench_a FOREIGN DATA WRAPPER postgres_fdw
+	OPTIONS (host :'host', port :'port', dbname :'dbname');
+CREATE SERVER fdw_bench_b FOREIGN DATA WRAPPER postgres_fdw
+	OPTIONS (host :'host', port :'port', dbname :'dbname');
+CREATE USER MAPPING FOR CURRENT_USER SERVER fdw_bench_a
+	OPTIONS (user :'user');
+CREATE USER MAPPING FOR CURRENT_USER SERVER fdw_bench_b
+	OPTIONS (user :'user');
+
+CREATE SCHEMA fdw_bench;
+
+CREATE FOREIGN TABLE fdw_bench.narrow (
+	id int NOT NULL,
+	v int NOT NULL
+) SERVER fdw_bench_a
+  OPTIONS (schema_name 'fdw_bench_remote', table_name 'narrow');
+
+CREATE FOREIGN TABLE fdw_bench.narrow_b (
+	id int NOT NULL,
+	v int NOT NULL
+) SERVER fdw_bench_b
+  OPTIONS (schema_name 'fdw_bench_remote', table_name 'narrow');
+
+-- for measuring the planning overhead of remote estimates
+CREATE FOREIGN TABLE fdw_bench.narrow_est (
+	id int NOT NULL,
+	v int NOT NULL
+) SERVER fdw_bench_a
+  OPTIONS (schema_name 'fdw_bench_remote', table_name 'narrow',
+		   use_remote_estimate 'true');
+
+CREATE FOREIGN TABLE fdw_bench.wide (
+	id int NOT NULL,
+	t1 text, t2 text, t3 text, t4 text, t5 text,
+	t6 text, t7 text, t8 text, t9 text, t10 text,
+	n1 numeric, n2 numeric, n3 numeric, n4 numeric,
+	ts1 timestamptz, ts2 timestamptz, ts3 timestamptz, ts4 timestamptz,
+	b bytea
+) SERVER fdw_bench_a
+  OPTIONS (schema_name 'fdw_bench_remote', table_name 'wide');
+
+-- outer rows of the parameterized lookups
+CREATE TABLE fdw_bench.keys AS
+	SELECT (random() * (:rows - 1))::int + 1 AS id
+	FROM generate_series(1, 100);
+
+ANALYZE fdw_bench.keys;
+ANALYZE fdw_bench.narrow;
+ANALYZE fdw_bench.wide;
@@ -0,0 +1,38 @@
+-- Tables scanned by the benchmarks, created in the remote database.
+-- Set the psql variable rows to the number of rows of the narrow table;
+-- the wide one gets a tenth of that.
+
+DROP SCHEMA IF EXISTS fdw_bench_remote CASCADE;
+CREATE SCHEMA fdw_bench_remote;
+
+CREATE TABLE fdw_bench_remote.narrow (
+	id int PRIMARY KEY,
+	v int NOT NULL
+);
+INSERT INTO fdw_bench_remote.narrow
+	SELECT i, i % 1000 FROM generate_series(1, :rows) i;
+
+CREATE TABLE fdw_bench_remote.wide (
+	id int PRIMARY KEY,
+	t1 text, t2 text, t3 text, t4 text, t5 text,
+	t6 text, t7 text, t8 text, t9 text, t10 text,
+	n1 numeric, n2 numeric, n3 numeric, n4 numeric,
+	ts1 timestamptz, ts2 timestamptz, ts3 timestamptz, ts4 timestamptz,
+	b bytea
+);
+INSERT INTO fdw_bench_remote.wide
+	SELECT i,
+	       md5(i::text), md5((i + 1)::text), md5((i + 2)::text),
+	       md5((i + 3)::text), md5((i + 4)::text), md5((i + 5)::text),
+	       md5((i + 6)::text), md5((i + 7)::text), md5((i + 8)::text),
+	       md5((i + 9)::text),
+	       i * 1.5, i / 7.0, i * 100.25, i - 0.125,
+	       '2000-01-01'::timestamptz + i * interval '1 minute',
+	       '2010-01-01'::timestamptz + i * interval '1 second',
+	       '2020-01-01'::timestamptz - i * interval '1 hour',
+	       '1990-01-01'::timestamptz + i * interval '1 day',
+	       decode(md5(i::text) || md5((-i)::text), 'hex')
+	FROM generate_series(1, :rows / 10) i;
+
+ANALYZE fdw_bench_remote.narrow;
+ANALYZE fdw_bench_remote.wide;
@@ -0,0 +1,3 @@
+-- full scan of a table of wide rows; the whole-row reference makes all the
+-- columns be fetched and converted
+SELECT count(w.*) FROM fdw_bench.wide w;
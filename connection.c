@@ -12,13 +12,20 @@
  */
 #include "postgres.h"
 
+#include <poll.h>
+
 #include "postgres_fdw.h"
 
 #include "access/xact.h"
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
+#include "portability/instr_time.h"
+#include "utils/builtins.h"
 #include "utils/hsearch.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
 
 
 /*
@@ -27,28 +34,91 @@
  * The lookup key in this hash table is the foreign server OID plus the user
  * mapping OID.  (We use just one connection per user per foreign server,
  * so that we can ensure all scans use the same snapshot during a query.)
+ * The exception is a scan split over several connections: its extra
+ * connections, numbered from 1 up in the "worker" key field, are kept
+ * separately, and their remote transactions import the snapshot of the main
+ * connection's (worker 0) transaction, whose ID is kept in snapshot_id.
  *
  * The "conn" pointer can be NULL if we don't currently have a live connection.
- * When we do have a connection, xact_depth tracks the current depth of
+ * While "connecting" is set, conn is still being established asynchronously
+ * (see StartConnection), and poll_status is what PQconnectPoll last said about
+ * it; connect_deadline is when we give up on it, per the connect_timeout
+ * option, or 0 if never, and timed_out says we did.  When we do have a
+ * connection, xact_depth tracks the current depth of
  * transactions and subtransactions open on the remote side.  We need to issue
  * commands at the same nesting depth on the remote as we're executing at
  * ourselves, so that rolling back a subtransaction will kill the right
- * queries and not the wrong ones.
+ * queries and not the wrong ones.  begin_level is the depth the remote side
+ * must be brought to before the next command; it can be ahead of xact_depth
+ * when GetConnection was asked to defer the START TRANSACTION and SAVEPOINT
+ * commands, so that they can be sent along with the first real command.
+ *
+ * server_version is the remote server version seen on the last connection,
+ * which tells us which session settings the server accepts: if it's known,
+ * they are sent along in the startup packet rather than as SET commands (see
+ * configure_remote_session).  settings_version is the version a connection
+ * being established was started for, or 0 if it was started without them.
+ * options_rejected is set once a connection with the settings in the startup
+ * packet failed and one without them then worked, as happens with poolers
+ * such as pgbouncer that don't accept the "options" startup parameter; from
+ * then on we go straight to SET commands.
+ *
+ * The state struct tracks any asynchronous request outstanding on the
+ * connection; see postgres_fdw.h.
+ *
+ * prep_stmts lists the statements we have prepared on the connection, most
+ * recently used first; see GetPreparedStatement.
  */
 typedef struct ConnCacheKey
 {
 	Oid			serverid;		/* OID of foreign server */
 	Oid			userid;			/* OID of local user whose mapping we use */
+	int			worker;			/* 0 for the main connection, else 1 and up */
 } ConnCacheKey;
 
 typedef struct ConnCacheEntry
 {
 	ConnCacheKey key;			/* hash key (must be first) */
 	PGconn	   *conn;			/* connection to foreign server, or NULL */
+	bool		connecting;		/* is conn still being established? */
+	bool		prestarted;		/* was it started before it was needed? */
+	PostgresPollingStatusType poll_status;	/* progress, if connecting */
+	TimestampTz connect_deadline;	/* give up connecting then, or 0 */
+	bool		timed_out;		/* did we give up for that? */
+	int			server_version; /* remote version last seen, or 0 */
+	int			settings_version;	/* version conn was started for, or 0 */
+	bool		options_rejected;	/* must settings be made by SET? */
 	int			xact_depth;		/* 0 = no xact open, 1 = main xact open, 2 =
 								 * one level of subxact open, etc */
+	int			begin_level;	/* xact_depth wanted before next command */
+	bool		xact_cmd_sent;	/* transaction end command awaiting result? */
+	char		snapshot_id[64];	/* exported (worker 0) or to be imported
+									 * snapshot, or empty */
+	PgFdwConnState state;		/* extra per-connection state */
+	List	   *prep_stmts;		/* PgFdwPreparedStmt list, in LRU order */
+	unsigned int prep_number;	/* last statement number assigned */
 } ConnCacheEntry;
 
+/*
+ * A statement prepared on a connection, named p<stmt_number>.  We identify
+ * it by its text and number of parameters; since every parameter reference
+ * in the text has an explicit cast, and unused parameter slots are always
+ * declared as int4, that determines the parameter types too.
+ */
+typedef struct PgFdwPreparedStmt
+{
+	char	   *sql;			/* statement text */
+	int			nparams;		/* number of parameters */
+	unsigned int stmt_number;	/* ID of the statement */
+	bool		stale;			/* must it be prepared again before use? */
+} PgFdwPreparedStmt;
+
+/*
+ * Maximum number of prepared statements kept per connection; the least
+ * recently used one is deallocated to make room for a new one.
+ */
+#define MAX_PREPARED_STMTS	64
+
 /*
  * Connection cache (initialized on first use)
  */
@@ -60,12 +130,48 @@ static unsigned int cursor_number = 0;
 /* tracks whether any work is needed in callback functions */
 static bool xact_got_connection = false;
 
+/* servers to start connecting to on first use (a GUC) */
+char	   *pgfdw_prewarm_servers = NULL;
+
+/* how long to wait for connection progress between interrupt checks (ms) */
+#define CONNECT_POLL_INTERVAL	1000
+
+/* maximum number of settings made by configure_remote_session */
+#define MAX_SESSION_SETTINGS	8
+
 /* prototypes of private functions */
-static PGconn *connect_pg_server(ForeignServer *server, UserMapping *user);
+static void init_connection_cache(void);
+static PGconn *get_connection(ForeignServer *server, UserMapping *user,
+			   int worker, bool defer_begin, PgFdwConnState **state);
+static ConnCacheEntry *get_conn_entry(Oid serverid, Oid userid, int worker);
+static void prewarm_connections(void);
+static void start_pg_connection(ConnCacheEntry *entry, ForeignServer *server,
+					UserMapping *user);
+static void finish_pg_connection(ConnCacheEntry *entry, ForeignServer *server);
+static void wait_for_connections(void);
 static void check_conn_params(const char **keywords, const char **values);
-static void configure_remote_session(PGconn *conn);
-static void do_sql_command(PGconn *conn, const char *sql);
+static int get_session_settings(int remoteversion,
+					 const char **names, const char **values);
+static char *session_startup_options(int remoteversion);
+static void configure_remote_session(ConnCacheEntry *entry);
+static void do_sql_command(PGconn *conn, PgFdwStats *stats, const char *sql);
 static void begin_remote_xact(ConnCacheEntry *entry);
+static bool append_begin_commands(ConnCacheEntry *entry, StringInfo buf);
+static ConnCacheEntry *find_conn_entry(PGconn *conn);
+static void deallocate_prepared_stmt(ConnCacheEntry *entry,
+						 PgFdwPreparedStmt *stmt);
+static void forget_prepared_stmts(ConnCacheEntry *entry);
+static void pgfdw_collect_pending(PGconn *conn, PgFdwConnState *state,
+					  bool keep_data);
+static void pgfdw_close_copy_savepoint(PGconn *conn, PgFdwConnState *state);
+static void pgfdw_cancel_request(PGconn *conn);
+static void pgfdw_cancel_pending(PGconn *conn, PgFdwConnState *state);
+static void pgfdw_reset_pending(PgFdwConnState *state);
+static void count_connection_error(PGconn *conn);
+static void pgfdw_report_send_error(int elevel, PGconn *conn,
+						const char *sql);
+static void send_xact_command(ConnCacheEntry *entry, const char *sql);
+static PGresult *get_xact_command_result(ConnCacheEntry *entry);
 static void pgfdw_xact_callback(XactEvent event, void *arg);
 static void pgfdw_subxact_callback(SubXactEvent event,
 					   SubTransactionId mySubid,
@@ -79,6 +185,18 @@ static void pgfdw_subxact_callback(SubXactEvent event,
  * if we don't already have a suitable one, and a transaction is opened at
  * the right subtransaction nesting depth if we didn't do that already.
  *
+ * If defer_begin is true, the commands starting the remote transaction or
+ * subtransaction are not sent yet: the caller promises to prefix them to its
+ * first command with pgfdw_append_begin, or to call pgfdw_begin_xact first,
+ * which saves a round trip.
+ *
+ * If state is not NULL, *state receives a pointer to the per-connection state
+ * struct, which callers that want to issue asynchronous requests need.  On
+ * return, no request is in flight on the connection, unless defer_begin is
+ * true (in which case we needn't wait for one, since we send nothing); but
+ * since that can change whenever control leaves the caller anyway, anyone
+ * who sends a command later must call pgfdw_absorb_pending first.
+ *
  * XXX Note that caching connections theoretically requires a mechanism to
  * detect change of FDW objects to invalidate already established connections.
  * We could manage that by watching for invalidation events on the relevant
@@ -87,52 +205,83 @@ static void pgfdw_subxact_callback(SubXactEvent event,
  * mid-transaction anyway.
  */
 PGconn *
-GetConnection(ForeignServer *server, UserMapping *user)
+GetConnection(ForeignServer *server, UserMapping *user, bool defer_begin,
+			  PgFdwConnState **state)
 {
-	bool		found;
+	return get_connection(server, user, 0, defer_begin, state);
+}
+
+/*
+ * Get one of the extra connections used by a scan split over several
+ * connections (see postgresBeginForeignScan), numbered from 1 up.  If a
+ * remote transaction needs to be started on it, it will adopt the given
+ * snapshot, which the caller got from pgfdw_export_snapshot on the main
+ * connection.  Otherwise this works like GetConnection with defer_begin.
+ */
+PGconn *
+GetWorkerConnection(ForeignServer *server, UserMapping *user, int worker,
+					const char *snapshot, PgFdwConnState **state)
+{
+	PGconn	   *conn;
 	ConnCacheEntry *entry;
-	ConnCacheKey key;
 
-	/* First time through, initialize connection cache hashtable */
+	Assert(worker > 0);
+	conn = get_connection(server, user, worker, true, state);
+
+	entry = find_conn_entry(conn);
+	if (entry->xact_depth == 0)
+		strlcpy(entry->snapshot_id, snapshot, sizeof(entry->snapshot_id));
+
+	return conn;
+}
+
+/*
+ * Start establishing the extra connections 1 to nworkers of a scan split over
+ * several connections, so that their handshakes can proceed in parallel
+ * before GetWorkerConnection waits for each one.
+ */
+void
+StartWorkerConnections(ForeignServer *server, UserMapping *user, int nworkers)
+{
+	int			i;
+
 	if (ConnectionHash == NULL)
-	{
-		HASHCTL		ctl;
+		init_connection_cache();
 
-		MemSet(&ctl, 0, sizeof(ctl));
-		ctl.keysize = sizeof(ConnCacheKey);
-		ctl.entrysize = sizeof(ConnCacheEntry);
-		ctl.hash = tag_hash;
-		/* allocate ConnectionHash in the cache context */
-		ctl.hcxt = CacheMemoryContext;
-		ConnectionHash = hash_create("postgres_fdw connections", 8,
-									 &ctl,
-								   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+	for (i = 1; i <= nworkers; i++)
+	{
+		ConnCacheEntry *entry = get_conn_entry(server->serverid,
+											   user->userid, i);
 
-		/*
-		 * Register some callback functions that manage connection cleanup.
-		 * This should be done just once in each backend.
-		 */
-		RegisterXactCallback(pgfdw_xact_callback, NULL);
-		RegisterSubXactCallback(pgfdw_subxact_callback, NULL);
+		if (entry->conn == NULL)
+		{
+			entry->xact_depth = 0;	/* just to be sure */
+			entry->begin_level = 0;
+			start_pg_connection(entry, server, user);
+		}
 	}
+}
+
+/*
+ * Workhorse for GetConnection and GetWorkerConnection.
+ */
+static PGconn *
+get_connection(ForeignServer *server, UserMapping *user, int worker,
+			   bool defer_begin, PgFdwConnState **state)
+{
+	ConnCacheEntry *entry;
+
+	/* First time through, initialize connection cache hashtable */
+	if (ConnectionHash == NULL)
+		init_connection_cache();
 
 	/* Set flag that we did GetConnection during the current transaction */
 	xact_got_connection = true;
 
-	/* Create hash key for the entry.  Assume no pad bytes in key struct */
-	key.serverid = server->serverid;
-	key.userid = user->userid;
-
 	/*
 	 * Find or create cached entry for requested connection.
 	 */
-	entry = hash_search(ConnectionHash, &key, HASH_ENTER, &found);
-	if (!found)
-	{
-		/* initialize new hashtable entry (key is already filled in) */
-		entry->conn = NULL;
-		entry->xact_depth = 0;
-	}
+	entry = get_conn_entry(server->serverid, user->userid, worker);
 
 	/*
 	 * We don't check the health of cached connection here, because it would
@@ -142,81 +291,409 @@ GetConnection(ForeignServer *server, UserMapping *user)
 
 	/*
 	 * If cache entry doesn't have a connection, we have to establish a new
-	 * connection.	(If connect_pg_server throws an error, the cache entry
-	 * will be left in a valid empty state.)
+	 * connection; or finish establishing it, if somebody started that for us
+	 * already.  (If that throws an error, the cache entry will be left in a
+	 * valid empty state.)
 	 */
+	if (entry->conn != NULL && !entry->connecting)
+		entry->state.stats->connections_reused++;
 	if (entry->conn == NULL)
 	{
 		entry->xact_depth = 0;	/* just to be sure */
-		entry->conn = connect_pg_server(server, user);
+		entry->begin_level = 0;
+		start_pg_connection(entry, server, user);
+	}
+	if (entry->connecting)
+	{
+		finish_pg_connection(entry, server);
 		elog(DEBUG3, "new postgres_fdw connection %p for server \"%s\"",
 			 entry->conn, server->servername);
 	}
 
 	/*
-	 * Start a new transaction or subtransaction if needed.
+	 * Start a new transaction or subtransaction if needed, or make a note to
+	 * do so later.  In the former case, first collect the result of any
+	 * request in flight, so that our callers (and begin_remote_xact) are
+	 * free to use the connection.
 	 */
-	begin_remote_xact(entry);
+	entry->begin_level = Max(entry->begin_level,
+							 GetCurrentTransactionNestLevel());
+	if (!defer_begin)
+	{
+		pgfdw_absorb_pending(entry->conn, &entry->state);
+		begin_remote_xact(entry);
+	}
+
+	if (state)
+		*state = &entry->state;
 
 	return entry->conn;
 }
 
 /*
- * Connect to remote server using specified server and user mapping properties.
+ * Start establishing a connection to the given server for the given local
+ * user, if there isn't one already, without waiting for it to complete.
+ * A later GetConnection for the same server and user picks it up.
+ *
+ * This lets the connection handshakes of several servers proceed while we
+ * wait for any one of them (see wait_for_connections).  Since the connection
+ * isn't actually needed yet, we don't complain about anything here: if the
+ * user has no user mapping for the server, we do nothing, and any problem
+ * connecting is reported when the connection is asked for.
  */
-static PGconn *
-connect_pg_server(ForeignServer *server, UserMapping *user)
+void
+StartConnection(ForeignServer *server, Oid userid)
+{
+	ConnCacheEntry *entry;
+	ConnCacheKey key;
+	UserMapping *user;
+	ListCell   *lc;
+
+	if (ConnectionHash == NULL)
+		init_connection_cache();
+
+	/* Quick exit if we have the connection already */
+	key.serverid = server->serverid;
+	key.userid = userid;
+	key.worker = 0;
+	entry = hash_search(ConnectionHash, &key, HASH_FIND, NULL);
+	if (entry && entry->conn)
+		return;
+
+	/* GetUserMapping throws an error if there's no mapping; check first */
+	if (!SearchSysCacheExists2(USERMAPPINGUSERSERVER,
+							   ObjectIdGetDatum(userid),
+							   ObjectIdGetDatum(server->serverid)) &&
+		!SearchSysCacheExists2(USERMAPPINGUSERSERVER,
+							   ObjectIdGetDatum(InvalidOid),
+							   ObjectIdGetDatum(server->serverid)))
+		return;
+	user = GetUserMapping(userid, server->serverid);
+
+	/* Likewise, leave it to GetConnection to complain about a password */
+	if (!superuser())
+	{
+		bool		has_password = false;
+
+		foreach(lc, user->options)
+		{
+			DefElem    *d = (DefElem *) lfirst(lc);
+
+			if (strcmp(d->defname, "password") == 0 &&
+				defGetString(d)[0] != '\0')
+				has_password = true;
+		}
+		if (!has_password)
+			return;
+	}
+
+	entry = get_conn_entry(server->serverid, user->userid, 0);
+	if (entry->conn == NULL)
+	{
+		entry->xact_depth = 0;	/* just to be sure */
+		entry->begin_level = 0;
+		start_pg_connection(entry, server, user);
+		entry->prestarted = true;
+	}
+}
+
+/*
+ * Initialize the connection cache, and start connecting to the servers listed
+ * in postgres_fdw.prewarm_servers.
+ */
+static void
+init_connection_cache(void)
 {
-	PGconn	   *volatile conn = NULL;
+	HASHCTL		ctl;
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(ConnCacheKey);
+	ctl.entrysize = sizeof(ConnCacheEntry);
+	ctl.hash = tag_hash;
+	/* allocate ConnectionHash in the cache context */
+	ctl.hcxt = CacheMemoryContext;
+	ConnectionHash = hash_create("postgres_fdw connections", 8,
+								 &ctl,
+								 HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
 
 	/*
-	 * Use PG_TRY block to ensure closing connection on error.
+	 * Register some callback functions that manage connection cleanup.
+	 * This should be done just once in each backend.
 	 */
-	PG_TRY();
+	RegisterXactCallback(pgfdw_xact_callback, NULL);
+	RegisterSubXactCallback(pgfdw_subxact_callback, NULL);
+
+	prewarm_connections();
+}
+
+/*
+ * Find or create the cache entry for the given server, user mapping and
+ * worker number.
+ */
+static ConnCacheEntry *
+get_conn_entry(Oid serverid, Oid userid, int worker)
+{
+	ConnCacheEntry *entry;
+	ConnCacheKey key;
+	bool		found;
+
+	/* Create hash key for the entry.  Assume no pad bytes in key struct */
+	key.serverid = serverid;
+	key.userid = userid;
+	key.worker = worker;
+
+	entry = hash_search(ConnectionHash, &key, HASH_ENTER, &found);
+	if (!found)
 	{
-		const char **keywords;
-		const char **values;
-		int			n;
+		/* initialize new hashtable entry (key is already filled in) */
+		entry->conn = NULL;
+		entry->connecting = false;
+		entry->prestarted = false;
+		entry->poll_status = PGRES_POLLING_FAILED;
+		entry->connect_deadline = 0;
+		entry->timed_out = false;
+		entry->server_version = 0;
+		entry->settings_version = 0;
+		entry->options_rejected = false;
+		entry->xact_depth = 0;
+		entry->begin_level = 0;
+		entry->xact_cmd_sent = false;
+		entry->snapshot_id[0] = '\0';
+		memset(&entry->state, 0, sizeof(entry->state));
+		entry->state.stats = pgfdw_get_stats(serverid, userid);
+		entry->prep_stmts = NIL;
+		entry->prep_number = 0;
+	}
 
-		/*
-		 * Construct connection params from generic options of ForeignServer
-		 * and UserMapping.  (Some of them might not be libpq options, in
-		 * which case we'll just waste a few array slots.)  Add 3 extra slots
-		 * for fallback_application_name, client_encoding, end marker.
-		 */
-		n = list_length(server->options) + list_length(user->options) + 3;
-		keywords = (const char **) palloc(n * sizeof(char *));
-		values = (const char **) palloc(n * sizeof(char *));
+	return entry;
+}
+
+/*
+ * Start connecting to each server named in postgres_fdw.prewarm_servers, as
+ * the current user.  Names that don't identify a postgres_fdw server are
+ * silently ignored, since the setting may well be meant for several
+ * databases.
+ */
+static void
+prewarm_connections(void)
+{
+	char	   *rawstring;
+	List	   *namelist;
+	ListCell   *lc;
+
+	if (pgfdw_prewarm_servers == NULL || pgfdw_prewarm_servers[0] == '\0')
+		return;
 
-		n = 0;
-		n += ExtractConnectionOptions(server->options,
-									  keywords + n, values + n);
-		n += ExtractConnectionOptions(user->options,
-									  keywords + n, values + n);
+	/* A malformed list is ignored too; this is only an optimization */
+	rawstring = pstrdup(pgfdw_prewarm_servers);
+	if (!SplitIdentifierString(rawstring, ',', &namelist))
+	{
+		pfree(rawstring);
+		return;
+	}
+
+	foreach(lc, namelist)
+	{
+		ForeignServer *server;
+		ForeignDataWrapper *fdw;
+		char	   *handler;
+
+		server = GetForeignServerByName((char *) lfirst(lc), true);
+		if (server == NULL)
+			continue;
+		fdw = GetForeignDataWrapper(server->fdwid);
+		handler = OidIsValid(fdw->fdwhandler) ?
+			get_func_name(fdw->fdwhandler) : NULL;
+		if (handler == NULL || strcmp(handler, "postgres_fdw_handler") != 0)
+			continue;
+
+		StartConnection(server, GetUserId());
+	}
+
+	list_free(namelist);
+	pfree(rawstring);
+}
+
+/*
+ * Start connecting to remote server using specified server and user mapping
+ * properties, storing the connection in the cache entry.  Except for bad
+ * connection parameters, any errors are reported by finish_pg_connection.
+ */
+static void
+start_pg_connection(ConnCacheEntry *entry, ForeignServer *server,
+					UserMapping *user)
+{
+	const char **keywords;
+	const char **values;
+	char	   *startup_options = NULL;
+	int			timeout;
+	int			n;
+	int			i;
+
+	/*
+	 * Construct connection params from generic options of ForeignServer and
+	 * UserMapping.  (Some of them might not be libpq options, in which case
+	 * we'll just waste a few array slots.)  Add 4 extra slots for
+	 * fallback_application_name, client_encoding, options, end marker.
+	 */
+	n = list_length(server->options) + list_length(user->options) + 4;
+	keywords = (const char **) palloc(n * sizeof(char *));
+	values = (const char **) palloc(n * sizeof(char *));
+
+	n = 0;
+	n += ExtractConnectionOptions(server->options,
+								  keywords + n, values + n);
+	n += ExtractConnectionOptions(user->options,
+								  keywords + n, values + n);
+
+	/* Use "postgres_fdw" as fallback_application_name. */
+	keywords[n] = "fallback_application_name";
+	values[n] = "postgres_fdw";
+	n++;
+
+	/* Set client_encoding so that libpq can convert encoding properly. */
+	keywords[n] = "client_encoding";
+	values[n] = GetDatabaseEncodingName();
+	n++;
+
+	/*
+	 * If we know which version the server is, pass the session settings in
+	 * the startup packet, saving the round trip for SET commands.  They go
+	 * after any options the user specified, so that ours take precedence.
+	 */
+	entry->settings_version =
+		entry->options_rejected ? 0 : entry->server_version;
+	if (entry->settings_version != 0)
+	{
+		startup_options = session_startup_options(entry->settings_version);
+		for (i = 0; i < n; i++)
+		{
+			if (strcmp(keywords[i], "options") == 0)
+				break;
+		}
+		if (i < n)
+		{
+			StringInfoData buf;
+
+			initStringInfo(&buf);
+			appendStringInfo(&buf, "%s %s", values[i], startup_options);
+			values[i] = buf.data;
+		}
+		else
+		{
+			keywords[n] = "options";
+			values[n] = startup_options;
+			n++;
+		}
+	}
+
+	keywords[n] = values[n] = NULL;
+
+	/* verify connection parameters and start connection */
+	check_conn_params(keywords, values);
+
+	/*
+	 * libpq enforces connect_timeout only when it waits for the connection
+	 * itself, so wait_for_connections must do it for us.  Like libpq, use
+	 * the last setting given, and no less than 2 seconds.
+	 */
+	timeout = 0;
+	for (i = 0; i < n; i++)
+	{
+		if (strcmp(keywords[i], "connect_timeout") == 0)
+			timeout = atoi(values[i]);
+	}
+	if (timeout > 0)
+		entry->connect_deadline =
+			TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+										Max(timeout, 2) * 1000);
+	else
+		entry->connect_deadline = 0;
+	entry->timed_out = false;
+
+	entry->conn = PQconnectStartParams(keywords, values, false);
+	entry->connecting = true;
+	entry->state.stats->connections_opened++;
+	entry->prestarted = false;
+
+	/*
+	 * Per the libpq documentation, act as if PQconnectPoll had returned
+	 * PGRES_POLLING_WRITING, unless the attempt has failed already.
+	 */
+	if (entry->conn && PQstatus(entry->conn) != CONNECTION_BAD)
+		entry->poll_status = PGRES_POLLING_WRITING;
+	else
+		entry->poll_status = PGRES_POLLING_FAILED;
 
-		/* Use "postgres_fdw" as fallback_application_name. */
-		keywords[n] = "fallback_application_name";
-		values[n] = "postgres_fdw";
-		n++;
+	pfree(keywords);
+	pfree(values);
+}
+
+/*
+ * Wait until the connection of the cache entry is established, and prepare
+ * the new session for use.  Other connections being established make
+ * progress meanwhile.
+ */
+static void
+finish_pg_connection(ConnCacheEntry *entry, ForeignServer *server)
+{
+	/*
+	 * A connection started ahead of need may have sat half-open long enough
+	 * for the remote server to give up on it; rather than failing, try once
+	 * more with a fresh connection.  UserMapping might have changed too, but
+	 * then GetConnection's caller will notice soon enough.  Likewise, if the
+	 * server rejected the session settings we sent in the startup packet
+	 * (perhaps it has been replaced by an older version), try again without
+	 * them; but not if the attempt failed only for taking too long.
+	 */
+	while (entry->poll_status != PGRES_POLLING_OK &&
+		   entry->poll_status != PGRES_POLLING_FAILED)
+		wait_for_connections();
+	if (entry->poll_status == PGRES_POLLING_FAILED &&
+		(entry->prestarted ||
+		 (entry->settings_version != 0 && !entry->timed_out)))
+	{
+		UserMapping *user = GetUserMapping(entry->key.userid,
+										   server->serverid);
+		bool		sent_settings = (entry->settings_version != 0 &&
+									 !entry->prestarted);
 
-		/* Set client_encoding so that libpq can convert encoding properly. */
-		keywords[n] = "client_encoding";
-		values[n] = GetDatabaseEncodingName();
-		n++;
+		if (entry->conn)
+			PQfinish(entry->conn);
+		entry->conn = NULL;
+		entry->connecting = false;
+		entry->server_version = 0;
+		start_pg_connection(entry, server, user);
+		while (entry->poll_status != PGRES_POLLING_OK &&
+			   entry->poll_status != PGRES_POLLING_FAILED)
+			wait_for_connections();
 
-		keywords[n] = values[n] = NULL;
+		/*
+		 * If only the settings can have been the problem, don't spend a
+		 * failed attempt on them every time.  (A connection started ahead
+		 * of need may just have been idle too long.)
+		 */
+		if (sent_settings && entry->poll_status == PGRES_POLLING_OK)
+			entry->options_rejected = true;
+	}
 
-		/* verify connection parameters and make connection */
-		check_conn_params(keywords, values);
+	/*
+	 * Use PG_TRY block to ensure closing connection on error.
+	 */
+	PG_TRY();
+	{
+		PGconn	   *conn = entry->conn;
 
-		conn = PQconnectdbParams(keywords, values, false);
-		if (!conn || PQstatus(conn) != CONNECTION_OK)
+		if (entry->poll_status == PGRES_POLLING_FAILED)
 		{
 			char	   *connmessage;
 			int			msglen;
 
 			/* libpq typically appends a newline, strip that */
-			connmessage = pstrdup(PQerrorMessage(conn));
+			if (entry->timed_out)
+				connmessage = pstrdup("timeout expired");
+			else
+				connmessage = pstrdup(PQerrorMessage(conn));
 			msglen = strlen(connmessage);
 			if (msglen > 0 && connmessage[msglen - 1] == '\n')
 				connmessage[msglen - 1] = '\0';
@@ -240,21 +717,120 @@ connect_pg_server(ForeignServer *server, UserMapping *user)
 				   errhint("Target server's authentication method must be changed.")));
 
 		/* Prepare new session for use */
-		configure_remote_session(conn);
-
-		pfree(keywords);
-		pfree(values);
+		configure_remote_session(entry);
 	}
 	PG_CATCH();
 	{
 		/* Release PGconn data structure if we managed to create one */
-		if (conn)
-			PQfinish(conn);
+		if (entry->conn)
+			PQfinish(entry->conn);
+		entry->conn = NULL;
+		entry->connecting = false;
 		PG_RE_THROW();
 	}
 	PG_END_TRY();
 
-	return conn;
+	entry->connecting = false;
+}
+
+/*
+ * Wait until at least one of the connections being established can make
+ * progress (or a while has passed), and advance those that can.  Those past
+ * their connect_timeout are marked as failed instead.
+ *
+ * All the connections in the cache are advanced together, so that when a
+ * query needs several new connections, their network round trips overlap
+ * instead of adding up.
+ */
+static void
+wait_for_connections(void)
+{
+	HASH_SEQ_STATUS scan;
+	ConnCacheEntry *entry;
+	ConnCacheEntry **entries;
+	struct pollfd *fds;
+	int			nfds = 0;
+	TimestampTz now;
+	TimestampTz deadline = 0;
+	int			timeout;
+	int			rc;
+	int			i;
+
+	CHECK_FOR_INTERRUPTS();
+
+	entries = (ConnCacheEntry **)
+		palloc(hash_get_num_entries(ConnectionHash) * sizeof(ConnCacheEntry *));
+	fds = (struct pollfd *)
+		palloc(hash_get_num_entries(ConnectionHash) * sizeof(struct pollfd));
+
+	now = GetCurrentTimestamp();
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		int			sock;
+
+		if (!entry->connecting ||
+			(entry->poll_status != PGRES_POLLING_READING &&
+			 entry->poll_status != PGRES_POLLING_WRITING))
+			continue;
+
+		/* Give up on connections that have taken too long */
+		if (entry->connect_deadline != 0 && now >= entry->connect_deadline)
+		{
+			entry->poll_status = PGRES_POLLING_FAILED;
+			entry->timed_out = true;
+			continue;
+		}
+
+		sock = PQsocket(entry->conn);
+		if (sock < 0)
+		{
+			/* shouldn't happen, but let PQconnectPoll report the problem */
+			entry->poll_status = PQconnectPoll(entry->conn);
+			continue;
+		}
+
+		entries[nfds] = entry;
+		fds[nfds].fd = sock;
+		fds[nfds].events =
+			(entry->poll_status == PGRES_POLLING_READING) ? POLLIN : POLLOUT;
+		fds[nfds].revents = 0;
+		nfds++;
+
+		if (entry->connect_deadline != 0 &&
+			(deadline == 0 || entry->connect_deadline < deadline))
+			deadline = entry->connect_deadline;
+	}
+
+	if (nfds > 0)
+	{
+		/* Wake up in time for the nearest deadline */
+		timeout = CONNECT_POLL_INTERVAL;
+		if (deadline != 0)
+		{
+			long		secs;
+			int			microsecs;
+
+			TimestampDifference(now, deadline, &secs, &microsecs);
+			if (secs * 1000 + (microsecs + 999) / 1000 < timeout)
+				timeout = secs * 1000 + (microsecs + 999) / 1000;
+		}
+
+		rc = poll(fds, nfds, timeout);
+		if (rc < 0 && errno != EINTR)
+			ereport(ERROR,
+					(errcode_for_socket_access(),
+					 errmsg("poll() failed while connecting to remote servers: %m")));
+
+		for (i = 0; rc > 0 && i < nfds; i++)
+		{
+			if (fds[i].revents != 0)
+				entries[i]->poll_status = PQconnectPoll(entries[i]->conn);
+		}
+	}
+
+	pfree(entries);
+	pfree(fds);
 }
 
 /*
@@ -287,9 +863,11 @@ check_conn_params(const char **keywords, const char **values)
 }
 
 /*
- * Issue SET commands to make sure remote session is configured properly.
+ * Get the settings the remote session needs, as names and values, for a
+ * server of the given version.  The arrays must have room for
+ * MAX_SESSION_SETTINGS entries.  Returns the number of settings.
  *
- * We do this just once at connection, assuming nothing will change the
+ * We apply these just once at connection, assuming nothing will change the
  * values later.  Since we'll never send volatile function calls to the
  * remote, there shouldn't be any way to break this assumption from our end.
  * It's possible to think of ways to break it at the remote end, eg making
@@ -297,13 +875,15 @@ check_conn_params(const char **keywords, const char **values)
  * but once you admit the possibility of a malicious view definition,
  * there are any number of ways to break things.
  */
-static void
-configure_remote_session(PGconn *conn)
+static int
+get_session_settings(int remoteversion, const char **names,
+					 const char **values)
 {
-	int			remoteversion = PQserverVersion(conn);
+	int			n = 0;
 
 	/* Force the search path to contain only pg_catalog (see deparse.c) */
-	do_sql_command(conn, "SET search_path = pg_catalog");
+	names[n] = "search_path";
+	values[n++] = "pg_catalog";
 
 	/*
 	 * Set remote timezone; this is basically just cosmetic, since all
@@ -313,64 +893,173 @@ configure_remote_session(PGconn *conn)
 	 * We don't risk setting remote zone equal to ours, since the remote
 	 * server might use a different timezone database.
 	 */
-	do_sql_command(conn, "SET timezone = UTC");
+	names[n] = "timezone";
+	values[n++] = "UTC";
 
 	/*
 	 * Set values needed to ensure unambiguous data output from remote.  (This
 	 * logic should match what pg_dump does.  See also set_transmission_modes
 	 * in postgres_fdw.c.)
 	 */
-	do_sql_command(conn, "SET datestyle = ISO");
+	names[n] = "datestyle";
+	values[n++] = "ISO";
 	if (remoteversion >= 80400)
-		do_sql_command(conn, "SET intervalstyle = postgres");
-	if (remoteversion >= 90000)
-		do_sql_command(conn, "SET extra_float_digits = 3");
-	else
-		do_sql_command(conn, "SET extra_float_digits = 2");
+	{
+		names[n] = "intervalstyle";
+		values[n++] = "postgres";
+	}
+	names[n] = "extra_float_digits";
+	values[n++] = (remoteversion >= 90000) ? "3" : "2";
+
+	Assert(n <= MAX_SESSION_SETTINGS);
+	return n;
 }
 
 /*
- * Convenience subroutine to issue a non-data-returning SQL command to remote
+ * Build the value of libpq's "options" parameter that applies the session
+ * settings for a server of the given version.  The values contain no spaces
+ * or backslashes, so they need no escaping.
  */
-static void
-do_sql_command(PGconn *conn, const char *sql)
+static char *
+session_startup_options(int remoteversion)
 {
-	PGresult   *res;
+	const char *names[MAX_SESSION_SETTINGS];
+	const char *values[MAX_SESSION_SETTINGS];
+	StringInfoData buf;
+	int			n;
+	int			i;
 
-	res = PQexec(conn, sql);
-	if (PQresultStatus(res) != PGRES_COMMAND_OK)
-		pgfdw_report_error(ERROR, res, true, sql);
-	PQclear(res);
+	n = get_session_settings(remoteversion, names, values);
+	initStringInfo(&buf);
+	for (i = 0; i < n; i++)
+		appendStringInfo(&buf, "%s-c %s=%s", (i > 0) ? " " : "",
+						 names[i], values[i]);
+
+	return buf.data;
 }
 
 /*
- * Start remote transaction or subtransaction, if needed.
+ * Make sure the session of a new connection is configured properly.
  *
- * Note that we always use at least REPEATABLE READ in the remote session.
+ * Usually the settings were sent in the startup packet already, and there
+ * is nothing left to do.  Otherwise, which happens on the first connection
+ * to a server (we need its version to decide on the settings), if its
+ * version changed since, or if it doesn't accept settings in the startup
+ * packet (see finish_pg_connection), we issue SET commands; all in one
+ * multi-statement command, to spend just one round trip on them.
+ */
+static void
+configure_remote_session(ConnCacheEntry *entry)
+{
+	PGconn	   *conn = entry->conn;
+	int			remoteversion = PQserverVersion(conn);
+	const char *names[MAX_SESSION_SETTINGS];
+	const char *values[MAX_SESSION_SETTINGS];
+	StringInfoData sql;
+	int			n;
+	int			i;
+
+	if (entry->settings_version != 0)
+	{
+		char	   *sent = session_startup_options(entry->settings_version);
+		char	   *wanted = session_startup_options(remoteversion);
+		bool		same = (strcmp(sent, wanted) == 0);
+
+		pfree(sent);
+		pfree(wanted);
+		if (same)
+		{
+			entry->server_version = remoteversion;
+			return;
+		}
+	}
+
+	n = get_session_settings(remoteversion, names, values);
+	initStringInfo(&sql);
+	for (i = 0; i < n; i++)
+		appendStringInfo(&sql, "%sSET %s = %s", (i > 0) ? "; " : "",
+						 names[i], values[i]);
+
+	do_sql_command(conn, entry->state.stats, sql.data);
+	pfree(sql.data);
+
+	/* Remember the version, so that next time we can skip this */
+	entry->server_version = remoteversion;
+}
+
+/*
+ * Convenience subroutine to issue a non-data-returning SQL command to remote
+ */
+static void
+do_sql_command(PGconn *conn, PgFdwStats *stats, const char *sql)
+{
+	PGresult   *res;
+
+	stats->round_trips++;
+	res = PQexec(conn, sql);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		pgfdw_report_error(ERROR, res, conn, true, sql);
+	PQclear(res);
+}
+
+/*
+ * Start remote transaction or subtransaction, if needed.
+ */
+static void
+begin_remote_xact(ConnCacheEntry *entry)
+{
+	StringInfoData sql;
+
+	initStringInfo(&sql);
+	if (append_begin_commands(entry, &sql))
+	{
+		/* All the commands go in one round trip; drop the trailing "; " */
+		sql.data[sql.len - 2] = '\0';
+		do_sql_command(entry->conn, entry->state.stats, sql.data);
+	}
+	pfree(sql.data);
+}
+
+/*
+ * Append the commands needed to bring the remote side to begin_level to buf,
+ * each followed by "; ", and consider them done.  Returns true if there were
+ * any.
+ *
+ * We count the levels as reached even before the commands have been run: if
+ * any of them fails, the local (sub)transaction aborts, and rolling back a
+ * level that wasn't actually reached merely draws a warning, while failing to
+ * roll back one that was would leave the remote transaction dangling.
+ *
+ * Note that we always use at least REPEATABLE READ in the remote session.
  * This is so that, if a query initiates multiple scans of the same or
  * different foreign tables, we will get snapshot-consistent results from
  * those scans.  A disadvantage is that we can't provide sane emulation of
  * READ COMMITTED behavior --- it would be nice if we had some other way to
  * control which remote queries share a snapshot.
  */
-static void
-begin_remote_xact(ConnCacheEntry *entry)
+static bool
+append_begin_commands(ConnCacheEntry *entry, StringInfo buf)
 {
-	int			curlevel = GetCurrentTransactionNestLevel();
+	if (entry->xact_depth >= entry->begin_level)
+		return false;
 
 	/* Start main transaction if we haven't yet */
 	if (entry->xact_depth <= 0)
 	{
-		const char *sql;
-
 		elog(DEBUG3, "starting remote transaction on connection %p",
 			 entry->conn);
 
 		if (IsolationIsSerializable())
-			sql = "START TRANSACTION ISOLATION LEVEL SERIALIZABLE";
+			appendStringInfoString(buf,
+						"START TRANSACTION ISOLATION LEVEL SERIALIZABLE; ");
 		else
-			sql = "START TRANSACTION ISOLATION LEVEL REPEATABLE READ";
-		do_sql_command(entry->conn, sql);
+			appendStringInfoString(buf,
+					 "START TRANSACTION ISOLATION LEVEL REPEATABLE READ; ");
+
+		/* An extra connection must see what the main one sees */
+		if (entry->key.worker > 0 && entry->snapshot_id[0] != '\0')
+			appendStringInfo(buf, "SET TRANSACTION SNAPSHOT '%s'; ",
+							 entry->snapshot_id);
 		entry->xact_depth = 1;
 	}
 
@@ -379,14 +1068,86 @@ begin_remote_xact(ConnCacheEntry *entry)
 	 * This ensures we can rollback just the desired effects when a
 	 * subtransaction aborts.
 	 */
-	while (entry->xact_depth < curlevel)
+	while (entry->xact_depth < entry->begin_level)
 	{
-		char		sql[64];
-
-		snprintf(sql, sizeof(sql), "SAVEPOINT s%d", entry->xact_depth + 1);
-		do_sql_command(entry->conn, sql);
+		appendStringInfo(buf, "SAVEPOINT s%d; ", entry->xact_depth + 1);
 		entry->xact_depth++;
 	}
+
+	return true;
+}
+
+/*
+ * Append the START TRANSACTION and SAVEPOINT commands that GetConnection
+ * deferred, if any, to a command about to be sent with PQsendQuery or
+ * PQexec.  Each is followed by "; ", so the caller's command can simply be
+ * appended.
+ *
+ * The remote transaction is considered started from here on; see
+ * append_begin_commands.
+ */
+void
+pgfdw_append_begin(PGconn *conn, StringInfo buf)
+{
+	append_begin_commands(find_conn_entry(conn), buf);
+}
+
+/*
+ * Send the START TRANSACTION and SAVEPOINT commands that GetConnection
+ * deferred, if any, for callers that can't prefix them to their first
+ * command (because it's not sent as a simple query).
+ */
+void
+pgfdw_begin_xact(PGconn *conn)
+{
+	begin_remote_xact(find_conn_entry(conn));
+}
+
+/*
+ * Export the snapshot of the remote transaction on the given (main)
+ * connection, starting the transaction if need be, so that other connections
+ * can import it with GetWorkerConnection.  The snapshot is exported once per
+ * transaction.  Returns NULL if that's not possible: the remote server must
+ * be 9.2 or later, and a snapshot can't be exported from a subtransaction, so
+ * if we're in one, the remote transaction must not have any savepoints yet.
+ * Those are then set only after the export.
+ */
+char *
+pgfdw_export_snapshot(PGconn *conn)
+{
+	ConnCacheEntry *entry = find_conn_entry(conn);
+	StringInfoData sql;
+	PGresult   *res;
+	int			begin_level;
+
+	if (entry->snapshot_id[0] != '\0')
+		return entry->snapshot_id;
+	if (PQserverVersion(conn) < 90200 || entry->xact_depth > 1)
+		return NULL;
+
+	/* Start just the main transaction, if needed */
+	begin_level = entry->begin_level;
+	entry->begin_level = Min(begin_level, 1);
+	initStringInfo(&sql);
+	append_begin_commands(entry, &sql);
+	entry->begin_level = begin_level;
+	appendStringInfoString(&sql, "SELECT pg_export_snapshot()");
+
+	/*
+	 * We don't use a PG_TRY block here, so be careful not to throw error
+	 * without releasing the PGresult.
+	 */
+	pgfdw_absorb_pending(conn, &entry->state);
+	entry->state.stats->round_trips++;
+	res = PQexec(conn, sql.data);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1)
+		pgfdw_report_error(ERROR, res, conn, true, sql.data);
+	strlcpy(entry->snapshot_id, PQgetvalue(res, 0, 0),
+			sizeof(entry->snapshot_id));
+	PQclear(res);
+	pfree(sql.data);
+
+	return entry->snapshot_id;
 }
 
 /*
@@ -419,17 +1180,626 @@ GetCursorNumber(PGconn *conn)
 	return ++cursor_number;
 }
 
+/*
+ * Get the name of a statement prepared on the connection for the given SQL
+ * text and parameter types, preparing it if we haven't done so already.
+ * The result is a palloc'd string.
+ *
+ * This saves the remote server parsing and planning the same query over and
+ * over, when a scan is restarted with new parameter values, or the same
+ * query is run again in a later transaction.  Prepared statements are not
+ * transactional on the remote side, so they are kept for the life of the
+ * connection, up to MAX_PREPARED_STMTS of them.
+ *
+ * The caller must make sure that no request is in flight.
+ */
+char *
+GetPreparedStatement(PGconn *conn, const char *sql,
+					 int nparams, const Oid *types)
+{
+	ConnCacheEntry *entry = find_conn_entry(conn);
+	PgFdwPreparedStmt *stmt;
+	MemoryContext oldcontext;
+	char		name[32];
+	PGresult   *res;
+	ListCell   *lc;
+
+	/* Look for the statement, and move it to the front if found */
+	foreach(lc, entry->prep_stmts)
+	{
+		stmt = (PgFdwPreparedStmt *) lfirst(lc);
+
+		if (stmt->nparams == nparams && strcmp(stmt->sql, sql) == 0)
+		{
+			/* If it failed last time, get rid of it and start over */
+			if (stmt->stale)
+			{
+				deallocate_prepared_stmt(entry, stmt);
+				break;
+			}
+
+			if (lc != list_head(entry->prep_stmts))
+			{
+				oldcontext = MemoryContextSwitchTo(CacheMemoryContext);
+				entry->prep_stmts = lcons(stmt,
+										  list_delete_ptr(entry->prep_stmts,
+														  stmt));
+				MemoryContextSwitchTo(oldcontext);
+			}
+			snprintf(name, sizeof(name), "p%u", stmt->stmt_number);
+			return pstrdup(name);
+		}
+	}
+
+	/* Make room for it, if necessary */
+	if (list_length(entry->prep_stmts) >= MAX_PREPARED_STMTS)
+		deallocate_prepared_stmt(entry,
+							(PgFdwPreparedStmt *) llast(entry->prep_stmts));
+
+	/* Prepare it; if that fails, the cache is left as it was */
+	snprintf(name, sizeof(name), "p%u", entry->prep_number + 1);
+	entry->state.stats->round_trips++;
+	res = PQprepare(conn, name, sql, nparams, types);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		pgfdw_report_error(ERROR, res, conn, true, sql);
+	PQclear(res);
+
+	oldcontext = MemoryContextSwitchTo(CacheMemoryContext);
+	stmt = (PgFdwPreparedStmt *) palloc(sizeof(PgFdwPreparedStmt));
+	stmt->sql = pstrdup(sql);
+	stmt->nparams = nparams;
+	stmt->stmt_number = ++entry->prep_number;
+	stmt->stale = false;
+	entry->prep_stmts = lcons(stmt, entry->prep_stmts);
+	MemoryContextSwitchTo(oldcontext);
+
+	return pstrdup(name);
+}
+
+/*
+ * Note that running the named statement, prepared on the connection by
+ * GetPreparedStatement, has failed.  That may be because it can't run
+ * anymore: the remote server refuses with "cached plan must not change
+ * result type" when the column types of a table have changed.  So it's
+ * prepared afresh the next time it's wanted.  It can't be deallocated right
+ * away, since the remote transaction is aborted; until the next use, it's
+ * the first to go to make room for others.
+ */
+void
+ForgetPreparedStatement(PGconn *conn, const char *name)
+{
+	ConnCacheEntry *entry = find_conn_entry(conn);
+	MemoryContext oldcontext;
+	ListCell   *lc;
+
+	foreach(lc, entry->prep_stmts)
+	{
+		PgFdwPreparedStmt *stmt = (PgFdwPreparedStmt *) lfirst(lc);
+		char		stmt_name[32];
+
+		snprintf(stmt_name, sizeof(stmt_name), "p%u", stmt->stmt_number);
+		if (strcmp(stmt_name, name) == 0)
+		{
+			stmt->stale = true;
+			oldcontext = MemoryContextSwitchTo(CacheMemoryContext);
+			entry->prep_stmts = lappend(list_delete_ptr(entry->prep_stmts,
+														stmt),
+										stmt);
+			MemoryContextSwitchTo(oldcontext);
+			return;
+		}
+	}
+}
+
+/*
+ * Deallocate a statement prepared on the entry's connection, and remove it
+ * from the entry's list.
+ */
+static void
+deallocate_prepared_stmt(ConnCacheEntry *entry, PgFdwPreparedStmt *stmt)
+{
+	char		sql[64];
+
+	snprintf(sql, sizeof(sql), "DEALLOCATE p%u", stmt->stmt_number);
+	do_sql_command(entry->conn, entry->state.stats, sql);
+	entry->prep_stmts = list_delete_ptr(entry->prep_stmts, stmt);
+	pfree(stmt->sql);
+	pfree(stmt);
+}
+
+/*
+ * Return the counters of the server and user mapping of the given
+ * connection, for postgres_fdw_stats.
+ */
+PgFdwStats *
+GetConnectionStats(PGconn *conn)
+{
+	return find_conn_entry(conn)->state.stats;
+}
+
+/*
+ * Find the connection cache entry for the given connection.
+ */
+static ConnCacheEntry *
+find_conn_entry(PGconn *conn)
+{
+	HASH_SEQ_STATUS scan;
+	ConnCacheEntry *entry;
+
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		if (entry->conn == conn)
+		{
+			hash_seq_term(&scan);
+			return entry;
+		}
+	}
+
+	elog(ERROR, "could not find connection cache entry");
+	return NULL;				/* keep compiler quiet */
+}
+
+/*
+ * Forget the statements prepared on the entry's connection, which is about
+ * to be closed.
+ */
+static void
+forget_prepared_stmts(ConnCacheEntry *entry)
+{
+	ListCell   *lc;
+
+	foreach(lc, entry->prep_stmts)
+	{
+		PgFdwPreparedStmt *stmt = (PgFdwPreparedStmt *) lfirst(lc);
+
+		pfree(stmt->sql);
+	}
+	list_free_deep(entry->prep_stmts);
+	entry->prep_stmts = NIL;
+}
+
+/*
+ * Send a query asynchronously on behalf of the given cursor's scan.
+ *
+ * The caller must make sure that no other request is in flight.  The result
+ * is later retrieved with pgfdw_get_pending_result.
+ */
+void
+pgfdw_send_query(PGconn *conn, PgFdwConnState *state,
+				 unsigned int cursor_number, const char *sql)
+{
+	Assert(state->pending_cursor == 0);
+
+	state->stats->round_trips++;
+	if (!PQsendQuery(conn, sql))
+		pgfdw_report_send_error(ERROR, conn, sql);
+
+	state->pending_cursor = cursor_number;
+	state->pending_copy = false;
+	state->pending_done = false;
+	state->pending_result = NULL;
+}
+
+/*
+ * Start a COPY TO STDOUT command on behalf of the given cursor's scan; the
+ * rows are then read with pgfdw_get_copy_data.
+ *
+ * The COPY runs inside a savepoint of its own (named after the cursor), so
+ * that if the scan stops early we can cancel the COPY without wrecking the
+ * remote transaction.  The savepoint is closed as soon as the COPY is over,
+ * lest it get entangled with the savepoints of subtransactions; so if another
+ * user of the connection collects the remaining rows, it closes it as well.
+ *
+ * The caller must make sure that no other request is in flight.
+ */
+void
+pgfdw_send_copy(PGconn *conn, PgFdwConnState *state,
+				unsigned int cursor_number, const char *sql)
+{
+	StringInfoData buf;
+	PGresult   *res;
+
+	Assert(state->pending_cursor == 0);
+
+	initStringInfo(&buf);
+	pgfdw_append_begin(conn, &buf);
+	appendStringInfo(&buf, "SAVEPOINT c%u; %s", cursor_number, sql);
+	state->stats->round_trips++;
+	if (!PQsendQuery(conn, buf.data))
+		pgfdw_report_send_error(ERROR, conn, sql);
+
+	state->pending_cursor = cursor_number;
+	state->pending_copy = true;
+	state->pending_done = false;
+	state->pending_result = NULL;
+	state->copy_savepoint = true;
+
+	/*
+	 * Wait for the COPY to start.  If anything goes wrong, collect whatever
+	 * is left of the request before reporting the trouble.
+	 */
+	res = PQgetResult(conn);
+	while (res != NULL && PQresultStatus(res) == PGRES_COMMAND_OK)
+	{
+		PQclear(res);
+		res = PQgetResult(conn);
+	}
+	if (PQresultStatus(res) != PGRES_COPY_OUT)
+	{
+		state->pending_result = res;
+		pgfdw_collect_pending(conn, state, false);
+		res = state->pending_result;
+		state->pending_result = NULL;
+		pgfdw_reset_pending(state);
+		pgfdw_report_error(ERROR, res, conn, true, sql);
+	}
+	PQclear(res);
+
+	pfree(buf.data);
+}
+
+/*
+ * Get the next row of the COPY started for the given cursor.  Returns its
+ * length and sets *buffer to point to it (including the trailing newline);
+ * the data stays valid until the next call.  Returns -1 at the end of the
+ * data, after checking that the COPY completed successfully.
+ *
+ * sql is the command to mention if we need to report an error.
+ */
+int
+pgfdw_get_copy_data(PGconn *conn, PgFdwConnState *state,
+					unsigned int cursor_number, char **buffer,
+					const char *sql)
+{
+	PGresult   *res;
+	int			len;
+
+	if (state->pending_cursor != cursor_number || !state->pending_copy)
+		elog(ERROR, "no COPY is pending for cursor c%u", cursor_number);
+
+	if (state->copy_buf)
+	{
+		PQfreemem(state->copy_buf);
+		state->copy_buf = NULL;
+	}
+
+	if (state->pending_done)
+	{
+		/* Somebody collected the rows for us; hand them out from there */
+		StringInfo	stash = state->copy_stash;
+
+		if (stash && state->copy_stash_pos < stash->len)
+		{
+			char	   *row = stash->data + state->copy_stash_pos;
+			char	   *end = memchr(row, '\n',
+									 stash->len - state->copy_stash_pos);
+
+			len = end ? end - row + 1 : stash->len - state->copy_stash_pos;
+			state->copy_stash_pos += len;
+			*buffer = row;
+			return len;
+		}
+	}
+	else
+	{
+		len = PQgetCopyData(conn, buffer, 0);
+		if (len > 0)
+		{
+			state->copy_buf = *buffer;
+			return len;
+		}
+
+		/* End of data (or failure); collect the command result */
+		pgfdw_collect_pending(conn, state, false);
+	}
+
+	/* Close the savepoint, if nobody did that yet, and check the result */
+	pgfdw_close_copy_savepoint(conn, state);
+	res = state->pending_result;
+	state->pending_result = NULL;
+	pgfdw_reset_pending(state);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		pgfdw_report_error(ERROR, res, conn, true, sql);
+	PQclear(res);
+
+	return -1;
+}
+
+/*
+ * Abandon the COPY started for the given cursor, if it's still in progress.
+ */
+void
+pgfdw_cancel_copy(PGconn *conn, PgFdwConnState *state,
+				  unsigned int cursor_number)
+{
+	if (state->pending_cursor != cursor_number || !state->pending_copy)
+		return;
+
+	if (!state->pending_done)
+	{
+		pgfdw_cancel_request(conn);
+		pgfdw_collect_pending(conn, state, false);
+	}
+
+	/* The COPY failed if we cancelled it in time; we don't care. */
+	pgfdw_close_copy_savepoint(conn, state);
+	pgfdw_reset_pending(state);
+}
+
+/*
+ * Check without blocking whether the result of the request in flight has
+ * arrived completely.
+ *
+ * This also reads whatever data is available from the socket, which keeps
+ * the remote server from stalling on a full send buffer while we're busy.
+ */
+bool
+pgfdw_pending_ready(PGconn *conn, PgFdwConnState *state)
+{
+	Assert(state->pending_cursor != 0 && !state->pending_copy);
+
+	if (state->pending_done)
+		return true;
+
+	/* On failure, let PQgetResult report the trouble. */
+	if (!PQconsumeInput(conn))
+		return true;
+
+	return !PQisBusy(conn);
+}
+
+/*
+ * Collect the result of the request in flight on the connection, if any, and
+ * keep it in the state struct for its owner; thereafter the connection can be
+ * used for other commands.
+ *
+ * This must be called before sending anything on a connection that might
+ * have a request in flight, since libpq's PQexec and friends would silently
+ * throw the outstanding result away.  Note that for a COPY this means reading
+ * all the remaining rows into memory.
+ */
+void
+pgfdw_absorb_pending(PGconn *conn, PgFdwConnState *state)
+{
+	if (state == NULL || state->pending_cursor == 0 || state->pending_done)
+		return;
+
+	pgfdw_collect_pending(conn, state, true);
+	pgfdw_close_copy_savepoint(conn, state);
+}
+
+/*
+ * Hand the result of the request sent for the given cursor over to the
+ * caller, waiting for it to arrive if necessary.  The caller is responsible
+ * for PQclear'ing it.  The result can be NULL if the connection was lost.
+ */
+PGresult *
+pgfdw_get_pending_result(PGconn *conn, PgFdwConnState *state,
+						 unsigned int cursor_number)
+{
+	PGresult   *res;
+
+	if (state->pending_cursor != cursor_number || state->pending_copy)
+		elog(ERROR, "no request is pending for cursor c%u", cursor_number);
+
+	pgfdw_absorb_pending(conn, state);
+
+	res = state->pending_result;
+	state->pending_result = NULL;
+	pgfdw_reset_pending(state);
+
+	return res;
+}
+
+/*
+ * Read everything that remains of the request in flight, without issuing any
+ * commands of our own.  The rows of a COPY are kept in copy_stash if
+ * keep_data is true, else thrown away.  Of the results, we keep the first
+ * error if any (that's where the interesting message is), else the last.
+ */
+static void
+pgfdw_collect_pending(PGconn *conn, PgFdwConnState *state, bool keep_data)
+{
+	PGresult   *res;
+
+	if (state->pending_copy)
+	{
+		char	   *buf;
+		int			len;
+
+		while ((len = PQgetCopyData(conn, &buf, 0)) > 0)
+		{
+			if (keep_data)
+			{
+				if (state->copy_stash == NULL)
+				{
+					MemoryContext oldcontext;
+
+					oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+					state->copy_stash = makeStringInfo();
+					MemoryContextSwitchTo(oldcontext);
+				}
+				appendBinaryStringInfo(state->copy_stash, buf, len);
+			}
+			PQfreemem(buf);
+		}
+	}
+
+	while ((res = PQgetResult(conn)) != NULL)
+	{
+		PGresult   *prev = state->pending_result;
+
+		if (prev == NULL ||
+			PQresultStatus(prev) == PGRES_COMMAND_OK ||
+			PQresultStatus(prev) == PGRES_TUPLES_OK)
+		{
+			if (prev)
+				PQclear(prev);
+			state->pending_result = res;
+		}
+		else
+			PQclear(res);
+	}
+	state->pending_done = true;
+}
+
+/*
+ * Close the savepoint established by pgfdw_send_copy, once the COPY is over.
+ * If the COPY failed, we must roll back to the savepoint first.
+ */
+static void
+pgfdw_close_copy_savepoint(PGconn *conn, PgFdwConnState *state)
+{
+	char		sql[100];
+
+	if (!state->pending_copy || !state->copy_savepoint)
+		return;
+	Assert(state->pending_done);
+
+	if (PQresultStatus(state->pending_result) == PGRES_COMMAND_OK)
+		snprintf(sql, sizeof(sql), "RELEASE SAVEPOINT c%u",
+				 state->pending_cursor);
+	else
+		snprintf(sql, sizeof(sql),
+				 "ROLLBACK TO SAVEPOINT c%u; RELEASE SAVEPOINT c%u",
+				 state->pending_cursor, state->pending_cursor);
+	state->copy_savepoint = false;
+	do_sql_command(conn, state->stats, sql);
+}
+
+/*
+ * Ask the remote server to cancel the command it's executing.  Problems are
+ * reported as warnings, since we're always cleaning up something.
+ *
+ * The cancel can't hit the command we send next (the RELEASE or ROLLBACK TO
+ * of a COPY's savepoint, say) instead: PQcancel returns only once the
+ * postmaster has signalled the backend, and a backend that's done with the
+ * command by the time the signal arrives forgets about it before reading
+ * another one.
+ */
+static void
+pgfdw_cancel_request(PGconn *conn)
+{
+	PGcancel   *cancel;
+	char		errbuf[256];
+
+	if ((cancel = PQgetCancel(conn)) != NULL)
+	{
+		if (!PQcancel(cancel, errbuf, sizeof(errbuf)))
+			ereport(WARNING,
+					(errcode(ERRCODE_CONNECTION_FAILURE),
+					 errmsg("could not send cancel request: %s",
+							errbuf)));
+		PQfreeCancel(cancel);
+	}
+}
+
+/*
+ * Cancel the request in flight on the connection, if any, and discard its
+ * result.  This is used during abort cleanup, so don't throw errors.
+ */
+static void
+pgfdw_cancel_pending(PGconn *conn, PgFdwConnState *state)
+{
+	if (state->pending_cursor != 0 && !state->pending_done)
+	{
+		pgfdw_cancel_request(conn);
+		pgfdw_collect_pending(conn, state, false);
+	}
+	pgfdw_reset_pending(state);
+}
+
+/*
+ * Forget about any request in flight, releasing any result collected for it.
+ */
+static void
+pgfdw_reset_pending(PgFdwConnState *state)
+{
+	PgFdwStats *stats = state->stats;
+
+	if (state->pending_result)
+		PQclear(state->pending_result);
+	if (state->copy_buf)
+		PQfreemem(state->copy_buf);
+	if (state->copy_stash)
+	{
+		pfree(state->copy_stash->data);
+		pfree(state->copy_stash);
+	}
+	memset(state, 0, sizeof(PgFdwConnState));
+	state->stats = stats;
+}
+
+/*
+ * Count an error reported for a remote command in the stats of the
+ * connection's server.  We're about to throw an error, so don't throw
+ * another one if the connection isn't in the cache.
+ */
+static void
+count_connection_error(PGconn *conn)
+{
+	HASH_SEQ_STATUS scan;
+	ConnCacheEntry *entry;
+
+	if (ConnectionHash == NULL)
+		return;
+
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		if (entry->conn == conn)
+		{
+			hash_seq_term(&scan);
+			entry->state.stats->errors++;
+			return;
+		}
+	}
+}
+
+/*
+ * Report failure to send a command to the remote server.
+ *
+ * elevel: error level to use (typically ERROR, but might be less)
+ */
+static void
+pgfdw_report_send_error(int elevel, PGconn *conn, const char *sql)
+{
+	char	   *connmessage;
+	int			msglen;
+
+	if (elevel >= ERROR)
+		count_connection_error(conn);
+
+	/* libpq typically appends a newline, strip that */
+	connmessage = pstrdup(PQerrorMessage(conn));
+	msglen = strlen(connmessage);
+	if (msglen > 0 && connmessage[msglen - 1] == '\n')
+		connmessage[msglen - 1] = '\0';
+	ereport(elevel,
+			(errcode(ERRCODE_CONNECTION_FAILURE),
+			 errmsg("could not send query to remote server"),
+			 errdetail_internal("%s", connmessage),
+			 errcontext("Remote SQL command: %s", sql)));
+}
+
 /*
  * Report an error we got from the remote server.
  *
  * elevel: error level to use (typically ERROR, but might be less)
  * res: PGresult containing the error
+ * conn: connection we did the remote command on, or NULL; errors are counted
+ *		 in its postgres_fdw_stats
  * clear: if true, PQclear the result (otherwise caller will handle it)
  * sql: NULL, or text of remote command we tried to execute
  */
 void
-pgfdw_report_error(int elevel, PGresult *res, bool clear, const char *sql)
+pgfdw_report_error(int elevel, PGresult *res, PGconn *conn, bool clear,
+				   const char *sql)
 {
+	if (elevel >= ERROR && conn != NULL)
+		count_connection_error(conn);
+
 	/* If requested, PGresult must be released before leaving this function. */
 	PG_TRY();
 	{
@@ -469,27 +1839,99 @@ pgfdw_report_error(int elevel, PGresult *res, bool clear, const char *sql)
 		PQclear(res);
 }
 
+/*
+ * Send a command ending a remote (sub)transaction on the entry's connection,
+ * without waiting for its result, which get_xact_command_result collects.
+ * Sending the commands for all connections first lets the remote servers
+ * work on them at the same time, so that ending a transaction that touched
+ * several servers costs one round trip rather than one per server.
+ *
+ * A failure to send is reported as a WARNING, since we're ending the local
+ * transaction already; xact_cmd_sent tells the caller whether it worked.
+ */
+static void
+send_xact_command(ConnCacheEntry *entry, const char *sql)
+{
+	entry->xact_cmd_sent = (PQsendQuery(entry->conn, sql) != 0);
+	if (!entry->xact_cmd_sent)
+		pgfdw_report_send_error(WARNING, entry->conn, sql);
+}
+
+/*
+ * Collect the result of the command sent by send_xact_command.  Returns the
+ * first result that isn't successful, which the caller must PQclear, or NULL
+ * if there was none.
+ */
+static PGresult *
+get_xact_command_result(ConnCacheEntry *entry)
+{
+	PGresult   *failed = NULL;
+	PGresult   *res;
+
+	Assert(entry->xact_cmd_sent);
+	entry->xact_cmd_sent = false;
+
+	while ((res = PQgetResult(entry->conn)) != NULL)
+	{
+		if (PQresultStatus(res) != PGRES_COMMAND_OK && failed == NULL)
+			failed = res;
+		else
+			PQclear(res);
+	}
+
+	return failed;
+}
+
 /*
  * pgfdw_xact_callback --- cleanup at main-transaction end.
+ *
+ * The COMMIT or ABORT commands are sent to all the connections with open
+ * remote transactions first, and their results collected afterwards (see
+ * send_xact_command).  If a remote COMMIT fails, we still finish the others
+ * before reporting the (first) failure as an error.
  */
 static void
 pgfdw_xact_callback(XactEvent event, void *arg)
 {
 	HASH_SEQ_STATUS scan;
 	ConnCacheEntry *entry;
+	const char *sql;
+	PGresult   *commit_error = NULL;
+	bool		commit_failed = false;
+	instr_time	start;
 
 	/* Quick exit if no connections were touched in this transaction. */
 	if (!xact_got_connection)
 		return;
 
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+			sql = "COMMIT TRANSACTION";
+			break;
+		case XACT_EVENT_PREPARE:
+			/* Should not get here -- pre-commit should have handled it */
+			elog(ERROR, "XACT_EVENT_PREPARE");
+			return;				/* keep compiler quiet */
+		case XACT_EVENT_ABORT:
+		default:
+			sql = "ABORT TRANSACTION";
+			break;
+	}
+
 	/*
 	 * Scan all connection cache entries to find open remote transactions, and
-	 * close them.
+	 * send the commands closing them.  The time their results take to arrive
+	 * is counted from here, so for each server it includes the wait for the
+	 * ones before it; that's what the local transaction experiences.
 	 */
+	INSTR_TIME_SET_CURRENT(start);
 	hash_seq_init(&scan, ConnectionHash);
 	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
 	{
-		PGresult   *res;
+		/* Forget about remote transactions we didn't get around to start */
+		entry->begin_level = 0;
+		entry->snapshot_id[0] = '\0';
 
 		/* We only care about connections with open remote transactions */
 		if (entry->conn == NULL || entry->xact_depth == 0)
@@ -498,27 +1940,68 @@ pgfdw_xact_callback(XactEvent event, void *arg)
 		elog(DEBUG3, "closing remote transaction on connection %p",
 			 entry->conn);
 
-		switch (event)
+		if (event == XACT_EVENT_COMMIT)
 		{
-			case XACT_EVENT_COMMIT:
-				/* Commit all remote transactions */
-				do_sql_command(entry->conn, "COMMIT TRANSACTION");
-				break;
-			case XACT_EVENT_PREPARE:
-				/* Should not get here -- pre-commit should have handled it */
-				elog(ERROR, "XACT_EVENT_PREPARE");
-				break;
-			case XACT_EVENT_ABORT:
-				/* If we're aborting, abort all remote transactions too */
-				res = PQexec(entry->conn, "ABORT TRANSACTION");
-				/* Note: can't throw ERROR, it would be infinite loop */
-				if (PQresultStatus(res) != PGRES_COMMAND_OK)
-					pgfdw_report_error(WARNING, res, true,
-									   "ABORT TRANSACTION");
+			/*
+			 * Scans are all shut down by now, so any request still in flight
+			 * (or collected but not claimed) has been orphaned by a scan that
+			 * died in a subtransaction.  Just discard it.
+			 */
+			pgfdw_absorb_pending(entry->conn, &entry->state);
+			pgfdw_reset_pending(&entry->state);
+		}
+		else
+		{
+			/* Nobody wants the result of a request in flight anymore */
+			pgfdw_cancel_pending(entry->conn, &entry->state);
+		}
+
+		send_xact_command(entry, sql);
+		if (!entry->xact_cmd_sent)
+			commit_failed = true;
+	}
+
+	/*
+	 * Now collect the results.  Note: we mustn't throw ERROR until all the
+	 * connections are cleaned up, and not at all during abort, since that
+	 * would be an infinite loop.
+	 */
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		if (entry->conn == NULL || entry->xact_depth == 0)
+			continue;
+
+		if (entry->xact_cmd_sent)
+		{
+			PGresult   *res = get_xact_command_result(entry);
+			PgFdwStats *stats = entry->state.stats;
+			instr_time	duration;
+
+			INSTR_TIME_SET_CURRENT(duration);
+			INSTR_TIME_SUBTRACT(duration, start);
+			if (res != NULL)
+				stats->errors++;
+			else if (event == XACT_EVENT_COMMIT)
+				stats->commits++;
+			else
+				stats->aborts++;
+			if (event == XACT_EVENT_COMMIT)
+				stats->commit_time += INSTR_TIME_GET_MILLISEC(duration);
+			else
+				stats->abort_time += INSTR_TIME_GET_MILLISEC(duration);
+
+			if (res != NULL)
+			{
+				commit_failed = true;
+				if (event == XACT_EVENT_COMMIT && commit_error == NULL)
+					commit_error = res;
 				else
-					PQclear(res);
-				break;
+					pgfdw_report_error(WARNING, res, entry->conn, true, sql);
+			}
 		}
+		else
+			entry->state.stats->errors++;
 
 		/* Reset state to show we're out of a transaction */
 		entry->xact_depth = 0;
@@ -531,6 +2014,8 @@ pgfdw_xact_callback(XactEvent event, void *arg)
 			PQtransactionStatus(entry->conn) != PQTRANS_IDLE)
 		{
 			elog(DEBUG3, "discarding connection %p", entry->conn);
+			pgfdw_reset_pending(&entry->state);
+			forget_prepared_stmts(entry);
 			PQfinish(entry->conn);
 			entry->conn = NULL;
 		}
@@ -544,10 +2029,30 @@ pgfdw_xact_callback(XactEvent event, void *arg)
 
 	/* Also reset cursor numbering for next transaction */
 	cursor_number = 0;
+
+	/* Make this transaction's activity visible in postgres_fdw_stats */
+	pgfdw_flush_stats();
+
+	/* Finally, complain if any remote transaction failed to commit */
+	if (event == XACT_EVENT_COMMIT && commit_failed)
+	{
+		if (commit_error != NULL)
+			pgfdw_report_error(ERROR, commit_error, NULL, true, sql);
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("could not commit remote transaction")));
+	}
 }
 
 /*
  * pgfdw_subxact_callback --- cleanup at subtransaction end.
+ *
+ * At subtransaction commit, the remote savepoints of the current level are
+ * released; at abort, they are rolled back and released.  As at main
+ * transaction end, the commands for all connections are sent before any of
+ * their results is collected.  Failures are reported as warnings only,
+ * since we can't throw an error at this point; a remote subtransaction
+ * that's left open is rolled back along with the main transaction.
  */
 static void
 pgfdw_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
@@ -556,25 +2061,34 @@ pgfdw_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
 	HASH_SEQ_STATUS scan;
 	ConnCacheEntry *entry;
 	int			curlevel;
+	char		sql[100];
 
-	/* Nothing to do at subxact start, nor after commit. */
-	if (!(event == SUBXACT_EVENT_ABORT_SUB))
+	/* Nothing to do at subxact start. */
+	if (!(event == SUBXACT_EVENT_COMMIT_SUB || event == SUBXACT_EVENT_ABORT_SUB))
 		return;
 
 	/* Quick exit if no connections were touched in this transaction. */
 	if (!xact_got_connection)
 		return;
 
+	curlevel = GetCurrentTransactionNestLevel();
+	if (event == SUBXACT_EVENT_COMMIT_SUB)
+		snprintf(sql, sizeof(sql), "RELEASE SAVEPOINT s%d", curlevel);
+	else
+		snprintf(sql, sizeof(sql),
+				 "ROLLBACK TO SAVEPOINT s%d; RELEASE SAVEPOINT s%d",
+				 curlevel, curlevel);
+
 	/*
 	 * Scan all connection cache entries to find open remote subtransactions
-	 * of the current level, and close them.
+	 * of the current level, and send the commands closing them.
 	 */
-	curlevel = GetCurrentTransactionNestLevel();
 	hash_seq_init(&scan, ConnectionHash);
 	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
 	{
-		PGresult   *res;
-		char		sql[100];
+		/* Any deferred savepoint of this level isn't wanted anymore */
+		if (entry->begin_level >= curlevel)
+			entry->begin_level = curlevel - 1;
 
 		/*
 		 * We only care about connections with open remote subtransactions of
@@ -587,15 +2101,38 @@ pgfdw_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
 			elog(ERROR, "missed cleaning up remote subtransaction at level %d",
 				 entry->xact_depth);
 
-		/* Rollback all remote subtransactions during abort */
-		snprintf(sql, sizeof(sql),
-			 "ROLLBACK TO SAVEPOINT s%d; RELEASE SAVEPOINT s%d",
-			 curlevel, curlevel);
-		res = PQexec(entry->conn, sql);
-		if (PQresultStatus(res) != PGRES_COMMAND_OK)
-			pgfdw_report_error(WARNING, res, true, sql);
-		else
-			PQclear(res);
+		/*
+		 * Collect the result of any request in flight first.  We can't
+		 * cancel it, because its scan might belong to an outer subtransaction
+		 * and still want the data; neither releasing nor rolling back to a
+		 * savepoint affects the position of cursors that survive it.
+		 */
+		if (entry->state.pending_cursor != 0 && !entry->state.pending_done)
+			pgfdw_collect_pending(entry->conn, &entry->state, true);
+
+		send_xact_command(entry, sql);
+	}
+
+	/* Now collect the results */
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		if (entry->conn == NULL || entry->xact_depth < curlevel)
+			continue;
+
+		if (entry->xact_cmd_sent)
+		{
+			PGresult   *res = get_xact_command_result(entry);
+
+			if (res != NULL)
+				pgfdw_report_error(WARNING, res, entry->conn, true, sql);
+		}
+
+		/*
+		 * A COPY's savepoint that's still open must have been established
+		 * since our savepoint (see GetConnection), so it's gone now too.
+		 */
+		entry->state.copy_savepoint = false;
 
 		/* OK, we're outta that level of subtransaction */
 		entry->xact_depth--;
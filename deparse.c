@@ -35,8 +35,8 @@
 #include "postgres_fdw.h"
 
 #include "access/htup.h"
+#include "access/skey.h"
 #include "access/sysattr.h"
-#include "access/transam.h"
 #include "catalog/pg_collation.h"
 #include "catalog/pg_namespace.h"
 #include "catalog/pg_operator.h"
@@ -52,18 +52,6 @@
 #include "utils/syscache.h"
 
 
-/*
- * Global context for foreign_expr_walker's search of an expression tree.
- */
-typedef struct foreign_glob_cxt
-{
-	/* Input values */
-	PlannerInfo *root;
-	RelOptInfo *foreignrel;
-	/* Result values */
-	List	   *param_numbers;	/* Param IDs of PARAM_EXTERN Params */
-} foreign_glob_cxt;
-
 /*
  * Local (per-tree-level) context for foreign_expr_walker's search.
  * This is concerned with identifying collations used in the expression.
@@ -81,16 +69,42 @@ typedef struct foreign_loc_cxt
 	FDWCollateState state;		/* state of current collation choice */
 } foreign_loc_cxt;
 
+/*
+ * Global context for foreign_expr_walker's search of an expression tree.
+ */
+typedef struct foreign_glob_cxt
+{
+	/* Input values */
+	PlannerInfo *root;
+	RelOptInfo *foreignrel;
+	/* Working state */
+	foreign_loc_cxt *case_arg_cxt;	/* collation state of the arg of the
+									 * CASE whose WHENs we're in, or NULL */
+	/* Result values */
+	List	   *param_numbers;	/* Param IDs of PARAM_EXTERN Params */
+} foreign_glob_cxt;
+
+/*
+ * Context for deparseExpr
+ */
+typedef struct deparse_expr_cxt
+{
+	PlannerInfo *root;			/* global planner state */
+	RelOptInfo *foreignrel;		/* the foreign relation we are planning for */
+	List	  **params_list;	/* exprs that will become remote Params, or
+								 * NULL if deparsing for remote EXPLAIN */
+	int			param_offset;	/* # of Param numbers used by PARAM_EXTERN
+								 * Params, which come first */
+} deparse_expr_cxt;
+
 /*
  * Functions to determine whether an expression can be evaluated safely on
  * remote server.
  */
-static bool is_foreign_expr(PlannerInfo *root, RelOptInfo *baserel,
-				Expr *expr, List **param_numbers);
 static bool foreign_expr_walker(Node *node,
 					foreign_glob_cxt *glob_cxt,
 					foreign_loc_cxt *outer_cxt);
-static bool is_builtin(Oid procid);
+static bool is_fixed_text_io_type(Oid type);
 
 /*
  * Functions to construct string representation of a node tree.
@@ -99,24 +113,47 @@ static void deparseColumnRef(StringInfo buf, int varno, int varattno,
 				 PlannerInfo *root);
 static void deparseRelation(StringInfo buf, Oid relid);
 static void deparseStringLiteral(StringInfo buf, const char *val);
-static void deparseExpr(StringInfo buf, Expr *expr, PlannerInfo *root);
-static void deparseVar(StringInfo buf, Var *node, PlannerInfo *root);
-static void deparseConst(StringInfo buf, Const *node, PlannerInfo *root);
-static void deparseParam(StringInfo buf, Param *node, PlannerInfo *root);
-static void deparseArrayRef(StringInfo buf, ArrayRef *node, PlannerInfo *root);
-static void deparseFuncExpr(StringInfo buf, FuncExpr *node, PlannerInfo *root);
-static void deparseOpExpr(StringInfo buf, OpExpr *node, PlannerInfo *root);
+static char *deparse_type_name(Oid type_oid, int32 typemod);
+static void deparseExpr(StringInfo buf, Expr *expr,
+			deparse_expr_cxt *context);
+static void deparseVar(StringInfo buf, Var *node, deparse_expr_cxt *context);
+static void deparseConst(StringInfo buf, Const *node,
+			 deparse_expr_cxt *context);
+static void deparseParam(StringInfo buf, Param *node,
+			 deparse_expr_cxt *context);
+static void deparseArrayRef(StringInfo buf, ArrayRef *node,
+				deparse_expr_cxt *context);
+static void deparseFuncExpr(StringInfo buf, FuncExpr *node,
+				deparse_expr_cxt *context);
+static void deparseOpExpr(StringInfo buf, OpExpr *node,
+			  deparse_expr_cxt *context);
 static void deparseOperatorName(StringInfo buf, Form_pg_operator opform);
 static void deparseDistinctExpr(StringInfo buf, DistinctExpr *node,
-					PlannerInfo *root);
+					deparse_expr_cxt *context);
 static void deparseScalarArrayOpExpr(StringInfo buf, ScalarArrayOpExpr *node,
-						 PlannerInfo *root);
+						 deparse_expr_cxt *context);
 static void deparseRelabelType(StringInfo buf, RelabelType *node,
-				   PlannerInfo *root);
-static void deparseBoolExpr(StringInfo buf, BoolExpr *node, PlannerInfo *root);
-static void deparseNullTest(StringInfo buf, NullTest *node, PlannerInfo *root);
+				   deparse_expr_cxt *context);
+static void deparseBoolExpr(StringInfo buf, BoolExpr *node,
+				deparse_expr_cxt *context);
+static void deparseNullTest(StringInfo buf, NullTest *node,
+				deparse_expr_cxt *context);
 static void deparseArrayExpr(StringInfo buf, ArrayExpr *node,
-				 PlannerInfo *root);
+				 deparse_expr_cxt *context);
+static void deparseCaseExpr(StringInfo buf, CaseExpr *node,
+				deparse_expr_cxt *context);
+static void deparseCoalesceExpr(StringInfo buf, CoalesceExpr *node,
+					deparse_expr_cxt *context);
+static void deparseNullIfExpr(StringInfo buf, NullIfExpr *node,
+				  deparse_expr_cxt *context);
+static void deparseMinMaxExpr(StringInfo buf, MinMaxExpr *node,
+				  deparse_expr_cxt *context);
+static void deparseRowCompareExpr(StringInfo buf, RowCompareExpr *node,
+					  deparse_expr_cxt *context);
+static void deparseCoerceViaIO(StringInfo buf, CoerceViaIO *node,
+				   deparse_expr_cxt *context);
+static void deparseBooleanTest(StringInfo buf, BooleanTest *node,
+				   deparse_expr_cxt *context);
 
 
 /*
@@ -180,7 +217,7 @@ classifyConditions(PlannerInfo *root,
  * If result is true, we also return a list of param IDs of PARAM_EXTERN
  * Params appearing in the expr into *param_numbers.
  */
-static bool
+bool
 is_foreign_expr(PlannerInfo *root,
 				RelOptInfo *baserel,
 				Expr *expr,
@@ -197,6 +234,7 @@ is_foreign_expr(PlannerInfo *root,
 	 */
 	glob_cxt.root = root;
 	glob_cxt.foreignrel = baserel;
+	glob_cxt.case_arg_cxt = NULL;
 	glob_cxt.param_numbers = NIL;
 	loc_cxt.collation = InvalidOid;
 	loc_cxt.state = FDW_COLLATE_NONE;
@@ -231,11 +269,11 @@ is_foreign_expr(PlannerInfo *root,
  * In addition, glob_cxt->param_numbers and *outer_cxt are updated.
  *
  * We must check that the expression contains only node types we can deparse,
- * that all types/functions/operators are safe to send (which we approximate
- * as being built-in), and that all collations used in the expression derive
- * from Vars of the foreign table.	Because of the latter, the logic is
- * pretty close to assign_collations_walker() in parse_collate.c, though we
- * can assume here that the given expression is valid.
+ * that all types/functions/operators are safe to send (they are "shippable"),
+ * and that all collations used in the expression derive from Vars of the
+ * foreign table.  Because of the latter, the logic is pretty close to
+ * assign_collations_walker() in parse_collate.c, though we can assume here
+ * that the given expression is valid.
  */
 static bool
 foreign_expr_walker(Node *node,
@@ -243,6 +281,7 @@ foreign_expr_walker(Node *node,
 					foreign_loc_cxt *outer_cxt)
 {
 	bool		check_type = true;
+	PgFdwRelationInfo *fpinfo;
 	foreign_loc_cxt inner_cxt;
 	Oid			collation;
 	FDWCollateState state;
@@ -251,6 +290,9 @@ foreign_expr_walker(Node *node,
 	if (node == NULL)
 		return true;
 
+	/* May need server info from baserel's fdw_private struct */
+	fpinfo = (PgFdwRelationInfo *) (glob_cxt->foreignrel->fdw_private);
+
 	/* Set up inner_cxt for possible recursion to child nodes */
 	inner_cxt.collation = InvalidOid;
 	inner_cxt.state = FDW_COLLATE_NONE;
@@ -261,20 +303,32 @@ foreign_expr_walker(Node *node,
 			{
 				Var		   *var = (Var *) node;
 
-				/*
-				 * Var can be used if it is in the foreign table (we shouldn't
-				 * really see anything else in baserestrict clauses, but let's
-				 * check anyway).
-				 */
-				if (var->varno != glob_cxt->foreignrel->relid ||
-					var->varlevelsup != 0)
+				if (var->varlevelsup != 0)
 					return false;
 
-				/*
-				 * If Var has a collation, consider that safe to use.
-				 */
-				collation = var->varcollid;
-				state = OidIsValid(collation) ? FDW_COLLATE_SAFE : FDW_COLLATE_NONE;
+				if (var->varno == glob_cxt->foreignrel->relid)
+				{
+					/*
+					 * Var belongs to the foreign table.  If it has a
+					 * collation, consider that safe to use.
+					 */
+					collation = var->varcollid;
+					state = OidIsValid(collation) ? FDW_COLLATE_SAFE : FDW_COLLATE_NONE;
+				}
+				else
+				{
+					/*
+					 * Var belongs to some other table, which can happen only
+					 * in join clauses, where it will be sent to the remote
+					 * server as a parameter.  So treat it like a Param: its
+					 * collation must not matter.
+					 */
+					if (var->varcollid != InvalidOid &&
+						var->varcollid != DEFAULT_COLLATION_OID)
+						return false;
+					collation = InvalidOid;
+					state = FDW_COLLATE_NONE;
+				}
 			}
 			break;
 		case T_Const:
@@ -367,11 +421,11 @@ foreign_expr_walker(Node *node,
 				FuncExpr   *fe = (FuncExpr *) node;
 
 				/*
-				 * If function used by the expression is not built-in, it
+				 * If function used by the expression is not shippable, it
 				 * can't be sent to remote because it might have incompatible
 				 * semantics on remote side.
 				 */
-				if (!is_builtin(fe->funcid))
+				if (!is_shippable(fe->funcid, ProcedureRelationId, fpinfo))
 					return false;
 
 				/*
@@ -409,15 +463,16 @@ foreign_expr_walker(Node *node,
 			break;
 		case T_OpExpr:
 		case T_DistinctExpr:	/* struct-equivalent to OpExpr */
+		case T_NullIfExpr:		/* struct-equivalent to OpExpr */
 			{
 				OpExpr	   *oe = (OpExpr *) node;
 
 				/*
-				 * Similarly, only built-in operators can be sent to remote.
-				 * (If the operator is, surely its underlying function is
-				 * too.)
+				 * Similarly, only shippable operators can be sent to remote.
+				 * (If the operator is shippable, we assume its underlying
+				 * function is too.)
 				 */
-				if (!is_builtin(oe->opno))
+				if (!is_shippable(oe->opno, OperatorRelationId, fpinfo))
 					return false;
 
 				/*
@@ -448,14 +503,299 @@ foreign_expr_walker(Node *node,
 					state = FDW_COLLATE_UNSAFE;
 			}
 			break;
+		case T_CaseExpr:
+			{
+				CaseExpr   *ce = (CaseExpr *) node;
+				foreign_loc_cxt *outer_case_arg_cxt = glob_cxt->case_arg_cxt;
+				foreign_loc_cxt arg_cxt;
+				foreign_loc_cxt tmp_cxt;
+				ListCell   *lc;
+
+				/*
+				 * Recurse to CASE's arg expression, if any.  Its collation
+				 * has to be saved aside for use while examining the
+				 * CaseTestExprs within the WHEN expressions.
+				 */
+				arg_cxt.collation = InvalidOid;
+				arg_cxt.state = FDW_COLLATE_NONE;
+				if (ce->arg &&
+					!foreign_expr_walker((Node *) ce->arg,
+										 glob_cxt, &arg_cxt))
+					return false;
+
+				foreach(lc, ce->args)
+				{
+					CaseWhen   *cw = (CaseWhen *) lfirst(lc);
+
+					if (ce->arg)
+					{
+						/*
+						 * In a CASE-with-arg, the parser produces WHEN
+						 * clauses of the form "CaseTestExpr = RHS", possibly
+						 * with an implicit coercion above the CaseTestExpr,
+						 * and deparseCaseExpr relies on that.  Don't try to
+						 * cope with anything else.
+						 */
+						Node	   *when_expr = (Node *) cw->expr;
+						List	   *op_args;
+
+						if (!IsA(when_expr, OpExpr))
+							return false;
+						op_args = ((OpExpr *) when_expr)->args;
+						if (list_length(op_args) != 2 ||
+							!IsA(strip_implicit_coercions(linitial(op_args)),
+								 CaseTestExpr))
+							return false;
+					}
+
+					/*
+					 * Recurse to the WHEN expression, letting any
+					 * CaseTestExpr in it see the arg's collation.  Its own
+					 * collation doesn't affect the result, since it's
+					 * boolean.
+					 */
+					tmp_cxt.collation = InvalidOid;
+					tmp_cxt.state = FDW_COLLATE_NONE;
+					glob_cxt->case_arg_cxt = ce->arg ? &arg_cxt : NULL;
+					if (!foreign_expr_walker((Node *) cw->expr,
+											 glob_cxt, &tmp_cxt))
+						return false;
+					glob_cxt->case_arg_cxt = outer_case_arg_cxt;
+
+					/* Recurse to the THEN expression. */
+					if (!foreign_expr_walker((Node *) cw->result,
+											 glob_cxt, &inner_cxt))
+						return false;
+				}
+
+				/* Recurse to the ELSE expression. */
+				if (!foreign_expr_walker((Node *) ce->defresult,
+										 glob_cxt, &inner_cxt))
+					return false;
+
+				/*
+				 * Result-collation handling is same as for functions, except
+				 * that only the THEN and ELSE subexpressions count as input.
+				 */
+				collation = ce->casecollid;
+				if (collation == InvalidOid)
+					state = FDW_COLLATE_NONE;
+				else if (inner_cxt.state == FDW_COLLATE_SAFE &&
+						 collation == inner_cxt.collation)
+					state = FDW_COLLATE_SAFE;
+				else
+					state = FDW_COLLATE_UNSAFE;
+			}
+			break;
+		case T_CaseTestExpr:
+			{
+				CaseTestExpr *c = (CaseTestExpr *) node;
+
+				/* Punt if we seem not to be inside a CASE arg WHEN. */
+				if (glob_cxt->case_arg_cxt == NULL)
+					return false;
+
+				/*
+				 * Otherwise, any collation attached to the CaseTestExpr must
+				 * be derived from foreign Var(s) in the CASE arg.
+				 */
+				collation = c->collation;
+				if (collation == InvalidOid)
+					state = FDW_COLLATE_NONE;
+				else if (glob_cxt->case_arg_cxt->state == FDW_COLLATE_SAFE &&
+						 collation == glob_cxt->case_arg_cxt->collation)
+					state = FDW_COLLATE_SAFE;
+				else
+					state = FDW_COLLATE_UNSAFE;
+			}
+			break;
+		case T_CoalesceExpr:
+			{
+				CoalesceExpr *c = (CoalesceExpr *) node;
+
+				/*
+				 * Recurse to input subexpressions.
+				 */
+				if (!foreign_expr_walker((Node *) c->args,
+										 glob_cxt, &inner_cxt))
+					return false;
+
+				/* Result-collation handling is same as for functions */
+				collation = c->coalescecollid;
+				if (collation == InvalidOid)
+					state = FDW_COLLATE_NONE;
+				else if (inner_cxt.state == FDW_COLLATE_SAFE &&
+						 collation == inner_cxt.collation)
+					state = FDW_COLLATE_SAFE;
+				else
+					state = FDW_COLLATE_UNSAFE;
+			}
+			break;
+		case T_MinMaxExpr:
+			{
+				MinMaxExpr *m = (MinMaxExpr *) node;
+
+				/*
+				 * The comparisons use the default btree opclass of the
+				 * (shippable) result type, which the remote server will
+				 * find too; so beyond that, this is just like a function.
+				 */
+				if (!foreign_expr_walker((Node *) m->args,
+										 glob_cxt, &inner_cxt))
+					return false;
+
+				/*
+				 * If the comparisons' input collation is not derived from a
+				 * foreign Var, it can't be sent to remote.
+				 */
+				if (m->inputcollid == InvalidOid)
+					 /* OK, inputs are all noncollatable */ ;
+				else if (inner_cxt.state != FDW_COLLATE_SAFE ||
+						 m->inputcollid != inner_cxt.collation)
+					return false;
+
+				/* Result-collation handling is same as for functions */
+				collation = m->minmaxcollid;
+				if (collation == InvalidOid)
+					state = FDW_COLLATE_NONE;
+				else if (inner_cxt.state == FDW_COLLATE_SAFE &&
+						 collation == inner_cxt.collation)
+					state = FDW_COLLATE_SAFE;
+				else
+					state = FDW_COLLATE_UNSAFE;
+			}
+			break;
+		case T_RowCompareExpr:
+			{
+				RowCompareExpr *rc = (RowCompareExpr *) node;
+				ListCell   *lc_l = list_head(rc->largs);
+				ListCell   *lc_r = list_head(rc->rargs);
+				ListCell   *lc_coll = list_head(rc->inputcollids);
+				ListCell   *lc_op;
+				Oid			opnamespace = InvalidOid;
+
+				/*
+				 * Each column pair is compared with its own operator, under
+				 * its own input collation, so check the pairs one at a time.
+				 * deparseRowCompareExpr prints a single operator name, which
+				 * must find each of the operators on the remote side; so they
+				 * must all be in the same schema, too.
+				 */
+				foreach(lc_op, rc->opnos)
+				{
+					Oid			opno = lfirst_oid(lc_op);
+					Oid			inputcollid = lfirst_oid(lc_coll);
+					Oid			nspid;
+					foreign_loc_cxt pair_cxt;
+
+					if (!is_shippable(opno, OperatorRelationId, fpinfo))
+						return false;
+
+					if (is_builtin(opno))
+						nspid = PG_CATALOG_NAMESPACE;
+					else
+					{
+						HeapTuple	tuple;
+
+						tuple = SearchSysCache1(OPEROID, ObjectIdGetDatum(opno));
+						if (!HeapTupleIsValid(tuple))
+							elog(ERROR, "cache lookup failed for operator %u",
+								 opno);
+						nspid = ((Form_pg_operator) GETSTRUCT(tuple))->oprnamespace;
+						ReleaseSysCache(tuple);
+					}
+					if (lc_op == list_head(rc->opnos))
+						opnamespace = nspid;
+					else if (nspid != opnamespace)
+						return false;
+
+					pair_cxt.collation = InvalidOid;
+					pair_cxt.state = FDW_COLLATE_NONE;
+					if (!foreign_expr_walker((Node *) lfirst(lc_l),
+											 glob_cxt, &pair_cxt))
+						return false;
+					if (!foreign_expr_walker((Node *) lfirst(lc_r),
+											 glob_cxt, &pair_cxt))
+						return false;
+
+					/*
+					 * If the pair's input collation is not derived from a
+					 * foreign Var, it can't be sent to remote.
+					 */
+					if (inputcollid == InvalidOid)
+						 /* OK, inputs are all noncollatable */ ;
+					else if (pair_cxt.state != FDW_COLLATE_SAFE ||
+							 inputcollid != pair_cxt.collation)
+						return false;
+
+					lc_l = lnext(lc_l);
+					lc_r = lnext(lc_r);
+					lc_coll = lnext(lc_coll);
+				}
+
+				/* Output is always boolean and so noncollatable. */
+				collation = InvalidOid;
+				state = FDW_COLLATE_NONE;
+			}
+			break;
+		case T_CoerceViaIO:
+			{
+				CoerceViaIO *c = (CoerceViaIO *) node;
+
+				/*
+				 * The input type's output function and the result type's
+				 * input function must behave the same remotely.  Being
+				 * immutable, which contain_mutable_functions checks, isn't
+				 * enough for that: float8out depends on extra_float_digits,
+				 * for one, which we set differently in the remote session.
+				 * So allow only types whose text form is fixed.
+				 */
+				if (!is_fixed_text_io_type(exprType((Node *) c->arg)) ||
+					!is_fixed_text_io_type(c->resulttype))
+					return false;
+
+				/*
+				 * Recurse to input subexpression.
+				 */
+				if (!foreign_expr_walker((Node *) c->arg,
+										 glob_cxt, &inner_cxt))
+					return false;
+
+				/* Result-collation handling is same as for RelabelType */
+				collation = c->resultcollid;
+				if (collation == InvalidOid)
+					state = FDW_COLLATE_NONE;
+				else if (inner_cxt.state == FDW_COLLATE_SAFE &&
+						 collation == inner_cxt.collation)
+					state = FDW_COLLATE_SAFE;
+				else
+					state = FDW_COLLATE_UNSAFE;
+			}
+			break;
+		case T_BooleanTest:
+			{
+				BooleanTest *bt = (BooleanTest *) node;
+
+				/*
+				 * Recurse to input subexpressions.
+				 */
+				if (!foreign_expr_walker((Node *) bt->arg,
+										 glob_cxt, &inner_cxt))
+					return false;
+
+				/* Output is always boolean and so noncollatable. */
+				collation = InvalidOid;
+				state = FDW_COLLATE_NONE;
+			}
+			break;
 		case T_ScalarArrayOpExpr:
 			{
 				ScalarArrayOpExpr *oe = (ScalarArrayOpExpr *) node;
 
 				/*
-				 * Again, only built-in operators can be sent to remote.
+				 * Again, only shippable operators can be sent to remote.
 				 */
-				if (!is_builtin(oe->opno))
+				if (!is_shippable(oe->opno, OperatorRelationId, fpinfo))
 					return false;
 
 				/*
@@ -598,10 +938,10 @@ foreign_expr_walker(Node *node,
 	}
 
 	/*
-	 * If result type of given expression is not built-in, it can't be sent to
-	 * remote because it might have incompatible semantics on remote side.
+	 * If result type of given expression is not shippable, it can't be sent
+	 * to remote because it might have incompatible semantics on remote side.
 	 */
-	if (check_type && !is_builtin(exprType(node)))
+	if (check_type && !is_shippable(exprType(node), TypeRelationId, fpinfo))
 		return false;
 
 	/*
@@ -654,27 +994,57 @@ foreign_expr_walker(Node *node,
 }
 
 /*
- * Return true if given object is one of PostgreSQL's built-in objects.
- *
- * We use FirstBootstrapObjectId as the cutoff, so that we only consider
- * objects with hand-assigned OIDs to be "built in", not for instance any
- * function or type defined in the information_schema.
- *
- * Our constraints for dealing with types are tighter than they are for
- * functions or operators: we want to accept only types that are in pg_catalog,
- * else format_type might incorrectly fail to schema-qualify their names.
- * (This could be fixed with some changes to format_type, but for now there's
- * no need.)  Thus we must exclude information_schema types.
- *
- * XXX there is a problem with this, which is that the set of built-in
- * objects expands over time.  Something that is built-in to us might not
- * be known to the remote server, if it's of an older version.  But keeping
- * track of that would be a huge exercise.
+ * Is the text representation of the given type independent of all settings,
+ * so that converting to or from it gives the same result on any server?
  */
 static bool
-is_builtin(Oid oid)
+is_fixed_text_io_type(Oid type)
+{
+	switch (type)
+	{
+		case BOOLOID:
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case OIDOID:
+		case TEXTOID:
+		case VARCHAROID:
+		case BPCHAROID:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Return true if values of the given type can be transferred in binary
+ * format, assuming the remote server is of the same major version as we are.
+ *
+ * The binary representation of a type that isn't built in might differ on
+ * the remote server, and so might its OID, which is embedded in the binary
+ * format of arrays and composites; so we accept only built-in types, which
+ * furthermore must have both send and receive functions.
+ */
+bool
+is_binary_safe_type(Oid type)
 {
-	return (oid < FirstBootstrapObjectId);
+	HeapTuple	tuple;
+	Form_pg_type typform;
+	bool		result;
+
+	if (!is_builtin(type))
+		return false;
+
+	tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(type));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for type %u", type);
+	typform = (Form_pg_type) GETSTRUCT(tuple);
+
+	result = OidIsValid(typform->typreceive) && OidIsValid(typform->typsend);
+
+	ReleaseSysCache(tuple);
+
+	return result;
 }
 
 
@@ -685,12 +1055,24 @@ is_builtin(Oid oid)
  *
  * "Interesting" columns are those appearing in the rel's targetlist or
  * in local_conds (conditions which can't be executed remotely).
+ *
+ * If binary_transfer is true, the result will be retrieved in binary format,
+ * so columns whose type is not binary-safe are cast to text; the receiving
+ * side applies the type's input function to them, as in text mode.  The
+ * other columns are cast to their local type, since they are decoded with
+ * its receive function: the remote column may well be of another type (int8
+ * rather than int4, say), which text mode copes with but binary doesn't.
+ *
+ * The attribute numbers of the columns actually fetched (rather than replaced
+ * by NULL) are returned as an integer List in *retrieved_attrs.
  */
 void
 deparseSimpleSql(StringInfo buf,
 				 PlannerInfo *root,
 				 RelOptInfo *baserel,
-				 List *local_conds)
+				 List *local_conds,
+				 bool binary_transfer,
+				 List **retrieved_attrs)
 {
 	RangeTblEntry *rte = root->simple_rte_array[baserel->relid];
 	Bitmapset  *attrs_used = NULL;
@@ -726,6 +1108,7 @@ deparseSimpleSql(StringInfo buf,
 	 */
 	appendStringInfo(buf, "SELECT ");
 	first = true;
+	*retrieved_attrs = NIL;
 	for (attr = 1; attr <= baserel->max_attr; attr++)
 	{
 		/* Ignore dropped attributes. */
@@ -739,7 +1122,20 @@ deparseSimpleSql(StringInfo buf,
 		if (have_wholerow ||
 			bms_is_member(attr - FirstLowInvalidHeapAttributeNumber,
 						  attrs_used))
+		{
 			deparseColumnRef(buf, baserel->relid, attr, root);
+			if (binary_transfer)
+			{
+				Oid			type = get_atttype(rte->relid, attr);
+
+				if (is_binary_safe_type(type))
+					appendStringInfo(buf, "::%s",
+									 deparse_type_name(type, -1));
+				else
+					appendStringInfoString(buf, "::text");
+			}
+			*retrieved_attrs = lappend_int(*retrieved_attrs, attr);
+		}
 		else
 			appendStringInfo(buf, "NULL");
 	}
@@ -759,16 +1155,31 @@ deparseSimpleSql(StringInfo buf,
  * Deparse WHERE clauses in given list of RestrictInfos and append them to buf.
  *
  * If no WHERE clause already exists in the buffer, is_first should be true.
+ *
+ * Join clauses may refer to Vars of other relations than baserel, which are
+ * sent as parameters: each distinct Var is appended to *params_list, and
+ * printed as Param number param_offset + its position in the list.  If
+ * params_list is NULL, we're deparsing for remote EXPLAIN, and such Vars are
+ * replaced by placeholders of the right type instead.
  */
 void
 appendWhereClause(StringInfo buf,
 				  bool is_first,
 				  List *exprs,
-				  PlannerInfo *root)
+				  PlannerInfo *root,
+				  RelOptInfo *baserel,
+				  List **params_list,
+				  int param_offset)
 {
+	deparse_expr_cxt context;
 	int			nestlevel;
 	ListCell   *lc;
 
+	context.root = root;
+	context.foreignrel = baserel;
+	context.params_list = params_list;
+	context.param_offset = param_offset;
+
 	/* Make sure any constants in the exprs are printed portably */
 	nestlevel = set_transmission_modes();
 
@@ -783,7 +1194,7 @@ appendWhereClause(StringInfo buf,
 			appendStringInfo(buf, " AND ");
 
 		appendStringInfoChar(buf, '(');
-		deparseExpr(buf, ri->clause, root);
+		deparseExpr(buf, ri->clause, &context);
 		appendStringInfoChar(buf, ')');
 
 		is_first = false;
@@ -793,15 +1204,159 @@ appendWhereClause(StringInfo buf,
 }
 
 /*
- * Construct SELECT statement to acquire size in blocks of given relation.
- *
- * Note: we use local definition of block size, not remote definition.
- * This is perhaps debatable.
- *
- * Note: pg_relation_size() exists in 8.1 and later.
+ * Append the condition selecting slice number part of baserel to buf, for
+ * scanning the table over several connections at once.  The slices are
+ * ranges of the integer column attnum, split at the nbounds values in bounds,
+ * which must be increasing: slice 0 takes the values below bounds[0],
+ * slice i those from bounds[i - 1] up to bounds[i], and the last one the
+ * rest.  The first slice also gets the rows where the column is null.
+ *
+ * If no WHERE clause already exists in the buffer, is_first should be true.
+ */
+void
+appendPartitionClause(StringInfo buf,
+					  bool is_first,
+					  PlannerInfo *root,
+					  RelOptInfo *baserel,
+					  AttrNumber attnum,
+					  const int64 *bounds,
+					  int nbounds,
+					  int part)
+{
+	Assert(part >= 0 && part <= nbounds);
+
+	appendStringInfoString(buf, is_first ? " WHERE " : " AND ");
+	appendStringInfoChar(buf, '(');
+	if (part > 0)
+	{
+		appendStringInfoChar(buf, '(');
+		deparseColumnRef(buf, baserel->relid, attnum, root);
+		appendStringInfo(buf, " >= " INT64_FORMAT ")", bounds[part - 1]);
+	}
+	if (part > 0 && part < nbounds)
+		appendStringInfoString(buf, " AND ");
+	if (part < nbounds)
+	{
+		appendStringInfoChar(buf, '(');
+		deparseColumnRef(buf, baserel->relid, attnum, root);
+		appendStringInfo(buf, " < " INT64_FORMAT ")", bounds[part]);
+	}
+	if (part == 0)
+	{
+		appendStringInfoString(buf, " OR (");
+		deparseColumnRef(buf, baserel->relid, attnum, root);
+		appendStringInfoString(buf, " IS NULL)");
+	}
+	appendStringInfoChar(buf, ')');
+}
+
+/*
+ * Construct SELECT statement to acquire the smallest and largest values of
+ * the column attnum of baserel, to split a scan over several connections by.
+ */
+void
+deparsePartitionBoundsSql(StringInfo buf,
+						  PlannerInfo *root,
+						  RelOptInfo *baserel,
+						  AttrNumber attnum)
+{
+	RangeTblEntry *rte = root->simple_rte_array[baserel->relid];
+
+	appendStringInfoString(buf, "SELECT min(");
+	deparseColumnRef(buf, baserel->relid, attnum, root);
+	appendStringInfoString(buf, "), max(");
+	deparseColumnRef(buf, baserel->relid, attnum, root);
+	appendStringInfoString(buf, ") FROM ");
+	deparseRelation(buf, rte->relid);
+}
+
+/*
+ * Append ORDER BY clause for the given pathkeys to buf.
+ *
+ * The caller must have checked that each pathkey's sort expression for
+ * baserel is safe to send (see find_em_expr_for_rel), and that it sorts by
+ * the default ordering operators of its type, so that ASC and DESC mean the
+ * same thing on the remote side.
+ */
+void
+appendOrderByClause(StringInfo buf,
+					PlannerInfo *root,
+					RelOptInfo *baserel,
+					List *pathkeys)
+{
+	deparse_expr_cxt context;
+	int			nestlevel;
+	const char *delim = " ";
+	ListCell   *lc;
+
+	context.root = root;
+	context.foreignrel = baserel;
+	context.params_list = NULL;
+	context.param_offset = 0;
+
+	/* Make sure any constants in the exprs are printed portably */
+	nestlevel = set_transmission_modes();
+
+	appendStringInfo(buf, " ORDER BY");
+	foreach(lc, pathkeys)
+	{
+		PathKey    *pathkey = (PathKey *) lfirst(lc);
+		Expr	   *em_expr;
+
+		em_expr = find_em_expr_for_rel(pathkey->pk_eclass, baserel);
+		Assert(em_expr != NULL);
+
+		appendStringInfoString(buf, delim);
+		deparseExpr(buf, em_expr, &context);
+		if (pathkey->pk_strategy == BTLessStrategyNumber)
+			appendStringInfoString(buf, " ASC");
+		else
+			appendStringInfoString(buf, " DESC");
+
+		if (pathkey->pk_nulls_first)
+			appendStringInfoString(buf, " NULLS FIRST");
+		else
+			appendStringInfoString(buf, " NULLS LAST");
+
+		delim = ", ";
+	}
+
+	reset_transmission_modes(nestlevel);
+}
+
+/*
+ * Construct SELECT statement to acquire size in blocks of given relation.
+ *
+ * Note: we use local definition of block size, not remote definition.
+ * This is perhaps debatable.
+ *
+ * Note: pg_relation_size() exists in 8.1 and later.
+ *
+ * This and the other functions here that look the relation up by its
+ * regclass don't work for a table defined by a query; the caller must
+ * check for that.
+ */
+void
+deparseAnalyzeSizeSql(StringInfo buf, Relation rel)
+{
+	Oid			relid = RelationGetRelid(rel);
+	StringInfoData relname;
+
+	/* We'll need the remote relation name as a literal. */
+	initStringInfo(&relname);
+	deparseRelation(&relname, relid);
+
+	appendStringInfo(buf, "SELECT pg_catalog.pg_relation_size(");
+	deparseStringLiteral(buf, relname.data);
+	appendStringInfo(buf, "::pg_catalog.regclass) / %d", BLCKSZ);
+}
+
+/*
+ * Construct SELECT statement to acquire the remote row count estimate of
+ * given relation, as last recorded by the remote ANALYZE or VACUUM.
  */
 void
-deparseAnalyzeSizeSql(StringInfo buf, Relation rel)
+deparseAnalyzeTuplesSql(StringInfo buf, Relation rel)
 {
 	Oid			relid = RelationGetRelid(rel);
 	StringInfoData relname;
@@ -810,18 +1365,25 @@ deparseAnalyzeSizeSql(StringInfo buf, Relation rel)
 	initStringInfo(&relname);
 	deparseRelation(&relname, relid);
 
-	appendStringInfo(buf, "SELECT pg_catalog.pg_relation_size(");
+	appendStringInfo(buf, "SELECT reltuples FROM pg_catalog.pg_class"
+					 " WHERE oid = ");
 	deparseStringLiteral(buf, relname.data);
-	appendStringInfo(buf, "::pg_catalog.regclass) / %d", BLCKSZ);
+	appendStringInfo(buf, "::pg_catalog.regclass");
 }
 
 /*
  * Construct SELECT statement to acquire sample rows of given relation.
  *
+ * Unless sample_method is ANALYZE_SAMPLE_OFF, the remote server is asked to
+ * return only about sample_frac of the rows, so that we need not transfer
+ * the whole table just to throw most of it away.  AUTO must have been
+ * resolved to a concrete method by the caller.
+ *
  * Note: command is appended to whatever might be in buf already.
  */
 void
-deparseAnalyzeSql(StringInfo buf, Relation rel)
+deparseAnalyzeSql(StringInfo buf, Relation rel,
+				  PgFdwSamplingMethod sample_method, double sample_frac)
 {
 	Oid			relid = RelationGetRelid(rel);
 	TupleDesc	tupdesc = RelationGetDescr(rel);
@@ -868,6 +1430,128 @@ deparseAnalyzeSql(StringInfo buf, Relation rel)
 	 */
 	appendStringInfo(buf, " FROM ");
 	deparseRelation(buf, relid);
+
+	/*
+	 * Add the sampling clause.  TABLESAMPLE takes a percentage; the random()
+	 * filter works on any remote version.  Print the fraction in full, since
+	 * for a big table it can be too small for a fixed number of decimals.
+	 */
+	switch (sample_method)
+	{
+		case ANALYZE_SAMPLE_OFF:
+			break;
+		case ANALYZE_SAMPLE_RANDOM:
+			appendStringInfo(buf, " WHERE pg_catalog.random() < %.17g",
+							 sample_frac);
+			break;
+		case ANALYZE_SAMPLE_SYSTEM:
+			appendStringInfo(buf, " TABLESAMPLE SYSTEM(%.17g)",
+							 100.0 * sample_frac);
+			break;
+		case ANALYZE_SAMPLE_BERNOULLI:
+			appendStringInfo(buf, " TABLESAMPLE BERNOULLI(%.17g)",
+							 100.0 * sample_frac);
+			break;
+		case ANALYZE_SAMPLE_AUTO:
+			elog(ERROR, "unexpected sampling method %d", (int) sample_method);
+			break;
+	}
+}
+
+/*
+ * Construct SELECT statement to acquire the remote planner statistics of
+ * given relation, one result row per non-dropped local column.
+ *
+ * The local attribute numbers and remote column names are supplied as a
+ * VALUES list so that mapping column_name options stays on our side; the
+ * remote query then only has to look each name up in pg_attribute and
+ * pg_stats.  Array-valued statistics are returned as text, since their
+ * element type is only known per column.  Columns missing remotely, or
+ * lacking statistics, yield NULLs which the caller must check for.
+ *
+ * Returns false, leaving buf untouched, for a zero-column relation.
+ *
+ * Note: pg_stats exists in all remote versions we support, but its
+ * "inherited" column appeared only in 9.0.
+ */
+bool
+deparseAnalyzeStatsSql(StringInfo buf, Relation rel)
+{
+	Oid			relid = RelationGetRelid(rel);
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	StringInfoData relname;
+	StringInfoData values;
+	int			i;
+	char	   *colname;
+	List	   *options;
+	ListCell   *lc;
+	bool		first = true;
+
+	initStringInfo(&values);
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		/* Ignore dropped columns. */
+		if (tupdesc->attrs[i]->attisdropped)
+			continue;
+
+		/* Use attribute name or column_name option. */
+		colname = NameStr(tupdesc->attrs[i]->attname);
+		options = GetForeignColumnOptions(relid, i + 1);
+
+		foreach(lc, options)
+		{
+			DefElem    *def = (DefElem *) lfirst(lc);
+
+			if (strcmp(def->defname, "column_name") == 0)
+			{
+				colname = defGetString(def);
+				break;
+			}
+		}
+
+		if (!first)
+			appendStringInfo(&values, ", ");
+		appendStringInfo(&values, "(%d, ", i + 1);
+		deparseStringLiteral(&values, colname);
+		appendStringInfo(&values, "::pg_catalog.name)");
+		first = false;
+	}
+
+	if (first)
+		return false;
+
+	/* We'll need the remote relation name as a literal. */
+	initStringInfo(&relname);
+	deparseRelation(&relname, relid);
+
+	appendStringInfo(buf,
+					 "SELECT l.attnum, tn.nspname, t.typname, c.reltuples,"
+					 " s.null_frac, s.avg_width, s.n_distinct,"
+					 " s.most_common_vals::pg_catalog.text,"
+					 " s.most_common_freqs::pg_catalog.text,"
+					 " s.histogram_bounds::pg_catalog.text,"
+					 " s.correlation"
+					 " FROM (VALUES %s) l(attnum, attname)"
+					 " CROSS JOIN pg_catalog.pg_class c"
+					 " JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace"
+					 " LEFT JOIN pg_catalog.pg_attribute a"
+					 " ON a.attrelid = c.oid AND a.attname = l.attname"
+					 " AND a.attnum > 0 AND NOT a.attisdropped"
+					 " LEFT JOIN pg_catalog.pg_type t ON t.oid = a.atttypid"
+					 " LEFT JOIN pg_catalog.pg_namespace tn"
+					 " ON tn.oid = t.typnamespace"
+					 " LEFT JOIN pg_catalog.pg_stats s"
+					 " ON s.schemaname = n.nspname AND s.tablename = c.relname"
+					 " AND s.attname = l.attname AND NOT s.inherited"
+					 " WHERE c.oid = ",
+					 values.data);
+	deparseStringLiteral(buf, relname.data);
+	appendStringInfo(buf, "::pg_catalog.regclass ORDER BY l.attnum");
+
+	pfree(values.data);
+	pfree(relname.data);
+
+	return true;
 }
 
 /*
@@ -925,6 +1609,7 @@ deparseRelation(StringInfo buf, Oid relid)
 	ForeignTable *table;
 	const char *nspname = NULL;
 	const char *relname = NULL;
+	const char *query = NULL;
 	ListCell   *lc;
 
 	/* obtain additional catalog information. */
@@ -941,6 +1626,20 @@ deparseRelation(StringInfo buf, Oid relid)
 			nspname = defGetString(def);
 		else if (strcmp(def->defname, "table_name") == 0)
 			relname = defGetString(def);
+		else if (strcmp(def->defname, "query") == 0)
+			query = defGetString(def);
+	}
+
+	/*
+	 * A foreign table defined by a query is sent as a derived table, named
+	 * like the local table.  Column references are never qualified, so the
+	 * alias is only there because the syntax requires one.
+	 */
+	if (query != NULL)
+	{
+		appendStringInfo(buf, "(%s) %s",
+						 query, quote_identifier(get_rel_name(relid)));
+		return;
 	}
 
 	/*
@@ -956,6 +1655,27 @@ deparseRelation(StringInfo buf, Oid relid)
 					 quote_identifier(nspname), quote_identifier(relname));
 }
 
+/*
+ * Return the remote query defining the given foreign table (its "query"
+ * option), or NULL if it is an ordinary remote table.
+ */
+char *
+get_remote_query(Oid relid)
+{
+	ForeignTable *table = GetForeignTable(relid);
+	ListCell   *lc;
+
+	foreach(lc, table->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "query") == 0)
+			return defGetString(def);
+	}
+
+	return NULL;
+}
+
 /*
  * Append a SQL string literal representing "val" to buf.
  */
@@ -984,6 +1704,51 @@ deparseStringLiteral(StringInfo buf, const char *val)
 	appendStringInfoChar(buf, '\'');
 }
 
+/*
+ * Return the name of the given type, as it should be written in the remote
+ * query, with the typmod if any.
+ *
+ * Built-in types live in pg_catalog, which is the remote session's whole
+ * search_path, so format_type_with_typemod gets those right.  A type from a
+ * shippable extension, though, must be schema-qualified even if it's visible
+ * to us, and format_type can't be made to do that here.
+ */
+static char *
+deparse_type_name(Oid type_oid, int32 typemod)
+{
+	HeapTuple	tuple;
+	Form_pg_type typform;
+	const char *nspname;
+	StringInfoData buf;
+
+	if (is_builtin(type_oid))
+		return format_type_with_typemod(type_oid, typemod);
+
+	tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(type_oid));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for type %u", type_oid);
+	typform = (Form_pg_type) GETSTRUCT(tuple);
+
+	initStringInfo(&buf);
+	nspname = get_namespace_name(typform->typnamespace);
+	appendStringInfoString(&buf,
+						   quote_qualified_identifier(nspname,
+												NameStr(typform->typname)));
+
+	/* Add the typmod decoration the way format_type's printTypmod does */
+	if (typemod >= 0 && OidIsValid(typform->typmodout))
+	{
+		Datum		tmstr;
+
+		tmstr = OidFunctionCall1(typform->typmodout, Int32GetDatum(typemod));
+		appendStringInfoString(&buf, DatumGetCString(tmstr));
+	}
+
+	ReleaseSysCache(tuple);
+
+	return buf.data;
+}
+
 /*
  * Deparse given expression into buf.
  *
@@ -995,7 +1760,7 @@ deparseStringLiteral(StringInfo buf, const char *val)
  * should be self-parenthesized.
  */
 static void
-deparseExpr(StringInfo buf, Expr *node, PlannerInfo *root)
+deparseExpr(StringInfo buf, Expr *node, deparse_expr_cxt *context)
 {
 	if (node == NULL)
 		return;
@@ -1003,40 +1768,61 @@ deparseExpr(StringInfo buf, Expr *node, PlannerInfo *root)
 	switch (nodeTag(node))
 	{
 		case T_Var:
-			deparseVar(buf, (Var *) node, root);
+			deparseVar(buf, (Var *) node, context);
 			break;
 		case T_Const:
-			deparseConst(buf, (Const *) node, root);
+			deparseConst(buf, (Const *) node, context);
 			break;
 		case T_Param:
-			deparseParam(buf, (Param *) node, root);
+			deparseParam(buf, (Param *) node, context);
 			break;
 		case T_ArrayRef:
-			deparseArrayRef(buf, (ArrayRef *) node, root);
+			deparseArrayRef(buf, (ArrayRef *) node, context);
 			break;
 		case T_FuncExpr:
-			deparseFuncExpr(buf, (FuncExpr *) node, root);
+			deparseFuncExpr(buf, (FuncExpr *) node, context);
 			break;
 		case T_OpExpr:
-			deparseOpExpr(buf, (OpExpr *) node, root);
+			deparseOpExpr(buf, (OpExpr *) node, context);
 			break;
 		case T_DistinctExpr:
-			deparseDistinctExpr(buf, (DistinctExpr *) node, root);
+			deparseDistinctExpr(buf, (DistinctExpr *) node, context);
 			break;
 		case T_ScalarArrayOpExpr:
-			deparseScalarArrayOpExpr(buf, (ScalarArrayOpExpr *) node, root);
+			deparseScalarArrayOpExpr(buf, (ScalarArrayOpExpr *) node, context);
 			break;
 		case T_RelabelType:
-			deparseRelabelType(buf, (RelabelType *) node, root);
+			deparseRelabelType(buf, (RelabelType *) node, context);
 			break;
 		case T_BoolExpr:
-			deparseBoolExpr(buf, (BoolExpr *) node, root);
+			deparseBoolExpr(buf, (BoolExpr *) node, context);
 			break;
 		case T_NullTest:
-			deparseNullTest(buf, (NullTest *) node, root);
+			deparseNullTest(buf, (NullTest *) node, context);
 			break;
 		case T_ArrayExpr:
-			deparseArrayExpr(buf, (ArrayExpr *) node, root);
+			deparseArrayExpr(buf, (ArrayExpr *) node, context);
+			break;
+		case T_CaseExpr:
+			deparseCaseExpr(buf, (CaseExpr *) node, context);
+			break;
+		case T_CoalesceExpr:
+			deparseCoalesceExpr(buf, (CoalesceExpr *) node, context);
+			break;
+		case T_NullIfExpr:
+			deparseNullIfExpr(buf, (NullIfExpr *) node, context);
+			break;
+		case T_MinMaxExpr:
+			deparseMinMaxExpr(buf, (MinMaxExpr *) node, context);
+			break;
+		case T_RowCompareExpr:
+			deparseRowCompareExpr(buf, (RowCompareExpr *) node, context);
+			break;
+		case T_CoerceViaIO:
+			deparseCoerceViaIO(buf, (CoerceViaIO *) node, context);
+			break;
+		case T_BooleanTest:
+			deparseBooleanTest(buf, (BooleanTest *) node, context);
 			break;
 		default:
 			elog(ERROR, "unsupported expression type for deparse: %d",
@@ -1047,12 +1833,48 @@ deparseExpr(StringInfo buf, Expr *node, PlannerInfo *root)
 
 /*
  * Deparse given Var node into buf.
+ *
+ * A Var of the foreign table becomes a column reference.  Any other Var is
+ * an outer reference of a join clause, and is printed as a Param; or as a
+ * placeholder, which lets the remote planner produce a generic estimate, if
+ * we're deparsing for remote EXPLAIN.
  */
 static void
-deparseVar(StringInfo buf, Var *node, PlannerInfo *root)
+deparseVar(StringInfo buf, Var *node, deparse_expr_cxt *context)
 {
+	char	   *ptypename;
+	ListCell   *lc;
+	int			pindex;
+
 	Assert(node->varlevelsup == 0);
-	deparseColumnRef(buf, node->varno, node->varattno, root);
+
+	if (node->varno == context->foreignrel->relid)
+	{
+		deparseColumnRef(buf, node->varno, node->varattno, context->root);
+		return;
+	}
+
+	ptypename = deparse_type_name(node->vartype, node->vartypmod);
+
+	if (context->params_list == NULL)
+	{
+		appendStringInfo(buf, "((SELECT null::%s)::%s)", ptypename, ptypename);
+		return;
+	}
+
+	/* Find the Var in params_list, adding it if not there yet */
+	pindex = 1;
+	foreach(lc, *context->params_list)
+	{
+		if (equal(node, (Node *) lfirst(lc)))
+			break;
+		pindex++;
+	}
+	if (lc == NULL)
+		*context->params_list = lappend(*context->params_list, node);
+
+	appendStringInfo(buf, "$%d::%s", context->param_offset + pindex,
+					 ptypename);
 }
 
 /*
@@ -1061,7 +1883,7 @@ deparseVar(StringInfo buf, Var *node, PlannerInfo *root)
  * This function has to be kept in sync with ruleutils.c's get_const_expr.
  */
 static void
-deparseConst(StringInfo buf, Const *node, PlannerInfo *root)
+deparseConst(StringInfo buf, Const *node, deparse_expr_cxt *context)
 {
 	Oid			typoutput;
 	bool		typIsVarlena;
@@ -1073,8 +1895,8 @@ deparseConst(StringInfo buf, Const *node, PlannerInfo *root)
 	{
 		appendStringInfo(buf, "NULL");
 		appendStringInfo(buf, "::%s",
-						 format_type_with_typemod(node->consttype,
-												  node->consttypmod));
+						 deparse_type_name(node->consttype,
+										   node->consttypmod));
 		return;
 	}
 
@@ -1147,8 +1969,8 @@ deparseConst(StringInfo buf, Const *node, PlannerInfo *root)
 	}
 	if (needlabel)
 		appendStringInfo(buf, "::%s",
-						 format_type_with_typemod(node->consttype,
-												  node->consttypmod));
+						 deparse_type_name(node->consttype,
+										   node->consttypmod));
 }
 
 /*
@@ -1164,20 +1986,19 @@ deparseConst(StringInfo buf, Const *node, PlannerInfo *root)
  * do locally --- they need only have the same names.
  */
 static void
-deparseParam(StringInfo buf, Param *node, PlannerInfo *root)
+deparseParam(StringInfo buf, Param *node, deparse_expr_cxt *context)
 {
 	Assert(node->paramkind == PARAM_EXTERN);
 	appendStringInfo(buf, "$%d", node->paramid);
 	appendStringInfo(buf, "::%s",
-					 format_type_with_typemod(node->paramtype,
-											  node->paramtypmod));
+					 deparse_type_name(node->paramtype, node->paramtypmod));
 }
 
 /*
  * Deparse an array subscript expression.
  */
 static void
-deparseArrayRef(StringInfo buf, ArrayRef *node, PlannerInfo *root)
+deparseArrayRef(StringInfo buf, ArrayRef *node, deparse_expr_cxt *context)
 {
 	ListCell   *lowlist_item;
 	ListCell   *uplist_item;
@@ -1192,11 +2013,11 @@ deparseArrayRef(StringInfo buf, ArrayRef *node, PlannerInfo *root)
 	 * case of subscripting a Var, but otherwise do it.
 	 */
 	if (IsA(node->refexpr, Var))
-		deparseExpr(buf, node->refexpr, root);
+		deparseExpr(buf, node->refexpr, context);
 	else
 	{
 		appendStringInfoChar(buf, '(');
-		deparseExpr(buf, node->refexpr, root);
+		deparseExpr(buf, node->refexpr, context);
 		appendStringInfoChar(buf, ')');
 	}
 
@@ -1207,11 +2028,11 @@ deparseArrayRef(StringInfo buf, ArrayRef *node, PlannerInfo *root)
 		appendStringInfoChar(buf, '[');
 		if (lowlist_item)
 		{
-			deparseExpr(buf, lfirst(lowlist_item), root);
+			deparseExpr(buf, lfirst(lowlist_item), context);
 			appendStringInfoChar(buf, ':');
 			lowlist_item = lnext(lowlist_item);
 		}
-		deparseExpr(buf, lfirst(uplist_item), root);
+		deparseExpr(buf, lfirst(uplist_item), context);
 		appendStringInfoChar(buf, ']');
 	}
 
@@ -1222,7 +2043,7 @@ deparseArrayRef(StringInfo buf, ArrayRef *node, PlannerInfo *root)
  * Deparse given node which represents a function call into buf.
  */
 static void
-deparseFuncExpr(StringInfo buf, FuncExpr *node, PlannerInfo *root)
+deparseFuncExpr(StringInfo buf, FuncExpr *node, deparse_expr_cxt *context)
 {
 	HeapTuple	proctup;
 	Form_pg_proc procform;
@@ -1236,7 +2057,7 @@ deparseFuncExpr(StringInfo buf, FuncExpr *node, PlannerInfo *root)
 	 */
 	if (node->funcformat == COERCE_IMPLICIT_CAST)
 	{
-		deparseExpr(buf, (Expr *) linitial(node->args), root);
+		deparseExpr(buf, (Expr *) linitial(node->args), context);
 		return;
 	}
 
@@ -1252,9 +2073,9 @@ deparseFuncExpr(StringInfo buf, FuncExpr *node, PlannerInfo *root)
 		/* Get the typmod if this is a length-coercion function */
 		(void) exprIsLengthCoercion((Node *) node, &coercedTypmod);
 
-		deparseExpr(buf, (Expr *) linitial(node->args), root);
+		deparseExpr(buf, (Expr *) linitial(node->args), context);
 		appendStringInfo(buf, "::%s",
-						 format_type_with_typemod(rettype, coercedTypmod));
+						 deparse_type_name(rettype, coercedTypmod));
 		return;
 	}
 
@@ -1284,7 +2105,7 @@ deparseFuncExpr(StringInfo buf, FuncExpr *node, PlannerInfo *root)
 	{
 		if (!first)
 			appendStringInfoString(buf, ", ");
-		deparseExpr(buf, (Expr *) lfirst(arg), root);
+		deparseExpr(buf, (Expr *) lfirst(arg), context);
 		first = false;
 	}
 	appendStringInfoChar(buf, ')');
@@ -1297,7 +2118,7 @@ deparseFuncExpr(StringInfo buf, FuncExpr *node, PlannerInfo *root)
  * priority of operations, we always parenthesize the arguments.
  */
 static void
-deparseOpExpr(StringInfo buf, OpExpr *node, PlannerInfo *root)
+deparseOpExpr(StringInfo buf, OpExpr *node, deparse_expr_cxt *context)
 {
 	HeapTuple	tuple;
 	Form_pg_operator form;
@@ -1323,7 +2144,7 @@ deparseOpExpr(StringInfo buf, OpExpr *node, PlannerInfo *root)
 	if (oprkind == 'r' || oprkind == 'b')
 	{
 		arg = list_head(node->args);
-		deparseExpr(buf, lfirst(arg), root);
+		deparseExpr(buf, lfirst(arg), context);
 		appendStringInfoChar(buf, ' ');
 	}
 
@@ -1335,7 +2156,7 @@ deparseOpExpr(StringInfo buf, OpExpr *node, PlannerInfo *root)
 	{
 		arg = list_tail(node->args);
 		appendStringInfoChar(buf, ' ');
-		deparseExpr(buf, lfirst(arg), root);
+		deparseExpr(buf, lfirst(arg), context);
 	}
 
 	appendStringInfoChar(buf, ')');
@@ -1375,14 +2196,15 @@ deparseOperatorName(StringInfo buf, Form_pg_operator opform)
  * Deparse IS DISTINCT FROM.
  */
 static void
-deparseDistinctExpr(StringInfo buf, DistinctExpr *node, PlannerInfo *root)
+deparseDistinctExpr(StringInfo buf, DistinctExpr *node,
+					deparse_expr_cxt *context)
 {
 	Assert(list_length(node->args) == 2);
 
 	appendStringInfoChar(buf, '(');
-	deparseExpr(buf, linitial(node->args), root);
+	deparseExpr(buf, linitial(node->args), context);
 	appendStringInfo(buf, " IS DISTINCT FROM ");
-	deparseExpr(buf, lsecond(node->args), root);
+	deparseExpr(buf, lsecond(node->args), context);
 	appendStringInfoChar(buf, ')');
 }
 
@@ -1393,7 +2215,7 @@ deparseDistinctExpr(StringInfo buf, DistinctExpr *node, PlannerInfo *root)
 static void
 deparseScalarArrayOpExpr(StringInfo buf,
 						 ScalarArrayOpExpr *node,
-						 PlannerInfo *root)
+						 deparse_expr_cxt *context)
 {
 	HeapTuple	tuple;
 	Form_pg_operator form;
@@ -1414,7 +2236,7 @@ deparseScalarArrayOpExpr(StringInfo buf,
 
 	/* Deparse left operand. */
 	arg1 = linitial(node->args);
-	deparseExpr(buf, arg1, root);
+	deparseExpr(buf, arg1, context);
 	appendStringInfoChar(buf, ' ');
 
 	/* Deparse operator name plus decoration. */
@@ -1423,7 +2245,7 @@ deparseScalarArrayOpExpr(StringInfo buf,
 
 	/* Deparse right operand. */
 	arg2 = lsecond(node->args);
-	deparseExpr(buf, arg2, root);
+	deparseExpr(buf, arg2, context);
 
 	appendStringInfoChar(buf, ')');
 
@@ -1437,13 +2259,14 @@ deparseScalarArrayOpExpr(StringInfo buf,
  * Deparse a RelabelType (binary-compatible cast) node.
  */
 static void
-deparseRelabelType(StringInfo buf, RelabelType *node, PlannerInfo *root)
+deparseRelabelType(StringInfo buf, RelabelType *node,
+				   deparse_expr_cxt *context)
 {
-	deparseExpr(buf, node->arg, root);
+	deparseExpr(buf, node->arg, context);
 	if (node->relabelformat != COERCE_IMPLICIT_CAST)
 		appendStringInfo(buf, "::%s",
-						 format_type_with_typemod(node->resulttype,
-												  node->resulttypmod));
+						 deparse_type_name(node->resulttype,
+										   node->resulttypmod));
 }
 
 /*
@@ -1453,7 +2276,7 @@ deparseRelabelType(StringInfo buf, RelabelType *node, PlannerInfo *root)
  * into N-argument form, so we'd better be prepared to deal with that.
  */
 static void
-deparseBoolExpr(StringInfo buf, BoolExpr *node, PlannerInfo *root)
+deparseBoolExpr(StringInfo buf, BoolExpr *node, deparse_expr_cxt *context)
 {
 	const char *op = NULL;		/* keep compiler quiet */
 	bool		first;
@@ -1469,7 +2292,7 @@ deparseBoolExpr(StringInfo buf, BoolExpr *node, PlannerInfo *root)
 			break;
 		case NOT_EXPR:
 			appendStringInfo(buf, "(NOT ");
-			deparseExpr(buf, linitial(node->args), root);
+			deparseExpr(buf, linitial(node->args), context);
 			appendStringInfoChar(buf, ')');
 			return;
 	}
@@ -1480,7 +2303,7 @@ deparseBoolExpr(StringInfo buf, BoolExpr *node, PlannerInfo *root)
 	{
 		if (!first)
 			appendStringInfo(buf, " %s ", op);
-		deparseExpr(buf, (Expr *) lfirst(lc), root);
+		deparseExpr(buf, (Expr *) lfirst(lc), context);
 		first = false;
 	}
 	appendStringInfoChar(buf, ')');
@@ -1490,10 +2313,10 @@ deparseBoolExpr(StringInfo buf, BoolExpr *node, PlannerInfo *root)
  * Deparse IS [NOT] NULL expression.
  */
 static void
-deparseNullTest(StringInfo buf, NullTest *node, PlannerInfo *root)
+deparseNullTest(StringInfo buf, NullTest *node, deparse_expr_cxt *context)
 {
 	appendStringInfoChar(buf, '(');
-	deparseExpr(buf, node->arg, root);
+	deparseExpr(buf, node->arg, context);
 	if (node->nulltesttype == IS_NULL)
 		appendStringInfo(buf, " IS NULL)");
 	else
@@ -1504,7 +2327,7 @@ deparseNullTest(StringInfo buf, NullTest *node, PlannerInfo *root)
  * Deparse ARRAY[...] construct.
  */
 static void
-deparseArrayExpr(StringInfo buf, ArrayExpr *node, PlannerInfo *root)
+deparseArrayExpr(StringInfo buf, ArrayExpr *node, deparse_expr_cxt *context)
 {
 	bool		first = true;
 	ListCell   *lc;
@@ -1514,7 +2337,7 @@ deparseArrayExpr(StringInfo buf, ArrayExpr *node, PlannerInfo *root)
 	{
 		if (!first)
 			appendStringInfo(buf, ", ");
-		deparseExpr(buf, lfirst(lc), root);
+		deparseExpr(buf, lfirst(lc), context);
 		first = false;
 	}
 	appendStringInfoChar(buf, ']');
@@ -1522,5 +2345,204 @@ deparseArrayExpr(StringInfo buf, ArrayExpr *node, PlannerInfo *root)
 	/* If the array is empty, we need an explicit cast to the array type. */
 	if (node->elements == NIL)
 		appendStringInfo(buf, "::%s",
-						 format_type_with_typemod(node->array_typeid, -1));
+						 deparse_type_name(node->array_typeid, -1));
+}
+
+/*
+ * Deparse a CASE expression.
+ *
+ * In a CASE-with-arg, each WHEN expression is "CaseTestExpr = RHS" (the
+ * walker has made sure of that), of which we print only the RHS.
+ */
+static void
+deparseCaseExpr(StringInfo buf, CaseExpr *node, deparse_expr_cxt *context)
+{
+	ListCell   *lc;
+
+	appendStringInfo(buf, "(CASE");
+
+	if (node->arg != NULL)
+	{
+		appendStringInfoChar(buf, ' ');
+		deparseExpr(buf, node->arg, context);
+	}
+
+	foreach(lc, node->args)
+	{
+		CaseWhen   *cw = (CaseWhen *) lfirst(lc);
+
+		appendStringInfo(buf, " WHEN ");
+		if (node->arg == NULL)
+			deparseExpr(buf, cw->expr, context);
+		else
+			deparseExpr(buf, lsecond(((OpExpr *) cw->expr)->args), context);
+		appendStringInfo(buf, " THEN ");
+		deparseExpr(buf, cw->result, context);
+	}
+
+	if (node->defresult != NULL)
+	{
+		appendStringInfo(buf, " ELSE ");
+		deparseExpr(buf, node->defresult, context);
+	}
+
+	appendStringInfo(buf, " END)");
+}
+
+/*
+ * Deparse COALESCE(...).
+ */
+static void
+deparseCoalesceExpr(StringInfo buf, CoalesceExpr *node,
+					deparse_expr_cxt *context)
+{
+	bool		first = true;
+	ListCell   *lc;
+
+	appendStringInfo(buf, "COALESCE(");
+	foreach(lc, node->args)
+	{
+		if (!first)
+			appendStringInfo(buf, ", ");
+		deparseExpr(buf, lfirst(lc), context);
+		first = false;
+	}
+	appendStringInfoChar(buf, ')');
+}
+
+/*
+ * Deparse NULLIF(a, b).
+ */
+static void
+deparseNullIfExpr(StringInfo buf, NullIfExpr *node, deparse_expr_cxt *context)
+{
+	Assert(list_length(node->args) == 2);
+
+	appendStringInfo(buf, "NULLIF(");
+	deparseExpr(buf, linitial(node->args), context);
+	appendStringInfo(buf, ", ");
+	deparseExpr(buf, lsecond(node->args), context);
+	appendStringInfoChar(buf, ')');
+}
+
+/*
+ * Deparse GREATEST(...) or LEAST(...).
+ */
+static void
+deparseMinMaxExpr(StringInfo buf, MinMaxExpr *node, deparse_expr_cxt *context)
+{
+	bool		first = true;
+	ListCell   *lc;
+
+	if (node->op == IS_GREATEST)
+		appendStringInfo(buf, "GREATEST(");
+	else
+		appendStringInfo(buf, "LEAST(");
+	foreach(lc, node->args)
+	{
+		if (!first)
+			appendStringInfo(buf, ", ");
+		deparseExpr(buf, lfirst(lc), context);
+		first = false;
+	}
+	appendStringInfoChar(buf, ')');
+}
+
+/*
+ * Deparse a row comparison, ROW(...) op ROW(...).
+ *
+ * The operators for the column pairs all have the same name, and the walker
+ * has checked that they're in the same schema, so printing the first one is
+ * enough for the remote parser to find all of them.
+ */
+static void
+deparseRowCompareExpr(StringInfo buf, RowCompareExpr *node,
+					  deparse_expr_cxt *context)
+{
+	HeapTuple	tuple;
+	Form_pg_operator form;
+	Oid			opno = linitial_oid(node->opnos);
+	bool		first;
+	ListCell   *lc;
+
+	tuple = SearchSysCache1(OPEROID, ObjectIdGetDatum(opno));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for operator %u", opno);
+	form = (Form_pg_operator) GETSTRUCT(tuple);
+
+	appendStringInfo(buf, "(ROW(");
+	first = true;
+	foreach(lc, node->largs)
+	{
+		if (!first)
+			appendStringInfo(buf, ", ");
+		deparseExpr(buf, lfirst(lc), context);
+		first = false;
+	}
+	appendStringInfo(buf, ") ");
+
+	deparseOperatorName(buf, form);
+
+	appendStringInfo(buf, " ROW(");
+	first = true;
+	foreach(lc, node->rargs)
+	{
+		if (!first)
+			appendStringInfo(buf, ", ");
+		deparseExpr(buf, lfirst(lc), context);
+		first = false;
+	}
+	appendStringInfo(buf, "))");
+
+	ReleaseSysCache(tuple);
+}
+
+/*
+ * Deparse a CoerceViaIO (cast through the types' I/O functions) node.
+ *
+ * Unlike for RelabelType, we print the cast even if it was implicit: the
+ * remote parser might not otherwise find the same coercion.
+ */
+static void
+deparseCoerceViaIO(StringInfo buf, CoerceViaIO *node,
+				   deparse_expr_cxt *context)
+{
+	deparseExpr(buf, node->arg, context);
+	appendStringInfo(buf, "::%s", deparse_type_name(node->resulttype, -1));
+}
+
+/*
+ * Deparse IS [NOT] TRUE/FALSE/UNKNOWN expression.
+ */
+static void
+deparseBooleanTest(StringInfo buf, BooleanTest *node,
+				   deparse_expr_cxt *context)
+{
+	const char *test = NULL;	/* keep compiler quiet */
+
+	switch (node->booltesttype)
+	{
+		case IS_TRUE:
+			test = "IS TRUE";
+			break;
+		case IS_NOT_TRUE:
+			test = "IS NOT TRUE";
+			break;
+		case IS_FALSE:
+			test = "IS FALSE";
+			break;
+		case IS_NOT_FALSE:
+			test = "IS NOT FALSE";
+			break;
+		case IS_UNKNOWN:
+			test = "IS UNKNOWN";
+			break;
+		case IS_NOT_UNKNOWN:
+			test = "IS NOT UNKNOWN";
+			break;
+	}
+
+	appendStringInfoChar(buf, '(');
+	deparseExpr(buf, node->arg, context);
+	appendStringInfo(buf, " %s)", test);
 }
@@ -12,6 +12,8 @@
  */
 #include "postgres.h"
 
+#include <limits.h>
+
 #include "postgres_fdw.h"
 
 #include "access/reloptions.h"
@@ -19,6 +21,9 @@
 #include "catalog/pg_foreign_table.h"
 #include "catalog/pg_user_mapping.h"
 #include "commands/defrem.h"
+#include "commands/extension.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
 
 
 /*
@@ -67,6 +72,8 @@ postgres_fdw_validator(PG_FUNCTION_ARGS)
 	List	   *options_list = untransformRelOptions(PG_GETARG_DATUM(0));
 	Oid			catalog = PG_GETARG_OID(1);
 	ListCell   *cell;
+	bool		has_query = false;
+	bool		has_name = false;
 
 	/* Build our options lists if we didn't yet. */
 	InitPgFdwOptions();
@@ -106,9 +113,16 @@ postgres_fdw_validator(PG_FUNCTION_ARGS)
 		/*
 		 * Validate option value, when we can do so without any context.
 		 */
-		if (strcmp(def->defname, "use_remote_estimate") == 0)
+		if (strcmp(def->defname, "use_remote_estimate") == 0 ||
+			strcmp(def->defname, "adaptive_fetch") == 0 ||
+			strcmp(def->defname, "prefetch") == 0 ||
+			strcmp(def->defname, "binary_transfer") == 0 ||
+			strcmp(def->defname, "use_prepared_statements") == 0 ||
+			strcmp(def->defname, "spool_rescans") == 0 ||
+			strcmp(def->defname, "calibrate_costs") == 0 ||
+			strcmp(def->defname, "import_remote_stats") == 0)
 		{
-			/* use_remote_estimate accepts only boolean values */
+			/* these accept only boolean values */
 			(void) defGetBoolean(def);
 		}
 		else if (strcmp(def->defname, "fdw_startup_cost") == 0 ||
@@ -125,8 +139,143 @@ postgres_fdw_validator(PG_FUNCTION_ARGS)
 						 errmsg("%s requires a non-negative numeric value",
 								def->defname)));
 		}
+		else if (strcmp(def->defname, "fetch_size") == 0)
+		{
+			/* fetch_size must be a positive integer */
+			long		val;
+			char	   *endp;
+
+			val = strtol(defGetString(def), &endp, 10);
+			if (*endp || val <= 0 || val > INT_MAX)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("%s requires a positive integer value",
+								def->defname)));
+		}
+		else if (strcmp(def->defname, "copy_threshold") == 0)
+		{
+			/* copy_threshold is a row count; 0 disables COPY mode */
+			char	   *str = defGetString(def);
+			long		val;
+			char	   *endp;
+
+			val = strtol(str, &endp, 10);
+			if (endp == str || *endp || val < 0 || val > INT_MAX)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("%s requires a non-negative integer value",
+								def->defname)));
+		}
+		else if (strcmp(def->defname, "fetch_memory") == 0)
+		{
+			/* fetch_memory is given in kilobytes, like work_mem */
+			long		val;
+			char	   *endp;
+
+			val = strtol(defGetString(def), &endp, 10);
+			if (*endp || val < 64)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("%s requires an integer value of at least %d",
+								def->defname, 64)));
+			if (val > MAX_KILOBYTES)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("%s must not exceed %d",
+								def->defname, MAX_KILOBYTES)));
+		}
+		else if (strcmp(def->defname, "lookup_cache_memory") == 0)
+		{
+			/* lookup_cache_memory is given in kilobytes; 0 disables it */
+			char	   *str = defGetString(def);
+			long		val;
+			char	   *endp;
+
+			val = strtol(str, &endp, 10);
+			if (endp == str || *endp || val < 0 || val > MAX_KILOBYTES)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("%s requires an integer value between %d and %d",
+								def->defname, 0, MAX_KILOBYTES)));
+		}
+		else if (strcmp(def->defname, "estimate_cache_ttl") == 0 ||
+				 strcmp(def->defname, "cache_ttl") == 0)
+		{
+			/* these are given in seconds; 0 disables caching */
+			char	   *str = defGetString(def);
+			long		val;
+			char	   *endp;
+
+			val = strtol(str, &endp, 10);
+			if (endp == str || *endp || val < 0 || val > INT_MAX / 1000)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("%s requires an integer value between %d and %d",
+								def->defname, 0, INT_MAX / 1000)));
+		}
+		else if (strcmp(def->defname, "parallel_connections") == 0)
+		{
+			/* parallel_connections counts the connection a scan uses anyway */
+			long		val;
+			char	   *endp;
+
+			val = strtol(defGetString(def), &endp, 10);
+			if (*endp || val < 1 || val > MAX_PARALLEL_CONNECTIONS)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("%s requires an integer value between %d and %d",
+								def->defname, 1, MAX_PARALLEL_CONNECTIONS)));
+		}
+		else if (strcmp(def->defname, "partition_column") == 0)
+		{
+			/* the column itself can only be checked at planning time */
+			if (defGetString(def)[0] == '\0')
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("%s requires a non-empty value",
+								def->defname)));
+		}
+		else if (strcmp(def->defname, "query") == 0)
+		{
+			/* query must be a nonempty SELECT, sent as a derived table */
+			if (defGetString(def)[0] == '\0')
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("%s requires a non-empty value",
+								def->defname)));
+			has_query = true;
+		}
+		else if (strcmp(def->defname, "schema_name") == 0 ||
+				 strcmp(def->defname, "table_name") == 0)
+			has_name = true;
+		else if (strcmp(def->defname, "extensions") == 0)
+		{
+			/* check list syntax, warn about uninstalled extensions */
+			(void) ExtractExtensionList(defGetString(def), true);
+		}
+		else if (strcmp(def->defname, "analyze_sampling") == 0)
+		{
+			/* analyze_sampling names a remote sampling method */
+			char	   *value = defGetString(def);
+
+			if (strcmp(value, "off") != 0 &&
+				strcmp(value, "auto") != 0 &&
+				strcmp(value, "random") != 0 &&
+				strcmp(value, "system") != 0 &&
+				strcmp(value, "bernoulli") != 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("%s must be one of off, auto, random, system or bernoulli",
+								def->defname)));
+		}
 	}
 
+	/* A foreign table is defined either by its remote name or by a query */
+	if (has_query && has_name)
+		ereport(ERROR,
+				(errcode(ERRCODE_SYNTAX_ERROR),
+				 errmsg("query cannot be used together with schema_name or table_name")));
+
 	PG_RETURN_VOID();
 }
 
@@ -144,6 +293,7 @@ InitPgFdwOptions(void)
 	static const PgFdwOption non_libpq_options[] = {
 		{"schema_name", ForeignTableRelationId, false},
 		{"table_name", ForeignTableRelationId, false},
+		{"query", ForeignTableRelationId, false},
 		{"column_name", AttributeRelationId, false},
 		/* use_remote_estimate is available on both server and table */
 		{"use_remote_estimate", ForeignServerRelationId, false},
@@ -151,6 +301,43 @@ InitPgFdwOptions(void)
 		/* cost factors */
 		{"fdw_startup_cost", ForeignServerRelationId, false},
 		{"fdw_tuple_cost", ForeignServerRelationId, false},
+		/* ... or measured ones in place of the defaults */
+		{"calibrate_costs", ForeignServerRelationId, false},
+		/* batch sizing options are available on both server and table */
+		{"fetch_size", ForeignServerRelationId, false},
+		{"fetch_size", ForeignTableRelationId, false},
+		{"adaptive_fetch", ForeignServerRelationId, false},
+		{"adaptive_fetch", ForeignTableRelationId, false},
+		{"fetch_memory", ForeignServerRelationId, false},
+		{"fetch_memory", ForeignTableRelationId, false},
+		{"prefetch", ForeignServerRelationId, false},
+		{"prefetch", ForeignTableRelationId, false},
+		{"binary_transfer", ForeignServerRelationId, false},
+		{"binary_transfer", ForeignTableRelationId, false},
+		{"copy_threshold", ForeignServerRelationId, false},
+		{"copy_threshold", ForeignTableRelationId, false},
+		{"use_prepared_statements", ForeignServerRelationId, false},
+		{"use_prepared_statements", ForeignTableRelationId, false},
+		{"lookup_cache_memory", ForeignServerRelationId, false},
+		{"lookup_cache_memory", ForeignTableRelationId, false},
+		{"estimate_cache_ttl", ForeignServerRelationId, false},
+		{"estimate_cache_ttl", ForeignTableRelationId, false},
+		/* complete scan results can be cached too */
+		{"cache_ttl", ForeignTableRelationId, false},
+		/* rows of a rewound scan can be kept for the rescans */
+		{"spool_rescans", ForeignServerRelationId, false},
+		{"spool_rescans", ForeignTableRelationId, false},
+		/* big tables can be scanned in slices over several connections */
+		{"parallel_connections", ForeignServerRelationId, false},
+		{"parallel_connections", ForeignTableRelationId, false},
+		{"partition_column", ForeignTableRelationId, false},
+		/* ANALYZE can copy remote statistics instead of sampling */
+		{"import_remote_stats", ForeignServerRelationId, false},
+		{"import_remote_stats", ForeignTableRelationId, false},
+		{"analyze_sampling", ForeignServerRelationId, false},
+		{"analyze_sampling", ForeignTableRelationId, false},
+		/* extensions whose objects the remote server has too */
+		{"extensions", ForeignServerRelationId, false},
 		{NULL, InvalidOid, false}
 	};
 
@@ -291,3 +478,46 @@ ExtractConnectionOptions(List *defelems, const char **keywords,
 	}
 	return i;
 }
+
+/*
+ * Parse a comma-separated list of extension names, as given in the
+ * "extensions" server option, and return a List of the OIDs of those
+ * extensions.
+ *
+ * Extensions that aren't installed locally are ignored, since none of our
+ * objects can belong to them; if warnOnMissing is true, we warn about them.
+ */
+List *
+ExtractExtensionList(const char *extensionsString, bool warnOnMissing)
+{
+	List	   *extensionOids = NIL;
+	List	   *extlist;
+	ListCell   *lc;
+
+	/* SplitIdentifierString scribbles on its input, so pstrdup first */
+	if (!SplitIdentifierString(pstrdup(extensionsString), ',', &extlist))
+	{
+		/* syntax error in name list */
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("parameter \"%s\" must be a list of extension names",
+						"extensions")));
+	}
+
+	foreach(lc, extlist)
+	{
+		const char *extension_name = (const char *) lfirst(lc);
+		Oid			extension_oid = get_extension_oid(extension_name, true);
+
+		if (OidIsValid(extension_oid))
+			extensionOids = lappend_oid(extensionOids, extension_oid);
+		else if (warnOnMissing)
+			ereport(WARNING,
+					(errcode(ERRCODE_UNDEFINED_OBJECT),
+					 errmsg("extension \"%s\" is not installed",
+							extension_name)));
+	}
+
+	list_free(extlist);
+	return extensionOids;
+}
@@ -0,0 +1,61 @@
+/* contrib/postgres_fdw/postgres_fdw--1.1.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION postgres_fdw" to load this file. \quit
+
+CREATE FUNCTION postgres_fdw_handler()
+RETURNS fdw_handler
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION postgres_fdw_validator(text[], oid)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FOREIGN DATA WRAPPER postgres_fdw
+  HANDLER postgres_fdw_handler
+  VALIDATOR postgres_fdw_validator;
+
+CREATE FUNCTION postgres_fdw_flush_estimates()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION postgres_fdw_invalidate_cache(regclass)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION postgres_fdw_stats(
+    OUT srvid oid,
+    OUT srvname text,
+    OUT userid oid,
+    OUT usename text,
+    OUT connections_opened bigint,
+    OUT connections_reused bigint,
+    OUT round_trips bigint,
+    OUT rows_fetched bigint,
+    OUT bytes_fetched bigint,
+    OUT remote_estimates bigint,
+    OUT commits bigint,
+    OUT commit_time float8,
+    OUT aborts bigint,
+    OUT abort_time float8,
+    OUT errors bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW postgres_fdw_stats AS
+  SELECT * FROM postgres_fdw_stats();
+
+GRANT SELECT ON postgres_fdw_stats TO PUBLIC;
+
+CREATE FUNCTION postgres_fdw_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION postgres_fdw_stats_reset() FROM PUBLIC;
@@ -12,23 +12,53 @@
  */
 #include "postgres.h"
 
+#include <math.h>
+
 #include "postgres_fdw.h"
 
+#include "access/hash.h"
+#include "access/heapam.h"
 #include "access/htup.h"
+#include "access/skey.h"
+#include "access/sysattr.h"
+#include "access/xact.h"
+#include "catalog/indexing.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_statistic.h"
+#include "catalog/pg_type.h"
 #include "commands/defrem.h"
 #include "commands/explain.h"
 #include "commands/vacuum.h"
 #include "foreign/fdwapi.h"
 #include "funcapi.h"
 #include "miscadmin.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/clauses.h"
 #include "optimizer/cost.h"
 #include "optimizer/pathnode.h"
+#include "optimizer/paths.h"
 #include "optimizer/planmain.h"
+#include "optimizer/restrictinfo.h"
+#include "optimizer/var.h"
+#include "parser/parse_oper.h"
 #include "parser/parsetree.h"
+#include "portability/instr_time.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/date.h"
+#include "utils/datetime.h"
+#include "utils/datum.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/int8.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/resowner.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#include "utils/typcache.h"
 
 
 PG_MODULE_MAGIC;
@@ -40,24 +70,39 @@ PG_MODULE_MAGIC;
 #define DEFAULT_FDW_TUPLE_COST		0.01
 
 /*
- * FDW-specific planner information kept in RelOptInfo.fdw_private for a
- * foreign table.  This information is collected by postgresGetForeignRelSize.
+ * Factor by which we guess a sorted remote scan to be more expensive than an
+ * unsorted one, when we can't ask the remote server.
  */
-typedef struct PgFdwRelationInfo
-{
-	/* XXX underdocumented, but a lot of this shouldn't be here anyway */
-	StringInfoData sql;
-	Cost		startup_cost;
-	Cost		total_cost;
-	List	   *remote_conds;
-	List	   *param_conds;
-	List	   *local_conds;
-	List	   *param_numbers;
+#define DEFAULT_FDW_SORT_MULTIPLIER	1.2
 
-	/* Cached catalog information. */
-	ForeignTable *table;
-	ForeignServer *server;
-} PgFdwRelationInfo;
+/*
+ * With calibrate_costs, the weight of each scan's measurements in the
+ * smoothed costs of its server, and the number of rows a scan must fetch
+ * beyond its first batch for its time per row to be taken into account.
+ * The measured cost per row is never taken to be below cpu_tuple_cost: when
+ * batches are prefetched, the wait per row can be close to nothing, but each
+ * row still has to be received and stored by libpq.
+ */
+#define CALIBRATION_WEIGHT		0.2
+#define CALIBRATION_MIN_ROWS	100
+
+/* Default number of rows to retrieve per FETCH. */
+#define DEFAULT_FETCH_SIZE			100
+
+/* Default memory budget (in kilobytes) for one batch in adaptive mode. */
+#define DEFAULT_FETCH_MEMORY		1024
+
+/* Default memory limit (in kilobytes) for a parameterized scan's lookup cache. */
+#define DEFAULT_LOOKUP_CACHE_MEMORY	1024
+
+/* Maximum number of entries in the remote estimate cache. */
+#define ESTIMATE_CACHE_SIZE			1024
+
+/* Maximum number of entries in the result cache. */
+#define RESULT_CACHE_SIZE			32
+
+/* How often (in rows) to check whether a prefetched batch has arrived. */
+#define PREFETCH_POLL_INTERVAL		32
 
 /*
  * Indexes of FDW-private information stored in fdw_private list.
@@ -67,6 +112,22 @@ typedef struct PgFdwRelationInfo
  *
  * 1) SELECT statement text to be sent to the remote server
  * 2) IDs of PARAM_EXEC Params used in the SELECT statement
+ * 3) Number of rows to retrieve per FETCH (initial value, if adaptive)
+ * 4) Memory budget for a batch in adaptive mode, or 0 if not adaptive
+ * 5) Boolean flag showing whether to prefetch batches
+ * 6) Boolean flag showing whether to use binary transfer, if possible
+ * 7) Boolean flag showing whether to retrieve the rows with COPY
+ * 8) Integer list of attribute numbers of the columns actually retrieved
+ * 9) Boolean flag showing whether to run the query as a prepared statement
+ * 10) Memory limit for the lookup cache of a parameterized scan, or 0
+ * 11) Number of rows the query is expected to need from the scan, or 0
+ * 12) Number of seconds to keep the scan's result in the result cache, or 0
+ * 13) Boolean flag showing whether to spool the rows for rescans
+ * 14) Integer list of attribute numbers of the columns used by the local
+ *	   conditions, if they are to be checked before the other columns are
+ *	   converted, or NIL
+ * 15) List of SELECT statements for the slices of a scan split over several
+ *	   connections, or NIL
  *
  * These items are indexed with the enum FdwPrivateIndex, so an item can be
  * fetched with list_nth().  For example, to get the SELECT statement:
@@ -77,13 +138,156 @@ enum FdwPrivateIndex
 	/* SQL statement to execute remotely (as a String node) */
 	FdwPrivateSelectSql,
 
-	/* Integer list of param IDs of PARAM_EXEC Params used in SQL stmt */
+	/* Integer list of param IDs of PARAM_EXTERN Params used in SQL stmt */
 	FdwPrivateExternParamIds,
 
+	/* Number of rows per FETCH (as an Integer node) */
+	FdwPrivateFetchSize,
+
+	/* Per-batch memory budget in kB for adaptive fetching (Integer node) */
+	FdwPrivateFetchMemory,
+
+	/* Whether to prefetch batches (as an Integer node, 1 = yes) */
+	FdwPrivatePrefetch,
+
+	/* Whether SQL was built for binary transfer (Integer node, 1 = yes) */
+	FdwPrivateBinaryTransfer,
+
+	/* Whether to use COPY instead of a cursor (Integer node, 1 = yes) */
+	FdwPrivateCopyMode,
+
+	/* Integer list of attnums of columns not replaced by NULL in SQL */
+	FdwPrivateRetrievedAttrs,
+
+	/* Whether to use a prepared statement (Integer node, 1 = yes) */
+	FdwPrivatePrepared,
+
+	/* Lookup cache limit in kB, or 0 for no cache (as an Integer node) */
+	FdwPrivateLookupCache,
+
+	/* # of rows likely needed, or 0 if unknown (as an Integer node) */
+	FdwPrivateRowsNeeded,
+
+	/* Result cache TTL in seconds, or 0 for no caching (Integer node) */
+	FdwPrivateCacheTtl,
+
+	/* Whether to keep fetched rows for rescans (Integer node, 1 = yes) */
+	FdwPrivateSpoolRescans,
+
+	/* Whether to measure the costs of the server (Integer node, 1 = yes) */
+	FdwPrivateCalibrateCosts,
+
+	/* Integer list of attnums to convert before checking local conditions */
+	FdwPrivateFilterAttrs,
+
+	/* List of String nodes, SQL of each slice of a split scan, or NIL */
+	FdwPrivatePartitionSql,
+
 	/* # of elements stored in the list fdw_private */
 	FdwPrivateNum
 };
 
+/*
+ * Metadata for converting values retrieved in binary format.  Attributes
+ * marked in attbinary are converted by their type's receive function; the
+ * others arrive as text (the remote query casts them) and are converted by
+ * their input function, as in text mode.
+ */
+typedef struct AttRecvMetadata
+{
+	bool	   *attbinary;		/* per attribute: value is in binary? */
+	FmgrInfo   *attrecvfuncs;	/* receive functions of such attributes */
+} AttRecvMetadata;
+
+/*
+ * Ways of converting a column value retrieved in text format.  The decoder
+ * plan of a scan (see make_decoder_plan) assigns one to each attribute.
+ * Except for the generic one, the decoders parse the remote server's output
+ * format directly, rather than going through the type's input function; if
+ * a value doesn't look the way they expect, they punt to the input function.
+ */
+typedef enum PgFdwDecoder
+{
+	PGFDW_DECODE_GENERIC,		/* call the type's input function */
+	PGFDW_DECODE_SKIP,			/* column is not retrieved, so always null */
+	PGFDW_DECODE_INT2,
+	PGFDW_DECODE_INT4,
+	PGFDW_DECODE_INT8,
+	PGFDW_DECODE_FLOAT8,
+	PGFDW_DECODE_BOOL,
+	PGFDW_DECODE_TEXT,
+	PGFDW_DECODE_VARCHAR,
+	PGFDW_DECODE_DATE,
+	PGFDW_DECODE_TIMESTAMP
+} PgFdwDecoder;
+
+/*
+ * Entry of the lookup cache of a parameterized scan, holding the rows that
+ * were returned for one set of outer parameter values.  The key is the
+ * values' transmission form, as built by build_lookup_key.
+ */
+typedef struct PgFdwLookupKey
+{
+	char	   *data;			/* serialized parameter values */
+	int			len;			/* length of data */
+} PgFdwLookupKey;
+
+typedef struct PgFdwLookupEntry
+{
+	PgFdwLookupKey key;			/* hash key (must be first) */
+	Datum	   *values;			/* values of the rows, natts per row */
+	bool	   *nulls;			/* null flags of the rows, natts per row */
+	int			num_tuples;		/* # of rows */
+} PgFdwLookupEntry;
+
+/*
+ * Cache of the complete results of scans of foreign tables that have
+ * cache_ttl set, each kept for cache_ttl seconds.  The key is the foreign
+ * table, whose column types determine what the rows were converted to, the
+ * server and the user whose mapping we connect as, and the remote query,
+ * which includes whatever conditions were sent along.  Each entry's rows
+ * live in a memory context of their own.
+ *
+ * The cache is per backend.  Entries are dropped when the foreign table's
+ * relcache entry is invalidated (see result_cache_callback), which also
+ * happens when the table is altered; postgres_fdw_invalidate_cache forces
+ * that in all backends.
+ */
+typedef struct ResultCacheKey
+{
+	Oid			relid;			/* OID of foreign table */
+	Oid			serverid;		/* OID of foreign server */
+	Oid			userid;			/* OID of the user mapping's user */
+	char	   *sql;			/* text of the remote query */
+} ResultCacheKey;
+
+typedef struct ResultCacheEntry
+{
+	ResultCacheKey key;			/* hash key (must be first) */
+	TimestampTz created;		/* when the rows were fetched */
+	MemoryContext cxt;			/* context holding the rows and key.sql */
+	Datum	   *values;			/* values of the rows, natts per row */
+	bool	   *nulls;			/* null flags of the rows, natts per row */
+	int			num_tuples;		/* # of rows */
+} ResultCacheEntry;
+
+static HTAB *ResultCache = NULL;
+
+/*
+ * One of several connections a scan is split over, which reads its own slice
+ * of the table through a cursor of its own.
+ */
+typedef struct PgFdwStream
+{
+	PGconn	   *conn;			/* connection for the slice */
+	PgFdwConnState *conn_state; /* extra per-connection state */
+	unsigned int cursor_number; /* quasi-unique ID for the cursor */
+	char	   *sql;			/* SELECT statement for the slice */
+	bool		fetch_in_flight;	/* is a FETCH request outstanding? */
+	int			fetch_in_flight_size;	/* # of rows it asked for */
+	bool		eof_reached;	/* true if last fetch reached EOF */
+} PgFdwStream;
+
 /*
  * Execution state of a foreign scan using postgres_fdw.
  */
@@ -91,30 +295,122 @@ typedef struct PgFdwExecutionState
 {
 	Relation	rel;			/* relcache entry for the foreign table */
 	AttInMetadata *attinmeta;	/* attribute datatype conversion metadata */
+	AttRecvMetadata *recvmeta;	/* binary conversion metadata, or NULL if
+								 * we retrieve data in text format */
+	PgFdwDecoder *decoders;		/* decoder plan: per attribute, how to
+								 * convert values in text format */
 
 	List	   *fdw_private;	/* FDW-private information from planner */
 
 	/* for remote query execution */
 	PGconn	   *conn;			/* connection for the scan */
+	PgFdwConnState *conn_state; /* extra per-connection state */
+	bool		copy_mode;		/* use COPY rather than a cursor? */
+	bool		prepared;		/* use a prepared statement rather than a
+								 * cursor? */
+	char	   *stmt_name;		/* name of the prepared statement */
 	unsigned int cursor_number; /* quasi-unique ID for my cursor */
-	bool		cursor_exists;	/* have we created the cursor? */
+	bool		cursor_exists;	/* have we created the cursor (or started
+								 * the COPY, or run the prepared statement)? */
 	bool		extparams_done; /* have we converted PARAM_EXTERN params? */
+	List	   *param_exprs;	/* executable expressions for the values of
+								 * outer relation Params */
+	int			param_offset;	/* slots before their first one */
 	int			numParams;		/* number of parameters passed to query */
 	Oid		   *param_types;	/* array of types of query parameters */
 	const char **param_values;	/* array of values of query parameters */
+	int		   *param_lengths;	/* array of lengths of binary values */
+	int		   *param_formats;	/* array of formats of query parameters */
 
-	/* for storing result tuples */
-	HeapTuple  *tuples;			/* array of currently-retrieved tuples */
-	int			num_tuples;		/* # of tuples in array */
+	/*
+	 * for storing result tuples; the tuples are kept in decoded form, natts
+	 * values and null flags per tuple, and returned as virtual tuples
+	 */
+	Datum	   *tuple_values;	/* values of currently-retrieved tuples */
+	bool	   *tuple_nulls;	/* null flags of currently-retrieved tuples */
+	int			num_tuples;		/* # of tuples in arrays */
 	int			next_tuple;		/* index of next one to return */
 
+	/* batch that becomes current once the one above is used up */
+	Datum	   *next_values;	/* values of tuples of next batch */
+	bool	   *next_nulls;		/* null flags of tuples of next batch */
+	int			next_num_tuples;	/* # of tuples in arrays */
+	bool		next_batch_ready;	/* true if next batch has been fetched */
+
+	/* prefetching */
+	bool		prefetch;		/* send FETCH for next batch in advance? */
+	bool		fetch_in_flight;	/* is our FETCH request outstanding? */
+	int			fetch_in_flight_size;	/* # of rows it asked for */
+
 	/* batch-level state, for optimizing rewinds and avoiding useless fetch */
 	int			fetch_ct_2;		/* Min(# of fetches done, 2) */
 	bool		eof_reached;	/* true if last fetch reached EOF */
 
+	/* batch sizing */
+	int			fetch_size;		/* # of rows to request in next FETCH */
+	int			rows_needed;	/* # of rows the query likely needs, or 0 */
+	Size		fetch_memory;	/* batch memory budget in bytes, or 0 if batch
+								 * size is not adaptive */
+
 	/* working memory contexts */
 	MemoryContext batch_cxt;	/* context holding current batch of tuples */
-	MemoryContext temp_cxt;		/* context for per-tuple temporary data */
+	MemoryContext next_batch_cxt;	/* context holding next batch of tuples */
+
+	/* lookup cache of a parameterized scan; see lookup_cached_rows */
+	HTAB	   *lookup_cache;	/* cached rows, or NULL if no cache */
+	MemoryContext lookup_cxt;	/* context holding the cache */
+	Size		lookup_cache_limit; /* memory limit for the cache, in bytes */
+	Size		lookup_cache_used;	/* memory used by the cache (roughly) */
+	PgFdwLookupKey lookup_key;	/* key for the rows being fetched, if they
+								 * are to be cached */
+	long		lookup_hits;	/* # of scans answered from the cache */
+	long		lookup_misses;	/* # of scans that had to query */
+
+	/* result cache; see result_cached_rows */
+	int			cache_ttl;		/* seconds to keep the result, or 0 */
+	ResultCacheKey result_key;	/* key of the result in the cache */
+	bool		result_cache_hit;	/* are the rows from the cache? */
+	MemoryContext result_cxt;	/* rows being collected, or NULL */
+	Datum	   *result_values;	/* values of the rows collected so far */
+	bool	   *result_nulls;	/* their null flags */
+	int			result_num_tuples;	/* # of rows collected */
+	int			result_max_tuples;	/* # of rows the arrays have room for */
+	Size		result_size;	/* memory used by the rows (roughly) */
+
+	/* scan split over several connections; see setup_parallel_scan */
+	int			nstreams;		/* number of slices, or 0 if not split */
+	PgFdwStream *streams;		/* the first one uses conn, above */
+	int			next_stream;	/* the one to try first for the next batch */
+
+	/* rows fetched so far, kept for rescans; see postgresBeginForeignScan */
+	Tuplestorestate *spool;		/* the rows, or NULL if not spooling */
+	bool		spool_complete; /* does it hold all of the result? */
+	long		spool_rescans;	/* # of rescans answered from the spool */
+
+	/* local conditions checked as rows are converted; see filter_row */
+	List	   *filter_quals;	/* the conditions, or NIL if left to ExecScan */
+	bool	   *filter_cols;	/* per attribute: needed by the conditions? */
+	bool	   *other_cols;		/* per attribute: converted only for rows
+								 * that pass? */
+
+	/* counters for EXPLAIN ANALYZE; see postgresExplainForeignScan */
+	bool		track_io;		/* count the bytes received? */
+	bool		track_timing;	/* measure the times below? */
+	long		remote_fetches; /* # of results of FETCH etc. received */
+	double		remote_rows;	/* # of rows received */
+	double		remote_bytes;	/* # of bytes of row data received, if
+								 * track_io */
+	instr_time	connect_time;	/* time spent getting connections */
+	instr_time	remote_time;	/* time spent starting the query and
+								 * reading its rows, including convert_time */
+	instr_time	convert_time;	/* time spent converting the rows */
+
+	/* cost calibration; see calibrate_scan */
+	bool		calibrate;		/* measure the costs of the server? */
+	Oid			serverid;		/* OID of the server */
+	bool		calib_started;	/* has this run's first batch arrived? */
+	double		calib_first_ms; /* wait time when first batch arrived */
+	double		calib_first_rows;	/* remote_rows when first batch arrived */
 } PgFdwExecutionState;
 
 /*
@@ -149,12 +445,64 @@ typedef struct ConversionLocation
 	AttrNumber	cur_attno;		/* attribute number being processed, or 0 */
 } ConversionLocation;
 
+/*
+ * Cache of remote estimates, for use_remote_estimate mode.  Planning the same
+ * query again runs the very same EXPLAIN on the remote server, so we keep
+ * its results for estimate_cache_ttl seconds.  The hash key is the server,
+ * the user whose mapping we connect with, and the SQL text, which includes
+ * the types of any parameters.
+ */
+typedef struct EstimateCacheKey
+{
+	Oid			serverid;		/* OID of foreign server */
+	Oid			userid;			/* OID of the user mapping's user */
+	char	   *sql;			/* text of the remote query */
+} EstimateCacheKey;
+
+typedef struct EstimateCacheEntry
+{
+	EstimateCacheKey key;		/* hash key (must be first) */
+	TimestampTz created;		/* when the remote EXPLAIN was run */
+	double		rows;
+	int			width;
+	Cost		startup_cost;
+	Cost		total_cost;
+} EstimateCacheEntry;
+
+static HTAB *EstimateCache = NULL;
+
+/*
+ * Costs of the foreign servers with calibrate_costs set, as measured by
+ * their scans, in milliseconds: the latency of a round trip, taken from the
+ * CLOSE of a scan's cursor, which costs the remote server nothing to
+ * execute, and the wait per row after the first batch.  Each is an
+ * exponentially weighted moving average of the measurements, or negative if
+ * there hasn't been any yet.  They are converted to cost units with
+ * postgres_fdw.cost_unit_ms.
+ */
+typedef struct CalibrationEntry
+{
+	Oid			serverid;		/* hash key (must be first) */
+	double		startup_ms;
+	double		tuple_ms;
+} CalibrationEntry;
+
+static HTAB *Calibration = NULL;
+
+/* time that corresponds to one unit of planner cost (a GUC) */
+static double pgfdw_cost_unit_ms = 0.01;
+
 /*
  * SQL functions
  */
+extern void _PG_init(void);
 extern Datum postgres_fdw_handler(PG_FUNCTION_ARGS);
+extern Datum postgres_fdw_flush_estimates(PG_FUNCTION_ARGS);
+extern Datum postgres_fdw_invalidate_cache(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(postgres_fdw_handler);
+PG_FUNCTION_INFO_V1(postgres_fdw_flush_estimates);
+PG_FUNCTION_INFO_V1(postgres_fdw_invalidate_cache);
 
 /*
  * FDW callback routines
@@ -173,6 +521,8 @@ static ForeignScan *postgresGetForeignPlan(PlannerInfo *root,
 					   List *scan_clauses);
 static void postgresExplainForeignScan(ForeignScanState *node,
 						   ExplainState *es);
+static void explain_remote_io(PgFdwExecutionState *festate,
+				  ExplainState *es);
 static void postgresBeginForeignScan(ForeignScanState *node, int eflags);
 static TupleTableSlot *postgresIterateForeignScan(ForeignScanState *node);
 static void postgresReScanForeignScan(ForeignScanState *node);
@@ -184,28 +534,183 @@ static bool postgresAnalyzeForeignTable(Relation relation,
 /*
  * Helper functions
  */
+static void apply_server_options(PgFdwRelationInfo *fpinfo);
+static void apply_table_options(PgFdwRelationInfo *fpinfo);
+static void estimate_remote_scan(PgFdwRelationInfo *fpinfo, const char *sql,
+					 double *rows, int *width,
+					 Cost *startup_cost, Cost *total_cost);
 static void get_remote_estimate(const char *sql,
 					PGconn *conn,
 					double *rows,
 					int *width,
 					Cost *startup_cost,
 					Cost *total_cost);
+static void add_sorted_paths(PlannerInfo *root, RelOptInfo *baserel,
+				 bool copy_mode);
+static List *get_useful_pathkeys(PlannerInfo *root, RelOptInfo *baserel);
+static bool is_foreign_pathkey(PlannerInfo *root, RelOptInfo *baserel,
+				   PathKey *pathkey);
+static PathKey *get_canonical_pathkey(PlannerInfo *root,
+					  EquivalenceClass *eclass, Oid opfamily,
+					  int strategy, bool nulls_first);
+static void add_parameterized_paths(PlannerInfo *root, RelOptInfo *baserel);
+static void estimate_remote_path(PlannerInfo *root, RelOptInfo *baserel,
+					 List *remote_join_conds, List *local_join_conds,
+					 List *pathkeys, double *p_rows,
+					 Cost *p_startup_cost, Cost *p_total_cost);
+static List *add_outer_candidate(List *candidates, Relids required_outer);
+static void add_foreign_costs(PgFdwRelationInfo *fpinfo, double rows,
+				  Cost *startup_cost, Cost *total_cost);
+static List *make_path_private(PgFdwRelationInfo *fpinfo, double rows,
+				  bool copy_mode, bool param_path,
+				  double rows_needed, bool limit_pushed);
+static double get_rows_needed(PlannerInfo *root, RelOptInfo *baserel,
+				List *pathkeys, bool *limit_pushed);
+static bool is_constant_limit(Query *parse);
+static List *get_filter_attrs(List *local_exprs, Index relid,
+				 List *retrieved_attrs);
+static int	get_param_offset(List *param_numbers);
+static void set_param_value(PgFdwExecutionState *festate, int paramno,
+				Oid type, Datum value, bool isnull);
 static void create_cursor(ForeignScanState *node);
+static PGresult *switch_to_cursor(PgFdwExecutionState *festate);
+static void build_lookup_key(PgFdwExecutionState *festate,
+				 PgFdwLookupKey *key);
+static bool lookup_cached_rows(PgFdwExecutionState *festate);
+static void store_lookup_rows(PgFdwExecutionState *festate);
+static uint32 lookup_key_hash(const void *key, Size keysize);
+static int	lookup_key_match(const void *key1, const void *key2,
+				 Size keysize);
+static uint32 estimate_key_hash(const void *key, Size keysize);
+static int estimate_key_match(const void *key1, const void *key2,
+				   Size keysize);
+static void expire_estimates(int ttl);
+static void apply_calibrated_costs(PgFdwRelationInfo *fpinfo);
+static bool result_cached_rows(PgFdwExecutionState *festate);
+static void collect_result_rows(PgFdwExecutionState *festate);
+static void store_result_cache(PgFdwExecutionState *festate);
+static void drop_result_entry(ResultCacheEntry *entry);
+static void result_cache_callback(Datum arg, Oid relid);
+static uint32 result_key_hash(const void *key, Size keysize);
+static int result_key_match(const void *key1, const void *key2,
+				 Size keysize);
 static void fetch_more_data(ForeignScanState *node);
-static void close_cursor(PGconn *conn, unsigned int cursor_number);
+static void fetch_more_copy_data(ForeignScanState *node);
+static void store_result_batch(ForeignScanState *node, PGresult *res);
+static bool filter_row(ForeignScanState *node, Datum *values, bool *nulls);
+static void start_timer(PgFdwExecutionState *festate, instr_time *start);
+static void stop_timer(PgFdwExecutionState *festate, instr_time *start,
+		   instr_time *counter);
+static double remote_wait_ms(PgFdwExecutionState *festate);
+static void note_first_batch(PgFdwExecutionState *festate);
+static void calibrate_scan(PgFdwExecutionState *festate);
+static void calibrate_latency(PgFdwExecutionState *festate, double ms);
+static CalibrationEntry *get_calibration_entry(Oid serverid);
+static double smooth_cost(double average, double value);
+static void setup_parallel_scan(PgFdwExecutionState *festate,
+					ForeignServer *server, UserMapping *user,
+					List *partition_sqls);
+static void create_parallel_cursors(PgFdwExecutionState *festate);
+static void fetch_parallel_data(ForeignScanState *node);
+static void close_parallel_cursors(PgFdwExecutionState *festate);
+static void send_fetch_request(PgFdwExecutionState *festate);
+static void activate_next_batch(PgFdwExecutionState *festate);
+static void discard_prefetched_data(PgFdwExecutionState *festate);
+static void adjust_fetch_size(PgFdwExecutionState *festate, PGresult *res);
+static bool binary_transfer_possible(PGconn *conn);
+static AttRecvMetadata *make_recv_metadata(TupleDesc tupdesc);
+static PgFdwDecoder *make_decoder_plan(TupleDesc tupdesc,
+				  List *retrieved_attrs);
+static void close_cursor(PGconn *conn, PgFdwConnState *conn_state,
+			 unsigned int cursor_number);
 static int postgresAcquireSampleRowsFunc(Relation relation, int elevel,
 							  HeapTuple *rows, int targrows,
 							  double *totalrows,
 							  double *totaldeadrows);
 static void analyze_row_processor(PGresult *res, int row,
 					  PgFdwAnalyzeState *astate);
+static PgFdwSamplingMethod parse_sampling_method(const char *value);
+static double get_remote_reltuples(Relation relation, PGconn *conn);
+static bool import_remote_stats(Relation relation, PGconn *conn,
+					double *totalrows);
+static bool remote_type_matches(Oid typid, const char *nspname,
+					const char *typname);
+static bool store_all_remote_stats(Relation relation, PGresult *res);
+static void store_remote_stats(Relation sd, Relation relation,
+				   Form_pg_attribute attr, PGresult *res, int row);
+static Datum parse_stats_array(const char *str, Oid elemtype);
 static HeapTuple make_tuple_from_result_row(PGresult *res,
 						   int row,
 						   Relation rel,
 						   AttInMetadata *attinmeta,
+						   AttRecvMetadata *recvmeta,
 						   MemoryContext temp_context);
+static void convert_result_row(PGresult *res,
+				   int row,
+				   Relation rel,
+				   AttInMetadata *attinmeta,
+				   AttRecvMetadata *recvmeta,
+				   PgFdwDecoder *decoders,
+				   const bool *wanted,
+				   Datum *values,
+				   bool *nulls);
+static void convert_copy_row(char *row,
+				 int len,
+				 Relation rel,
+				 AttInMetadata *attinmeta,
+				 PgFdwDecoder *decoders,
+				 Datum *values,
+				 bool *nulls);
+static Datum decode_text_value(PgFdwDecoder decoder,
+				  char *valstr,
+				  AttInMetadata *attinmeta,
+				  int i);
+static bool parse_iso_date(const char *str, int *year, int *mon, int *mday);
+static bool parse_digits(const char *str, int ndigits, int *result);
+static AttrNumber get_partition_attnum(Oid relid, const char *colname);
+static int get_partition_bounds(PlannerInfo *root, RelOptInfo *baserel,
+					 int nparts, int64 *bounds);
+static char *parse_copy_field(char *start, char **next);
 static void conversion_error_callback(void *arg);
+static void start_query_connections(EState *estate, Oid relid, Oid fdwhandler);
+static bool connection_is_shared(EState *estate, Index scanrelid);
+
 
+/*
+ * Module load callback
+ */
+void
+_PG_init(void)
+{
+	DefineCustomStringVariable("postgres_fdw.prewarm_servers",
+							   "Foreign servers to connect to ahead of need.",
+							   "Connections to these servers are started in the background when the session first uses postgres_fdw.",
+							   &pgfdw_prewarm_servers,
+							   "",
+							   PGC_USERSET,
+							   GUC_LIST_INPUT | GUC_LIST_QUOTE,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomRealVariable("postgres_fdw.cost_unit_ms",
+							 "Sets the time corresponding to one unit of planner cost, in milliseconds.",
+							 "The times measured for foreign servers with calibrate_costs set are converted to costs with this.",
+							 &pgfdw_cost_unit_ms,
+							 0.01,
+							 0.0001,
+							 1000.0,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	/* Shared statistics, if we're in shared_preload_libraries */
+	pgfdw_stats_init();
+
+	EmitWarningsOnPlaceholders("postgres_fdw");
+}
 
 /*
  * Foreign-data wrapper handler function: return a struct with pointers
@@ -250,8 +755,6 @@ postgresGetForeignRelSize(PlannerInfo *root,
 						  RelOptInfo *baserel,
 						  Oid foreigntableid)
 {
-	bool		use_remote_estimate = false;
-	ListCell   *lc;
 	PgFdwRelationInfo *fpinfo;
 	StringInfo	sql;
 	ForeignTable *table;
@@ -276,45 +779,61 @@ postgresGetForeignRelSize(PlannerInfo *root,
 	fpinfo = palloc0(sizeof(PgFdwRelationInfo));
 	initStringInfo(&fpinfo->sql);
 	sql = &fpinfo->sql;
+	baserel->fdw_private = (void *) fpinfo;
 
 	/*
-	 * Determine whether we use remote estimate or not.  Note that per-table
-	 * setting overrides per-server setting.
+	 * Look up the catalog objects and extract the options we care about.
+	 * Note that per-table settings override per-server settings, so the
+	 * table's options have to be applied last.
 	 */
 	table = GetForeignTable(foreigntableid);
 	server = GetForeignServer(table->serverid);
-	foreach(lc, server->options)
-	{
-		DefElem    *def = (DefElem *) lfirst(lc);
+	fpinfo->table = table;
+	fpinfo->server = server;
 
-		if (strcmp(def->defname, "use_remote_estimate") == 0)
-		{
-			use_remote_estimate = defGetBoolean(def);
-			break;
-		}
-	}
-	foreach(lc, table->options)
-	{
-		DefElem    *def = (DefElem *) lfirst(lc);
+	fpinfo->use_remote_estimate = false;
+	fpinfo->fdw_startup_cost = DEFAULT_FDW_STARTUP_COST;
+	fpinfo->fdw_tuple_cost = DEFAULT_FDW_TUPLE_COST;
+	fpinfo->calibrate_costs = false;
+	fpinfo->fetch_size = DEFAULT_FETCH_SIZE;
+	fpinfo->adaptive_fetch = false;
+	fpinfo->fetch_memory = DEFAULT_FETCH_MEMORY;
+	fpinfo->prefetch = false;
+	fpinfo->binary_transfer = false;
+	fpinfo->copy_threshold = 0;
+	fpinfo->use_prepared = true;
+	fpinfo->lookup_cache_memory = DEFAULT_LOOKUP_CACHE_MEMORY;
+	fpinfo->estimate_cache_ttl = 0;
+	fpinfo->cache_ttl = 0;
+	fpinfo->spool_rescans = false;
+	fpinfo->parallel_connections = 1;
+	fpinfo->partition_attnum = InvalidAttrNumber;
+	fpinfo->shippable_extensions = NIL;
+
+	apply_server_options(fpinfo);
+	apply_table_options(fpinfo);
 
-		if (strcmp(def->defname, "use_remote_estimate") == 0)
-		{
-			use_remote_estimate = defGetBoolean(def);
-			break;
-		}
-	}
+	/*
+	 * The costs measured during earlier scans of the server stand in for the
+	 * defaults, though not for costs set explicitly.  This comes after the
+	 * table's options, since it depends on use_remote_estimate.
+	 */
+	if (fpinfo->calibrate_costs)
+		apply_calibrated_costs(fpinfo);
 
 	/*
 	 * Construct remote query which consists of SELECT, FROM, and WHERE
 	 * clauses.  Conditions which contain any Param node are excluded because
 	 * placeholder can't be used in EXPLAIN statement.  Such conditions are
-	 * appended later.
+	 * appended later.  (classifyConditions finds the shippable extensions
+	 * through baserel->fdw_private, which is why that's set already.)
 	 */
 	classifyConditions(root, baserel, &remote_conds, &param_conds,
 					   &local_conds, &param_numbers);
-	deparseSimpleSql(sql, root, baserel, local_conds);
+	deparseSimpleSql(sql, root, baserel, local_conds,
+					 fpinfo->binary_transfer, &fpinfo->retrieved_attrs);
 	if (list_length(remote_conds) > 0)
-		appendWhereClause(sql, true, remote_conds, root);
+		appendWhereClause(sql, true, remote_conds, root, baserel, NULL, 0);
 
 	/*
 	 * If the table or the server is configured to use remote estimates,
@@ -322,12 +841,10 @@ postgresGetForeignRelSize(PlannerInfo *root,
 	 * don't contain any Param nodes.  Otherwise, estimate rows using whatever
 	 * statistics we have locally, in a way similar to ordinary tables.
 	 */
-	if (use_remote_estimate)
+	if (fpinfo->use_remote_estimate)
 	{
 		RangeTblEntry *rte;
 		Oid			userid;
-		UserMapping *user;
-		PGconn	   *conn;
 
 		/*
 		 * Identify which user to do the remote access as.	This should match
@@ -337,11 +854,9 @@ postgresGetForeignRelSize(PlannerInfo *root,
 		rte = planner_rt_fetch(baserel->relid, root);
 		userid = rte->checkAsUser ? rte->checkAsUser : GetUserId();
 
-		user = GetUserMapping(userid, server->serverid);
-		conn = GetConnection(server, user);
-		get_remote_estimate(sql->data, conn, &rows, &width,
-							&startup_cost, &total_cost);
-		ReleaseConnection(conn);
+		fpinfo->user = GetUserMapping(userid, server->serverid);
+		estimate_remote_scan(fpinfo, sql->data, &rows, &width,
+							 &startup_cost, &total_cost);
 
 		/*
 		 * Estimate selectivity of conditions which were not used in remote
@@ -409,11 +924,11 @@ postgresGetForeignRelSize(PlannerInfo *root,
 	 */
 	if (list_length(param_conds) > 0)
 		appendWhereClause(sql, !(list_length(remote_conds) > 0), param_conds,
-						  root);
+						  root, baserel, NULL, 0);
 
 	/*
-	 * Store obtained information into FDW-private area of RelOptInfo so it's
-	 * available to subsequent functions.
+	 * Store obtained information into our FDW-private area so it's available
+	 * to subsequent functions.
 	 */
 	fpinfo->startup_cost = startup_cost;
 	fpinfo->total_cost = total_cost;
@@ -421,9 +936,6 @@ postgresGetForeignRelSize(PlannerInfo *root,
 	fpinfo->param_conds = param_conds;
 	fpinfo->local_conds = local_conds;
 	fpinfo->param_numbers = param_numbers;
-	fpinfo->table = table;
-	fpinfo->server = server;
-	baserel->fdw_private = (void *) fpinfo;
 }
 
 /*
@@ -437,25 +949,11 @@ postgresGetForeignPaths(PlannerInfo *root,
 {
 	PgFdwRelationInfo *fpinfo = (PgFdwRelationInfo *) baserel->fdw_private;
 	ForeignPath *path;
-	ListCell   *lc;
-	double		fdw_startup_cost = DEFAULT_FDW_STARTUP_COST;
-	double		fdw_tuple_cost = DEFAULT_FDW_TUPLE_COST;
 	Cost		startup_cost;
 	Cost		total_cost;
-	List	   *fdw_private;
-
-	/*
-	 * Check for user override of fdw_startup_cost, fdw_tuple_cost values
-	 */
-	foreach(lc, fpinfo->server->options)
-	{
-		DefElem    *d = (DefElem *) lfirst(lc);
-
-		if (strcmp(d->defname, "fdw_startup_cost") == 0)
-			fdw_startup_cost = strtod(defGetString(d), NULL);
-		else if (strcmp(d->defname, "fdw_tuple_cost") == 0)
-			fdw_tuple_cost = strtod(defGetString(d), NULL);
-	}
+	bool		copy_mode;
+	double		rows_needed;
+	bool		limit_pushed;
 
 	/*
 	 * We have cost values which are estimated on remote side, so adjust them
@@ -464,25 +962,19 @@ postgresGetForeignPaths(PlannerInfo *root,
 	 */
 	startup_cost = fpinfo->startup_cost;
 	total_cost = fpinfo->total_cost;
-
-	/*----------
-	 * Adjust costs with factors of the corresponding foreign server:
-	 *	 - add cost to establish connection to both startup and total
-	 *	 - add cost to manipulate on remote, and transfer result to total
-	 *	 - add cost to manipulate tuples on local side to total
-	 *----------
-	 */
-	startup_cost += fdw_startup_cost;
-	total_cost += fdw_startup_cost;
-	total_cost += fdw_tuple_cost * baserel->rows;
-	total_cost += cpu_tuple_cost * baserel->rows;
+	add_foreign_costs(fpinfo, baserel->rows, &startup_cost, &total_cost);
 
 	/*
-	 * Build the fdw_private list that will be available to the executor.
-	 * Items in the list must match enum FdwPrivateIndex, above.
+	 * Decide whether to stream the rows with COPY instead of fetching them
+	 * through a cursor.  That saves a round trip per batch, but it's worth
+	 * the trouble only for large results, and COPY can't take parameters.
+	 * Also, a COPY can't be rewound, so if the scan is rescanned it must be
+	 * started over; the executor falls back to a cursor if it knows in
+	 * advance that rescans are coming (see postgresBeginForeignScan).
 	 */
-	fdw_private = list_make2(makeString(fpinfo->sql.data),
-							 fpinfo->param_numbers);
+	copy_mode = (fpinfo->copy_threshold > 0 &&
+				 baserel->rows >= fpinfo->copy_threshold &&
+				 fpinfo->param_conds == NIL);
 
 	/*
 	 * Create simplest ForeignScan path node and add it to baserel.  This path
@@ -490,387 +982,3760 @@ postgresGetForeignPaths(PlannerInfo *root,
 	 * baserestrict conditions we were able to send to remote, there might
 	 * actually be an indexscan happening there).
 	 */
+	rows_needed = get_rows_needed(root, baserel, NIL, &limit_pushed);
 	path = create_foreignscan_path(root, baserel,
 								   baserel->rows,
 								   startup_cost,
 								   total_cost,
 								   NIL, /* no pathkeys */
 								   NULL,		/* no outer rel either */
-								   fdw_private);
+								   make_path_private(fpinfo, baserel->rows,
+													 copy_mode, false,
+													 rows_needed,
+													 limit_pushed));
 	add_path(baserel, (Path *) path);
 
 	/*
-	 * XXX We can consider sorted path or parameterized path here if we know
-	 * that foreign table is indexed on remote end.  For this purpose, we
-	 * might have to support FOREIGN INDEX to represent possible sets of sort
-	 * keys and/or filtering.  Or we could just try some join conditions and
-	 * see if remote side estimates using them as markedly cheaper.  Note that
-	 * executor functions need work to support internal Params before we can
-	 * try generating any parameterized paths, though.
+	 * Consider paths sorted by the remote server, which saves a local sort
+	 * for ORDER BY or a merge join, and may well be cheap if the remote table
+	 * has a suitable index.
 	 */
+	add_sorted_paths(root, baserel, copy_mode);
+
+	/*
+	 * Also consider parameterized paths, in which the join clauses of a
+	 * nestloop join are sent to the remote server along with values from the
+	 * outer relation.
+	 */
+	add_parameterized_paths(root, baserel);
 }
 
 /*
- * postgresGetForeignPlan
- *		Create ForeignScan plan node which implements selected best path
+ * Add unparameterized paths with the useful sort orders to baserel.
+ *
+ * With use_remote_estimate, the remote server tells us what the sorting
+ * costs, or whether it can use an index instead.  Otherwise we have no idea,
+ * so we just charge a fixed premium over the unsorted scan: enough that
+ * the sorted path isn't used when nobody needs the order, but little enough
+ * that it beats a local sort of many rows.
  */
-static ForeignScan *
-postgresGetForeignPlan(PlannerInfo *root,
-					   RelOptInfo *baserel,
-					   Oid foreigntableid,
-					   ForeignPath *best_path,
-					   List *tlist,
-					   List *scan_clauses)
+static void
+add_sorted_paths(PlannerInfo *root, RelOptInfo *baserel, bool copy_mode)
 {
 	PgFdwRelationInfo *fpinfo = (PgFdwRelationInfo *) baserel->fdw_private;
-	Index		scan_relid = baserel->relid;
-	List	   *fdw_private = best_path->fdw_private;
-	List	   *remote_exprs = NIL;
-	List	   *local_exprs = NIL;
+	List	   *useful_pathkeys_list;
 	ListCell   *lc;
 
-	/*
-	 * Separate the scan_clauses into those that can be executed remotely and
-	 * those that can't.  For now, we accept only remote clauses that were
-	 * previously determined to be safe by classifyClauses (so, only
-	 * baserestrictinfo clauses can be used that way).
-	 *
-	 * This code must match "extract_actual_clauses(scan_clauses, false)"
-	 * except for the additional decision about remote versus local execution.
-	 */
-	foreach(lc, scan_clauses)
+	useful_pathkeys_list = get_useful_pathkeys(root, baserel);
+
+	foreach(lc, useful_pathkeys_list)
 	{
-		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+		List	   *pathkeys = (List *) lfirst(lc);
+		double		rows;
+		Cost		startup_cost;
+		Cost		total_cost;
+		double		rows_needed;
+		bool		limit_pushed;
+		ForeignPath *path;
+
+		if (fpinfo->use_remote_estimate)
+			estimate_remote_path(root, baserel, NIL, NIL, pathkeys,
+								 &rows, &startup_cost, &total_cost);
+		else
+		{
+			rows = baserel->rows;
+			startup_cost = fpinfo->startup_cost * DEFAULT_FDW_SORT_MULTIPLIER;
+			total_cost = fpinfo->total_cost * DEFAULT_FDW_SORT_MULTIPLIER;
+		}
+		add_foreign_costs(fpinfo, rows, &startup_cost, &total_cost);
+
+		rows_needed = get_rows_needed(root, baserel, pathkeys, &limit_pushed);
+		path = create_foreignscan_path(root, baserel,
+									   rows,
+									   startup_cost,
+									   total_cost,
+									   pathkeys,
+									   NULL,	/* no outer rel either */
+									   make_path_private(fpinfo, rows,
+														 copy_mode, false,
+														 rows_needed,
+														 limit_pushed));
+		add_path(baserel, (Path *) path);
+	}
+}
 
-		Assert(IsA(rinfo, RestrictInfo));
+/*
+ * Collect the lists of pathkeys worth building sorted paths for.
+ *
+ * The first candidate is the ordering the query as a whole wants, if the
+ * remote server can produce all of it.  With use_remote_estimate, we also
+ * try the orderings a merge join with another relation could use; without
+ * it, we couldn't tell whether any of them is cheap, so we don't bother.
+ */
+static List *
+get_useful_pathkeys(PlannerInfo *root, RelOptInfo *baserel)
+{
+	PgFdwRelationInfo *fpinfo = (PgFdwRelationInfo *) baserel->fdw_private;
+	List	   *useful_pathkeys_list = NIL;
+	bool		query_pathkeys_ok = true;
+	ListCell   *lc;
 
-		/* Ignore any pseudoconstants, they're dealt with elsewhere */
-		if (rinfo->pseudoconstant)
+	foreach(lc, root->query_pathkeys)
+	{
+		if (!is_foreign_pathkey(root, baserel, (PathKey *) lfirst(lc)))
+		{
+			query_pathkeys_ok = false;
+			break;
+		}
+	}
+	if (root->query_pathkeys != NIL && query_pathkeys_ok)
+		useful_pathkeys_list = lappend(useful_pathkeys_list,
+									   list_copy(root->query_pathkeys));
+
+	if (!fpinfo->use_remote_estimate)
+		return useful_pathkeys_list;
+
+	foreach(lc, root->eq_classes)
+	{
+		EquivalenceClass *ec = (EquivalenceClass *) lfirst(lc);
+		PathKey    *pathkey;
+		List	   *pathkeys;
+		bool		duplicate = false;
+		ListCell   *lc2;
+
+		/* Only ECs joining our relation to another one are interesting */
+		if (ec->ec_has_const || ec->ec_has_volatile ||
+			ec->ec_opfamilies == NIL ||
+			!bms_is_member(baserel->relid, ec->ec_relids) ||
+			bms_equal(ec->ec_relids, baserel->relids))
 			continue;
 
-		/* Either simple or parameterized remote clauses are OK now */
-		if (list_member_ptr(fpinfo->remote_conds, rinfo) ||
-			list_member_ptr(fpinfo->param_conds, rinfo))
-			remote_exprs = lappend(remote_exprs, rinfo->clause);
-		else
-			local_exprs = lappend(local_exprs, rinfo->clause);
+		pathkey = get_canonical_pathkey(root, ec,
+										linitial_oid(ec->ec_opfamilies),
+										BTLessStrategyNumber, false);
+		if (!is_foreign_pathkey(root, baserel, pathkey))
+			continue;
+
+		pathkeys = list_make1(pathkey);
+		foreach(lc2, useful_pathkeys_list)
+		{
+			if (compare_pathkeys(pathkeys, (List *) lfirst(lc2)) ==
+				PATHKEYS_EQUAL)
+				duplicate = true;
+		}
+		if (!duplicate)
+			useful_pathkeys_list = lappend(useful_pathkeys_list, pathkeys);
 	}
 
-	/*
-	 * Create the ForeignScan node from target list, local filtering
-	 * expressions, remote filtering expressions, and FDW private information.
-	 *
-	 * Note that the remote_exprs are stored in the fdw_exprs field of the
-	 * finished plan node; we can't keep them in private state because then
-	 * they wouldn't be subject to later planner processing.
-	 *
-	 * XXX Currently, the remote_exprs aren't actually used at runtime, so we
-	 * don't need to store them at all.  But we'll keep this behavior for a
-	 * little while for debugging reasons.
-	 */
-	return make_foreignscan(tlist,
-							local_exprs,
-							scan_relid,
-							remote_exprs,
-							fdw_private);
+	return useful_pathkeys_list;
 }
 
 /*
- * postgresExplainForeignScan
- *		Produce extra output for EXPLAIN
+ * Check whether the remote server can sort baserel by the given pathkey.
+ *
+ * The pathkey's expression must be computable from baserel alone and safe to
+ * send, and the ordering must be the default one of the expression's type,
+ * since all we can send is ASC or DESC.
  */
-static void
-postgresExplainForeignScan(ForeignScanState *node, ExplainState *es)
+static bool
+is_foreign_pathkey(PlannerInfo *root, RelOptInfo *baserel, PathKey *pathkey)
 {
-	List	   *fdw_private;
-	char	   *sql;
+	Expr	   *em_expr;
+	List	   *param_numbers;
+	Oid			em_type;
+	Oid			sortop;
+	TypeCacheEntry *typentry;
+
+	if (pathkey->pk_eclass->ec_has_volatile)
+		return false;
+
+	em_expr = find_em_expr_for_rel(pathkey->pk_eclass, baserel);
+	if (em_expr == NULL ||
+		!is_foreign_expr(root, baserel, em_expr, &param_numbers) ||
+		param_numbers != NIL)
+		return false;
+
+	em_type = exprType((Node *) em_expr);
+	sortop = get_opfamily_member(pathkey->pk_opfamily, em_type, em_type,
+								 pathkey->pk_strategy);
+	if (!OidIsValid(sortop))
+		return false;
+
+	typentry = lookup_type_cache(em_type, TYPECACHE_LT_OPR | TYPECACHE_GT_OPR);
+	if (pathkey->pk_strategy == BTLessStrategyNumber)
+		return sortop == typentry->lt_opr;
+	else
+		return sortop == typentry->gt_opr;
+}
 
-	if (es->verbose)
+/*
+ * Find an equivalence class member expression that is computed from rel
+ * alone, or return NULL if there is none.  If there are several, any of
+ * them will do.
+ */
+Expr *
+find_em_expr_for_rel(EquivalenceClass *ec, RelOptInfo *rel)
+{
+	ListCell   *lc;
+
+	foreach(lc, ec->ec_members)
 	{
-		fdw_private = ((ForeignScan *) node->ss.ps.plan)->fdw_private;
-		sql = strVal(list_nth(fdw_private, FdwPrivateSelectSql));
-		ExplainPropertyText("Remote SQL", sql, es);
+		EquivalenceMember *em = (EquivalenceMember *) lfirst(lc);
+
+		if (!em->em_is_child && bms_equal(em->em_relids, rel->relids))
+			return em->em_expr;
 	}
+
+	return NULL;
 }
 
 /*
- * postgresBeginForeignScan
- *		Initiate an executor scan of a foreign PostgreSQL table.
+ * Return the canonical PathKey for the given sort order of eclass, creating
+ * it if necessary.  This duplicates make_canonical_pathkey(), which is static
+ * in pathkeys.c.  The pathkey must be canonical, because the planner compares
+ * pathkeys by address.
  */
-static void
-postgresBeginForeignScan(ForeignScanState *node, int eflags)
+static PathKey *
+get_canonical_pathkey(PlannerInfo *root, EquivalenceClass *eclass,
+					  Oid opfamily, int strategy, bool nulls_first)
 {
-	ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
-	EState	   *estate = node->ss.ps.state;
-	PgFdwExecutionState *festate;
-	RangeTblEntry *rte;
-	Oid			userid;
-	ForeignTable *table;
-	ForeignServer *server;
-	UserMapping *user;
-	List	   *param_numbers;
-	int			numParams;
-	int			i;
+	PathKey    *pk;
+	ListCell   *lc;
+	MemoryContext oldcontext;
 
-	/*
-	 * Do nothing in EXPLAIN (no ANALYZE) case.  node->fdw_state stays NULL.
-	 */
-	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
-		return;
+	/* The passed eclass might be non-canonical, so chase up to the top */
+	while (eclass->ec_merged)
+		eclass = eclass->ec_merged;
 
-	/*
-	 * We'll save private state in node->fdw_state.
-	 */
-	festate = (PgFdwExecutionState *) palloc0(sizeof(PgFdwExecutionState));
-	node->fdw_state = (void *) festate;
+	foreach(lc, root->canon_pathkeys)
+	{
+		pk = (PathKey *) lfirst(lc);
+		if (eclass == pk->pk_eclass &&
+			opfamily == pk->pk_opfamily &&
+			strategy == pk->pk_strategy &&
+			nulls_first == pk->pk_nulls_first)
+			return pk;
+	}
 
 	/*
-	 * Identify which user to do the remote access as.	This should match what
-	 * ExecCheckRTEPerms() does.
+	 * Be sure canonical pathkeys are allocated in the main planning context.
+	 * Not an issue in normal planning, but it is for GEQO.
 	 */
-	rte = rt_fetch(fsplan->scan.scanrelid, estate->es_range_table);
-	userid = rte->checkAsUser ? rte->checkAsUser : GetUserId();
+	oldcontext = MemoryContextSwitchTo(root->planner_cxt);
 
-	/* Get info about foreign table. */
-	festate->rel = node->ss.ss_currentRelation;
-	table = GetForeignTable(RelationGetRelid(festate->rel));
-	server = GetForeignServer(table->serverid);
-	user = GetUserMapping(userid, server->serverid);
+	pk = makeNode(PathKey);
+	pk->pk_eclass = eclass;
+	pk->pk_opfamily = opfamily;
+	pk->pk_strategy = strategy;
+	pk->pk_nulls_first = nulls_first;
+	root->canon_pathkeys = lappend(root->canon_pathkeys, pk);
 
-	/*
-	 * Get connection to the foreign server.  Connection manager will
-	 * establish new connection if necessary.
+	MemoryContextSwitchTo(oldcontext);
+
+	return pk;
+}
+
+/*
+ * Add parameterized paths for the foreign table to baserel.
+ *
+ * Candidate sets of outer relations are those referenced by the join clauses
+ * that could be evaluated at the foreign scan, as well as those sharing an
+ * equivalence class with a column of the foreign table.  For each, the
+ * planner's ParamPathInfo tells us which clauses a parameterized scan has
+ * to enforce, including the equalities implied by equivalence classes; we
+ * send those that are safe to the remote server, where they can turn a full
+ * scan into index probes.  The path is costed by remote EXPLAIN if
+ * use_remote_estimate is set, and by the local row model otherwise.
+ */
+static void
+add_parameterized_paths(PlannerInfo *root, RelOptInfo *baserel)
+{
+	PgFdwRelationInfo *fpinfo = (PgFdwRelationInfo *) baserel->fdw_private;
+	List	   *candidates = NIL;
+	List	   *param_numbers;
+	ListCell   *lc;
+
+	/* Scan the join clauses for outer relations we could use. */
+	foreach(lc, baserel->joininfo)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+
+		if (!join_clause_is_movable_to(rinfo, baserel->relid))
+			continue;
+		if (!is_foreign_expr(root, baserel, rinfo->clause, &param_numbers) ||
+			param_numbers != NIL)
+			continue;
+
+		candidates = add_outer_candidate(candidates,
+										 bms_difference(rinfo->clause_relids,
+														baserel->relids));
+	}
+
+	/* And the equivalence classes involving our columns. */
+	foreach(lc, root->eq_classes)
+	{
+		EquivalenceClass *ec = (EquivalenceClass *) lfirst(lc);
+		bool		has_our_member = false;
+		ListCell   *lc2;
+
+		/* ECs containing constants generate no join clauses */
+		if (ec->ec_has_const || ec->ec_has_volatile ||
+			list_length(ec->ec_members) <= 1 ||
+			!bms_is_member(baserel->relid, ec->ec_relids))
+			continue;
+
+		foreach(lc2, ec->ec_members)
+		{
+			EquivalenceMember *em = (EquivalenceMember *) lfirst(lc2);
+
+			if (!em->em_is_child && bms_equal(em->em_relids, baserel->relids))
+				has_our_member = true;
+		}
+		if (!has_our_member)
+			continue;
+
+		foreach(lc2, ec->ec_members)
+		{
+			EquivalenceMember *em = (EquivalenceMember *) lfirst(lc2);
+
+			if (em->em_is_child || bms_is_empty(em->em_relids) ||
+				bms_overlap(em->em_relids, baserel->relids))
+				continue;
+			candidates = add_outer_candidate(candidates, em->em_relids);
+		}
+	}
+
+	/* Now build a path for each candidate. */
+	foreach(lc, candidates)
+	{
+		Relids		required_outer = (Relids) lfirst(lc);
+		ParamPathInfo *ppi;
+		List	   *remote_join_conds = NIL;
+		List	   *local_join_conds = NIL;
+		double		rows;
+		Cost		startup_cost;
+		Cost		total_cost;
+		QualCost	qpqual_cost;
+		ForeignPath *path;
+		ListCell   *lc2;
+
+		ppi = get_baserel_parampathinfo(root, baserel, required_outer);
+
+		foreach(lc2, ppi->ppi_clauses)
+		{
+			RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc2);
+
+			if (is_foreign_expr(root, baserel, rinfo->clause,
+								&param_numbers) &&
+				param_numbers == NIL)
+				remote_join_conds = lappend(remote_join_conds, rinfo);
+			else
+				local_join_conds = lappend(local_join_conds, rinfo);
+		}
+
+		/* No point unless the remote server gets to use some of them */
+		if (remote_join_conds == NIL)
+			continue;
+
+		if (fpinfo->use_remote_estimate)
+			estimate_remote_path(root, baserel,
+								 remote_join_conds, local_join_conds, NIL,
+								 &rows, &startup_cost, &total_cost);
+		else
+		{
+			/*
+			 * Without remote estimates, we can't know whether the remote
+			 * server has an index to use, so cost it as a seqscan that
+			 * checks the join clauses on every row, as for the plain path;
+			 * only the number of rows transferred gets smaller.
+			 */
+			rows = ppi->ppi_rows;
+			startup_cost = fpinfo->startup_cost;
+			total_cost = fpinfo->total_cost;
+			cost_qual_eval(&qpqual_cost, ppi->ppi_clauses, root);
+			startup_cost += qpqual_cost.startup;
+			total_cost += qpqual_cost.per_tuple * baserel->tuples;
+		}
+
+		add_foreign_costs(fpinfo, rows, &startup_cost, &total_cost);
+
+		/* The remote query will have parameters, so COPY is out */
+		path = create_foreignscan_path(root, baserel,
+									   rows,
+									   startup_cost,
+									   total_cost,
+									   NIL,		/* no pathkeys */
+									   required_outer,
+									   make_path_private(fpinfo, rows,
+														 false, true, 0, false));
+		add_path(baserel, (Path *) path);
+	}
+}
+
+/*
+ * Estimate a path with remote EXPLAIN, for use_remote_estimate mode.
+ *
+ * The remote server gets the scan with remote_join_conds added, whose outer
+ * values deparse as placeholders here, and sorted by pathkeys if any.  The
+ * other conditions get estimated locally, as in postgresGetForeignRelSize.
+ * The costs returned don't include add_foreign_costs yet.
+ */
+static void
+estimate_remote_path(PlannerInfo *root, RelOptInfo *baserel,
+					 List *remote_join_conds, List *local_join_conds,
+					 List *pathkeys, double *p_rows,
+					 Cost *p_startup_cost, Cost *p_total_cost)
+{
+	PgFdwRelationInfo *fpinfo = (PgFdwRelationInfo *) baserel->fdw_private;
+	StringInfoData sql;
+	List	   *retrieved_attrs;
+	double		rows;
+	int			width;
+	Cost		startup_cost;
+	Cost		total_cost;
+	Selectivity sel;
+	QualCost	qpqual_cost;
+
+	initStringInfo(&sql);
+	deparseSimpleSql(&sql, root, baserel, fpinfo->local_conds,
+					 fpinfo->binary_transfer, &retrieved_attrs);
+	if (fpinfo->remote_conds != NIL)
+		appendWhereClause(&sql, true, fpinfo->remote_conds,
+						  root, baserel, NULL, 0);
+	if (remote_join_conds != NIL)
+		appendWhereClause(&sql, fpinfo->remote_conds == NIL,
+						  remote_join_conds, root, baserel, NULL, 0);
+	if (pathkeys != NIL)
+		appendOrderByClause(&sql, root, baserel, pathkeys);
+
+	estimate_remote_scan(fpinfo, sql.data, &rows, &width,
+						 &startup_cost, &total_cost);
+
+	sel = clauselist_selectivity(root, fpinfo->param_conds,
+								 baserel->relid, JOIN_INNER, NULL);
+	sel *= clauselist_selectivity(root, fpinfo->local_conds,
+								  baserel->relid, JOIN_INNER, NULL);
+	sel *= clauselist_selectivity(root, local_join_conds,
+								  baserel->relid, JOIN_INNER, NULL);
+
+	cost_qual_eval(&qpqual_cost, fpinfo->param_conds, root);
+	startup_cost += qpqual_cost.startup;
+	total_cost += qpqual_cost.per_tuple * rows;
+	cost_qual_eval(&qpqual_cost, fpinfo->local_conds, root);
+	startup_cost += qpqual_cost.startup;
+	total_cost += qpqual_cost.per_tuple * rows;
+	cost_qual_eval(&qpqual_cost, local_join_conds, root);
+	startup_cost += qpqual_cost.startup;
+	total_cost += qpqual_cost.per_tuple * rows;
+
+	*p_rows = clamp_row_est(rows * sel);
+	*p_startup_cost = startup_cost;
+	*p_total_cost = total_cost;
+}
+
+/*
+ * Add required_outer to the list of candidate outer relation sets, unless
+ * it's already there.
+ */
+static List *
+add_outer_candidate(List *candidates, Relids required_outer)
+{
+	ListCell   *lc;
+
+	foreach(lc, candidates)
+	{
+		if (bms_equal((Relids) lfirst(lc), required_outer))
+			return candidates;
+	}
+
+	return lappend(candidates, required_outer);
+}
+
+/*----------
+ * Adjust the costs of a foreign path returning the given number of rows with
+ * factors of the corresponding foreign server:
+ *	 - add cost to establish connection to both startup and total
+ *	 - add cost to manipulate on remote, and transfer result to total
+ *	 - add cost to manipulate tuples on local side to total
+ *----------
+ */
+static void
+add_foreign_costs(PgFdwRelationInfo *fpinfo, double rows,
+				  Cost *startup_cost, Cost *total_cost)
+{
+	*startup_cost += fpinfo->fdw_startup_cost;
+	*total_cost += fpinfo->fdw_startup_cost;
+	*total_cost += fpinfo->fdw_tuple_cost * rows;
+	*total_cost += cpu_tuple_cost * rows;
+}
+
+/*
+ * Build the fdw_private list of a path returning the given number of rows,
+ * which will be available to the executor.  Items in the list must match
+ * enum FdwPrivateIndex, above.  param_path tells whether the path is
+ * parameterized by outer relations.  rows_needed and limit_pushed are as
+ * returned by get_rows_needed.
+ *
+ * The SQL stored here lacks the join clauses of a parameterized path;
+ * postgresGetForeignPlan adds them.
+ */
+static List *
+make_path_private(PgFdwRelationInfo *fpinfo, double rows, bool copy_mode,
+				  bool param_path, double rows_needed, bool limit_pushed)
+{
+	List	   *fdw_private;
+	bool		prepared;
+
+	/* Streaming with COPY isn't worth it if we need only a few rows */
+	if (rows_needed > 0 && rows_needed < fpinfo->copy_threshold)
+		copy_mode = false;
+
+	/* With a LIMIT in the remote query, that's all we'll get */
+	if (limit_pushed)
+		rows = Min(rows, rows_needed);
+
+	/*
+	 * Scans expected to return no more than a batch of rows are run as
+	 * prepared statements, with the whole result retrieved at once.  That
+	 * saves the round trips of DECLARE and CLOSE, and when the scan is
+	 * restarted with new parameter values, or the query is run again, the
+	 * remote server needn't parse and plan it anew.  Should the estimate
+	 * be too low, the executor reverts to a cursor (see create_cursor).
+	 */
+	prepared = (fpinfo->use_prepared && !copy_mode &&
+				rows <= fpinfo->fetch_size);
+
+	fdw_private = list_make4(makeString(fpinfo->sql.data),
+							 fpinfo->param_numbers,
+							 makeInteger(fpinfo->fetch_size),
+							 makeInteger(fpinfo->adaptive_fetch ?
+										 fpinfo->fetch_memory : 0));
+	fdw_private = lappend(fdw_private, makeInteger(fpinfo->prefetch));
+	fdw_private = lappend(fdw_private,
+						  makeInteger(fpinfo->binary_transfer));
+	fdw_private = lappend(fdw_private, makeInteger(copy_mode));
+	fdw_private = lappend(fdw_private, fpinfo->retrieved_attrs);
+	fdw_private = lappend(fdw_private, makeInteger(prepared));
+
+	/*
+	 * A parameterized scan is restarted for every outer row, likely with the
+	 * same outer values again and again.  Since a prepared statement gets us
+	 * all the rows at once, we can keep them to answer later scans with the
+	 * same values, without asking the remote server.
+	 */
+	fdw_private = lappend(fdw_private,
+						  makeInteger(prepared && param_path ?
+									  fpinfo->lookup_cache_memory : 0));
+
+	fdw_private = lappend(fdw_private,
+						  makeInteger(rows_needed <= INT_MAX ?
+									  (int) rows_needed : 0));
+
+	fdw_private = lappend(fdw_private, makeInteger(fpinfo->cache_ttl));
+
+	/*
+	 * A prepared statement's rows are all in memory anyway, and a
+	 * parameterized scan gets different rows each time, so spooling is only
+	 * worthwhile for other scans.  The path isn't charged for it: the
+	 * planner costs every rescan of a foreign scan as a complete new scan,
+	 * so we couldn't credit the rescans saved, and charging the spooling
+	 * alone would only count against the paths it speeds up, including the
+	 * many that are never rescanned.
+	 */
+	fdw_private = lappend(fdw_private,
+						  makeInteger(fpinfo->spool_rescans &&
+									  !prepared && !param_path));
+	fdw_private = lappend(fdw_private, makeInteger(fpinfo->calibrate_costs));
+
+	/*
+	 * postgresGetForeignPlan works out the columns needed by the local
+	 * conditions, and decides whether to split the scan
+	 */
+	fdw_private = lappend(fdw_private, NIL);
+	fdw_private = lappend(fdw_private, NIL);
+
+	return fdw_private;
+}
+
+/*
+ * Work out how many rows the query will need from a scan of baserel in the
+ * order of pathkeys, or return 0 if we can't tell.
+ *
+ * This is only known if the scan is all there is to the query, and nothing
+ * between it and the top needs all its rows; in particular, if the query's
+ * ORDER BY isn't satisfied by pathkeys, a Sort will read them all.  Then a
+ * LIMIT, including any OFFSET, tells how many rows are needed, and so may
+ * be sent to the remote server; *limit_pushed is set to true if so.  That
+ * can't be done if local conditions might filter out some of the rows, or a
+ * set-returning function in the target list might turn some into none; nor
+ * unless the LIMIT and OFFSET are constants, since otherwise the planner's
+ * figure is an estimate from the current value of a parameter, say, and the
+ * plan may be reused with another.  Then, as without a LIMIT, the planner's
+ * figure is just a hint for the FETCH size.
+ */
+static double
+get_rows_needed(PlannerInfo *root, RelOptInfo *baserel, List *pathkeys,
+				bool *limit_pushed)
+{
+	PgFdwRelationInfo *fpinfo = (PgFdwRelationInfo *) baserel->fdw_private;
+
+	*limit_pushed = false;
+
+	if (baserel->reloptkind != RELOPT_BASEREL ||
+		!bms_equal(root->all_baserels, baserel->relids) ||
+		!pathkeys_contained_in(root->query_pathkeys, pathkeys))
+		return 0;
+
+	if (root->limit_tuples >= 1.0)
+	{
+		*limit_pushed = (fpinfo->local_conds == NIL &&
+						 root->limit_tuples <= INT_MAX &&
+						 is_constant_limit(root->parse) &&
+						 !expression_returns_set((Node *) root->parse->targetList));
+		return root->limit_tuples;
+	}
+
+	/* tuple_fraction is an absolute count if >= 1 */
+	if (root->tuple_fraction >= 1.0)
+		return root->tuple_fraction;
+	if (root->tuple_fraction > 0.0)
+		return clamp_row_est(root->tuple_fraction * baserel->rows);
+
+	return 0;
+}
+
+/*
+ * Are the LIMIT of the query, and its OFFSET if any, non-null constants?
+ */
+static bool
+is_constant_limit(Query *parse)
+{
+	Node	   *count = parse->limitCount;
+	Node	   *offset = parse->limitOffset;
+
+	if (count == NULL || !IsA(count, Const) || ((Const *) count)->constisnull)
+		return false;
+	if (offset != NULL &&
+		(!IsA(offset, Const) || ((Const *) offset)->constisnull))
+		return false;
+
+	return true;
+}
+
+/*
+ * Return the attribute numbers of the columns of relid that local_exprs use,
+ * which must all be among retrieved_attrs, or NIL if they use all of those
+ * columns, or anything else, such as a whole-row reference or a system
+ * column.  Then there's nothing to gain from checking local_exprs before
+ * converting the other columns, or it can't be done.
+ */
+static List *
+get_filter_attrs(List *local_exprs, Index relid, List *retrieved_attrs)
+{
+	Bitmapset  *attrs_used = NULL;
+	List	   *filter_attrs = NIL;
+	ListCell   *lc;
+
+	pull_varattnos((Node *) local_exprs, relid, &attrs_used);
+
+	foreach(lc, retrieved_attrs)
+	{
+		int			attno = lfirst_int(lc) - FirstLowInvalidHeapAttributeNumber;
+
+		if (bms_is_member(attno, attrs_used))
+		{
+			filter_attrs = lappend_int(filter_attrs, lfirst_int(lc));
+			attrs_used = bms_del_member(attrs_used, attno);
+		}
+	}
+
+	if (!bms_is_empty(attrs_used) ||
+		list_length(filter_attrs) == list_length(retrieved_attrs))
+		return NIL;
+
+	return filter_attrs;
+}
+
+/*
+ * Return the number of the last Param slot used by PARAM_EXTERN Params,
+ * given their param IDs; the Params standing for outer relation values of a
+ * parameterized scan are numbered after it.
+ */
+static int
+get_param_offset(List *param_numbers)
+{
+	int			offset = 0;
+	ListCell   *lc;
+
+	foreach(lc, param_numbers)
+		offset = Max(offset, lfirst_int(lc));
+
+	return offset;
+}
+
+/*
+ * postgresGetForeignPlan
+ *		Create ForeignScan plan node which implements selected best path
+ */
+static ForeignScan *
+postgresGetForeignPlan(PlannerInfo *root,
+					   RelOptInfo *baserel,
+					   Oid foreigntableid,
+					   ForeignPath *best_path,
+					   List *tlist,
+					   List *scan_clauses)
+{
+	PgFdwRelationInfo *fpinfo = (PgFdwRelationInfo *) baserel->fdw_private;
+	Index		scan_relid = baserel->relid;
+	List	   *fdw_private = best_path->fdw_private;
+	List	   *remote_join_conds = NIL;
+	List	   *local_exprs = NIL;
+	List	   *params_list = NIL;
+	List	   *param_numbers;
+	bool		limit_pushed = false;
+	ListCell   *lc;
+
+	/*
+	 * Separate the scan_clauses into those that can be executed remotely and
+	 * those that can't.  Remote baserestrictinfo clauses were determined to
+	 * be safe by classifyConditions, and are already in the SQL.  In a
+	 * parameterized path, scan_clauses also contains the join clauses that
+	 * the path must enforce; the safe ones are sent to the remote server,
+	 * as postgresGetForeignPaths assumed.
+	 *
+	 * This code must match "extract_actual_clauses(scan_clauses, false)"
+	 * except for the additional decision about remote versus local execution.
+	 */
+	foreach(lc, scan_clauses)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+
+		Assert(IsA(rinfo, RestrictInfo));
+
+		/* Ignore any pseudoconstants, they're dealt with elsewhere */
+		if (rinfo->pseudoconstant)
+			continue;
+
+		/* Either simple or parameterized remote clauses are OK now */
+		if (list_member_ptr(fpinfo->remote_conds, rinfo) ||
+			list_member_ptr(fpinfo->param_conds, rinfo))
+			continue;
+		else if (best_path->path.param_info != NULL &&
+				 !list_member_ptr(baserel->baserestrictinfo, rinfo) &&
+				 is_foreign_expr(root, baserel, rinfo->clause,
+								 &param_numbers) &&
+				 param_numbers == NIL)
+			remote_join_conds = lappend(remote_join_conds, rinfo);
+		else
+			local_exprs = lappend(local_exprs, rinfo->clause);
+	}
+
+	/*
+	 * Add the remote join clauses to the SQL.  The outer relation's Vars in
+	 * them become Params numbered after the PARAM_EXTERN ones, and are
+	 * collected in params_list.  If the path is sorted, the remote server
+	 * has to do the sorting, so add ORDER BY too, and the query's LIMIT if
+	 * the rows come straight from us (see get_rows_needed).
+	 */
+	if (best_path->path.param_info == NULL)
+		(void) get_rows_needed(root, baserel, best_path->path.pathkeys,
+							   &limit_pushed);
+
+	if (remote_join_conds != NIL || best_path->path.pathkeys != NIL ||
+		limit_pushed)
+	{
+		StringInfoData sql;
+
+		initStringInfo(&sql);
+		appendStringInfoString(&sql, fpinfo->sql.data);
+		if (remote_join_conds != NIL)
+			appendWhereClause(&sql,
+							  fpinfo->remote_conds == NIL &&
+							  fpinfo->param_conds == NIL,
+							  remote_join_conds, root, baserel, &params_list,
+							  get_param_offset(fpinfo->param_numbers));
+		if (best_path->path.pathkeys != NIL)
+			appendOrderByClause(&sql, root, baserel,
+								best_path->path.pathkeys);
+		if (limit_pushed)
+			appendStringInfo(&sql, " LIMIT %.0f", root->limit_tuples);
+
+		Assert(FdwPrivateSelectSql == 0);
+		fdw_private = lcons(makeString(sql.data),
+							list_copy_tail(fdw_private, 1));
+	}
+
+	/*
+	 * If the local conditions need only some of the columns retrieved, the
+	 * executor can convert just those, check the conditions, and convert the
+	 * other columns only for the rows that pass.  That's not safe if the
+	 * conditions might have side effects, since they get checked for a whole
+	 * batch of rows at a time, nor is it useful with a LIMIT, where most of
+	 * the rows of the batch may not be needed at all.
+	 */
+	if (local_exprs != NIL &&
+		!contain_volatile_functions((Node *) local_exprs) &&
+		intVal(list_nth(fdw_private, FdwPrivateRowsNeeded)) == 0)
+	{
+		List	   *retrieved_attrs;
+		List	   *filter_attrs;
+
+		retrieved_attrs = (List *) list_nth(fdw_private,
+											FdwPrivateRetrievedAttrs);
+		filter_attrs = get_filter_attrs(local_exprs, scan_relid,
+										retrieved_attrs);
+		if (filter_attrs != NIL)
+		{
+			fdw_private = list_copy(fdw_private);
+			lfirst(list_nth_cell(fdw_private, FdwPrivateFilterAttrs)) =
+				filter_attrs;
+		}
+	}
+
+	/*
+	 * Split the scan into slices read over several connections at once, if
+	 * the table is configured for that.  The slices' rows come interleaved,
+	 * so the scan mustn't be sorted, nor limited to a number of rows; and a
+	 * parameterized scan, or one whose query has parameters, would pay for
+	 * setting up all the slices over and over, for little data each time.
+	 */
+	if (fpinfo->parallel_connections > 1 &&
+		fpinfo->partition_attnum != InvalidAttrNumber &&
+		best_path->path.param_info == NULL &&
+		best_path->path.pathkeys == NIL && !limit_pushed &&
+		fpinfo->param_numbers == NIL)
+	{
+		List	   *partition_sqls = NIL;
+		int64	   *bounds;
+		int			nbounds;
+		int			i;
+
+		bounds = (int64 *) palloc(fpinfo->parallel_connections *
+								  sizeof(int64));
+		nbounds = get_partition_bounds(root, baserel,
+									   fpinfo->parallel_connections, bounds);
+
+		for (i = 0; nbounds > 0 && i <= nbounds; i++)
+		{
+			StringInfoData sql;
+
+			initStringInfo(&sql);
+			appendStringInfoString(&sql, fpinfo->sql.data);
+			appendPartitionClause(&sql,
+								  fpinfo->remote_conds == NIL &&
+								  fpinfo->param_conds == NIL,
+								  root, baserel, fpinfo->partition_attnum,
+								  bounds, nbounds, i);
+			partition_sqls = lappend(partition_sqls, makeString(sql.data));
+		}
+
+		if (partition_sqls != NIL)
+		{
+			Assert(FdwPrivatePartitionSql == FdwPrivateNum - 1);
+			fdw_private = list_truncate(list_copy(fdw_private),
+										FdwPrivatePartitionSql);
+			fdw_private = lappend(fdw_private, partition_sqls);
+		}
+	}
+
+	/*
+	 * Create the ForeignScan node from target list, local filtering
+	 * expressions, the expressions to be sent as Params, and FDW private
+	 * information.
+	 *
+	 * Note that the params_list is stored in the fdw_exprs field of the
+	 * finished plan node; we can't keep it in private state because then
+	 * it wouldn't be subject to later planner processing, which replaces the
+	 * outer relation's Vars with executor Params.
+	 */
+	return make_foreignscan(tlist,
+							local_exprs,
+							scan_relid,
+							params_list,
+							fdw_private);
+}
+
+/*
+ * postgresExplainForeignScan
+ *		Produce extra output for EXPLAIN
+ */
+static void
+postgresExplainForeignScan(ForeignScanState *node, ExplainState *es)
+{
+	PgFdwExecutionState *festate = (PgFdwExecutionState *) node->fdw_state;
+	List	   *fdw_private;
+	List	   *partition_sqls;
+	char	   *sql;
+	int			lookup_cache_memory;
+	int			cache_ttl;
+
+	if (es->verbose)
+	{
+		fdw_private = ((ForeignScan *) node->ss.ps.plan)->fdw_private;
+		sql = strVal(list_nth(fdw_private, FdwPrivateSelectSql));
+		ExplainPropertyText("Remote SQL", sql, es);
+		partition_sqls = (List *) list_nth(fdw_private,
+										   FdwPrivatePartitionSql);
+		if (partition_sqls != NIL)
+			ExplainPropertyInteger("Remote Connections",
+								   list_length(partition_sqls), es);
+		else if (intVal(list_nth(fdw_private, FdwPrivateCopyMode)) &&
+				 !connection_is_shared(node->ss.ps.state,
+									   ((Scan *) node->ss.ps.plan)->scanrelid))
+			ExplainPropertyText("Remote Scan Mode", "COPY", es);
+		lookup_cache_memory = intVal(list_nth(fdw_private,
+											  FdwPrivateLookupCache));
+		if (lookup_cache_memory > 0)
+		{
+			char		buf[32];
+
+			snprintf(buf, sizeof(buf), "%dkB", lookup_cache_memory);
+			ExplainPropertyText("Lookup Cache Memory", buf, es);
+		}
+		cache_ttl = intVal(list_nth(fdw_private, FdwPrivateCacheTtl));
+		if (cache_ttl > 0)
+		{
+			char		buf[32];
+
+			snprintf(buf, sizeof(buf), "%ds", cache_ttl);
+			ExplainPropertyText("Result Cache TTL", buf, es);
+		}
+		if (intVal(list_nth(fdw_private, FdwPrivateSpoolRescans)))
+			ExplainPropertyText("Rescan Spool", "on", es);
+	}
+
+	/* In EXPLAIN ANALYZE, show whether the rows came from the cache */
+	if (es->analyze && festate != NULL && festate->cache_ttl > 0)
+		ExplainPropertyText("Result Cache",
+							festate->result_cache_hit ? "hit" : "miss", es);
+
+	/* In EXPLAIN ANALYZE, show how well the lookup cache worked */
+	if (es->analyze && festate != NULL && festate->lookup_cache != NULL)
+	{
+		ExplainPropertyLong("Lookup Cache Hits", festate->lookup_hits, es);
+		ExplainPropertyLong("Lookup Cache Misses", festate->lookup_misses, es);
+	}
+
+	/* In EXPLAIN ANALYZE, show how many rescans didn't go to the remote */
+	if (es->analyze && festate != NULL && festate->spool != NULL)
+		ExplainPropertyLong("Rescans From Spool", festate->spool_rescans, es);
+
+	if (es->analyze && festate != NULL)
+		explain_remote_io(festate, es);
+}
+
+/*
+ * Show the counters of the remote I/O of a scan in EXPLAIN ANALYZE: the
+ * number of results received (one per FETCH, mostly) and their rows, and
+ * with BUFFERS, the bytes of data received.  With TIMING, also the time it
+ * took to get the connections, to wait for the remote server and the
+ * network, and to convert the rows, in milliseconds.  The waiting time is
+ * what remains of the time spent starting the query and reading its rows
+ * once the conversion is taken out.
+ */
+static void
+explain_remote_io(PgFdwExecutionState *festate, ExplainState *es)
+{
+	double		connect_ms = INSTR_TIME_GET_MILLISEC(festate->connect_time);
+	double		convert_ms = INSTR_TIME_GET_MILLISEC(festate->convert_time);
+	double		wait_ms = remote_wait_ms(festate);
+
+	if (es->format == EXPLAIN_FORMAT_TEXT)
+	{
+		appendStringInfoSpaces(es->str, es->indent * 2);
+		appendStringInfo(es->str, "Remote I/O: fetches=%ld rows=%.0f",
+						 festate->remote_fetches, festate->remote_rows);
+		if (es->buffers)
+			appendStringInfo(es->str, " bytes=%.0f", festate->remote_bytes);
+		appendStringInfoChar(es->str, '\n');
+		if (es->timing && festate->track_timing)
+		{
+			appendStringInfoSpaces(es->str, es->indent * 2);
+			appendStringInfo(es->str,
+							 "Remote Timing: connect=%.3f wait=%.3f convert=%.3f\n",
+							 connect_ms, wait_ms, convert_ms);
+		}
+	}
+	else
+	{
+		ExplainPropertyLong("Remote Fetches", festate->remote_fetches, es);
+		ExplainPropertyFloat("Remote Rows", festate->remote_rows, 0, es);
+		if (es->buffers)
+			ExplainPropertyFloat("Remote Bytes", festate->remote_bytes, 0,
+								 es);
+		if (es->timing && festate->track_timing)
+		{
+			ExplainPropertyFloat("Remote Connect Time", connect_ms, 3, es);
+			ExplainPropertyFloat("Remote Wait Time", wait_ms, 3, es);
+			ExplainPropertyFloat("Remote Convert Time", convert_ms, 3, es);
+		}
+	}
+}
+
+/*
+ * postgresBeginForeignScan
+ *		Initiate an executor scan of a foreign PostgreSQL table.
+ */
+static void
+postgresBeginForeignScan(ForeignScanState *node, int eflags)
+{
+	ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
+	EState	   *estate = node->ss.ps.state;
+	PgFdwExecutionState *festate;
+	RangeTblEntry *rte;
+	Oid			userid;
+	ForeignTable *table;
+	ForeignServer *server;
+	UserMapping *user;
+	List	   *param_numbers;
+	List	   *partition_sqls;
+	List	   *filter_attrs;
+	int			numParams;
+	int			lookup_cache_memory;
+	instr_time	start;
+	int			i;
+
+	/*
+	 * Do nothing in EXPLAIN (no ANALYZE) case.  node->fdw_state stays NULL.
+	 */
+	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+		return;
+
+	/*
+	 * We'll save private state in node->fdw_state.
+	 */
+	festate = (PgFdwExecutionState *) palloc0(sizeof(PgFdwExecutionState));
+	node->fdw_state = (void *) festate;
+
+	/*
+	 * The times are only of interest to EXPLAIN ANALYZE.  The node's own
+	 * instrumentation isn't set up yet, but the flags tell what it will do.
+	 */
+	festate->track_timing = (estate->es_instrument & INSTRUMENT_TIMER) != 0;
+
+	/*
+	 * Counting the bytes takes a pass over each batch in cursor mode, so do
+	 * it only if EXPLAIN (ANALYZE, BUFFERS) or postgres_fdw_stats across
+	 * backends wants to know.  COPY mode, where the count costs nothing,
+	 * follows the same rule, so that whether bytes are shown doesn't depend
+	 * on the mode.
+	 */
+	festate->track_io = (estate->es_instrument & INSTRUMENT_BUFFERS) != 0 ||
+		pgfdw_stats_shared();
+
+	/* Calibrating the server's costs takes the same measurements */
+	festate->calibrate = intVal(list_nth(fsplan->fdw_private,
+										 FdwPrivateCalibrateCosts));
+	if (festate->calibrate)
+		festate->track_timing = true;
+
+	/*
+	 * Identify which user to do the remote access as.	This should match what
+	 * ExecCheckRTEPerms() does.
+	 */
+	rte = rt_fetch(fsplan->scan.scanrelid, estate->es_range_table);
+	userid = rte->checkAsUser ? rte->checkAsUser : GetUserId();
+
+	/* Get info about foreign table. */
+	festate->rel = node->ss.ss_currentRelation;
+	table = GetForeignTable(RelationGetRelid(festate->rel));
+	server = GetForeignServer(table->serverid);
+	user = GetUserMapping(userid, server->serverid);
+	festate->serverid = server->serverid;
+
+	/*
+	 * Let the connections needed by the other foreign scans of the query get
+	 * established while we wait for ours, which we take below, once we know
+	 * that the rows aren't in the result cache.
+	 */
+	start_timer(festate, &start);
+	start_query_connections(estate, RelationGetRelid(festate->rel),
+							GetForeignDataWrapper(server->fdwid)->fdwhandler);
+	stop_timer(festate, &start, &festate->connect_time);
+	festate->cursor_exists = false;
+
+	/* Get private info created by planner functions. */
+	festate->fdw_private = fsplan->fdw_private;
+	festate->fetch_size = intVal(list_nth(festate->fdw_private,
+										  FdwPrivateFetchSize));
+	festate->rows_needed = intVal(list_nth(festate->fdw_private,
+										   FdwPrivateRowsNeeded));
+	festate->fetch_memory = (Size) intVal(list_nth(festate->fdw_private,
+												   FdwPrivateFetchMemory)) * 1024L;
+	festate->prefetch = intVal(list_nth(festate->fdw_private,
+										FdwPrivatePrefetch)) != 0;
+
+	/*
+	 * Use COPY if the planner said so, unless we know the scan will be
+	 * rewound; restarting the COPY each time would be a loser.  Nor if
+	 * another scan of the query shares our connection: whenever it sends a
+	 * command, it would have to read all the rest of the COPY into memory.
+	 */
+	festate->copy_mode = intVal(list_nth(festate->fdw_private,
+										 FdwPrivateCopyMode)) != 0 &&
+		!(eflags & (EXEC_FLAG_REWIND | EXEC_FLAG_BACKWARD | EXEC_FLAG_MARK)) &&
+		!connection_is_shared(estate, fsplan->scan.scanrelid);
+	festate->prepared = intVal(list_nth(festate->fdw_private,
+										FdwPrivatePrepared)) != 0;
+
+	/*
+	 * Create contexts for batches of tuples.  Besides the decoded tuples,
+	 * these hold whatever the datatype I/O functions leak while decoding
+	 * them, so there's no need for a per-tuple workspace.
+	 */
+	festate->batch_cxt = AllocSetContextCreate(estate->es_query_cxt,
+											   "postgres_fdw tuple data",
+											   ALLOCSET_DEFAULT_MINSIZE,
+											   ALLOCSET_DEFAULT_INITSIZE,
+											   ALLOCSET_DEFAULT_MAXSIZE);
+	festate->next_batch_cxt = AllocSetContextCreate(estate->es_query_cxt,
+													"postgres_fdw tuple data",
+													ALLOCSET_DEFAULT_MINSIZE,
+													ALLOCSET_DEFAULT_INITSIZE,
+													ALLOCSET_DEFAULT_MAXSIZE);
+
+	/* Get info we'll need for data conversion. */
+	festate->attinmeta = TupleDescGetAttInMetadata(RelationGetDescr(festate->rel));
+
+	festate->decoders =
+		make_decoder_plan(RelationGetDescr(festate->rel),
+						  (List *) list_nth(festate->fdw_private,
+											FdwPrivateRetrievedAttrs));
+
+	/*
+	 * Prepare for evaluation of the outer relation values sent as Params in
+	 * a parameterized scan.
+	 */
+	festate->param_exprs = (List *)
+		ExecInitExpr((Expr *) fsplan->fdw_exprs, (PlanState *) node);
+
+	/*
+	 * Allocate buffer for query parameters, if the remote conditions use any.
+	 *
+	 * We use a parameter slot for each PARAM_EXTERN parameter, even though
+	 * not all of them may get sent to the remote server.  This allows us to
+	 * refer to Params by their original number rather than remapping, and it
+	 * doesn't cost much.  Slots that are not actually used get filled with
+	 * null values that are arbitrarily marked as being of type int4.  The
+	 * outer relation values follow in the slots after the last PARAM_EXTERN
+	 * one used.
+	 */
+	param_numbers = (List *)
+		list_nth(festate->fdw_private, FdwPrivateExternParamIds);
+	if (param_numbers != NIL)
+	{
+		ParamListInfo params = estate->es_param_list_info;
+
+		numParams = params ? params->numParams : 0;
+	}
+	else
+		numParams = 0;
+	festate->param_offset = get_param_offset(param_numbers);
+	numParams = Max(numParams,
+					festate->param_offset + list_length(festate->param_exprs));
+	festate->numParams = numParams;
+	if (numParams > 0)
+	{
+		/* we initially fill all slots with value = NULL, type = int4 */
+		festate->param_types = (Oid *) palloc(numParams * sizeof(Oid));
+		festate->param_values = (const char **) palloc0(numParams * sizeof(char *));
+		festate->param_lengths = (int *) palloc0(numParams * sizeof(int));
+		festate->param_formats = (int *) palloc0(numParams * sizeof(int));
+		for (i = 0; i < numParams; i++)
+			festate->param_types[i] = INT4OID;
+	}
+	else
+	{
+		festate->param_types = NULL;
+		festate->param_values = NULL;
+		festate->param_lengths = NULL;
+		festate->param_formats = NULL;
+	}
+	festate->extparams_done = false;
+
+	/*
+	 * Set up the lookup cache, if the planner asked for one.  It's useful
+	 * only for a prepared statement with outer relation parameters.
+	 */
+	lookup_cache_memory = intVal(list_nth(festate->fdw_private,
+										  FdwPrivateLookupCache));
+	if (lookup_cache_memory > 0 && festate->prepared &&
+		festate->param_exprs != NIL)
+	{
+		HASHCTL		ctl;
+
+		festate->lookup_cxt = AllocSetContextCreate(estate->es_query_cxt,
+													"postgres_fdw lookup cache",
+													ALLOCSET_DEFAULT_MINSIZE,
+													ALLOCSET_DEFAULT_INITSIZE,
+													ALLOCSET_DEFAULT_MAXSIZE);
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(PgFdwLookupKey);
+		ctl.entrysize = sizeof(PgFdwLookupEntry);
+		ctl.hash = lookup_key_hash;
+		ctl.match = lookup_key_match;
+		ctl.hcxt = festate->lookup_cxt;
+		festate->lookup_cache = hash_create("postgres_fdw lookup cache", 256,
+											&ctl,
+											HASH_ELEM | HASH_FUNCTION |
+											HASH_COMPARE | HASH_CONTEXT);
+		festate->lookup_cache_limit = (Size) lookup_cache_memory * 1024L;
+	}
+
+	/*
+	 * If the scan's result is to be cached, and we have it already, there's
+	 * no need to contact the remote server at all, nor to have a connection
+	 * to it.  Otherwise, prepare to collect the rows as they come.  Scans with parameters aren't cached;
+	 * their results can differ from one execution to the next.
+	 */
+	festate->cache_ttl = intVal(list_nth(festate->fdw_private,
+										 FdwPrivateCacheTtl));
+	if (numParams > 0)
+		festate->cache_ttl = 0;
+	if (festate->cache_ttl > 0)
+	{
+		festate->result_key.relid = RelationGetRelid(festate->rel);
+		festate->result_key.serverid = server->serverid;
+		festate->result_key.userid = user->userid;
+		festate->result_key.sql = strVal(list_nth(festate->fdw_private,
+												  FdwPrivateSelectSql));
+		if (result_cached_rows(festate))
+			return;
+		festate->result_cxt = AllocSetContextCreate(estate->es_query_cxt,
+													"postgres_fdw result cache",
+													ALLOCSET_DEFAULT_MINSIZE,
+													ALLOCSET_DEFAULT_INITSIZE,
+													ALLOCSET_DEFAULT_MAXSIZE);
+	}
+
+	/*
+	 * Get connection to the foreign server.  Connection manager will
+	 * establish new connection if necessary.  The remote transaction is
+	 * started along with our first command, in create_cursor.
+	 */
+	start_timer(festate, &start);
+	festate->conn = GetConnection(server, user, true, &festate->conn_state);
+	stop_timer(festate, &start, &festate->connect_time);
+
+	/* Assign a unique ID for my cursor */
+	festate->cursor_number = GetCursorNumber(festate->conn);
+
+	/*
+	 * Use binary transfer if the planner built the query for it, and the
+	 * remote server's binary formats are sure to match ours.  Otherwise the
+	 * same query works in text mode too; the columns cast to text just get
+	 * converted like all the others.
+	 */
+	if (intVal(list_nth(festate->fdw_private, FdwPrivateBinaryTransfer)) &&
+		binary_transfer_possible(festate->conn))
+		festate->recvmeta = make_recv_metadata(RelationGetDescr(festate->rel));
+	else
+		festate->recvmeta = NULL;
+
+	/*
+	 * Keep the rows we fetch in a tuplestore if the planner said so and we
+	 * know the scan will be rewound, so that rescans can return them without
+	 * going back to the remote server.  The spool is limited to work_mem,
+	 * like a Material node's; beyond that, it goes to a temporary file.
+	 * When parameters change between rescans, it has to be emptied, so it's
+	 * of no use for a parameterized scan.
+	 */
+	if (intVal(list_nth(festate->fdw_private, FdwPrivateSpoolRescans)) &&
+		(eflags & EXEC_FLAG_REWIND) && festate->param_exprs == NIL)
+	{
+		festate->spool = tuplestore_begin_heap(false, false, work_mem);
+		tuplestore_set_eflags(festate->spool, EXEC_FLAG_REWIND);
+	}
+
+	/*
+	 * Take over checking the local conditions if the planner found that they
+	 * need only some of the columns, so that the others needn't be converted
+	 * for rows that fail (see store_result_batch).  Rows kept in the caches
+	 * must not be filtered, since another query, or another scan with other
+	 * outer values in the conditions, may get them; and COPY rows are
+	 * converted all at once.
+	 */
+	filter_attrs = (List *) list_nth(festate->fdw_private,
+									 FdwPrivateFilterAttrs);
+	if (filter_attrs != NIL && node->ss.ps.qual != NIL &&
+		!festate->copy_mode && festate->cache_ttl == 0 &&
+		festate->lookup_cache == NULL)
+	{
+		TupleDesc	tupdesc = RelationGetDescr(festate->rel);
+		ListCell   *lc;
+
+		festate->filter_quals = node->ss.ps.qual;
+		node->ss.ps.qual = NIL;
+
+		festate->filter_cols = (bool *) palloc0(tupdesc->natts * sizeof(bool));
+		festate->other_cols = (bool *) palloc(tupdesc->natts * sizeof(bool));
+		foreach(lc, filter_attrs)
+			festate->filter_cols[lfirst_int(lc) - 1] = true;
+		for (i = 0; i < tupdesc->natts; i++)
+			festate->other_cols[i] = !festate->filter_cols[i];
+	}
+
+	/*
+	 * Split the scan over several connections if the planner said so, unless
+	 * we know the scan will be rewound; setting up all the slices again each
+	 * time would be a loser.
+	 */
+	partition_sqls = (List *) list_nth(festate->fdw_private,
+									   FdwPrivatePartitionSql);
+	if (partition_sqls != NIL && numParams == 0 &&
+		!(eflags & (EXEC_FLAG_REWIND | EXEC_FLAG_BACKWARD | EXEC_FLAG_MARK)))
+	{
+		start_timer(festate, &start);
+		setup_parallel_scan(festate, server, user, partition_sqls);
+		stop_timer(festate, &start, &festate->connect_time);
+	}
+
+	/*
+	 * If the query can be sent without waiting for anything, send it right
+	 * away, so that the remote servers of all the foreign scans in the plan
+	 * get to work at the same time rather than one after another; the first
+	 * IterateForeignScan call collects the rows.  A COPY or a prepared
+	 * statement takes a round trip to start, and a query with parameters
+	 * can't be sent that way (see create_cursor), so those still start on
+	 * the first IterateForeignScan call, as do scans whose connection is busy
+	 * with another scan's request.
+	 */
+	if (festate->nstreams > 0 ||
+		(festate->numParams == 0 && !festate->copy_mode &&
+		 !festate->prepared && festate->conn_state->pending_cursor == 0))
+	{
+		start_timer(festate, &start);
+		create_cursor(node);
+		stop_timer(festate, &start, &festate->remote_time);
+	}
+}
+
+/*
+ * postgresIterateForeignScan
+ *		Retrieve next row from the result set, or clear tuple slot to indicate
+ *		EOF.
+ */
+static TupleTableSlot *
+postgresIterateForeignScan(ForeignScanState *node)
+{
+	PgFdwExecutionState *festate = (PgFdwExecutionState *) node->fdw_state;
+	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+	int			natts = slot->tts_tupleDescriptor->natts;
+	instr_time	start;
+
+	/*
+	 * After a rescan, return the spooled rows first.  Once they are used
+	 * up, carry on fetching from where we left off, unless we had the whole
+	 * result already.
+	 */
+	if (festate->spool != NULL)
+	{
+		if (tuplestore_gettupleslot(festate->spool, true, false, slot))
+			return slot;
+		if (festate->spool_complete)
+			return ExecClearTuple(slot);
+	}
+
+	/*
+	 * If this is the first call after ReScan, or after a Begin that couldn't
+	 * send the query yet, we need to create the cursor on the remote side.
+	 */
+	if (!festate->cursor_exists)
+	{
+		start_timer(festate, &start);
+		create_cursor(node);
+		stop_timer(festate, &start, &festate->remote_time);
+	}
+
+	/*
+	 * Get some more tuples, if we've run out.
+	 */
+	if (festate->next_tuple >= festate->num_tuples)
+	{
+		/*
+		 * Use the next batch if we have it already.  Otherwise fetch it, but
+		 * there's no point in another fetch if we already detected EOF.  A
+		 * batch may come out empty if we check the local conditions, so go
+		 * on until we have some tuples or run out of batches.
+		 */
+		while (festate->next_tuple >= festate->num_tuples)
+		{
+			if (!festate->next_batch_ready && !festate->eof_reached)
+			{
+				start_timer(festate, &start);
+				if (festate->copy_mode)
+					fetch_more_copy_data(node);
+				else if (festate->nstreams > 0)
+					fetch_parallel_data(node);
+				else
+					fetch_more_data(node);
+				stop_timer(festate, &start, &festate->remote_time);
+				note_first_batch(festate);
+			}
+			/* If there's no batch to be had, must be end of data. */
+			if (!festate->next_batch_ready)
+			{
+				/* Now we have the complete result, if it's to be cached */
+				if (festate->result_cxt != NULL && festate->eof_reached)
+					store_result_cache(festate);
+				if (festate->spool != NULL && festate->eof_reached)
+					festate->spool_complete = true;
+				return ExecClearTuple(slot);
+			}
+			activate_next_batch(festate);
+		}
+	}
+	else if (festate->fetch_in_flight && !festate->next_batch_ready &&
+			 festate->next_tuple % PREFETCH_POLL_INTERVAL == 0 &&
+			 pgfdw_pending_ready(festate->conn, festate->conn_state))
+	{
+		/*
+		 * The prefetched batch has arrived in full.  Collect it now, so that
+		 * the request for the batch after it can go out right away.
+		 */
+		start_timer(festate, &start);
+		fetch_more_data(node);
+		stop_timer(festate, &start, &festate->remote_time);
+		note_first_batch(festate);
+	}
+
+	/*
+	 * Return the next tuple, as a virtual tuple pointing into the batch; the
+	 * executor forms a physical tuple only if it needs one.
+	 */
+	ExecClearTuple(slot);
+	memcpy(slot->tts_values,
+		   festate->tuple_values + festate->next_tuple * natts,
+		   natts * sizeof(Datum));
+	memcpy(slot->tts_isnull,
+		   festate->tuple_nulls + festate->next_tuple * natts,
+		   natts * sizeof(bool));
+	festate->next_tuple++;
+	ExecStoreVirtualTuple(slot);
+
+	if (festate->spool != NULL)
+		tuplestore_puttupleslot(festate->spool, slot);
+
+	return slot;
+}
+
+/*
+ * postgresReScanForeignScan
+ *		Restart the scan.
+ */
+static void
+postgresReScanForeignScan(ForeignScanState *node)
+{
+	PgFdwExecutionState *festate = (PgFdwExecutionState *) node->fdw_state;
+	char		sql[64];
+	PGresult   *res;
+	instr_time	start;
+
+	/* What we've measured so far is done with; see calibrate_scan */
+	calibrate_scan(festate);
+
+	/*
+	 * Note: we assume that PARAM_EXTERN params don't change over the life of
+	 * the query, so no need to reset extparams_done.
+	 */
+
+	/* If we haven't created the cursor yet, nothing to do. */
+	if (!festate->cursor_exists)
+		return;
+
+	/*
+	 * If we've been spooling the rows, the ones fetched so far are returned
+	 * from the spool, and the cursor is left where it is for the rest.  If
+	 * parameters have changed, the spooled rows are no good, so the scan
+	 * gets restarted as usual.
+	 */
+	if (festate->spool != NULL)
+	{
+		if (node->ss.ps.chgParam == NULL)
+		{
+			tuplestore_rescan(festate->spool);
+			festate->spool_rescans++;
+			return;
+		}
+		tuplestore_clear(festate->spool);
+		festate->spool_complete = false;
+	}
+
+	/* Rows from the result cache are simply returned again */
+	if (festate->result_cache_hit)
+	{
+		festate->next_tuple = 0;
+		return;
+	}
+
+	/*
+	 * An incomplete result can't be cached anymore, since the rows might
+	 * be fetched again.
+	 */
+	if (festate->result_cxt != NULL)
+	{
+		MemoryContextDelete(festate->result_cxt);
+		festate->result_cxt = NULL;
+	}
+
+	/*
+	 * The slices of a split scan have to be started over; we're not expecting
+	 * to be rescanned much anyway (see postgresBeginForeignScan).
+	 */
+	if (festate->nstreams > 0)
+	{
+		close_parallel_cursors(festate);
+		festate->cursor_exists = false;
+		return;
+	}
+
+	/*
+	 * A COPY can't be rewound.  If we have all of its rows in memory, just
+	 * rescan them; otherwise we have to abandon it and start over.
+	 */
+	if (festate->copy_mode)
+	{
+		if (festate->fetch_ct_2 <= 1 && festate->eof_reached)
+		{
+			festate->next_tuple = 0;
+			return;
+		}
+
+		pgfdw_cancel_copy(festate->conn, festate->conn_state,
+						  festate->cursor_number);
+		festate->cursor_exists = false;
+		return;
+	}
+
+	/*
+	 * A prepared statement returns all its rows at once, so we have them in
+	 * memory; just rescan them, unless the parameters have changed, in which
+	 * case the statement must be run again.
+	 */
+	if (festate->prepared)
+	{
+		if (node->ss.ps.chgParam != NULL)
+			festate->cursor_exists = false;
+		else
+			festate->next_tuple = 0;
+		return;
+	}
+
+	/*
+	 * If the first batch is still on its way (see create_cursor), collect
+	 * it, since we may be able to rescan it.  Beyond that, whatever we have
+	 * prefetched is of no use anymore.
+	 */
+	if (festate->fetch_in_flight && festate->fetch_ct_2 == 1 &&
+		node->ss.ps.chgParam == NULL)
+	{
+		start_timer(festate, &start);
+		fetch_more_data(node);
+		stop_timer(festate, &start, &festate->remote_time);
+		activate_next_batch(festate);
+	}
+	discard_prefetched_data(festate);
+
+	/*
+	 * If any internal parameters affecting this node have changed, we'd
+	 * better destroy and recreate the cursor.	Otherwise, rewinding it should
+	 * be good enough.	If we've only fetched zero or one batch, we needn't
+	 * even rewind the cursor, just rescan what we have.
+	 */
+	if (node->ss.ps.chgParam != NULL)
+	{
+		festate->cursor_exists = false;
+		snprintf(sql, sizeof(sql), "CLOSE c%u",
+				 festate->cursor_number);
+	}
+	else if (festate->fetch_ct_2 > 1)
+	{
+		snprintf(sql, sizeof(sql), "MOVE BACKWARD ALL IN c%u",
+				 festate->cursor_number);
+	}
+	else
+	{
+		/* Easy: just rescan what we already have in memory, if anything */
+		festate->next_tuple = 0;
+		return;
+	}
+
+	/*
+	 * We don't use a PG_TRY block here, so be careful not to throw error
+	 * without releasing the PGresult.
+	 */
+	pgfdw_absorb_pending(festate->conn, festate->conn_state);
+	festate->conn_state->stats->round_trips++;
+	res = PQexec(festate->conn, sql);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		pgfdw_report_error(ERROR, res, festate->conn, true, sql);
+	PQclear(res);
+
+	/* Now force a fresh FETCH. */
+	festate->tuple_values = NULL;
+	festate->tuple_nulls = NULL;
+	festate->num_tuples = 0;
+	festate->next_tuple = 0;
+	festate->fetch_ct_2 = 0;
+	festate->eof_reached = false;
+}
+
+/*
+ * postgresEndForeignScan
+ *		Finish scanning foreign table and dispose objects used for this scan
+ */
+static void
+postgresEndForeignScan(ForeignScanState *node)
+{
+	PgFdwExecutionState *festate = (PgFdwExecutionState *) node->fdw_state;
+	instr_time	start;
+	instr_time	elapsed;
+
+	/* if festate is NULL, we are in EXPLAIN; nothing to do */
+	if (festate == NULL)
+		return;
+
+	calibrate_scan(festate);
+
+	/* Close the cursor if open, to prevent accumulation of cursors */
+	if (festate->result_cache_hit)
+		;						/* no cursor was needed */
+	else if (festate->cursor_exists && festate->nstreams > 0)
+		close_parallel_cursors(festate);
+	else if (festate->cursor_exists && festate->copy_mode)
+		pgfdw_cancel_copy(festate->conn, festate->conn_state,
+						  festate->cursor_number);
+	else if (festate->cursor_exists && !festate->prepared)
+	{
+		discard_prefetched_data(festate);
+		INSTR_TIME_SET_ZERO(start);
+		if (festate->calibrate)
+		{
+			/*
+			 * The CLOSE is as cheap a command as any, so its round trip is
+			 * what connection latency costs a query.  Other scans' requests
+			 * on the connection are waited for first, so as not to count.
+			 */
+			pgfdw_absorb_pending(festate->conn, festate->conn_state);
+			INSTR_TIME_SET_CURRENT(start);
+		}
+		close_cursor(festate->conn, festate->conn_state,
+					 festate->cursor_number);
+		if (festate->calibrate)
+		{
+			INSTR_TIME_SET_CURRENT(elapsed);
+			INSTR_TIME_SUBTRACT(elapsed, start);
+			calibrate_latency(festate, INSTR_TIME_GET_MILLISEC(elapsed));
+		}
+	}
+
+	/* Release remote connection */
+	ReleaseConnection(festate->conn);
+	festate->conn = NULL;
+
+	/* The spool may have a temporary file to get rid of */
+	if (festate->spool != NULL)
+		tuplestore_end(festate->spool);
+
+	/* MemoryContexts will be deleted automatically. */
+}
+
+/*
+ * Extract the options of the foreign server that affect planning and scan
+ * execution, and store them into fpinfo.
+ */
+static void
+apply_server_options(PgFdwRelationInfo *fpinfo)
+{
+	ListCell   *lc;
+
+	foreach(lc, fpinfo->server->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "use_remote_estimate") == 0)
+			fpinfo->use_remote_estimate = defGetBoolean(def);
+		else if (strcmp(def->defname, "fdw_startup_cost") == 0)
+			fpinfo->fdw_startup_cost = strtod(defGetString(def), NULL);
+		else if (strcmp(def->defname, "fdw_tuple_cost") == 0)
+			fpinfo->fdw_tuple_cost = strtod(defGetString(def), NULL);
+		else if (strcmp(def->defname, "calibrate_costs") == 0)
+			fpinfo->calibrate_costs = defGetBoolean(def);
+		else if (strcmp(def->defname, "fetch_size") == 0)
+			fpinfo->fetch_size = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "adaptive_fetch") == 0)
+			fpinfo->adaptive_fetch = defGetBoolean(def);
+		else if (strcmp(def->defname, "fetch_memory") == 0)
+			fpinfo->fetch_memory = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "prefetch") == 0)
+			fpinfo->prefetch = defGetBoolean(def);
+		else if (strcmp(def->defname, "binary_transfer") == 0)
+			fpinfo->binary_transfer = defGetBoolean(def);
+		else if (strcmp(def->defname, "copy_threshold") == 0)
+			fpinfo->copy_threshold = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "use_prepared_statements") == 0)
+			fpinfo->use_prepared = defGetBoolean(def);
+		else if (strcmp(def->defname, "lookup_cache_memory") == 0)
+			fpinfo->lookup_cache_memory = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "estimate_cache_ttl") == 0)
+			fpinfo->estimate_cache_ttl = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "spool_rescans") == 0)
+			fpinfo->spool_rescans = defGetBoolean(def);
+		else if (strcmp(def->defname, "parallel_connections") == 0)
+			fpinfo->parallel_connections = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "extensions") == 0)
+			fpinfo->shippable_extensions =
+				ExtractExtensionList(defGetString(def), false);
+	}
+}
+
+/*
+ * Same as apply_server_options, but for the options of the foreign table.
+ * This must be called after apply_server_options, since table settings
+ * override server settings.
+ */
+static void
+apply_table_options(PgFdwRelationInfo *fpinfo)
+{
+	ListCell   *lc;
+
+	foreach(lc, fpinfo->table->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "use_remote_estimate") == 0)
+			fpinfo->use_remote_estimate = defGetBoolean(def);
+		else if (strcmp(def->defname, "fetch_size") == 0)
+			fpinfo->fetch_size = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "adaptive_fetch") == 0)
+			fpinfo->adaptive_fetch = defGetBoolean(def);
+		else if (strcmp(def->defname, "fetch_memory") == 0)
+			fpinfo->fetch_memory = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "prefetch") == 0)
+			fpinfo->prefetch = defGetBoolean(def);
+		else if (strcmp(def->defname, "binary_transfer") == 0)
+			fpinfo->binary_transfer = defGetBoolean(def);
+		else if (strcmp(def->defname, "copy_threshold") == 0)
+			fpinfo->copy_threshold = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "use_prepared_statements") == 0)
+			fpinfo->use_prepared = defGetBoolean(def);
+		else if (strcmp(def->defname, "lookup_cache_memory") == 0)
+			fpinfo->lookup_cache_memory = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "estimate_cache_ttl") == 0)
+			fpinfo->estimate_cache_ttl = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "cache_ttl") == 0)
+			fpinfo->cache_ttl = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "spool_rescans") == 0)
+			fpinfo->spool_rescans = defGetBoolean(def);
+		else if (strcmp(def->defname, "parallel_connections") == 0)
+			fpinfo->parallel_connections = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "partition_column") == 0)
+			fpinfo->partition_attnum =
+				get_partition_attnum(fpinfo->table->relid,
+									 defGetString(def));
+	}
+}
+
+/*
+ * Look up the column named by a foreign table's partition_column option,
+ * which must be of an integer type.
+ */
+static AttrNumber
+get_partition_attnum(Oid relid, const char *colname)
+{
+	AttrNumber	attnum = get_attnum(relid, colname);
+	Oid			typid;
+
+	if (attnum <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("partition_column \"%s\" of foreign table \"%s\" does not exist",
+						colname, get_rel_name(relid))));
+
+	typid = get_atttype(relid, attnum);
+	if (typid != INT2OID && typid != INT4OID && typid != INT8OID)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+				 errmsg("partition_column \"%s\" of foreign table \"%s\" must be of an integer type",
+						colname, get_rel_name(relid))));
+
+	return attnum;
+}
+
+/*
+ * Choose the values at which to split the partition_column of baserel into
+ * nparts ranges holding about as many rows each, for a scan split over
+ * several connections, and store them in bounds in increasing order.
+ * Returns how many there are, which can be fewer than nparts - 1 if the
+ * column has few distinct values, or 0 if the table looks empty.
+ *
+ * If the foreign table has been analyzed, the values are taken from the
+ * histogram of the column.  Otherwise, the range between the smallest and
+ * largest remote values is split evenly; getting those is cheap only if the
+ * column is indexed on the remote side, but then so is scanning the slices.
+ */
+static int
+get_partition_bounds(PlannerInfo *root, RelOptInfo *baserel, int nparts,
+					 int64 *bounds)
+{
+	PgFdwRelationInfo *fpinfo = (PgFdwRelationInfo *) baserel->fdw_private;
+	RangeTblEntry *rte = planner_rt_fetch(baserel->relid, root);
+	AttrNumber	attnum = fpinfo->partition_attnum;
+	Oid			typid = get_atttype(rte->relid, attnum);
+	HeapTuple	statstuple;
+	int			nbounds = 0;
+	int			i;
+
+	statstuple = SearchSysCache3(STATRELATTINH,
+								 ObjectIdGetDatum(rte->relid),
+								 Int16GetDatum(attnum),
+								 BoolGetDatum(false));
+	if (HeapTupleIsValid(statstuple))
+	{
+		Datum	   *values;
+		int			nvalues;
+
+		if (get_attstatsslot(statstuple, typid, -1,
+							 STATISTIC_KIND_HISTOGRAM, InvalidOid,
+							 NULL,
+							 &values, &nvalues,
+							 NULL, NULL) &&
+			nvalues >= 2)
+		{
+			for (i = 1; i < nparts; i++)
+			{
+				Datum		value = values[i * (nvalues - 1) / nparts];
+				int64		bound;
+
+				if (typid == INT2OID)
+					bound = DatumGetInt16(value);
+				else if (typid == INT4OID)
+					bound = DatumGetInt32(value);
+				else
+					bound = DatumGetInt64(value);
+				if (nbounds == 0 || bound > bounds[nbounds - 1])
+					bounds[nbounds++] = bound;
+			}
+			free_attstatsslot(typid, values, nvalues, NULL, 0);
+			ReleaseSysCache(statstuple);
+			return nbounds;
+		}
+		ReleaseSysCache(statstuple);
+	}
+
+	/* No histogram; ask the remote server for the range of the column */
+	{
+		Oid			userid;
+		UserMapping *user;
+		PGconn	   *conn;
+		PGresult   *volatile res = NULL;
+
+		/* Use the same user as the scan; see postgresGetForeignRelSize */
+		userid = rte->checkAsUser ? rte->checkAsUser : GetUserId();
+		user = GetUserMapping(userid, fpinfo->server->serverid);
+		conn = GetConnection(fpinfo->server, user, false, NULL);
+
+		/* PGresult must be released before leaving this function. */
+		PG_TRY();
+		{
+			StringInfoData sql;
+
+			initStringInfo(&sql);
+			deparsePartitionBoundsSql(&sql, root, baserel, attnum);
+			GetConnectionStats(conn)->round_trips++;
+			res = PQexec(conn, sql.data);
+			if (PQresultStatus(res) != PGRES_TUPLES_OK)
+				pgfdw_report_error(ERROR, res, conn, false, sql.data);
+
+			if (PQntuples(res) == 1 &&
+				!PQgetisnull(res, 0, 0) && !PQgetisnull(res, 0, 1))
+			{
+				int64		lo;
+				int64		hi;
+				uint64		step;
+
+				(void) scanint8(PQgetvalue(res, 0, 0), false, &lo);
+				(void) scanint8(PQgetvalue(res, 0, 1), false, &hi);
+
+				/* Unsigned, since hi - lo can overflow int64 */
+				step = ((uint64) hi - (uint64) lo) / nparts;
+				for (i = 1; step > 0 && i < nparts; i++)
+					bounds[nbounds++] = (int64) ((uint64) lo + step * i);
+			}
+
+			PQclear(res);
+			res = NULL;
+		}
+		PG_CATCH();
+		{
+			if (res)
+				PQclear(res);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		ReleaseConnection(conn);
+	}
+
+	return nbounds;
+}
+
+/*
+ * Get the remote server's estimates for the given SQL statement, using the
+ * estimate cache if the foreign table or server has estimate_cache_ttl set.
+ * fpinfo->user must be set.
+ */
+static void
+estimate_remote_scan(PgFdwRelationInfo *fpinfo, const char *sql,
+					 double *rows, int *width,
+					 Cost *startup_cost, Cost *total_cost)
+{
+	EstimateCacheKey key;
+	EstimateCacheEntry *entry;
+	PGconn	   *conn;
+	bool		found;
+
+	key.serverid = fpinfo->server->serverid;
+	key.userid = fpinfo->user->userid;
+	key.sql = (char *) sql;
+
+	if (fpinfo->estimate_cache_ttl > 0 && EstimateCache != NULL)
+	{
+		entry = (EstimateCacheEntry *) hash_search(EstimateCache, &key,
+												   HASH_FIND, NULL);
+		if (entry != NULL &&
+			!TimestampDifferenceExceeds(entry->created,
+										GetCurrentTimestamp(),
+										fpinfo->estimate_cache_ttl * 1000))
+		{
+			*rows = entry->rows;
+			*width = entry->width;
+			*startup_cost = entry->startup_cost;
+			*total_cost = entry->total_cost;
+			return;
+		}
+	}
+
+	conn = GetConnection(fpinfo->server, fpinfo->user, false, NULL);
+	get_remote_estimate(sql, conn, rows, width, startup_cost, total_cost);
+	ReleaseConnection(conn);
+
+	if (fpinfo->estimate_cache_ttl <= 0)
+		return;
+
+	/* First time through, initialize the cache */
+	if (EstimateCache == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(EstimateCacheKey);
+		ctl.entrysize = sizeof(EstimateCacheEntry);
+		ctl.hash = estimate_key_hash;
+		ctl.match = estimate_key_match;
+		ctl.hcxt = CacheMemoryContext;
+		EstimateCache = hash_create("postgres_fdw remote estimates", 64,
+									&ctl,
+									HASH_ELEM | HASH_FUNCTION |
+									HASH_COMPARE | HASH_CONTEXT);
+	}
+
+	/* Make room if the cache is full, throwing out old entries */
+	if (hash_get_num_entries(EstimateCache) >= ESTIMATE_CACHE_SIZE)
+		expire_estimates(fpinfo->estimate_cache_ttl);
+
+	entry = (EstimateCacheEntry *) hash_search(EstimateCache, &key,
+											   HASH_ENTER, &found);
+	if (!found)
+		entry->key.sql = MemoryContextStrdup(CacheMemoryContext, sql);
+	entry->created = GetCurrentTimestamp();
+	entry->rows = *rows;
+	entry->width = *width;
+	entry->startup_cost = *startup_cost;
+	entry->total_cost = *total_cost;
+}
+
+/*
+ * Remove the entries older than ttl seconds from the estimate cache; or all
+ * of them, if that doesn't free any space.
+ */
+static void
+expire_estimates(int ttl)
+{
+	HASH_SEQ_STATUS scan;
+	EstimateCacheEntry *entry;
+	TimestampTz now = GetCurrentTimestamp();
+	long		before = hash_get_num_entries(EstimateCache);
+
+	hash_seq_init(&scan, EstimateCache);
+	while ((entry = (EstimateCacheEntry *) hash_seq_search(&scan)))
+	{
+		if (ttl < 0 ||
+			TimestampDifferenceExceeds(entry->created, now, ttl * 1000))
+		{
+			char	   *sql = entry->key.sql;
+
+			hash_search(EstimateCache, &entry->key, HASH_REMOVE, NULL);
+			pfree(sql);
+		}
+	}
+
+	if (ttl >= 0 && hash_get_num_entries(EstimateCache) == before)
+		expire_estimates(-1);
+}
+
+/*
+ * Hash function for estimate cache keys.
+ */
+static uint32
+estimate_key_hash(const void *key, Size keysize)
+{
+	const EstimateCacheKey *k = (const EstimateCacheKey *) key;
+	uint32		hashval;
+
+	hashval = DatumGetUInt32(hash_any((const unsigned char *) k->sql,
+									  strlen(k->sql)));
+	hashval ^= DatumGetUInt32(hash_uint32((uint32) k->serverid));
+	hashval ^= DatumGetUInt32(hash_uint32((uint32) k->userid)) << 1;
+
+	return hashval;
+}
+
+/*
+ * Comparison function for estimate cache keys; returns 0 if they're equal.
+ */
+static int
+estimate_key_match(const void *key1, const void *key2, Size keysize)
+{
+	const EstimateCacheKey *k1 = (const EstimateCacheKey *) key1;
+	const EstimateCacheKey *k2 = (const EstimateCacheKey *) key2;
+
+	if (k1->serverid != k2->serverid || k1->userid != k2->userid)
+		return 1;
+	return strcmp(k1->sql, k2->sql);
+}
+
+/*
+ * Replace the startup cost and the cost per row of the server with those
+ * measured by calibrate_scan and calibrate_latency, if there are any, unless
+ * they are set explicitly.  With use_remote_estimate, the remote server's
+ * estimate already covers the work of producing each row, which the wait per
+ * row includes, so then only the startup cost is replaced.
+ */
+static void
+apply_calibrated_costs(PgFdwRelationInfo *fpinfo)
+{
+	CalibrationEntry *entry;
+	bool		startup = true;
+	bool		tuple = !fpinfo->use_remote_estimate;
+	ListCell   *lc;
+
+	if (Calibration == NULL)
+		return;
+	entry = (CalibrationEntry *) hash_search(Calibration,
+											 &fpinfo->server->serverid,
+											 HASH_FIND, NULL);
+	if (entry == NULL)
+		return;
+
+	foreach(lc, fpinfo->server->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "fdw_startup_cost") == 0)
+			startup = false;
+		else if (strcmp(def->defname, "fdw_tuple_cost") == 0)
+			tuple = false;
+	}
+
+	if (startup && entry->startup_ms >= 0)
+		fpinfo->fdw_startup_cost = entry->startup_ms / pgfdw_cost_unit_ms;
+	if (tuple && entry->tuple_ms >= 0)
+		fpinfo->fdw_tuple_cost = Max(entry->tuple_ms / pgfdw_cost_unit_ms,
+									 cpu_tuple_cost);
+}
+
+/*
+ * postgres_fdw_flush_estimates
+ *		Empty the remote estimate cache of this backend, and forget the
+ *		costs measured for calibrate_costs.
+ */
+Datum
+postgres_fdw_flush_estimates(PG_FUNCTION_ARGS)
+{
+	if (EstimateCache != NULL)
+		expire_estimates(-1);
+
+	if (Calibration != NULL)
+	{
+		hash_destroy(Calibration);
+		Calibration = NULL;
+	}
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Check whether the result cache has the rows of the node's scan, and if so,
+ * set them up as the only batch, and return true.  Otherwise return false.
+ *
+ * The rows are copied, rather than returned right out of the cache like
+ * those of the lookup cache, since the entry might be dropped while we're
+ * still scanning it: it can be invalidated, or replaced by another scan of
+ * the same query.  That's still much cheaper than asking the remote server.
+ */
+static bool
+result_cached_rows(PgFdwExecutionState *festate)
+{
+	TupleDesc	tupdesc = RelationGetDescr(festate->rel);
+	int			natts = tupdesc->natts;
+	ResultCacheEntry *entry;
+	MemoryContext oldcontext;
+	int			i;
+
+	if (ResultCache == NULL)
+		return false;
+
+	entry = (ResultCacheEntry *) hash_search(ResultCache,
+											 &festate->result_key,
+											 HASH_FIND, NULL);
+	if (entry == NULL)
+		return false;
+	if (TimestampDifferenceExceeds(entry->created, GetCurrentTimestamp(),
+								   festate->cache_ttl * 1000))
+	{
+		drop_result_entry(entry);
+		return false;
+	}
+
+	oldcontext = MemoryContextSwitchTo(festate->batch_cxt);
+	festate->tuple_values = (Datum *)
+		palloc(Max(entry->num_tuples * natts, 1) * sizeof(Datum));
+	festate->tuple_nulls = (bool *)
+		palloc(Max(entry->num_tuples * natts, 1) * sizeof(bool));
+	for (i = 0; i < entry->num_tuples * natts; i++)
+	{
+		Form_pg_attribute attr = tupdesc->attrs[i % natts];
+
+		festate->tuple_nulls[i] = entry->nulls[i];
+		if (entry->nulls[i])
+			festate->tuple_values[i] = (Datum) 0;
+		else
+			festate->tuple_values[i] = datumCopy(entry->values[i],
+												 attr->attbyval,
+												 attr->attlen);
+	}
+	MemoryContextSwitchTo(oldcontext);
+
+	festate->result_cache_hit = true;
+	festate->cursor_exists = true;
+	festate->num_tuples = entry->num_tuples;
+	festate->next_tuple = 0;
+	festate->next_values = NULL;
+	festate->next_nulls = NULL;
+	festate->next_num_tuples = 0;
+	festate->next_batch_ready = false;
+	festate->fetch_ct_2 = 1;
+	festate->eof_reached = true;
+
+	return true;
+}
+
+/*
+ * Add the rows of the node's next batch to the rows collected for the result
+ * cache.  If the result grows beyond work_mem, we stop collecting; it's not
+ * the kind of result the cache is meant for.
+ */
+static void
+collect_result_rows(PgFdwExecutionState *festate)
+{
+	TupleDesc	tupdesc = RelationGetDescr(festate->rel);
+	int			natts = tupdesc->natts;
+	int			numrows = festate->next_num_tuples;
+	MemoryContext oldcontext;
+	int			i;
+
+	/* Estimate the memory the rows will take */
+	festate->result_size += numrows * natts * (sizeof(Datum) + sizeof(bool));
+	for (i = 0; i < numrows * natts; i++)
+	{
+		Form_pg_attribute attr = tupdesc->attrs[i % natts];
+
+		if (!attr->attbyval && !festate->next_nulls[i])
+			festate->result_size += datumGetSize(festate->next_values[i],
+												 attr->attbyval,
+												 attr->attlen);
+	}
+	if (festate->result_size > work_mem * 1024L)
+	{
+		MemoryContextDelete(festate->result_cxt);
+		festate->result_cxt = NULL;
+		return;
+	}
+
+	oldcontext = MemoryContextSwitchTo(festate->result_cxt);
+
+	/* Make room, doubling the arrays as needed */
+	if (festate->result_num_tuples + numrows > festate->result_max_tuples)
+	{
+		int			newmax = Max(festate->result_max_tuples * 2, 64);
+
+		while (newmax < festate->result_num_tuples + numrows)
+			newmax *= 2;
+		if (festate->result_values == NULL)
+		{
+			festate->result_values = (Datum *)
+				palloc(newmax * natts * sizeof(Datum));
+			festate->result_nulls = (bool *)
+				palloc(newmax * natts * sizeof(bool));
+		}
+		else
+		{
+			festate->result_values = (Datum *)
+				repalloc(festate->result_values,
+						 newmax * natts * sizeof(Datum));
+			festate->result_nulls = (bool *)
+				repalloc(festate->result_nulls,
+						 newmax * natts * sizeof(bool));
+		}
+		festate->result_max_tuples = newmax;
+	}
+
+	for (i = 0; i < numrows * natts; i++)
+	{
+		Form_pg_attribute attr = tupdesc->attrs[i % natts];
+		int			j = festate->result_num_tuples * natts + i;
+
+		festate->result_nulls[j] = festate->next_nulls[i];
+		if (festate->next_nulls[i])
+			festate->result_values[j] = (Datum) 0;
+		else
+			festate->result_values[j] = datumCopy(festate->next_values[i],
+												  attr->attbyval,
+												  attr->attlen);
+	}
+	festate->result_num_tuples += numrows;
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Enter the complete result collected by the node's scan into the result
+ * cache.  The memory context holding the rows moves into the cache.
+ */
+static void
+store_result_cache(PgFdwExecutionState *festate)
+{
+	ResultCacheEntry *entry;
+	ResultCacheKey key;
+	MemoryContext oldcxt = NULL;
+	bool		found;
+
+	/* First time through, initialize the cache */
+	if (ResultCache == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(ResultCacheKey);
+		ctl.entrysize = sizeof(ResultCacheEntry);
+		ctl.hash = result_key_hash;
+		ctl.match = result_key_match;
+		ctl.hcxt = CacheMemoryContext;
+		ResultCache = hash_create("postgres_fdw result cache",
+								  RESULT_CACHE_SIZE,
+								  &ctl,
+								  HASH_ELEM | HASH_FUNCTION |
+								  HASH_COMPARE | HASH_CONTEXT);
+		CacheRegisterRelcacheCallback(result_cache_callback, (Datum) 0);
+	}
+
+	/* Make room if the cache is full, throwing out the oldest entry */
+	if (hash_get_num_entries(ResultCache) >= RESULT_CACHE_SIZE)
+	{
+		HASH_SEQ_STATUS scan;
+		ResultCacheEntry *oldest = NULL;
+
+		hash_seq_init(&scan, ResultCache);
+		while ((entry = (ResultCacheEntry *) hash_seq_search(&scan)))
+		{
+			if (oldest == NULL || entry->created < oldest->created)
+				oldest = entry;
+		}
+		drop_result_entry(oldest);
+	}
+
+	/* The key must live in the cache before it's entered */
+	key = festate->result_key;
+	key.sql = MemoryContextStrdup(festate->result_cxt, key.sql);
+	entry = (ResultCacheEntry *) hash_search(ResultCache, &key,
+											 HASH_ENTER, &found);
+	if (found)
+	{
+		/* Another scan of the query got there first; replace its rows */
+		oldcxt = entry->cxt;
+		entry->key.sql = key.sql;
+	}
+	entry->created = GetCurrentTimestamp();
+	entry->cxt = festate->result_cxt;
+	entry->values = festate->result_values;
+	entry->nulls = festate->result_nulls;
+	entry->num_tuples = festate->result_num_tuples;
+	if (oldcxt != NULL)
+		MemoryContextDelete(oldcxt);
+
+	MemoryContextSetParent(festate->result_cxt, CacheMemoryContext);
+	festate->result_cxt = NULL;
+}
+
+/*
+ * Remove an entry from the result cache, and free its rows.
+ */
+static void
+drop_result_entry(ResultCacheEntry *entry)
+{
+	MemoryContext cxt = entry->cxt;
+
+	hash_search(ResultCache, &entry->key, HASH_REMOVE, NULL);
+	MemoryContextDelete(cxt);
+}
+
+/*
+ * Drop the cached results of a foreign table when its relcache entry is
+ * invalidated, or all of them if relid is InvalidOid.
+ */
+static void
+result_cache_callback(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS scan;
+	ResultCacheEntry *entry;
+
+	hash_seq_init(&scan, ResultCache);
+	while ((entry = (ResultCacheEntry *) hash_seq_search(&scan)))
+	{
+		if (relid == InvalidOid || entry->key.relid == relid)
+			drop_result_entry(entry);
+	}
+}
+
+/*
+ * Hash function for result cache keys.
+ */
+static uint32
+result_key_hash(const void *key, Size keysize)
+{
+	const ResultCacheKey *k = (const ResultCacheKey *) key;
+	uint32		hashval;
+
+	hashval = DatumGetUInt32(hash_any((const unsigned char *) k->sql,
+									  strlen(k->sql)));
+	hashval ^= DatumGetUInt32(hash_uint32((uint32) k->relid));
+	hashval ^= DatumGetUInt32(hash_uint32((uint32) k->serverid)) << 1;
+	hashval ^= DatumGetUInt32(hash_uint32((uint32) k->userid)) << 2;
+
+	return hashval;
+}
+
+/*
+ * Comparison function for result cache keys; returns 0 if they're equal.
+ */
+static int
+result_key_match(const void *key1, const void *key2, Size keysize)
+{
+	const ResultCacheKey *k1 = (const ResultCacheKey *) key1;
+	const ResultCacheKey *k2 = (const ResultCacheKey *) key2;
+
+	if (k1->relid != k2->relid || k1->serverid != k2->serverid ||
+		k1->userid != k2->userid)
+		return 1;
+	return strcmp(k1->sql, k2->sql);
+}
+
+/*
+ * postgres_fdw_invalidate_cache
+ *		Drop the cached results of a foreign table, in all backends.
+ *
+ * The other backends drop theirs when our transaction commits; we do it
+ * right away.
+ */
+Datum
+postgres_fdw_invalidate_cache(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	char		relkind = get_rel_relkind(relid);
+
+	/* a regclass argument can still name a relation that doesn't exist */
+	if (relkind == '\0')
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_TABLE),
+				 errmsg("relation with OID %u does not exist", relid)));
+	if (relkind != RELKIND_FOREIGN_TABLE)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not a foreign table",
+						get_rel_name(relid))));
+
+	CacheInvalidateRelcacheByRelid(relid);
+	if (ResultCache != NULL)
+		result_cache_callback((Datum) 0, relid);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Estimate costs of executing given SQL statement.
+ */
+static void
+get_remote_estimate(const char *sql, PGconn *conn,
+					double *rows, int *width,
+					Cost *startup_cost, Cost *total_cost)
+{
+	PGresult   *volatile res = NULL;
+
+	/* PGresult must be released before leaving this function. */
+	PG_TRY();
+	{
+		StringInfoData buf;
+		PgFdwStats *stats;
+		char	   *line;
+		char	   *p;
+		int			n;
+
+		/*
+		 * Execute EXPLAIN remotely on given SQL statement.
+		 */
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "EXPLAIN %s", sql);
+		stats = GetConnectionStats(conn);
+		stats->round_trips++;
+		stats->remote_estimates++;
+		res = PQexec(conn, buf.data);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+			pgfdw_report_error(ERROR, res, conn, false, buf.data);
+
+		/*
+		 * Extract cost numbers for topmost plan node.	Note we search for a
+		 * left paren from the end of the line to avoid being confused by
+		 * other uses of parentheses.
+		 */
+		line = PQgetvalue(res, 0, 0);
+		p = strrchr(line, '(');
+		if (p == NULL)
+			elog(ERROR, "could not interpret EXPLAIN output: \"%s\"", line);
+		n = sscanf(p, "(cost=%lf..%lf rows=%lf width=%d)",
+				   startup_cost, total_cost, rows, width);
+		if (n != 4)
+			elog(ERROR, "could not interpret EXPLAIN output: \"%s\"", line);
+
+		PQclear(res);
+		res = NULL;
+	}
+	PG_CATCH();
+	{
+		if (res)
+			PQclear(res);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+/*
+ * Fill in the query parameter slot for paramno with the given value.
+ */
+static void
+set_param_value(PgFdwExecutionState *festate, int paramno,
+				Oid type, Datum value, bool isnull)
+{
+	/*
+	 * Force the remote server to infer a type for this parameter.  Since we
+	 * explicitly cast every parameter (see deparse.c), the "inference" is
+	 * trivial and will produce the desired result.  This allows us to avoid
+	 * assuming that the remote server has the same OIDs we do for the
+	 * parameters' types.
+	 *
+	 * We'd not need to pass a type array to PQexecParams at all, except that
+	 * there may be unused holes in the array, which will have to be filled
+	 * with something or the remote server will complain.  We arbitrarily set
+	 * them to INT4OID earlier.
+	 */
+	festate->param_types[paramno - 1] = InvalidOid;
+	festate->param_lengths[paramno - 1] = 0;
+	festate->param_formats[paramno - 1] = 0;
+
+	/*
+	 * Get string representation of each parameter value by invoking
+	 * type-specific output function, unless the value is null.  In binary
+	 * mode, send values of binary-safe types in binary format by using the
+	 * type-specific send function instead.
+	 */
+	if (isnull)
+		festate->param_values[paramno - 1] = NULL;
+	else if (festate->recvmeta && is_binary_safe_type(type))
+	{
+		Oid			send_func;
+		bool		isvarlena;
+		bytea	   *outval;
+
+		getTypeBinaryOutputInfo(type, &send_func, &isvarlena);
+		outval = OidSendFunctionCall(send_func, value);
+		festate->param_values[paramno - 1] = VARDATA(outval);
+		festate->param_lengths[paramno - 1] = VARSIZE(outval) - VARHDRSZ;
+		festate->param_formats[paramno - 1] = 1;
+	}
+	else
+	{
+		Oid			out_func;
+		bool		isvarlena;
+
+		getTypeOutputInfo(type, &out_func, &isvarlena);
+		festate->param_values[paramno - 1] = OidOutputFunctionCall(out_func,
+																   value);
+	}
+}
+
+/*
+ * Create cursor for node's query with current parameter values.
+ */
+static void
+create_cursor(ForeignScanState *node)
+{
+	PgFdwExecutionState *festate = (PgFdwExecutionState *) node->fdw_state;
+	int			numParams = festate->numParams;
+	Oid		   *types = festate->param_types;
+	const char **values = festate->param_values;
+	int		   *lengths = festate->param_lengths;
+	int		   *formats = festate->param_formats;
+	PGconn	   *conn = festate->conn;
+	char	   *sql;
+	StringInfoData buf;
+	PGresult   *res;
+	int			fetch_size = 0;
+	bool		first_fetch_sent = false;
+
+	/*
+	 * Construct array of external parameter values (in text format, except
+	 * as noted below).  Since there might be random unconvertible stuff in
+	 * the ParamExternData array, take care to convert only values we actually
+	 * need.
+	 *
+	 * The values are converted only once, in the query's memory context, and
+	 * kept until end of query, since we might need to recreate the cursor
+	 * after a rescan.
+	 */
+	if (numParams > 0 && !festate->extparams_done)
+	{
+		ParamListInfo params = node->ss.ps.state->es_param_list_info;
+		MemoryContext oldcontext;
+		int			nestlevel;
+		List	   *param_numbers;
+		ListCell   *lc;
+
+		oldcontext = MemoryContextSwitchTo(node->ss.ps.state->es_query_cxt);
+		nestlevel = set_transmission_modes();
+
+		param_numbers = (List *)
+			list_nth(festate->fdw_private, FdwPrivateExternParamIds);
+		foreach(lc, param_numbers)
+		{
+			int			paramno = lfirst_int(lc);
+			ParamExternData *prm = &params->params[paramno - 1];
+
+			/* give hook a chance in case parameter is dynamic */
+			if (!OidIsValid(prm->ptype) && params->paramFetch != NULL)
+				params->paramFetch(params, paramno);
+
+			set_param_value(festate, paramno, prm->ptype, prm->value,
+							prm->isnull);
+		}
+		reset_transmission_modes(nestlevel);
+		MemoryContextSwitchTo(oldcontext);
+
+		festate->extparams_done = true;
+	}
+
+	/*
+	 * The outer relation values of a parameterized scan, on the other hand,
+	 * change whenever the scan is restarted with new parameters, so evaluate
+	 * them every time.  They're needed only until the cursor is created.
+	 */
+	if (festate->param_exprs != NIL)
+	{
+		ExprContext *econtext = node->ss.ps.ps_ExprContext;
+		int			paramno = festate->param_offset;
+		int			nestlevel;
+		ListCell   *lc;
+
+		nestlevel = set_transmission_modes();
+		foreach(lc, festate->param_exprs)
+		{
+			ExprState  *expr_state = (ExprState *) lfirst(lc);
+			Datum		value;
+			bool		isnull;
+
+			value = ExecEvalExpr(expr_state, econtext, &isnull, NULL);
+			set_param_value(festate, ++paramno,
+							exprType((Node *) expr_state->expr),
+							value, isnull);
+		}
+		reset_transmission_modes(nestlevel);
+	}
+
+	/*
+	 * If we've seen the same outer values before, the rows are waiting in the
+	 * lookup cache.
+	 */
+	if (festate->lookup_cache != NULL && lookup_cached_rows(festate))
+		return;
+
+	sql = strVal(list_nth(festate->fdw_private, FdwPrivateSelectSql));
+	initStringInfo(&buf);
+
+	/*
+	 * A COPY needs the connection to itself until all its rows have been
+	 * read, unless somebody else collects them for us; but we can't start
+	 * one while the connection still holds another scan's uncollected
+	 * result.  Use a cursor in that case.
+	 */
+	pgfdw_absorb_pending(conn, festate->conn_state);
+	if (festate->copy_mode && festate->conn_state->pending_cursor != 0)
+		festate->copy_mode = false;
+
+	if (festate->nstreams > 0)
+		create_parallel_cursors(festate);
+	else if (festate->copy_mode)
+	{
+		/*
+		 * Start the COPY.  Rows are always transferred in text format here,
+		 * even in binary mode; columns the query casts to text don't mind.
+		 */
+		Assert(numParams == 0);
+		appendStringInfo(&buf, "COPY (%s) TO STDOUT", sql);
+		pgfdw_send_copy(conn, festate->conn_state, festate->cursor_number,
+						buf.data);
+		festate->recvmeta = NULL;
+	}
+	else if (festate->prepared)
+	{
+		/*
+		 * Look up the prepared statement, preparing it if we haven't yet.
+		 * It's executed by the fetch_more_data call that follows, in the
+		 * same IterateForeignScan call, so the parameter values set above
+		 * are still valid then.
+		 *
+		 * The planner expected no more than a batch of rows, but estimates
+		 * can be way off, so the statement returns one row more at most;
+		 * if it gets that many, fetch_more_data switches over to a cursor.
+		 */
+		appendStringInfo(&buf, "SELECT * FROM (%s) s LIMIT %d",
+						 sql, festate->fetch_size + 1);
+		festate->stmt_name = GetPreparedStatement(conn, buf.data, numParams,
+												  types);
+		pgfdw_begin_xact(conn);
+	}
+	else if (numParams == 0 && festate->conn_state->pending_cursor == 0)
+	{
+		/*
+		 * Without parameters, the DECLARE can go as a simple query, and then
+		 * so can the commands starting the remote transaction, if still
+		 * needed, and the first FETCH: send them all at once, and collect
+		 * the rows in fetch_more_data.  Thus a small query takes just one
+		 * round trip.  The first FETCH is sized as in fetch_more_data.
+		 */
+		fetch_size = festate->fetch_size;
+		if (festate->rows_needed > 0)
+			fetch_size = Min(fetch_size, festate->rows_needed);
+
+		pgfdw_append_begin(conn, &buf);
+		appendStringInfo(&buf, "DECLARE c%u %sCURSOR FOR\n%s;\n",
+						 festate->cursor_number,
+						 festate->recvmeta ? "BINARY " : "",
+						 sql);
+		appendStringInfo(&buf, "FETCH %d FROM c%u",
+						 fetch_size, festate->cursor_number);
+		pgfdw_send_query(conn, festate->conn_state, festate->cursor_number,
+						 buf.data);
+		first_fetch_sent = true;
+	}
+	else
+	{
+		/*
+		 * Construct the DECLARE CURSOR command.  A binary cursor makes all
+		 * the FETCHes return binary data, whichever way they are sent.
+		 */
+		appendStringInfo(&buf, "DECLARE c%u %sCURSOR FOR\n%s",
+						 festate->cursor_number,
+						 festate->recvmeta ? "BINARY " : "",
+						 sql);
+
+		/*
+		 * We don't use a PG_TRY block here, so be careful not to throw error
+		 * without releasing the PGresult.
+		 */
+		pgfdw_begin_xact(conn);
+		festate->conn_state->stats->round_trips++;
+		res = PQexecParams(conn, buf.data, numParams, types, values,
+						   lengths, formats, 0);
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			pgfdw_report_error(ERROR, res, conn, true, sql);
+		PQclear(res);
+	}
+
+	/*
+	 * Mark the cursor (or COPY) as created, and show no tuples have been
+	 * retrieved
+	 */
+	festate->cursor_exists = true;
+	festate->tuple_values = NULL;
+	festate->tuple_nulls = NULL;
+	festate->num_tuples = 0;
+	festate->next_tuple = 0;
+	festate->next_values = NULL;
+	festate->next_nulls = NULL;
+	festate->next_num_tuples = 0;
+	festate->next_batch_ready = false;
+	festate->fetch_ct_2 = 0;
+	festate->eof_reached = false;
+
+	if (first_fetch_sent)
+	{
+		festate->fetch_in_flight = true;
+		festate->fetch_in_flight_size = fetch_size;
+		festate->fetch_ct_2++;
+	}
+
+	/* Clean up */
+	pfree(buf.data);
+}
+
+/*
+ * Give up on running the node's query as a prepared statement, which has
+ * returned more rows than expected, and declare a cursor for it instead,
+ * with the same parameter values.  Returns the result of the first FETCH,
+ * of fetch_size rows.
+ */
+static PGresult *
+switch_to_cursor(PgFdwExecutionState *festate)
+{
+	PGconn	   *conn = festate->conn;
+	char	   *sql = strVal(list_nth(festate->fdw_private,
+									  FdwPrivateSelectSql));
+	StringInfoData buf;
+	PGresult   *res;
+
+	festate->prepared = false;
+
+	/* The lookup cache relies on getting all the rows at once */
+	festate->lookup_cache = NULL;
+	festate->lookup_key.data = NULL;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "DECLARE c%u %sCURSOR FOR\n%s",
+					 festate->cursor_number,
+					 festate->recvmeta ? "BINARY " : "",
+					 sql);
+	festate->conn_state->stats->round_trips++;
+	res = PQexecParams(conn, buf.data, festate->numParams,
+					   festate->param_types, festate->param_values,
+					   festate->param_lengths, festate->param_formats, 0);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		pgfdw_report_error(ERROR, res, conn, true, sql);
+	PQclear(res);
+
+	resetStringInfo(&buf);
+	appendStringInfo(&buf, "FETCH %d FROM c%u",
+					 festate->fetch_size, festate->cursor_number);
+	festate->conn_state->stats->round_trips++;
+	res = PQexec(conn, buf.data);
+	pfree(buf.data);
+
+	return res;
+}
+
+/*
+ * Build the lookup cache key for the current outer parameter values of a
+ * parameterized scan.  The key consists of the values in the form they're
+ * sent to the remote server, each with a length word, or just a marker for
+ * null.  It's allocated in the current memory context.
+ */
+static void
+build_lookup_key(PgFdwExecutionState *festate, PgFdwLookupKey *key)
+{
+	StringInfoData buf;
+	int			nparams = list_length(festate->param_exprs);
+	int			i;
+
+	initStringInfo(&buf);
+	for (i = festate->param_offset; i < festate->param_offset + nparams; i++)
+	{
+		const char *value = festate->param_values[i];
+		int32		len;
+
+		if (value == NULL)
+		{
+			appendStringInfoChar(&buf, 'n');
+			continue;
+		}
+
+		len = festate->param_formats[i] ? festate->param_lengths[i] :
+			strlen(value);
+		appendStringInfoChar(&buf, 'v');
+		appendBinaryStringInfo(&buf, (char *) &len, sizeof(len));
+		appendBinaryStringInfo(&buf, value, len);
+	}
+
+	key->data = buf.data;
+	key->len = buf.len;
+}
+
+/*
+ * Look up the rows for the current outer parameter values in the lookup
+ * cache.  If they're there, make them the current batch, mark the scan as
+ * started and at EOF, and return true.  Otherwise, remember the key in
+ * festate->lookup_key so that fetch_more_data stores the rows it gets, and
+ * return false.
+ *
+ * The remote data can't change under us, since we see it through the same
+ * snapshot for the whole query, so entries never go stale.
+ */
+static bool
+lookup_cached_rows(PgFdwExecutionState *festate)
+{
+	PgFdwLookupEntry *entry;
+
+	build_lookup_key(festate, &festate->lookup_key);
+	entry = (PgFdwLookupEntry *) hash_search(festate->lookup_cache,
+											 &festate->lookup_key,
+											 HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		festate->lookup_misses++;
+		return false;
+	}
+
+	festate->lookup_hits++;
+	festate->lookup_key.data = NULL;
+
+	/* The tuples can be returned right out of the cache. */
+	festate->cursor_exists = true;
+	festate->tuple_values = entry->values;
+	festate->tuple_nulls = entry->nulls;
+	festate->num_tuples = entry->num_tuples;
+	festate->next_tuple = 0;
+	festate->next_values = NULL;
+	festate->next_nulls = NULL;
+	festate->next_num_tuples = 0;
+	festate->next_batch_ready = false;
+	festate->fetch_ct_2 = 1;
+	festate->eof_reached = true;
+
+	return true;
+}
+
+/*
+ * Add the rows just fetched into the next batch to the lookup cache, under
+ * festate->lookup_key, unless that would exceed the cache's memory limit.
+ * Once the cache is full, it answers what it can, but no rows are added.
+ */
+static void
+store_lookup_rows(PgFdwExecutionState *festate)
+{
+	TupleDesc	tupdesc = RelationGetDescr(festate->rel);
+	int			natts = tupdesc->natts;
+	int			numrows = festate->next_num_tuples;
+	Size		size;
+	PgFdwLookupKey key;
+	PgFdwLookupEntry *entry;
+	MemoryContext oldcontext;
+	bool		found;
+	int			i;
+
+	/* Estimate the memory the entry will take */
+	size = sizeof(PgFdwLookupEntry) + festate->lookup_key.len +
+		numrows * natts * (sizeof(Datum) + sizeof(bool));
+	for (i = 0; i < numrows * natts; i++)
+	{
+		Form_pg_attribute attr = tupdesc->attrs[i % natts];
+
+		if (!attr->attbyval && !festate->next_nulls[i])
+			size += datumGetSize(festate->next_values[i],
+								 attr->attbyval, attr->attlen);
+	}
+
+	key = festate->lookup_key;
+	festate->lookup_key.data = NULL;
+	if (festate->lookup_cache_used + size > festate->lookup_cache_limit)
+		return;
+	festate->lookup_cache_used += size;
+
+	oldcontext = MemoryContextSwitchTo(festate->lookup_cxt);
+
+	/* The key must live in the cache before it's entered */
+	key.data = memcpy(palloc(key.len), key.data, key.len);
+	entry = (PgFdwLookupEntry *) hash_search(festate->lookup_cache, &key,
+											 HASH_ENTER, &found);
+	Assert(!found);
+
+	entry->values = (Datum *) palloc(Max(numrows * natts, 1) * sizeof(Datum));
+	entry->nulls = (bool *) palloc(Max(numrows * natts, 1) * sizeof(bool));
+	entry->num_tuples = numrows;
+	for (i = 0; i < numrows * natts; i++)
+	{
+		Form_pg_attribute attr = tupdesc->attrs[i % natts];
+
+		entry->nulls[i] = festate->next_nulls[i];
+		if (entry->nulls[i])
+			entry->values[i] = (Datum) 0;
+		else
+			entry->values[i] = datumCopy(festate->next_values[i],
+										 attr->attbyval, attr->attlen);
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Hash function for lookup cache keys.
+ */
+static uint32
+lookup_key_hash(const void *key, Size keysize)
+{
+	const PgFdwLookupKey *k = (const PgFdwLookupKey *) key;
+
+	return DatumGetUInt32(hash_any((const unsigned char *) k->data, k->len));
+}
+
+/*
+ * Comparison function for lookup cache keys; returns 0 if they're equal.
+ */
+static int
+lookup_key_match(const void *key1, const void *key2, Size keysize)
+{
+	const PgFdwLookupKey *k1 = (const PgFdwLookupKey *) key1;
+	const PgFdwLookupKey *k2 = (const PgFdwLookupKey *) key2;
+
+	if (k1->len != k2->len)
+		return 1;
+	return memcmp(k1->data, k2->data, k1->len);
+}
+
+/*
+ * Fetch some more rows from the node's cursor.
+ *
+ * The rows are stored as the node's next batch, in next_batch_cxt; the caller
+ * makes that the current batch when it's ready for it.  If our FETCH request
+ * is already in flight, we just collect its result; otherwise we issue a
+ * FETCH and wait for it.  Then, in prefetch mode, the FETCH for the following
+ * batch is sent right away, so that the remote server can work on it while
+ * we're busy with the rows we have.  (Note that this means up to two batches
+ * are held in memory, plus the one being received.)
+ */
+static void
+fetch_more_data(ForeignScanState *node)
+{
+	PgFdwExecutionState *festate = (PgFdwExecutionState *) node->fdw_state;
+	PGresult   *volatile res = NULL;
+	MemoryContext oldcontext;
+
+	Assert(!festate->next_batch_ready);
+
+	/*
+	 * We'll store the tuples in the next_batch_cxt.  First, flush the batch
+	 * previously stored there.
 	 */
-	festate->conn = GetConnection(server, user);
+	festate->next_values = NULL;
+	festate->next_nulls = NULL;
+	MemoryContextReset(festate->next_batch_cxt);
+	oldcontext = MemoryContextSwitchTo(festate->next_batch_cxt);
 
-	/* Assign a unique ID for my cursor */
-	festate->cursor_number = GetCursorNumber(festate->conn);
-	festate->cursor_exists = false;
+	/* PGresult must be released before leaving this function. */
+	PG_TRY();
+	{
+		PGconn	   *conn = festate->conn;
+		int			fetch_size;
+		int			numrows;
 
-	/* Get private info created by planner functions. */
-	festate->fdw_private = fsplan->fdw_private;
+		if (festate->fetch_in_flight)
+		{
+			/* Collect the result of the FETCH we sent earlier */
+			fetch_size = festate->fetch_in_flight_size;
+			festate->fetch_in_flight = false;
+			res = pgfdw_get_pending_result(conn, festate->conn_state,
+										   festate->cursor_number);
+		}
+		else if (festate->prepared)
+		{
+			/* Run the prepared statement, which returns all rows at once */
+			fetch_size = festate->fetch_size;
+
+			pgfdw_absorb_pending(conn, festate->conn_state);
+			festate->conn_state->stats->round_trips++;
+			res = PQexecPrepared(conn, festate->stmt_name,
+								 festate->numParams,
+								 festate->param_values,
+								 festate->param_lengths,
+								 festate->param_formats,
+								 festate->recvmeta ? 1 : 0);
 
-	/* Create contexts for batches of tuples and per-tuple temp workspace. */
-	festate->batch_cxt = AllocSetContextCreate(estate->es_query_cxt,
-											   "postgres_fdw tuple data",
-											   ALLOCSET_DEFAULT_MINSIZE,
-											   ALLOCSET_DEFAULT_INITSIZE,
-											   ALLOCSET_DEFAULT_MAXSIZE);
-	festate->temp_cxt = AllocSetContextCreate(estate->es_query_cxt,
-											  "postgres_fdw temporary data",
-											  ALLOCSET_SMALL_MINSIZE,
-											  ALLOCSET_SMALL_INITSIZE,
-											  ALLOCSET_SMALL_MAXSIZE);
+			/*
+			 * If that failed, the statement is prepared again next time, in
+			 * case it's stale.  If it returned more than a batch of rows,
+			 * there may be a lot more where they came from, so start over
+			 * with a cursor; nothing has been returned from the scan yet.
+			 */
+			if (PQresultStatus(res) != PGRES_TUPLES_OK)
+				ForgetPreparedStatement(conn, festate->stmt_name);
+			else if (PQntuples(res) > fetch_size)
+			{
+				PQclear(res);
+				res = NULL;
+				res = switch_to_cursor(festate);
+			}
 
-	/* Get info we'll need for data conversion. */
-	festate->attinmeta = TupleDescGetAttInMetadata(RelationGetDescr(festate->rel));
+			/* Update fetch_ct_2 */
+			if (festate->fetch_ct_2 < 2)
+				festate->fetch_ct_2++;
+		}
+		else
+		{
+			char		sql[64];
 
-	/*
-	 * Allocate buffer for query parameters, if the remote conditions use any.
-	 *
-	 * We use a parameter slot for each PARAM_EXTERN parameter, even though
-	 * not all of them may get sent to the remote server.  This allows us to
-	 * refer to Params by their original number rather than remapping, and it
-	 * doesn't cost much.  Slots that are not actually used get filled with
-	 * null values that are arbitrarily marked as being of type int4.
-	 */
-	param_numbers = (List *)
-		list_nth(festate->fdw_private, FdwPrivateExternParamIds);
-	if (param_numbers != NIL)
+			/*
+			 * Remember how many rows we asked for; it's needed to detect EOF
+			 * below, and adjust_fetch_size might change festate->fetch_size.
+			 * If the query is likely to need less than a batch, the first
+			 * FETCH asks for just that much.
+			 */
+			fetch_size = festate->fetch_size;
+			if (festate->fetch_ct_2 == 0 && festate->rows_needed > 0)
+				fetch_size = Min(fetch_size, festate->rows_needed);
+
+			snprintf(sql, sizeof(sql), "FETCH %d FROM c%u",
+					 fetch_size, festate->cursor_number);
+
+			pgfdw_absorb_pending(conn, festate->conn_state);
+			festate->conn_state->stats->round_trips++;
+			res = PQexec(conn, sql);
+
+			/* Update fetch_ct_2 */
+			if (festate->fetch_ct_2 < 2)
+				festate->fetch_ct_2++;
+		}
+
+		/* On error, report the original query, not the FETCH. */
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+			pgfdw_report_error(ERROR, res, festate->conn, false,
+							   strVal(list_nth(festate->fdw_private,
+											   FdwPrivateSelectSql)));
+
+		/* Decode the data into the batch arrays */
+		store_result_batch(node, res);
+		numrows = PQntuples(res);
+
+		/* Keep the rows in the lookup cache, if wanted */
+		if (festate->lookup_key.data != NULL)
+			store_lookup_rows(festate);
+
+		/*
+		 * Must be EOF if we didn't get as many tuples as we asked for, or if
+		 * we ran a prepared statement.
+		 */
+		festate->eof_reached = (festate->prepared || numrows < fetch_size);
+
+		/* Size the next batch according to what this one cost us. */
+		if (festate->fetch_memory > 0 && !festate->eof_reached)
+			adjust_fetch_size(festate, res);
+
+		PQclear(res);
+		res = NULL;
+
+		/*
+		 * Get the remote server started on the batch after this one, unless
+		 * we already have what the query is likely to need.
+		 */
+		if (festate->prefetch && !festate->eof_reached &&
+			!(festate->fetch_ct_2 == 1 && festate->rows_needed > 0 &&
+			  numrows >= festate->rows_needed))
+			send_fetch_request(festate);
+	}
+	PG_CATCH();
 	{
-		ParamListInfo params = estate->es_param_list_info;
+		if (res)
+			PQclear(res);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 
-		numParams = params ? params->numParams : 0;
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Decode the rows of a FETCH result into the node's next batch, in the
+ * current memory context (which should be next_batch_cxt).
+ *
+ * If we check the local conditions ourselves, only the columns they need are
+ * converted at first, and the rest only if the row passes; rows that fail
+ * don't make it into the batch at all.
+ */
+static void
+store_result_batch(ForeignScanState *node, PGresult *res)
+{
+	PgFdwExecutionState *festate = (PgFdwExecutionState *) node->fdw_state;
+	int			natts = RelationGetDescr(festate->rel)->natts;
+	int			numrows = PQntuples(res);
+	int			nkept = 0;
+	instr_time	start;
+	int			i;
+
+	festate->remote_fetches++;
+	festate->remote_rows += numrows;
+	festate->conn_state->stats->rows_fetched += numrows;
+	if (festate->track_io)
+	{
+		int			nfields = PQnfields(res);
+		int64		nbytes = 0;
+		int			j;
+
+		for (i = 0; i < numrows; i++)
+			for (j = 0; j < nfields; j++)
+				nbytes += PQgetlength(res, i, j);
+		festate->remote_bytes += nbytes;
+		festate->conn_state->stats->bytes_fetched += nbytes;
 	}
-	else
-		numParams = 0;
-	festate->numParams = numParams;
-	if (numParams > 0)
+
+	start_timer(festate, &start);
+	festate->next_values = (Datum *) palloc(numrows * natts * sizeof(Datum));
+	festate->next_nulls = (bool *) palloc(numrows * natts * sizeof(bool));
+
+	for (i = 0; i < numrows; i++)
 	{
-		/* we initially fill all slots with value = NULL, type = int4 */
-		festate->param_types = (Oid *) palloc(numParams * sizeof(Oid));
-		festate->param_values = (const char **) palloc0(numParams * sizeof(char *));
-		for (i = 0; i < numParams; i++)
-			festate->param_types[i] = INT4OID;
+		Datum	   *values = festate->next_values + nkept * natts;
+		bool	   *nulls = festate->next_nulls + nkept * natts;
+
+		if (festate->filter_quals != NIL)
+		{
+			memset(nulls, true, natts * sizeof(bool));
+			convert_result_row(res, i,
+							   festate->rel,
+							   festate->attinmeta,
+							   festate->recvmeta,
+							   festate->decoders,
+							   festate->filter_cols,
+							   values, nulls);
+			if (!filter_row(node, values, nulls))
+			{
+				InstrCountFiltered1(node, 1);
+				continue;
+			}
+			convert_result_row(res, i,
+							   festate->rel,
+							   festate->attinmeta,
+							   festate->recvmeta,
+							   festate->decoders,
+							   festate->other_cols,
+							   values, nulls);
+		}
+		else
+			convert_result_row(res, i,
+							   festate->rel,
+							   festate->attinmeta,
+							   festate->recvmeta,
+							   festate->decoders,
+							   NULL,
+							   values, nulls);
+		nkept++;
 	}
-	else
+	festate->next_num_tuples = nkept;
+	festate->next_batch_ready = true;
+	stop_timer(festate, &start, &festate->convert_time);
+}
+
+/*
+ * Start measuring the time of some step of the scan, if EXPLAIN ANALYZE
+ * wants to know.
+ */
+static void
+start_timer(PgFdwExecutionState *festate, instr_time *start)
+{
+	if (festate->track_timing)
+		INSTR_TIME_SET_CURRENT(*start);
+}
+
+/*
+ * Add the time since start_timer to *counter.
+ */
+static void
+stop_timer(PgFdwExecutionState *festate, instr_time *start,
+		   instr_time *counter)
+{
+	instr_time	end;
+
+	if (festate->track_timing)
 	{
-		festate->param_types = NULL;
-		festate->param_values = NULL;
+		INSTR_TIME_SET_CURRENT(end);
+		INSTR_TIME_ACCUM_DIFF(*counter, end, *start);
 	}
-	festate->extparams_done = false;
 }
 
 /*
- * postgresIterateForeignScan
- *		Retrieve next row from the result set, or clear tuple slot to indicate
- *		EOF.
+ * Return the time the scan has spent waiting for the remote server and the
+ * network so far, in milliseconds: the time spent starting the query and
+ * reading its rows, less that spent converting them.
  */
-static TupleTableSlot *
-postgresIterateForeignScan(ForeignScanState *node)
+static double
+remote_wait_ms(PgFdwExecutionState *festate)
+{
+	double		wait_ms = INSTR_TIME_GET_MILLISEC(festate->remote_time) -
+		INSTR_TIME_GET_MILLISEC(festate->convert_time);
+
+	return Max(wait_ms, 0.0);
+}
+
+/*
+ * Record the wait for the first batch of rows of this run of the scan, once
+ * it has arrived, for calibrate_scan.
+ */
+static void
+note_first_batch(PgFdwExecutionState *festate)
+{
+	if (!festate->calibrate || festate->calib_started)
+		return;
+	if (festate->remote_rows == 0 && !festate->eof_reached)
+		return;
+
+	festate->calib_started = true;
+	festate->calib_first_ms = remote_wait_ms(festate);
+	festate->calib_first_rows = festate->remote_rows;
+}
+
+/*
+ * At the end of a run of the scan (at ReScan or End), add the wait for the
+ * rows after its first batch, if there were enough of them, to the smoothed
+ * cost per row of its server.  The wait for the first batch isn't used: it
+ * includes the remote server's work on this particular query (a sort, say),
+ * which isn't what the startup cost stands for; see calibrate_latency.  The
+ * waits include those of any other scans whose requests were in the way,
+ * which the planner had better know about, too.  Runs that didn't need the
+ * remote server at all, because their rows were cached or spooled, tell
+ * nothing.
+ */
+static void
+calibrate_scan(PgFdwExecutionState *festate)
+{
+	CalibrationEntry *entry;
+	double		rest_rows;
+
+	if (!festate->calibrate || !festate->calib_started)
+		return;
+
+	festate->calib_started = false;
+	rest_rows = festate->remote_rows - festate->calib_first_rows;
+	if (rest_rows < CALIBRATION_MIN_ROWS)
+		return;
+
+	entry = get_calibration_entry(festate->serverid);
+	entry->tuple_ms = smooth_cost(entry->tuple_ms,
+								  (remote_wait_ms(festate) -
+								   festate->calib_first_ms) / rest_rows);
+}
+
+/*
+ * Add the time a round trip to the server took, for a command the remote
+ * server had next to nothing to do for, to its smoothed startup cost.
+ */
+static void
+calibrate_latency(PgFdwExecutionState *festate, double ms)
+{
+	CalibrationEntry *entry;
+
+	if (!festate->calibrate)
+		return;
+
+	entry = get_calibration_entry(festate->serverid);
+	entry->startup_ms = smooth_cost(entry->startup_ms, ms);
+}
+
+/*
+ * Find the measured costs of a server, creating an empty entry if needed.
+ */
+static CalibrationEntry *
+get_calibration_entry(Oid serverid)
+{
+	CalibrationEntry *entry;
+	bool		found;
+
+	if (Calibration == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(CalibrationEntry);
+		ctl.hash = oid_hash;
+		ctl.hcxt = CacheMemoryContext;
+		Calibration = hash_create("postgres_fdw cost calibration", 16,
+								  &ctl,
+								  HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+	}
+
+	entry = (CalibrationEntry *) hash_search(Calibration, &serverid,
+											 HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->startup_ms = -1;
+		entry->tuple_ms = -1;
+	}
+	return entry;
+}
+
+/*
+ * Add a new measurement to a moving average of costs (negative if empty).
+ */
+static double
+smooth_cost(double average, double value)
+{
+	value = Max(value, 0.0);
+	if (average < 0)
+		return value;
+	return average + CALIBRATION_WEIGHT * (value - average);
+}
+
+/*
+ * Check the local conditions of the scan, which we took over from ExecScan,
+ * against a row whose values are in the given arrays, at least for the
+ * columns the conditions use.
+ *
+ * The scan tuple slot serves to present the row to the conditions; whatever
+ * it held isn't needed anymore once we're fetching more rows.
+ */
+static bool
+filter_row(ForeignScanState *node, Datum *values, bool *nulls)
 {
 	PgFdwExecutionState *festate = (PgFdwExecutionState *) node->fdw_state;
 	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+	ExprContext *econtext = node->ss.ps.ps_ExprContext;
+	int			natts = slot->tts_tupleDescriptor->natts;
+	bool		result;
+
+	ExecClearTuple(slot);
+	memcpy(slot->tts_values, values, natts * sizeof(Datum));
+	memcpy(slot->tts_isnull, nulls, natts * sizeof(bool));
+	ExecStoreVirtualTuple(slot);
+
+	econtext->ecxt_scantuple = slot;
+	result = ExecQual(festate->filter_quals, econtext, false);
+	ResetExprContext(econtext);
+
+	return result;
+}
+
+/*
+ * Fetch some more rows from the node's COPY.
+ *
+ * This is the COPY-mode counterpart of fetch_more_data: it reads up to
+ * fetch_size rows off the COPY stream and stores them as the node's next
+ * batch.  There's no round trip involved, the remote server sends rows as
+ * fast as we care to read them, so prefetching doesn't apply.
+ */
+static void
+fetch_more_copy_data(ForeignScanState *node)
+{
+	PgFdwExecutionState *festate = (PgFdwExecutionState *) node->fdw_state;
+	const char *sql = strVal(list_nth(festate->fdw_private,
+									  FdwPrivateSelectSql));
+	int			natts = RelationGetDescr(festate->rel)->natts;
+	MemoryContext oldcontext;
+	int			maxrows;
+	int			numrows = 0;
+	instr_time	start;
+
+	Assert(!festate->next_batch_ready);
 
 	/*
-	 * If this is the first call after Begin or ReScan, we need to create the
-	 * cursor on the remote side.
+	 * We'll store the tuples in the next_batch_cxt.  First, flush the batch
+	 * previously stored there.
 	 */
-	if (!festate->cursor_exists)
-		create_cursor(node);
+	festate->next_values = NULL;
+	festate->next_nulls = NULL;
+	MemoryContextReset(festate->next_batch_cxt);
+	oldcontext = MemoryContextSwitchTo(festate->next_batch_cxt);
 
 	/*
-	 * Get some more tuples, if we've run out.
+	 * The rows come in one at a time, so we don't know in advance how many
+	 * there will be; start small and enlarge the arrays as needed.
 	 */
-	if (festate->next_tuple >= festate->num_tuples)
+	maxrows = Min(festate->fetch_size, 64);
+	festate->next_values = (Datum *) palloc(maxrows * natts * sizeof(Datum));
+	festate->next_nulls = (bool *) palloc(maxrows * natts * sizeof(bool));
+
+	while (numrows < festate->fetch_size)
 	{
-		/* No point in another fetch if we already detected EOF, though. */
-		if (!festate->eof_reached)
-			fetch_more_data(node);
-		/* If we didn't get any tuples, must be end of data. */
-		if (festate->next_tuple >= festate->num_tuples)
-			return ExecClearTuple(slot);
+		char	   *row;
+		int			len;
+
+		len = pgfdw_get_copy_data(festate->conn, festate->conn_state,
+								  festate->cursor_number, &row, sql);
+		if (len < 0)
+		{
+			festate->eof_reached = true;
+			break;
+		}
+		festate->remote_rows++;
+		festate->conn_state->stats->rows_fetched++;
+		if (festate->track_io)
+		{
+			festate->remote_bytes += len;
+			festate->conn_state->stats->bytes_fetched += len;
+		}
+
+		if (numrows >= maxrows)
+		{
+			maxrows = Min(maxrows * 2, festate->fetch_size);
+			festate->next_values = (Datum *)
+				repalloc(festate->next_values, maxrows * natts * sizeof(Datum));
+			festate->next_nulls = (bool *)
+				repalloc(festate->next_nulls, maxrows * natts * sizeof(bool));
+		}
+
+		start_timer(festate, &start);
+		convert_copy_row(row, len,
+						 festate->rel,
+						 festate->attinmeta,
+						 festate->decoders,
+						 festate->next_values + numrows * natts,
+						 festate->next_nulls + numrows * natts);
+		stop_timer(festate, &start, &festate->convert_time);
+		numrows++;
+	}
+	festate->next_num_tuples = numrows;
+	festate->next_batch_ready = true;
+
+	/* Update fetch_ct_2 */
+	if (festate->fetch_ct_2 < 2)
+		festate->fetch_ct_2++;
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Send a FETCH for the node's next batch, without waiting for the result.
+ */
+static void
+send_fetch_request(PgFdwExecutionState *festate)
+{
+	char		sql[64];
+
+	/*
+	 * Only one request can be in flight on a connection.  If another scan
+	 * got there first, or left behind a result that nobody claimed, just do
+	 * without; fetch_more_data will fetch synchronously when the time comes.
+	 */
+	if (festate->conn_state->pending_cursor != 0)
+		return;
+
+	snprintf(sql, sizeof(sql), "FETCH %d FROM c%u",
+			 festate->fetch_size, festate->cursor_number);
+
+	pgfdw_send_query(festate->conn, festate->conn_state,
+					 festate->cursor_number, sql);
+	festate->fetch_in_flight = true;
+	festate->fetch_in_flight_size = festate->fetch_size;
+
+	/* Update fetch_ct_2 */
+	if (festate->fetch_ct_2 < 2)
+		festate->fetch_ct_2++;
+}
+
+/*
+ * Make the node's next batch the current one.
+ *
+ * The memory contexts trade places, so the old batch stays valid until the
+ * next call of fetch_more_data.
+ */
+static void
+activate_next_batch(PgFdwExecutionState *festate)
+{
+	MemoryContext cxt = festate->batch_cxt;
+
+	Assert(festate->next_batch_ready);
+
+	if (festate->result_cxt != NULL)
+		collect_result_rows(festate);
+
+	festate->batch_cxt = festate->next_batch_cxt;
+	festate->next_batch_cxt = cxt;
+
+	festate->tuple_values = festate->next_values;
+	festate->tuple_nulls = festate->next_nulls;
+	festate->num_tuples = festate->next_num_tuples;
+	festate->next_tuple = 0;
+
+	festate->next_values = NULL;
+	festate->next_nulls = NULL;
+	festate->next_num_tuples = 0;
+	festate->next_batch_ready = false;
+}
+
+/*
+ * Throw away the node's prefetched batch, if any, after collecting the result
+ * of our FETCH request if it's still in flight.
+ */
+static void
+discard_prefetched_data(PgFdwExecutionState *festate)
+{
+	if (festate->fetch_in_flight)
+	{
+		PGresult   *res;
+
+		festate->fetch_in_flight = false;
+		res = pgfdw_get_pending_result(festate->conn, festate->conn_state,
+									   festate->cursor_number);
+		/* An error would doom our next command anyway, so report it now. */
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+			pgfdw_report_error(ERROR, res, festate->conn, true,
+							   strVal(list_nth(festate->fdw_private,
+											   FdwPrivateSelectSql)));
+		PQclear(res);
 	}
 
-	/*
-	 * Return the next tuple.
-	 */
-	ExecStoreTuple(festate->tuples[festate->next_tuple++],
-				   slot,
-				   InvalidBuffer,
-				   false);
-
-	return slot;
+	festate->next_values = NULL;
+	festate->next_nulls = NULL;
+	festate->next_num_tuples = 0;
+	festate->next_batch_ready = false;
 }
 
 /*
- * postgresReScanForeignScan
- *		Restart the scan.
+ * Prepare to split the node's scan over several connections, one per slice
+ * of the table that the planner made a query for.
+ *
+ * For the slices to add up to the table as one scan would see it, all the
+ * remote transactions must use the same snapshot, so the one of the main
+ * connection's transaction is exported for the others to import.  If that
+ * can't be done, we just scan the table in one piece after all.
  */
 static void
-postgresReScanForeignScan(ForeignScanState *node)
+setup_parallel_scan(PgFdwExecutionState *festate, ForeignServer *server,
+					UserMapping *user, List *partition_sqls)
 {
-	PgFdwExecutionState *festate = (PgFdwExecutionState *) node->fdw_state;
-	char		sql[64];
-	PGresult   *res;
-
-	/*
-	 * Note: we assume that PARAM_EXTERN params don't change over the life of
-	 * the query, so no need to reset extparams_done.
-	 */
+	char	   *snapshot;
+	ListCell   *lc;
+	int			i;
 
-	/* If we haven't created the cursor yet, nothing to do. */
-	if (!festate->cursor_exists)
+	snapshot = pgfdw_export_snapshot(festate->conn);
+	if (snapshot == NULL)
 		return;
 
-	/*
-	 * If any internal parameters affecting this node have changed, we'd
-	 * better destroy and recreate the cursor.	Otherwise, rewinding it should
-	 * be good enough.	If we've only fetched zero or one batch, we needn't
-	 * even rewind the cursor, just rescan what we have.
-	 */
-	if (node->ss.ps.chgParam != NULL)
-	{
-		festate->cursor_exists = false;
-		snprintf(sql, sizeof(sql), "CLOSE c%u",
-				 festate->cursor_number);
-	}
-	else if (festate->fetch_ct_2 > 1)
-	{
-		snprintf(sql, sizeof(sql), "MOVE BACKWARD ALL IN c%u",
-				 festate->cursor_number);
-	}
-	else
+	festate->nstreams = list_length(partition_sqls);
+	festate->streams = (PgFdwStream *)
+		palloc0(festate->nstreams * sizeof(PgFdwStream));
+	festate->next_stream = 0;
+
+	/* Let the extra connections' handshakes proceed all at once */
+	StartWorkerConnections(server, user, festate->nstreams - 1);
+
+	i = 0;
+	foreach(lc, partition_sqls)
 	{
-		/* Easy: just rescan what we already have in memory, if anything */
-		festate->next_tuple = 0;
-		return;
-	}
+		PgFdwStream *stream = &festate->streams[i];
 
-	/*
-	 * We don't use a PG_TRY block here, so be careful not to throw error
-	 * without releasing the PGresult.
-	 */
-	res = PQexec(festate->conn, sql);
-	if (PQresultStatus(res) != PGRES_COMMAND_OK)
-		pgfdw_report_error(ERROR, res, true, sql);
-	PQclear(res);
+		if (i == 0)
+		{
+			stream->conn = festate->conn;
+			stream->conn_state = festate->conn_state;
+			stream->cursor_number = festate->cursor_number;
+		}
+		else
+		{
+			stream->conn = GetWorkerConnection(server, user, i, snapshot,
+											   &stream->conn_state);
+			stream->cursor_number = GetCursorNumber(stream->conn);
+		}
+		stream->sql = strVal(lfirst(lc));
+		i++;
+	}
 
-	/* Now force a fresh FETCH. */
-	festate->tuples = NULL;
-	festate->num_tuples = 0;
-	festate->next_tuple = 0;
-	festate->fetch_ct_2 = 0;
-	festate->eof_reached = false;
+	/* The slices are always read with plain cursors */
+	festate->copy_mode = false;
+	festate->prepared = false;
 }
 
 /*
- * postgresEndForeignScan
- *		Finish scanning foreign table and dispose objects used for this scan
+ * Declare the cursors of all the slices of the node's scan.  Where the
+ * connection is free, the first FETCH goes along, as in create_cursor, so
+ * that all the remote servers' backends get to work at once.
  */
 static void
-postgresEndForeignScan(ForeignScanState *node)
+create_parallel_cursors(PgFdwExecutionState *festate)
 {
-	PgFdwExecutionState *festate = (PgFdwExecutionState *) node->fdw_state;
-
-	/* if festate is NULL, we are in EXPLAIN; nothing to do */
-	if (festate == NULL)
-		return;
+	StringInfoData buf;
+	int			i;
 
-	/* Close the cursor if open, to prevent accumulation of cursors */
-	if (festate->cursor_exists)
-		close_cursor(festate->conn, festate->cursor_number);
+	initStringInfo(&buf);
+	for (i = 0; i < festate->nstreams; i++)
+	{
+		PgFdwStream *stream = &festate->streams[i];
+
+		resetStringInfo(&buf);
+		pgfdw_absorb_pending(stream->conn, stream->conn_state);
+		pgfdw_append_begin(stream->conn, &buf);
+		appendStringInfo(&buf, "DECLARE c%u %sCURSOR FOR\n%s",
+						 stream->cursor_number,
+						 festate->recvmeta ? "BINARY " : "",
+						 stream->sql);
+
+		stream->eof_reached = false;
+		stream->fetch_in_flight = false;
+		if (stream->conn_state->pending_cursor == 0)
+		{
+			appendStringInfo(&buf, "; FETCH %d FROM c%u",
+							 festate->fetch_size, stream->cursor_number);
+			pgfdw_send_query(stream->conn, stream->conn_state,
+							 stream->cursor_number, buf.data);
+			stream->fetch_in_flight = true;
+			stream->fetch_in_flight_size = festate->fetch_size;
+		}
+		else
+		{
+			PGresult   *res;
 
-	/* Release remote connection */
-	ReleaseConnection(festate->conn);
-	festate->conn = NULL;
+			/*
+			 * We don't use a PG_TRY block here, so be careful not to throw
+			 * error without releasing the PGresult.
+			 */
+			stream->conn_state->stats->round_trips++;
+			res = PQexec(stream->conn, buf.data);
+			if (PQresultStatus(res) != PGRES_COMMAND_OK)
+				pgfdw_report_error(ERROR, res, stream->conn, true,
+								   stream->sql);
+			PQclear(res);
+		}
+	}
+	pfree(buf.data);
 
-	/* MemoryContexts will be deleted automatically. */
+	festate->next_stream = 0;
 }
 
 /*
- * Estimate costs of executing given SQL statement.
+ * Fetch the next batch of rows of a scan split over several connections.
+ *
+ * Each slice has a FETCH in flight whenever possible.  We take the rows of
+ * whichever slice's FETCH has completed, trying the slices in turn so none
+ * of them falls behind, and wait only if none has; then that slice's next
+ * FETCH is sent right away.  The rows of the slices thus come interleaved,
+ * in batches.
  */
 static void
-get_remote_estimate(const char *sql, PGconn *conn,
-					double *rows, int *width,
-					Cost *startup_cost, Cost *total_cost)
+fetch_parallel_data(ForeignScanState *node)
 {
+	PgFdwExecutionState *festate = (PgFdwExecutionState *) node->fdw_state;
 	PGresult   *volatile res = NULL;
+	MemoryContext oldcontext;
+
+	Assert(!festate->next_batch_ready);
+
+	/*
+	 * We'll store the tuples in the next_batch_cxt.  First, flush the batch
+	 * previously stored there.
+	 */
+	festate->next_values = NULL;
+	festate->next_nulls = NULL;
+	MemoryContextReset(festate->next_batch_cxt);
+	oldcontext = MemoryContextSwitchTo(festate->next_batch_cxt);
 
 	/* PGresult must be released before leaving this function. */
 	PG_TRY();
 	{
-		StringInfoData buf;
-		char	   *line;
-		char	   *p;
-		int			n;
+		for (;;)
+		{
+			PgFdwStream *stream = NULL;
+			int			fetch_size;
+			int			numrows;
+			int			i;
 
-		/*
-		 * Execute EXPLAIN remotely on given SQL statement.
-		 */
-		initStringInfo(&buf);
-		appendStringInfo(&buf, "EXPLAIN %s", sql);
-		res = PQexec(conn, buf.data);
-		if (PQresultStatus(res) != PGRES_TUPLES_OK)
-			pgfdw_report_error(ERROR, res, false, buf.data);
+			/* Look for a slice whose FETCH is done, else one still going */
+			for (i = 0; i < festate->nstreams; i++)
+			{
+				PgFdwStream *s = &festate->streams[(festate->next_stream + i) %
+												   festate->nstreams];
+
+				if (s->eof_reached)
+					continue;
+				if (s->fetch_in_flight &&
+					pgfdw_pending_ready(s->conn, s->conn_state))
+				{
+					stream = s;
+					break;
+				}
+				if (stream == NULL || (!stream->fetch_in_flight &&
+									   s->fetch_in_flight))
+					stream = s;
+			}
 
-		/*
-		 * Extract cost numbers for topmost plan node.	Note we search for a
-		 * left paren from the end of the line to avoid being confused by
-		 * other uses of parentheses.
-		 */
-		line = PQgetvalue(res, 0, 0);
-		p = strrchr(line, '(');
-		if (p == NULL)
-			elog(ERROR, "could not interpret EXPLAIN output: \"%s\"", line);
-		n = sscanf(p, "(cost=%lf..%lf rows=%lf width=%d)",
-				   startup_cost, total_cost, rows, width);
-		if (n != 4)
-			elog(ERROR, "could not interpret EXPLAIN output: \"%s\"", line);
+			/* Done if all slices reached EOF */
+			if (stream == NULL)
+			{
+				festate->eof_reached = true;
+				break;
+			}
+			festate->next_stream = (stream - festate->streams + 1) %
+				festate->nstreams;
 
-		PQclear(res);
-		res = NULL;
+			if (stream->fetch_in_flight)
+			{
+				fetch_size = stream->fetch_in_flight_size;
+				stream->fetch_in_flight = false;
+				res = pgfdw_get_pending_result(stream->conn,
+											   stream->conn_state,
+											   stream->cursor_number);
+			}
+			else
+			{
+				char		sql[64];
+
+				fetch_size = festate->fetch_size;
+				snprintf(sql, sizeof(sql), "FETCH %d FROM c%u",
+						 fetch_size, stream->cursor_number);
+				pgfdw_absorb_pending(stream->conn, stream->conn_state);
+				stream->conn_state->stats->round_trips++;
+				res = PQexec(stream->conn, sql);
+			}
+
+			/* On error, report the slice's query, not the FETCH. */
+			if (PQresultStatus(res) != PGRES_TUPLES_OK)
+				pgfdw_report_error(ERROR, res, stream->conn, false,
+								   stream->sql);
+
+			numrows = PQntuples(res);
+			stream->eof_reached = (numrows < fetch_size);
+
+			/* Size the next batch according to what this one cost us. */
+			if (festate->fetch_memory > 0 && !stream->eof_reached)
+				adjust_fetch_size(festate, res);
+
+			/* Get the slice's next batch coming, if the connection is free */
+			if (!stream->eof_reached &&
+				stream->conn_state->pending_cursor == 0)
+			{
+				char		sql[64];
+
+				snprintf(sql, sizeof(sql), "FETCH %d FROM c%u",
+						 festate->fetch_size, stream->cursor_number);
+				pgfdw_send_query(stream->conn, stream->conn_state,
+								 stream->cursor_number, sql);
+				stream->fetch_in_flight = true;
+				stream->fetch_in_flight_size = festate->fetch_size;
+			}
+
+			if (numrows > 0)
+			{
+				store_result_batch(node, res);
+				PQclear(res);
+				res = NULL;
+				break;
+			}
+
+			PQclear(res);
+			res = NULL;
+		}
 	}
 	PG_CATCH();
 	{
@@ -879,190 +4744,216 @@ get_remote_estimate(const char *sql, PGconn *conn,
 		PG_RE_THROW();
 	}
 	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcontext);
 }
 
 /*
- * Create cursor for node's query with current parameter values.
+ * Close the cursors of all the slices of the node's scan, after collecting
+ * the results of any FETCH requests still in flight.
  */
 static void
-create_cursor(ForeignScanState *node)
+close_parallel_cursors(PgFdwExecutionState *festate)
 {
-	PgFdwExecutionState *festate = (PgFdwExecutionState *) node->fdw_state;
-	int			numParams = festate->numParams;
-	Oid		   *types = festate->param_types;
-	const char **values = festate->param_values;
-	PGconn	   *conn = festate->conn;
-	char	   *sql;
-	StringInfoData buf;
-	PGresult   *res;
+	int			i;
 
-	/*
-	 * Construct array of external parameter values in text format.  Since
-	 * there might be random unconvertible stuff in the ParamExternData array,
-	 * take care to convert only values we actually need.
-	 *
-	 * Note that we leak the memory for the value strings until end of query;
-	 * this doesn't seem like a big problem, and in any case we might need to
-	 * recreate the cursor after a rescan, so we could need to re-use the
-	 * values anyway.
-	 */
-	if (numParams > 0 && !festate->extparams_done)
+	for (i = 0; i < festate->nstreams; i++)
 	{
-		ParamListInfo params = node->ss.ps.state->es_param_list_info;
-		int			nestlevel;
-		List	   *param_numbers;
-		ListCell   *lc;
+		PgFdwStream *stream = &festate->streams[i];
 
-		nestlevel = set_transmission_modes();
-
-		param_numbers = (List *)
-			list_nth(festate->fdw_private, FdwPrivateExternParamIds);
-		foreach(lc, param_numbers)
+		if (stream->fetch_in_flight)
 		{
-			int			paramno = lfirst_int(lc);
-			ParamExternData *prm = &params->params[paramno - 1];
-
-			/* give hook a chance in case parameter is dynamic */
-			if (!OidIsValid(prm->ptype) && params->paramFetch != NULL)
-				params->paramFetch(params, paramno);
+			PGresult   *res;
 
-			/*
-			 * Force the remote server to infer a type for this parameter.
-			 * Since we explicitly cast every parameter (see deparse.c), the
-			 * "inference" is trivial and will produce the desired result.
-			 * This allows us to avoid assuming that the remote server has the
-			 * same OIDs we do for the parameters' types.
-			 *
-			 * We'd not need to pass a type array to PQexecParams at all,
-			 * except that there may be unused holes in the array, which
-			 * will have to be filled with something or the remote server will
-			 * complain.  We arbitrarily set them to INT4OID earlier.
-			 */
-			types[paramno - 1] = InvalidOid;
+			stream->fetch_in_flight = false;
+			res = pgfdw_get_pending_result(stream->conn, stream->conn_state,
+										   stream->cursor_number);
+			/* An error would doom the CLOSE anyway, so report it now. */
+			if (PQresultStatus(res) != PGRES_TUPLES_OK)
+				pgfdw_report_error(ERROR, res, stream->conn, true,
+								   stream->sql);
+			PQclear(res);
+		}
+		close_cursor(stream->conn, stream->conn_state, stream->cursor_number);
+	}
+}
 
-			/*
-			 * Get string representation of each parameter value by invoking
-			 * type-specific output function, unless the value is null.
-			 */
-			if (prm->isnull)
-				values[paramno - 1] = NULL;
-			else
-			{
-				Oid			out_func;
-				bool		isvarlena;
+/*
+ * Choose the number of rows to request in the next FETCH of an adaptive scan.
+ *
+ * We estimate the memory that one row of the just-retrieved batch occupied,
+ * counting both the PGresult held by libpq and the values we decoded from it,
+ * and pick as many rows as fit into the scan's memory budget.  So that a few
+ * unrepresentative rows at the start can't cause a huge jump, the batch size
+ * is allowed to grow by at most a factor of two per fetch; shrinking takes
+ * effect immediately, though, since that's what protects the memory limit.
+ */
+static void
+adjust_fetch_size(PgFdwExecutionState *festate, PGresult *res)
+{
+	int			numrows = PQntuples(res);
+	int			numfields = PQnfields(res);
+	int			natts = RelationGetDescr(festate->rel)->natts;
+	double		batch_bytes = 0;
+	double		row_bytes;
+	double		target;
+	int			i;
+	int			j;
 
-				getTypeOutputInfo(prm->ptype, &out_func, &isvarlena);
-				values[paramno - 1] = OidOutputFunctionCall(out_func,
-															prm->value);
-			}
-		}
-		reset_transmission_modes(nestlevel);
+	if (numrows <= 0)
+		return;
 
-		festate->extparams_done = true;
+	for (i = 0; i < numrows; i++)
+	{
+		for (j = 0; j < numfields; j++)
+			batch_bytes += PQgetlength(res, i, j);
 	}
 
-	/* Construct the DECLARE CURSOR command */
-	sql = strVal(list_nth(festate->fdw_private, FdwPrivateSelectSql));
-	initStringInfo(&buf);
-	appendStringInfo(&buf, "DECLARE c%u CURSOR FOR\n%s",
-					 festate->cursor_number, sql);
-
 	/*
-	 * We don't use a PG_TRY block here, so be careful not to throw error
-	 * without releasing the PGresult.
+	 * Each value is stored twice (raw in the PGresult, and decoded in the
+	 * batch), and each one carries some fixed overhead in both places: the
+	 * PGresult's length word, and our Datum and null flag.
 	 */
-	res = PQexecParams(conn, buf.data, numParams, types, values,
-					   NULL, NULL, 0);
-	if (PQresultStatus(res) != PGRES_COMMAND_OK)
-		pgfdw_report_error(ERROR, res, true, sql);
-	PQclear(res);
+	row_bytes = 2 * batch_bytes / numrows +
+		numfields * (sizeof(Datum) + sizeof(bool) + sizeof(int));
 
-	/* Mark the cursor as created, and show no tuples have been retrieved */
-	festate->cursor_exists = true;
-	festate->tuples = NULL;
-	festate->num_tuples = 0;
-	festate->next_tuple = 0;
-	festate->fetch_ct_2 = 0;
-	festate->eof_reached = false;
+	target = (double) festate->fetch_memory / row_bytes;
+	target = Min(target, 2.0 * festate->fetch_size);
+	target = Min(target, (double) (MaxAllocSize / (Max(natts, 1) * sizeof(Datum))));
+	festate->fetch_size = (target < 1.0) ? 1 : (int) target;
+}
 
-	/* Clean up */
-	pfree(buf.data);
+/*
+ * Check whether data can be exchanged with the remote server in binary
+ * format.  That requires the binary representations of (built-in) types to
+ * be the same as ours, which we can rely on only if the remote server is of
+ * the same major version, and was built with the same datetime format.
+ */
+static bool
+binary_transfer_possible(PGconn *conn)
+{
+	const char *integer_datetimes;
+
+	if (PQserverVersion(conn) / 100 != PG_VERSION_NUM / 100)
+		return false;
+
+	integer_datetimes = PQparameterStatus(conn, "integer_datetimes");
+	if (integer_datetimes == NULL)
+		return false;
+#ifdef HAVE_INT64_TIMESTAMP
+	return strcmp(integer_datetimes, "on") == 0;
+#else
+	return strcmp(integer_datetimes, "off") == 0;
+#endif
 }
 
 /*
- * Fetch some more rows from the node's cursor.
+ * Build the metadata for converting binary-format values of the given tuple
+ * descriptor.  The attributes marked as binary must be those that
+ * deparseSimpleSql didn't cast to text.
  */
-static void
-fetch_more_data(ForeignScanState *node)
+static AttRecvMetadata *
+make_recv_metadata(TupleDesc tupdesc)
 {
-	PgFdwExecutionState *festate = (PgFdwExecutionState *) node->fdw_state;
-	PGresult   *volatile res = NULL;
-	MemoryContext oldcontext;
+	AttRecvMetadata *recvmeta;
+	int			natts = tupdesc->natts;
+	int			i;
 
-	/*
-	 * We'll store the tuples in the batch_cxt.  First, flush the previous
-	 * batch.
-	 */
-	festate->tuples = NULL;
-	MemoryContextReset(festate->batch_cxt);
-	oldcontext = MemoryContextSwitchTo(festate->batch_cxt);
+	recvmeta = (AttRecvMetadata *) palloc(sizeof(AttRecvMetadata));
+	recvmeta->attbinary = (bool *) palloc0(natts * sizeof(bool));
+	recvmeta->attrecvfuncs = (FmgrInfo *) palloc0(natts * sizeof(FmgrInfo));
 
-	/* PGresult must be released before leaving this function. */
-	PG_TRY();
+	for (i = 0; i < natts; i++)
 	{
-		PGconn	   *conn = festate->conn;
-		char		sql[64];
-		int			fetch_size;
-		int			numrows;
-		int			i;
+		Form_pg_attribute attr = tupdesc->attrs[i];
+		Oid			recv_func;
+		Oid			typioparam;
+
+		if (attr->attisdropped || !is_binary_safe_type(attr->atttypid))
+			continue;
+
+		getTypeBinaryInputInfo(attr->atttypid, &recv_func, &typioparam);
+		fmgr_info(recv_func, &recvmeta->attrecvfuncs[i]);
+		recvmeta->attbinary[i] = true;
+	}
+
+	return recvmeta;
+}
 
-		/* The fetch size is arbitrary, but shouldn't be enormous. */
-		fetch_size = 100;
+/*
+ * Build the decoder plan of a scan: for each attribute of tupdesc, choose how
+ * to convert its values when they arrive in text format.
+ *
+ * Attributes not in retrieved_attrs are replaced by NULL in the remote query,
+ * so unless a domain's input function might want to see the null (to reject
+ * it), they needn't be converted at all.  Retrieved attributes of common
+ * built-in types get a specialized decoder.  Note that domains over these
+ * types have OIDs of their own, so they always take the generic path.
+ */
+static PgFdwDecoder *
+make_decoder_plan(TupleDesc tupdesc, List *retrieved_attrs)
+{
+	PgFdwDecoder *decoders;
+	int			natts = tupdesc->natts;
+	int			i;
 
-		snprintf(sql, sizeof(sql), "FETCH %d FROM c%u",
-				 fetch_size, festate->cursor_number);
+	decoders = (PgFdwDecoder *) palloc(natts * sizeof(PgFdwDecoder));
 
-		res = PQexec(conn, sql);
-		/* On error, report the original query, not the FETCH. */
-		if (PQresultStatus(res) != PGRES_TUPLES_OK)
-			pgfdw_report_error(ERROR, res, false,
-							   strVal(list_nth(festate->fdw_private,
-											   FdwPrivateSelectSql)));
+	for (i = 0; i < natts; i++)
+	{
+		Form_pg_attribute attr = tupdesc->attrs[i];
 
-		/* Convert the data into HeapTuples */
-		numrows = PQntuples(res);
-		festate->tuples = (HeapTuple *) palloc0(numrows * sizeof(HeapTuple));
-		festate->num_tuples = numrows;
-		festate->next_tuple = 0;
+		decoders[i] = PGFDW_DECODE_GENERIC;
 
-		for (i = 0; i < numrows; i++)
+		if (attr->attisdropped)
+			continue;
+
+		if (!list_member_int(retrieved_attrs, i + 1))
 		{
-			festate->tuples[i] =
-				make_tuple_from_result_row(res, i,
-										   festate->rel,
-										   festate->attinmeta,
-										   festate->temp_cxt);
+			if (get_typtype(attr->atttypid) != TYPTYPE_DOMAIN)
+				decoders[i] = PGFDW_DECODE_SKIP;
+			continue;
 		}
 
-		/* Update fetch_ct_2 */
-		if (festate->fetch_ct_2 < 2)
-			festate->fetch_ct_2++;
-
-		/* Must be EOF if we didn't get as many tuples as we asked for. */
-		festate->eof_reached = (numrows < fetch_size);
-
-		PQclear(res);
-		res = NULL;
-	}
-	PG_CATCH();
-	{
-		if (res)
-			PQclear(res);
-		PG_RE_THROW();
+		switch (attr->atttypid)
+		{
+			case INT2OID:
+				decoders[i] = PGFDW_DECODE_INT2;
+				break;
+			case INT4OID:
+				decoders[i] = PGFDW_DECODE_INT4;
+				break;
+			case INT8OID:
+				decoders[i] = PGFDW_DECODE_INT8;
+				break;
+			case FLOAT8OID:
+				decoders[i] = PGFDW_DECODE_FLOAT8;
+				break;
+			case BOOLOID:
+				decoders[i] = PGFDW_DECODE_BOOL;
+				break;
+			case TEXTOID:
+				decoders[i] = PGFDW_DECODE_TEXT;
+				break;
+			case VARCHAROID:
+				decoders[i] = PGFDW_DECODE_VARCHAR;
+				break;
+			case DATEOID:
+				decoders[i] = PGFDW_DECODE_DATE;
+				break;
+#ifdef HAVE_INT64_TIMESTAMP
+			case TIMESTAMPOID:
+				/* a typmod means rounding; leave that to timestamp_in */
+				if (attr->atttypmod < 0)
+					decoders[i] = PGFDW_DECODE_TIMESTAMP;
+				break;
+#endif
+			default:
+				break;
+		}
 	}
-	PG_END_TRY();
 
-	MemoryContextSwitchTo(oldcontext);
+	return decoders;
 }
 
 /*
@@ -1119,7 +5010,8 @@ reset_transmission_modes(int nestlevel)
  * Utility routine to close a cursor.
  */
 static void
-close_cursor(PGconn *conn, unsigned int cursor_number)
+close_cursor(PGconn *conn, PgFdwConnState *conn_state,
+			 unsigned int cursor_number)
 {
 	char		sql[64];
 	PGresult   *res;
@@ -1130,9 +5022,11 @@ close_cursor(PGconn *conn, unsigned int cursor_number)
 	 * We don't use a PG_TRY block here, so be careful not to throw error
 	 * without releasing the PGresult.
 	 */
+	pgfdw_absorb_pending(conn, conn_state);
+	conn_state->stats->round_trips++;
 	res = PQexec(conn, sql);
 	if (PQresultStatus(res) != PGRES_COMMAND_OK)
-		pgfdw_report_error(ERROR, res, true, sql);
+		pgfdw_report_error(ERROR, res, conn, true, sql);
 	PQclear(res);
 }
 
@@ -1155,6 +5049,13 @@ postgresAnalyzeForeignTable(Relation relation,
 	/* Return the row-analysis function pointer */
 	*func = postgresAcquireSampleRowsFunc;
 
+	/* A table defined by a remote query has no size of its own. */
+	if (get_remote_query(RelationGetRelid(relation)) != NULL)
+	{
+		*totalpages = 0;
+		return true;
+	}
+
 	/*
 	 * Now we have to get the number of pages.  It's annoying that the ANALYZE
 	 * API requires us to return that now, because it forces some duplication
@@ -1169,7 +5070,7 @@ postgresAnalyzeForeignTable(Relation relation,
 	table = GetForeignTable(RelationGetRelid(relation));
 	server = GetForeignServer(table->serverid);
 	user = GetUserMapping(relation->rd_rel->relowner, server->serverid);
-	conn = GetConnection(server, user);
+	conn = GetConnection(server, user, false, NULL);
 
 	/*
 	 * Construct command to get page count for relation.
@@ -1180,9 +5081,10 @@ postgresAnalyzeForeignTable(Relation relation,
 	/* In what follows, do not risk leaking any PGresults. */
 	PG_TRY();
 	{
+		GetConnectionStats(conn)->round_trips++;
 		res = PQexec(conn, sql.data);
 		if (PQresultStatus(res) != PGRES_TUPLES_OK)
-			pgfdw_report_error(ERROR, res, false, sql.data);
+			pgfdw_report_error(ERROR, res, conn, false, sql.data);
 
 		if (PQntuples(res) != 1 || PQnfields(res) != 1)
 			elog(ERROR, "unexpected result from deparseAnalyzeSizeSql query");
@@ -1208,6 +5110,8 @@ postgresAnalyzeForeignTable(Relation relation,
  * Acquire a random sample of rows from foreign table managed by postgres_fdw.
  *
  * We fetch the whole table from the remote side and pick out some sample rows.
+ * For big tables, the remote side can be asked to return only a sample of
+ * roughly the desired size instead (see the analyze_sampling option).
  *
  * Selected rows are returned in the caller-allocated array rows[],
  * which must have at least targrows entries.
@@ -1231,7 +5135,14 @@ postgresAcquireSampleRowsFunc(Relation relation, int elevel,
 	ForeignServer *server;
 	UserMapping *user;
 	PGconn	   *conn;
+	PgFdwConnState *conn_state;
 	unsigned int cursor_number;
+	int			fetch_size;
+	bool		import_stats;
+	PgFdwSamplingMethod sample_method;
+	double		sample_frac = 1.0;
+	double		reltuples = -1;
+	ListCell   *lc;
 	StringInfoData sql;
 	PGresult   *volatile res = NULL;
 
@@ -1261,7 +5172,97 @@ postgresAcquireSampleRowsFunc(Relation relation, int elevel,
 	table = GetForeignTable(RelationGetRelid(relation));
 	server = GetForeignServer(table->serverid);
 	user = GetUserMapping(relation->rd_rel->relowner, server->serverid);
-	conn = GetConnection(server, user);
+	conn = GetConnection(server, user, false, &conn_state);
+
+	/*
+	 * Use the scan's fetch_size for retrieval here, too.  Adaptive sizing
+	 * isn't worth the trouble, since we keep only targrows rows anyway.
+	 */
+	fetch_size = DEFAULT_FETCH_SIZE;
+	import_stats = false;
+	sample_method = ANALYZE_SAMPLE_AUTO;
+	foreach(lc, server->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "fetch_size") == 0)
+			fetch_size = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "import_remote_stats") == 0)
+			import_stats = defGetBoolean(def);
+		else if (strcmp(def->defname, "analyze_sampling") == 0)
+			sample_method = parse_sampling_method(defGetString(def));
+	}
+	foreach(lc, table->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "fetch_size") == 0)
+			fetch_size = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "import_remote_stats") == 0)
+			import_stats = defGetBoolean(def);
+		else if (strcmp(def->defname, "analyze_sampling") == 0)
+			sample_method = parse_sampling_method(defGetString(def));
+	}
+
+	/*
+	 * If requested, try to copy the remote server's own statistics rather
+	 * than pulling the whole table over.  We then hand back no sample rows,
+	 * which makes ANALYZE skip computing statistics of its own while still
+	 * recording *totalrows in pg_class.
+	 */
+	if (import_stats)
+	{
+		if (import_remote_stats(relation, conn, totalrows))
+		{
+			ReleaseConnection(conn);
+			MemoryContextDelete(astate.temp_cxt);
+
+			*totaldeadrows = 0.0;
+
+			ereport(elevel,
+					(errmsg("\"%s\": imported remote statistics, table contains %.0f rows",
+							RelationGetRelationName(relation),
+							*totalrows)));
+
+			return 0;
+		}
+
+		ereport(elevel,
+				(errmsg("\"%s\": remote statistics not usable, sampling rows instead",
+						RelationGetRelationName(relation))));
+	}
+
+	/*
+	 * Unless told otherwise, have the remote server do the sampling, so that
+	 * only about targrows rows come over the wire.  The sampling fraction is
+	 * derived from the remote reltuples; if that is unknown, or we'd want
+	 * nearly all rows anyway, just fetch the whole table.  The local
+	 * reservoir sampling below still caps the sample at targrows.
+	 */
+	if (sample_method != ANALYZE_SAMPLE_OFF)
+	{
+		/* TABLESAMPLE appeared in 9.5. */
+		bool		can_tablesample = (PQserverVersion(conn) >= 90500);
+
+		if (sample_method == ANALYZE_SAMPLE_AUTO)
+			sample_method = can_tablesample ? ANALYZE_SAMPLE_BERNOULLI :
+				ANALYZE_SAMPLE_RANDOM;
+		else if (!can_tablesample && sample_method != ANALYZE_SAMPLE_RANDOM)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("remote server does not support TABLESAMPLE")));
+
+		/*
+		 * Sampling isn't worth it if we want nearly all the rows anyway; and
+		 * if the fraction came out as zero (or NaN), say because reltuples is
+		 * bogus, scan the whole table rather than get no sample at all.
+		 */
+		reltuples = get_remote_reltuples(relation, conn);
+		if (reltuples > 0)
+			sample_frac = targrows / reltuples;
+		if (reltuples <= 0 || !(sample_frac > 0.0 && sample_frac <= 0.95))
+			sample_method = ANALYZE_SAMPLE_OFF;
+	}
 
 	/*
 	 * Construct cursor that retrieves whole rows from remote.
@@ -1269,14 +5270,15 @@ postgresAcquireSampleRowsFunc(Relation relation, int elevel,
 	cursor_number = GetCursorNumber(conn);
 	initStringInfo(&sql);
 	appendStringInfo(&sql, "DECLARE c%u CURSOR FOR ", cursor_number);
-	deparseAnalyzeSql(&sql, relation);
+	deparseAnalyzeSql(&sql, relation, sample_method, sample_frac);
 
 	/* In what follows, do not risk leaking any PGresults. */
 	PG_TRY();
 	{
+		conn_state->stats->round_trips++;
 		res = PQexec(conn, sql.data);
 		if (PQresultStatus(res) != PGRES_COMMAND_OK)
-			pgfdw_report_error(ERROR, res, false, sql.data);
+			pgfdw_report_error(ERROR, res, conn, false, sql.data);
 		PQclear(res);
 		res = NULL;
 
@@ -1284,7 +5286,6 @@ postgresAcquireSampleRowsFunc(Relation relation, int elevel,
 		for (;;)
 		{
 			char		fetch_sql[64];
-			int			fetch_size;
 			int			numrows;
 			int			i;
 
@@ -1297,59 +5298,466 @@ postgresAcquireSampleRowsFunc(Relation relation, int elevel,
 			 * then just adjust rowstoskip and samplerows appropriately.
 			 */
 
-			/* The fetch size is arbitrary, but shouldn't be enormous. */
-			fetch_size = 100;
-
 			/* Fetch some rows */
 			snprintf(fetch_sql, sizeof(fetch_sql), "FETCH %d FROM c%u",
 					 fetch_size, cursor_number);
 
+			conn_state->stats->round_trips++;
 			res = PQexec(conn, fetch_sql);
 			/* On error, report the original query, not the FETCH. */
 			if (PQresultStatus(res) != PGRES_TUPLES_OK)
-				pgfdw_report_error(ERROR, res, false, sql.data);
+				pgfdw_report_error(ERROR, res, conn, false, sql.data);
 
 			/* Process whatever we got. */
 			numrows = PQntuples(res);
 			for (i = 0; i < numrows; i++)
 				analyze_row_processor(res, i, &astate);
 
-			PQclear(res);
-			res = NULL;
+			PQclear(res);
+			res = NULL;
+
+			/* Must be EOF if we didn't get all the rows requested. */
+			if (numrows < fetch_size)
+				break;
+		}
+
+		/* Close the cursor, just to be tidy. */
+		close_cursor(conn, conn_state, cursor_number);
+	}
+	PG_CATCH();
+	{
+		if (res)
+			PQclear(res);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	ReleaseConnection(conn);
+
+	/* We assume that we have no dead tuple. */
+	*totaldeadrows = 0.0;
+
+	/*
+	 * Without remote sampling, we've retrieved all living tuples from foreign
+	 * server.  Otherwise we have to trust its estimate.
+	 */
+	if (sample_method == ANALYZE_SAMPLE_OFF)
+		*totalrows = astate.samplerows;
+	else
+		*totalrows = reltuples;
+
+	/*
+	 * Emit some interesting relation info
+	 */
+	ereport(elevel,
+			(errmsg("\"%s\": table contains %.0f rows, %d rows in sample",
+					RelationGetRelationName(relation),
+					*totalrows, astate.numrows)));
+
+	return astate.numrows;
+}
+
+/*
+ * Convert a validated analyze_sampling option value to its enum value.
+ */
+static PgFdwSamplingMethod
+parse_sampling_method(const char *value)
+{
+	if (strcmp(value, "off") == 0)
+		return ANALYZE_SAMPLE_OFF;
+	if (strcmp(value, "random") == 0)
+		return ANALYZE_SAMPLE_RANDOM;
+	if (strcmp(value, "system") == 0)
+		return ANALYZE_SAMPLE_SYSTEM;
+	if (strcmp(value, "bernoulli") == 0)
+		return ANALYZE_SAMPLE_BERNOULLI;
+	return ANALYZE_SAMPLE_AUTO;
+}
+
+/*
+ * Fetch the remote reltuples of a foreign table, which is zero (or, on
+ * newer servers, -1) if the remote table was never vacuumed or analyzed.
+ */
+static double
+get_remote_reltuples(Relation relation, PGconn *conn)
+{
+	StringInfoData sql;
+	PGresult   *volatile res = NULL;
+	double		reltuples = -1;
+
+	/* A table defined by a remote query has no pg_class entry */
+	if (get_remote_query(RelationGetRelid(relation)) != NULL)
+		return -1;
+
+	initStringInfo(&sql);
+	deparseAnalyzeTuplesSql(&sql, relation);
+
+	/* In what follows, do not risk leaking any PGresults. */
+	PG_TRY();
+	{
+		GetConnectionStats(conn)->round_trips++;
+		res = PQexec(conn, sql.data);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+			pgfdw_report_error(ERROR, res, conn, false, sql.data);
+
+		if (PQntuples(res) != 1 || PQnfields(res) != 1)
+			elog(ERROR, "unexpected result from deparseAnalyzeTuplesSql query");
+		reltuples = strtod(PQgetvalue(res, 0, 0), NULL);
+
+		PQclear(res);
+		res = NULL;
+	}
+	PG_CATCH();
+	{
+		if (res)
+			PQclear(res);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	return reltuples;
+}
+
+/*
+ * Copy the remote planner statistics of a foreign table into pg_statistic.
+ *
+ * This only works if every local column maps to a remote column of the same
+ * type, whose values can be read back locally, and the remote table has been
+ * analyzed; otherwise nothing is written and false is returned, so that the
+ * caller can sample rows instead.  On
+ * success the remote reltuples is returned into *totalrows.
+ *
+ * Statistics kinds other than MCV, histogram and correlation are not
+ * imported.  Collation-sensitive statistics are taken on trust: if the
+ * remote column sorts differently than the local one, the histogram will
+ * be somewhat off.
+ */
+static bool
+import_remote_stats(Relation relation, PGconn *conn, double *totalrows)
+{
+	TupleDesc	tupdesc = RelationGetDescr(relation);
+	StringInfoData sql;
+	PGresult   *volatile res = NULL;
+	volatile bool ok = true;
+	int			natts;
+	int			i;
+
+	/* A table defined by a remote query has no statistics to import */
+	if (get_remote_query(RelationGetRelid(relation)) != NULL)
+		return false;
+
+	initStringInfo(&sql);
+	if (!deparseAnalyzeStatsSql(&sql, relation))
+		return false;
+
+	natts = 0;
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		if (!tupdesc->attrs[i]->attisdropped)
+			natts++;
+	}
+
+	/* In what follows, do not risk leaking any PGresults. */
+	PG_TRY();
+	{
+		int			ntuples;
+
+		GetConnectionStats(conn)->round_trips++;
+		res = PQexec(conn, sql.data);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+			pgfdw_report_error(ERROR, res, conn, false, sql.data);
+
+		if (PQnfields(res) != 11)
+			elog(ERROR, "unexpected result from deparseAnalyzeStatsSql query");
+		ntuples = PQntuples(res);
+
+		/*
+		 * A never-analyzed remote table shows zero reltuples; sampling is
+		 * the only way to learn anything about it then.
+		 */
+		if (ntuples != natts || strtod(PQgetvalue(res, 0, 3), NULL) <= 0)
+			ok = false;
+
+		/* Check all columns before touching the catalog. */
+		for (i = 0; ok && i < ntuples; i++)
+		{
+			int			attnum = atoi(PQgetvalue(res, i, 0));
+			Form_pg_attribute attr = tupdesc->attrs[attnum - 1];
+
+			if (PQgetisnull(res, i, 1) || PQgetisnull(res, i, 4) ||
+				!remote_type_matches(attr->atttypid,
+									 PQgetvalue(res, i, 1),
+									 PQgetvalue(res, i, 2)))
+				ok = false;
+		}
+
+		if (ok)
+			ok = store_all_remote_stats(relation, res);
+		if (ok)
+			*totalrows = strtod(PQgetvalue(res, 0, 3), NULL);
+
+		PQclear(res);
+		res = NULL;
+	}
+	PG_CATCH();
+	{
+		if (res)
+			PQclear(res);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	return ok;
+}
+
+/*
+ * Store the statistics of all columns of the deparseAnalyzeStatsSql result
+ * into pg_statistic, and return true; or, if the remote values aren't valid
+ * for the local column types, store nothing and return false.
+ *
+ * A local type of the same name as the remote one needn't be the same type:
+ * an enum, say, may have other labels.  So the values are parsed in a
+ * subtransaction, which is rolled back, catalog updates and all, if that
+ * fails with a data exception.
+ */
+static bool
+store_all_remote_stats(Relation relation, PGresult *res)
+{
+	TupleDesc	tupdesc = RelationGetDescr(relation);
+	MemoryContext oldcontext = CurrentMemoryContext;
+	ResourceOwner oldowner = CurrentResourceOwner;
+	volatile bool ok = true;
+
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_TRY();
+	{
+		Relation	sd;
+		int			i;
+
+		sd = heap_open(StatisticRelationId, RowExclusiveLock);
+		for (i = 0; i < PQntuples(res); i++)
+		{
+			int			attnum = atoi(PQgetvalue(res, i, 0));
+			Form_pg_attribute attr = tupdesc->attrs[attnum - 1];
+
+			/* Honor SET STATISTICS 0, as ANALYZE itself does. */
+			if (attr->attstattarget == 0)
+				continue;
+
+			store_remote_stats(sd, relation, attr, res, i);
+		}
+		heap_close(sd, RowExclusiveLock);
+
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcontext);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+
+		if (ERRCODE_TO_CATEGORY(edata->sqlerrcode) != ERRCODE_DATA_EXCEPTION)
+			ReThrowError(edata);
+		FreeErrorData(edata);
+		ok = false;
+	}
+	PG_END_TRY();
+
+	return ok;
+}
+
+/*
+ * Check whether the given local type has the given remote schema and name.
+ */
+static bool
+remote_type_matches(Oid typid, const char *nspname, const char *typname)
+{
+	HeapTuple	tuple;
+	Form_pg_type typform;
+	bool		result;
+
+	tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(typid));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for type %u", typid);
+	typform = (Form_pg_type) GETSTRUCT(tuple);
+
+	result = (strcmp(NameStr(typform->typname), typname) == 0 &&
+			  strcmp(get_namespace_name(typform->typnamespace), nspname) == 0);
+
+	ReleaseSysCache(tuple);
+
+	return result;
+}
+
+/*
+ * Form a pg_statistic entry for one column from a row of the
+ * deparseAnalyzeStatsSql result, and insert or replace it.
+ *
+ * This follows update_attstats() in commands/analyze.c.
+ */
+static void
+store_remote_stats(Relation sd, Relation relation, Form_pg_attribute attr,
+				   PGresult *res, int row)
+{
+	Datum		values[Natts_pg_statistic];
+	bool		nulls[Natts_pg_statistic];
+	bool		replaces[Natts_pg_statistic];
+	int			kind[STATISTIC_NUM_SLOTS];
+	Oid			op[STATISTIC_NUM_SLOTS];
+	Datum		numbers[STATISTIC_NUM_SLOTS];
+	Datum		vals[STATISTIC_NUM_SLOTS];
+	int			nslots = 0;
+	Oid			ltopr;
+	Oid			eqopr;
+	HeapTuple	stup,
+				oldtup;
+	int			i,
+				k;
+
+	get_sort_group_operators(attr->atttypid, false, false, false,
+							 &ltopr, &eqopr, NULL, NULL);
+
+	/* Most common values and their frequencies */
+	if (OidIsValid(eqopr) &&
+		!PQgetisnull(res, row, 7) && !PQgetisnull(res, row, 8))
+	{
+		kind[nslots] = STATISTIC_KIND_MCV;
+		op[nslots] = eqopr;
+		numbers[nslots] = parse_stats_array(PQgetvalue(res, row, 8), FLOAT4OID);
+		vals[nslots] = parse_stats_array(PQgetvalue(res, row, 7),
+										 attr->atttypid);
+		nslots++;
+	}
+
+	/* Histogram bounds */
+	if (OidIsValid(ltopr) && !PQgetisnull(res, row, 9))
+	{
+		kind[nslots] = STATISTIC_KIND_HISTOGRAM;
+		op[nslots] = ltopr;
+		numbers[nslots] = (Datum) 0;
+		vals[nslots] = parse_stats_array(PQgetvalue(res, row, 9),
+										 attr->atttypid);
+		nslots++;
+	}
+
+	/* Physical-order correlation */
+	if (OidIsValid(ltopr) && !PQgetisnull(res, row, 10))
+	{
+		Datum		corr;
+
+		corr = Float4GetDatum((float4) strtod(PQgetvalue(res, row, 10), NULL));
+		kind[nslots] = STATISTIC_KIND_CORRELATION;
+		op[nslots] = ltopr;
+		numbers[nslots] = PointerGetDatum(construct_array(&corr, 1, FLOAT4OID,
+														  sizeof(float4),
+														  FLOAT4PASSBYVAL,
+														  'i'));
+		vals[nslots] = (Datum) 0;
+		nslots++;
+	}
+
+	for (i = 0; i < Natts_pg_statistic; ++i)
+	{
+		nulls[i] = false;
+		replaces[i] = true;
+	}
+
+	values[Anum_pg_statistic_starelid - 1] =
+		ObjectIdGetDatum(RelationGetRelid(relation));
+	values[Anum_pg_statistic_staattnum - 1] = Int16GetDatum(attr->attnum);
+	values[Anum_pg_statistic_stainherit - 1] = BoolGetDatum(false);
+	values[Anum_pg_statistic_stanullfrac - 1] =
+		Float4GetDatum((float4) strtod(PQgetvalue(res, row, 4), NULL));
+	values[Anum_pg_statistic_stawidth - 1] =
+		Int32GetDatum(atoi(PQgetvalue(res, row, 5)));
+	values[Anum_pg_statistic_stadistinct - 1] =
+		Float4GetDatum((float4) strtod(PQgetvalue(res, row, 6), NULL));
+
+	for (k = 0; k < STATISTIC_NUM_SLOTS; k++)
+	{
+		bool		used = (k < nslots);
+
+		values[Anum_pg_statistic_stakind1 - 1 + k] =
+			Int16GetDatum(used ? kind[k] : 0);
+		values[Anum_pg_statistic_staop1 - 1 + k] =
+			ObjectIdGetDatum(used ? op[k] : InvalidOid);
 
-			/* Must be EOF if we didn't get all the rows requested. */
-			if (numrows < fetch_size)
-				break;
+		i = Anum_pg_statistic_stanumbers1 - 1 + k;
+		if (used && numbers[k] != (Datum) 0)
+			values[i] = numbers[k];
+		else
+		{
+			nulls[i] = true;
+			values[i] = (Datum) 0;
 		}
 
-		/* Close the cursor, just to be tidy. */
-		close_cursor(conn, cursor_number);
+		i = Anum_pg_statistic_stavalues1 - 1 + k;
+		if (used && vals[k] != (Datum) 0)
+			values[i] = vals[k];
+		else
+		{
+			nulls[i] = true;
+			values[i] = (Datum) 0;
+		}
 	}
-	PG_CATCH();
+
+	/* Is there already a pg_statistic tuple for this attribute? */
+	oldtup = SearchSysCache3(STATRELATTINH,
+							 ObjectIdGetDatum(RelationGetRelid(relation)),
+							 Int16GetDatum(attr->attnum),
+							 BoolGetDatum(false));
+
+	if (HeapTupleIsValid(oldtup))
 	{
-		if (res)
-			PQclear(res);
-		PG_RE_THROW();
+		/* Yes, replace it */
+		stup = heap_modify_tuple(oldtup,
+								 RelationGetDescr(sd),
+								 values,
+								 nulls,
+								 replaces);
+		ReleaseSysCache(oldtup);
+		simple_heap_update(sd, &stup->t_self, stup);
+	}
+	else
+	{
+		/* No, insert new tuple */
+		stup = heap_form_tuple(RelationGetDescr(sd), values, nulls);
+		simple_heap_insert(sd, stup);
 	}
-	PG_END_TRY();
 
-	ReleaseConnection(conn);
+	/* update indexes too */
+	CatalogUpdateIndexes(sd, stup);
 
-	/* We assume that we have no dead tuple. */
-	*totaldeadrows = 0.0;
+	heap_freetuple(stup);
+}
+
+/*
+ * Convert the text form of a statistics array to an array of elemtype.
+ */
+static Datum
+parse_stats_array(const char *str, Oid elemtype)
+{
+	Oid			arraytype = get_array_type(elemtype);
+	Oid			infunc;
+	Oid			ioparam;
 
-	/* We've retrieved all living tuples from foreign server. */
-	*totalrows = astate.samplerows;
+	if (!OidIsValid(arraytype))
+		elog(ERROR, "could not find array type for data type %s",
+			 format_type_be(elemtype));
 
-	/*
-	 * Emit some interesting relation info
-	 */
-	ereport(elevel,
-			(errmsg("\"%s\": table contains %.0f rows, %d rows in sample",
-					RelationGetRelationName(relation),
-					astate.samplerows, astate.numrows)));
+	getTypeInputInfo(arraytype, &infunc, &ioparam);
 
-	return astate.numrows;
+	return OidInputFunctionCall(infunc, (char *) str, ioparam, -1);
 }
 
 /*
@@ -1414,6 +5822,7 @@ analyze_row_processor(PGresult *res, int row, PgFdwAnalyzeState *astate)
 		astate->rows[pos] = make_tuple_from_result_row(res, row,
 													   astate->rel,
 													   astate->attinmeta,
+													   NULL,
 													   astate->temp_cxt);
 
 		MemoryContextSwitchTo(oldcontext);
@@ -1424,7 +5833,8 @@ analyze_row_processor(PGresult *res, int row, PgFdwAnalyzeState *astate)
  * Create a tuple from the specified row of the PGresult.
  *
  * rel is the local representation of the foreign table, attinmeta is
- * conversion data for the rel's tupdesc, and temp_context is a working
+ * conversion data for the rel's tupdesc, recvmeta is binary conversion data
+ * (NULL if the PGresult is in text format), and temp_context is a working
  * context that can be reset after each tuple.
  */
 static HeapTuple
@@ -1432,20 +5842,14 @@ make_tuple_from_result_row(PGresult *res,
 						   int row,
 						   Relation rel,
 						   AttInMetadata *attinmeta,
+						   AttRecvMetadata *recvmeta,
 						   MemoryContext temp_context)
 {
 	HeapTuple	tuple;
 	TupleDesc	tupdesc = RelationGetDescr(rel);
-	Form_pg_attribute *attrs = tupdesc->attrs;
 	Datum	   *values;
 	bool	   *nulls;
-	ConversionLocation errpos;
-	ErrorContextCallback errcallback;
 	MemoryContext oldcontext;
-	int			i;
-	int			j;
-
-	Assert(row < PQntuples(res));
 
 	/*
 	 * Do the following work in a temp context that we reset after each tuple.
@@ -1457,6 +5861,52 @@ make_tuple_from_result_row(PGresult *res,
 	values = (Datum *) palloc(tupdesc->natts * sizeof(Datum));
 	nulls = (bool *) palloc(tupdesc->natts * sizeof(bool));
 
+	convert_result_row(res, row, rel, attinmeta, recvmeta, NULL, NULL,
+					   values, nulls);
+
+	/*
+	 * Build the result tuple in caller's memory context.
+	 */
+	MemoryContextSwitchTo(oldcontext);
+
+	tuple = heap_form_tuple(tupdesc, values, nulls);
+
+	/* Clean up */
+	MemoryContextReset(temp_context);
+
+	return tuple;
+}
+
+/*
+ * Decode the specified row of the PGresult into the given values and nulls
+ * arrays, which must have room for all the attributes of rel.
+ *
+ * decoders is the scan's decoder plan, or NULL to convert all the values in
+ * text format with their input functions.  wanted, if not NULL, tells which
+ * attributes to convert; the others are left alone.  The other arguments are
+ * as for make_tuple_from_result_row.  The decoded values, and whatever the I/O
+ * functions leak, are allocated in the current memory context.
+ */
+static void
+convert_result_row(PGresult *res,
+				   int row,
+				   Relation rel,
+				   AttInMetadata *attinmeta,
+				   AttRecvMetadata *recvmeta,
+				   PgFdwDecoder *decoders,
+				   const bool *wanted,
+				   Datum *values,
+				   bool *nulls)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	Form_pg_attribute *attrs = tupdesc->attrs;
+	ConversionLocation errpos;
+	ErrorContextCallback errcallback;
+	int			i;
+	int			j;
+
+	Assert(row < PQntuples(res));
+
 	/*
 	 * Set up and install callback to report where conversion error occurs.
 	 */
@@ -1483,6 +5933,22 @@ make_tuple_from_result_row(PGresult *res,
 			continue;
 		}
 
+		/* leave alone the values of columns we're not asked for */
+		if (wanted && !wanted[i])
+		{
+			j++;
+			continue;
+		}
+
+		/* the remote query returns just NULL for columns not retrieved */
+		if (decoders && decoders[i] == PGFDW_DECODE_SKIP)
+		{
+			values[i] = (Datum) 0;
+			nulls[i] = true;
+			j++;
+			continue;
+		}
+
 		/* convert value to internal representation */
 		if (PQgetisnull(res, row, j))
 		{
@@ -1497,10 +5963,34 @@ make_tuple_from_result_row(PGresult *res,
 
 		/* Note: apply the input function even to nulls, to support domains */
 		errpos.cur_attno = i + 1;
-		values[i] = InputFunctionCall(&attinmeta->attinfuncs[i],
-									  valstr,
-									  attinmeta->attioparams[i],
-									  attinmeta->atttypmods[i]);
+		if (recvmeta && recvmeta->attbinary[i])
+		{
+			StringInfoData buf;
+
+			/*
+			 * libpq guarantees a trailing null byte after binary values too,
+			 * which some receive functions rely on.
+			 */
+			if (valstr)
+			{
+				buf.data = valstr;
+				buf.len = PQgetlength(res, row, j);
+				buf.maxlen = buf.len + 1;
+				buf.cursor = 0;
+			}
+			values[i] = ReceiveFunctionCall(&recvmeta->attrecvfuncs[i],
+											valstr ? &buf : NULL,
+											attinmeta->attioparams[i],
+											attinmeta->atttypmods[i]);
+			if (valstr && buf.cursor != buf.len)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						 errmsg("incorrect binary data format")));
+		}
+		else
+			values[i] = decode_text_value(decoders ? decoders[i] :
+										  PGFDW_DECODE_GENERIC,
+										  valstr, attinmeta, i);
 		errpos.cur_attno = 0;
 
 		j++;
@@ -1510,20 +6000,345 @@ make_tuple_from_result_row(PGresult *res,
 	error_context_stack = errcallback.previous;
 
 	/* check result and tuple descriptor have the same number of columns */
-	if (j != PQnfields(res))
+	/*
+	 * Without any undropped columns, the remote query still returns a single
+	 * NULL column (see deparseSimpleSql).
+	 */
+	if (j > 0 && j != PQnfields(res))
 		elog(ERROR, "remote query result does not match the foreign table");
+}
+
+/*
+ * Decode a row of COPY text-format output into the given values and nulls
+ * arrays, which must have room for all the attributes of rel.
+ *
+ * row and len describe the row as returned by pgfdw_get_copy_data, including
+ * the terminating newline; the other arguments are as for convert_result_row.
+ */
+static void
+convert_copy_row(char *row,
+				 int len,
+				 Relation rel,
+				 AttInMetadata *attinmeta,
+				 PgFdwDecoder *decoders,
+				 Datum *values,
+				 bool *nulls)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	Form_pg_attribute *attrs = tupdesc->attrs;
+	ConversionLocation errpos;
+	ErrorContextCallback errcallback;
+	char	   *line;
+	char	   *next;
+	int			i;
 
 	/*
-	 * Build the result tuple in caller's memory context.
+	 * Make a null-terminated copy of the row, without the newline, that we
+	 * can de-escape the fields in.
 	 */
-	MemoryContextSwitchTo(oldcontext);
+	if (len > 0 && row[len - 1] == '\n')
+		len--;
+	line = (char *) palloc(len + 1);
+	memcpy(line, row, len);
+	line[len] = '\0';
 
-	tuple = heap_form_tuple(tupdesc, values, nulls);
+	/*
+	 * Set up and install callback to report where conversion error occurs.
+	 */
+	errpos.rel = rel;
+	errpos.cur_attno = 0;
+	errcallback.callback = conversion_error_callback;
+	errcallback.arg = (void *) &errpos;
+	errcallback.previous = error_context_stack;
+	error_context_stack = &errcallback;
 
-	/* Clean up */
-	MemoryContextReset(temp_context);
+	/*
+	 * next points to the start of the next field of the line, or is NULL
+	 * once all of them have been consumed.  As in a PGresult, dropped columns
+	 * are not represented.
+	 */
+	next = line;
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		char	   *valstr;
 
-	return tuple;
+		/* skip dropped columns. */
+		if (attrs[i]->attisdropped)
+		{
+			values[i] = (Datum) 0;
+			nulls[i] = true;
+			continue;
+		}
+
+		if (next == NULL)
+			elog(ERROR, "remote query result does not match the foreign table");
+
+		/* convert value to internal representation */
+		valstr = parse_copy_field(next, &next);
+		nulls[i] = (valstr == NULL);
+
+		/* the remote query returns just NULL for columns not retrieved */
+		if (decoders[i] == PGFDW_DECODE_SKIP)
+		{
+			values[i] = (Datum) 0;
+			nulls[i] = true;
+			continue;
+		}
+
+		/* Note: apply the input function even to nulls, to support domains */
+		errpos.cur_attno = i + 1;
+		values[i] = decode_text_value(decoders[i], valstr, attinmeta, i);
+		errpos.cur_attno = 0;
+	}
+
+	/* Uninstall error context callback. */
+	error_context_stack = errcallback.previous;
+
+	/*
+	 * Without any undropped columns, the remote query still returns a single
+	 * NULL column (see deparseSimpleSql); skip it.
+	 */
+	if (next == line)
+		(void) parse_copy_field(next, &next);
+
+	/* check the row and tuple descriptor have the same number of columns */
+	if (next != NULL)
+		elog(ERROR, "remote query result does not match the foreign table");
+
+	/* The decoded values don't point into the line, so we can free it */
+	pfree(line);
+}
+
+/*
+ * Extract the field starting at start from a line of COPY text-format output.
+ *
+ * The field is de-escaped in place and returned, or NULL is returned if it
+ * represents a null value.  *next is set to the start of the following
+ * field, or to NULL if this was the last one on the line.
+ *
+ * The remote server only ever uses the escapes below (and never uses octal or
+ * hex escapes), but we accept any backslashed character as itself, as COPY
+ * FROM does.
+ */
+static char *
+parse_copy_field(char *start, char **next)
+{
+	char	   *src = start;
+	char	   *dst = start;
+
+	/* A null is represented by \N alone */
+	if (src[0] == '\\' && src[1] == 'N' && (src[2] == '\t' || src[2] == '\0'))
+	{
+		*next = (src[2] == '\t') ? src + 3 : NULL;
+		return NULL;
+	}
+
+	while (*src != '\t' && *src != '\0')
+	{
+		char		c = *src++;
+
+		if (c == '\\' && *src != '\0')
+		{
+			c = *src++;
+			switch (c)
+			{
+				case 'b':
+					c = '\b';
+					break;
+				case 'f':
+					c = '\f';
+					break;
+				case 'n':
+					c = '\n';
+					break;
+				case 'r':
+					c = '\r';
+					break;
+				case 't':
+					c = '\t';
+					break;
+				case 'v':
+					c = '\v';
+					break;
+				default:
+					/* take the character itself */
+					break;
+			}
+		}
+		*dst++ = c;
+	}
+
+	*next = (*src == '\t') ? src + 1 : NULL;
+	*dst = '\0';
+
+	return start;
+}
+
+/*
+ * Convert the value of attribute i (0-based), which arrived in text format,
+ * using the given decoder; valstr is NULL if the value is null.
+ *
+ * The specialized decoders accept only the exact format the remote server
+ * prints values in (we force DateStyle = ISO, see set_transmission_modes),
+ * and fall back to the input function for anything else.  That way we
+ * needn't duplicate its handling of unusual input, nor its error messages.
+ */
+static Datum
+decode_text_value(PgFdwDecoder decoder, char *valstr,
+				  AttInMetadata *attinmeta, int i)
+{
+	/* None of the specialized types' input functions accepts a null */
+	if (valstr == NULL && decoder != PGFDW_DECODE_GENERIC)
+		return (Datum) 0;
+
+	switch (decoder)
+	{
+		case PGFDW_DECODE_GENERIC:
+		case PGFDW_DECODE_SKIP:
+			break;
+		case PGFDW_DECODE_INT2:
+			/* this is all int2in does */
+			return Int16GetDatum((int16) pg_atoi(valstr, sizeof(int16), '\0'));
+		case PGFDW_DECODE_INT4:
+			/* this is all int4in does */
+			return Int32GetDatum(pg_atoi(valstr, sizeof(int32), '\0'));
+		case PGFDW_DECODE_INT8:
+			{
+				int64		result;
+
+				/* this is all int8in does */
+				(void) scanint8(valstr, false, &result);
+				return Int64GetDatum(result);
+			}
+		case PGFDW_DECODE_FLOAT8:
+			{
+				double		val;
+				char	   *endptr;
+
+				/* float8in is fussier about errors and special values */
+				errno = 0;
+				val = strtod(valstr, &endptr);
+				if (endptr != valstr && *endptr == '\0' && errno == 0)
+					return Float8GetDatum(val);
+				break;
+			}
+		case PGFDW_DECODE_BOOL:
+			if (valstr[0] != '\0' && valstr[1] == '\0')
+			{
+				if (valstr[0] == 't')
+					return BoolGetDatum(true);
+				if (valstr[0] == 'f')
+					return BoolGetDatum(false);
+			}
+			break;
+		case PGFDW_DECODE_TEXT:
+			/* this is all textin does */
+			return CStringGetTextDatum(valstr);
+		case PGFDW_DECODE_VARCHAR:
+			{
+				int32		typmod = attinmeta->atttypmods[i];
+				size_t		len = strlen(valstr);
+
+				/*
+				 * If the value has no more bytes than the column may have
+				 * characters, it certainly fits; otherwise let varcharin
+				 * check it.
+				 */
+				if (typmod < (int32) VARHDRSZ || len <= (size_t) (typmod - VARHDRSZ))
+					return PointerGetDatum(cstring_to_text_with_len(valstr,
+																	len));
+				break;
+			}
+		case PGFDW_DECODE_DATE:
+			{
+				int			year;
+				int			mon;
+				int			mday;
+
+				if (parse_iso_date(valstr, &year, &mon, &mday) &&
+					valstr[10] == '\0')
+					return DateADTGetDatum(date2j(year, mon, mday) -
+										   POSTGRES_EPOCH_JDATE);
+				break;
+			}
+		case PGFDW_DECODE_TIMESTAMP:
+#ifdef HAVE_INT64_TIMESTAMP
+			{
+				struct pg_tm tm;
+				fsec_t		fsec = 0;
+				Timestamp	result;
+				const char *p = valstr + 19;
+
+				/* YYYY-MM-DD HH:MM:SS[.ffffff] */
+				if (!parse_iso_date(valstr, &tm.tm_year, &tm.tm_mon,
+									&tm.tm_mday) ||
+					valstr[10] != ' ' ||
+					!parse_digits(valstr + 11, 2, &tm.tm_hour) ||
+					valstr[13] != ':' ||
+					!parse_digits(valstr + 14, 2, &tm.tm_min) ||
+					valstr[16] != ':' ||
+					!parse_digits(valstr + 17, 2, &tm.tm_sec) ||
+					tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 59)
+					break;
+				if (*p == '.')
+				{
+					int			scale = 1000000;
+
+					for (p++; *p >= '0' && *p <= '9' && scale > 1; p++)
+					{
+						scale /= 10;
+						fsec += (*p - '0') * scale;
+					}
+				}
+				if (*p != '\0' || tm2timestamp(&tm, fsec, NULL, &result) != 0)
+					break;
+				return TimestampGetDatum(result);
+			}
+#else
+			break;
+#endif
+	}
+
+	return InputFunctionCall(&attinmeta->attinfuncs[i],
+							 valstr,
+							 attinmeta->attioparams[i],
+							 attinmeta->atttypmods[i]);
+}
+
+/*
+ * Parse a date in the format YYYY-MM-DD at the start of str, as printed for
+ * dates AD 1 to 9999 in ISO style.  Returns false if str doesn't start with
+ * a valid date in exactly that format.
+ */
+static bool
+parse_iso_date(const char *str, int *year, int *mon, int *mday)
+{
+	if (!parse_digits(str, 4, year) || str[4] != '-' ||
+		!parse_digits(str + 5, 2, mon) || str[7] != '-' ||
+		!parse_digits(str + 8, 2, mday))
+		return false;
+
+	return (*year >= 1 && *mon >= 1 && *mon <= MONTHS_PER_YEAR &&
+			*mday >= 1 && *mday <= day_tab[isleap(*year)][*mon - 1]);
+}
+
+/*
+ * Parse exactly ndigits decimal digits at the start of str.
+ */
+static bool
+parse_digits(const char *str, int ndigits, int *result)
+{
+	int			i;
+
+	*result = 0;
+	for (i = 0; i < ndigits; i++)
+	{
+		if (str[i] < '0' || str[i] > '9')
+			return false;
+		*result = *result * 10 + (str[i] - '0');
+	}
+
+	return true;
 }
 
 /*
@@ -1541,3 +6356,72 @@ conversion_error_callback(void *arg)
 				   NameStr(tupdesc->attrs[errpos->cur_attno - 1]->attname),
 				   RelationGetRelationName(errpos->rel));
 }
+
+/*
+ * Start connecting to the servers of all the other foreign tables in the
+ * query's range table that belong to our FDW (as identified by its handler
+ * function), without waiting for the connections to complete.
+ *
+ * Each foreign scan would otherwise establish its connection only when it's
+ * started, so that a query joining tables on several servers would pay for
+ * the connection handshakes one after another.
+ */
+static void
+start_query_connections(EState *estate, Oid relid, Oid fdwhandler)
+{
+	ListCell   *lc;
+
+	foreach(lc, estate->es_range_table)
+	{
+		RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+		ForeignTable *table;
+		ForeignServer *server;
+
+		if (rte->rtekind != RTE_RELATION ||
+			rte->relkind != RELKIND_FOREIGN_TABLE ||
+			rte->relid == relid)
+			continue;
+
+		table = GetForeignTable(rte->relid);
+		server = GetForeignServer(table->serverid);
+		if (GetForeignDataWrapper(server->fdwid)->fdwhandler != fdwhandler)
+			continue;
+
+		StartConnection(server,
+						rte->checkAsUser ? rte->checkAsUser : GetUserId());
+	}
+}
+
+/*
+ * Does another foreign table of the query use the same connection as the scan
+ * of the given range table entry, that is, the same server and user?
+ *
+ * The range table of the executor state covers the subplans too, so this
+ * sees every scan of the query; and a table scanned twice has two entries.
+ */
+static bool
+connection_is_shared(EState *estate, Index scanrelid)
+{
+	RangeTblEntry *myrte = rt_fetch(scanrelid, estate->es_range_table);
+	Oid			serverid = GetForeignTable(myrte->relid)->serverid;
+	Oid			userid = myrte->checkAsUser ? myrte->checkAsUser : GetUserId();
+	Index		rtindex = 0;
+	ListCell   *lc;
+
+	foreach(lc, estate->es_range_table)
+	{
+		RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+
+		rtindex++;
+		if (rtindex == scanrelid ||
+			rte->rtekind != RTE_RELATION ||
+			rte->relkind != RELKIND_FOREIGN_TABLE)
+			continue;
+
+		if (GetForeignTable(rte->relid)->serverid == serverid &&
+			(rte->checkAsUser ? rte->checkAsUser : GetUserId()) == userid)
+			return true;
+	}
+
+	return false;
+}
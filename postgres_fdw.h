@@ -20,21 +20,160 @@
 
 #include "libpq-fe.h"
 
+/* Maximum number of connections a scan can be split over */
+#define MAX_PARALLEL_CONNECTIONS	64
+
+/*
+ * Cumulative counters of the remote activity on behalf of one foreign server
+ * and user mapping, as reported by postgres_fdw_stats() (see stats.c).
+ */
+typedef struct PgFdwStats
+{
+	int64		connections_opened;	/* connections established */
+	int64		connections_reused;	/* requests served by a cached one */
+	int64		round_trips;	/* commands sent */
+	int64		rows_fetched;	/* rows of scan results received */
+	int64		bytes_fetched;	/* bytes of row data received, if
+								 * pgfdw_stats_shared() */
+	int64		remote_estimates;	/* remote EXPLAINs done for planning */
+	int64		commits;		/* remote transactions committed */
+	double		commit_time;	/* total time spent committing, in ms */
+	int64		aborts;			/* remote transactions aborted */
+	double		abort_time;		/* total time spent aborting, in ms */
+	int64		errors;			/* remote commands that failed, including
+								 * ends of remote transactions */
+} PgFdwStats;
+
+/*
+ * Extra control information relating to a connection.
+ *
+ * At most one asynchronous request (a query, or a COPY whose rows are being
+ * streamed) can be outstanding on a connection at a time; pending_cursor
+ * identifies the cursor whose request it is, or is 0 if there is none.  Since
+ * a connection is shared by all scans of the same server and user mapping,
+ * anybody else wanting to send a command must first collect the outstanding
+ * result (see pgfdw_absorb_pending), which is then held here until the owning
+ * scan asks for it.
+ */
+typedef struct PgFdwConnState
+{
+	unsigned int pending_cursor;	/* cursor with request in flight, or 0 */
+	bool		pending_copy;	/* is the request a COPY? */
+	bool		pending_done;	/* has the result been collected already? */
+	PGresult   *pending_result; /* collected result, if pending_done */
+
+	/* these are used only for a COPY */
+	bool		copy_savepoint; /* is the COPY's savepoint still open? */
+	char	   *copy_buf;		/* row last returned by libpq, or NULL */
+	StringInfo	copy_stash;		/* rows collected for the owner, or NULL */
+	int			copy_stash_pos; /* offset of next row in copy_stash */
+
+	PgFdwStats *stats;			/* counters of the server and user mapping */
+} PgFdwConnState;
+
+/*
+ * FDW-specific planner information kept in RelOptInfo.fdw_private for a
+ * foreign table.  This information is collected by postgresGetForeignRelSize.
+ */
+typedef struct PgFdwRelationInfo
+{
+	/* XXX underdocumented, but a lot of this shouldn't be here anyway */
+	StringInfoData sql;
+	Cost		startup_cost;
+	Cost		total_cost;
+	List	   *remote_conds;
+	List	   *param_conds;
+	List	   *local_conds;
+	List	   *param_numbers;
+	List	   *retrieved_attrs;
+
+	/* Options extracted from catalogs (table settings override server's) */
+	bool		use_remote_estimate;
+	Cost		fdw_startup_cost;
+	Cost		fdw_tuple_cost;
+	bool		calibrate_costs;	/* measure the two above during scans? */
+	int			fetch_size;		/* rows per FETCH, or initial value if adaptive */
+	bool		adaptive_fetch; /* grow/shrink fetch_size based on row width? */
+	int			fetch_memory;	/* per-batch memory budget in kB, if adaptive */
+	bool		prefetch;		/* request next batch before it's needed? */
+	bool		binary_transfer;	/* retrieve data in binary format? */
+	int			copy_threshold; /* min. # of rows to use COPY, or 0 */
+	bool		use_prepared;	/* run small scans as prepared statements? */
+	int			lookup_cache_memory;	/* lookup cache limit in kB, or 0 */
+	int			estimate_cache_ttl; /* seconds to keep remote estimates */
+	int			cache_ttl;		/* seconds to keep scan results, or 0 */
+	bool		spool_rescans;	/* keep fetched rows for rescans? */
+	int			parallel_connections;	/* # of connections to split scan over */
+	AttrNumber	partition_attnum;	/* column to split it by, or 0 */
+
+	/* Cached catalog information. */
+	ForeignTable *table;
+	ForeignServer *server;
+	UserMapping *user;			/* only set in use_remote_estimate mode */
+
+	/* OIDs of extensions whose objects may be sent to the remote server */
+	List	   *shippable_extensions;
+} PgFdwRelationInfo;
+
+/*
+ * Methods for sampling rows on the remote side during ANALYZE
+ * (analyze_sampling option).
+ */
+typedef enum PgFdwSamplingMethod
+{
+	ANALYZE_SAMPLE_OFF,			/* fetch the whole table */
+	ANALYZE_SAMPLE_AUTO,		/* choose by remote server version */
+	ANALYZE_SAMPLE_RANDOM,		/* WHERE random() < fraction */
+	ANALYZE_SAMPLE_SYSTEM,		/* TABLESAMPLE SYSTEM */
+	ANALYZE_SAMPLE_BERNOULLI	/* TABLESAMPLE BERNOULLI */
+} PgFdwSamplingMethod;
+
 /* in postgres_fdw.c */
 extern int	set_transmission_modes(void);
 extern void reset_transmission_modes(int nestlevel);
+extern Expr *find_em_expr_for_rel(EquivalenceClass *ec, RelOptInfo *rel);
 
 /* in connection.c */
-extern PGconn *GetConnection(ForeignServer *server, UserMapping *user);
+extern char *pgfdw_prewarm_servers;
+extern PGconn *GetConnection(ForeignServer *server, UserMapping *user,
+			  bool defer_begin, PgFdwConnState **state);
+extern void StartConnection(ForeignServer *server, Oid userid);
+extern PGconn *GetWorkerConnection(ForeignServer *server, UserMapping *user,
+					int worker, const char *snapshot,
+					PgFdwConnState **state);
+extern void StartWorkerConnections(ForeignServer *server, UserMapping *user,
+					   int nworkers);
 extern void ReleaseConnection(PGconn *conn);
+extern void pgfdw_append_begin(PGconn *conn, StringInfo buf);
+extern void pgfdw_begin_xact(PGconn *conn);
+extern char *pgfdw_export_snapshot(PGconn *conn);
 extern unsigned int GetCursorNumber(PGconn *conn);
-extern void pgfdw_report_error(int elevel, PGresult *res, bool clear,
-				   const char *sql);
+extern char *GetPreparedStatement(PGconn *conn, const char *sql,
+					 int nparams, const Oid *types);
+extern void ForgetPreparedStatement(PGconn *conn, const char *name);
+extern void pgfdw_send_query(PGconn *conn, PgFdwConnState *state,
+				 unsigned int cursor_number, const char *sql);
+extern void pgfdw_send_copy(PGconn *conn, PgFdwConnState *state,
+				unsigned int cursor_number, const char *sql);
+extern int pgfdw_get_copy_data(PGconn *conn, PgFdwConnState *state,
+					unsigned int cursor_number, char **buffer,
+					const char *sql);
+extern void pgfdw_cancel_copy(PGconn *conn, PgFdwConnState *state,
+				  unsigned int cursor_number);
+extern bool pgfdw_pending_ready(PGconn *conn, PgFdwConnState *state);
+extern void pgfdw_absorb_pending(PGconn *conn, PgFdwConnState *state);
+extern PGresult *pgfdw_get_pending_result(PGconn *conn, PgFdwConnState *state,
+						 unsigned int cursor_number);
+extern void pgfdw_report_error(int elevel, PGresult *res, PGconn *conn,
+				   bool clear, const char *sql);
+extern PgFdwStats *GetConnectionStats(PGconn *conn);
 
 /* in option.c */
 extern int ExtractConnectionOptions(List *defelems,
 						 const char **keywords,
 						 const char **values);
+extern List *ExtractExtensionList(const char *extensionsString,
+					 bool warnOnMissing);
 
 /* in deparse.c */
 extern void classifyConditions(PlannerInfo *root,
@@ -43,15 +182,57 @@ extern void classifyConditions(PlannerInfo *root,
 				   List **param_conds,
 				   List **local_conds,
 				   List **param_numbers);
+extern bool is_foreign_expr(PlannerInfo *root,
+				RelOptInfo *baserel,
+				Expr *expr,
+				List **param_numbers);
+extern bool is_binary_safe_type(Oid type);
 extern void deparseSimpleSql(StringInfo buf,
 				 PlannerInfo *root,
 				 RelOptInfo *baserel,
-				 List *local_conds);
+				 List *local_conds,
+				 bool binary_transfer,
+				 List **retrieved_attrs);
 extern void appendWhereClause(StringInfo buf,
 				  bool has_where,
 				  List *exprs,
-				  PlannerInfo *root);
+				  PlannerInfo *root,
+				  RelOptInfo *baserel,
+				  List **params_list,
+				  int param_offset);
+extern void appendPartitionClause(StringInfo buf,
+					  bool is_first,
+					  PlannerInfo *root,
+					  RelOptInfo *baserel,
+					  AttrNumber attnum,
+					  const int64 *bounds,
+					  int nbounds,
+					  int part);
+extern void deparsePartitionBoundsSql(StringInfo buf,
+						  PlannerInfo *root,
+						  RelOptInfo *baserel,
+						  AttrNumber attnum);
+extern void appendOrderByClause(StringInfo buf,
+					PlannerInfo *root,
+					RelOptInfo *baserel,
+					List *pathkeys);
+extern char *get_remote_query(Oid relid);
 extern void deparseAnalyzeSizeSql(StringInfo buf, Relation rel);
-extern void deparseAnalyzeSql(StringInfo buf, Relation rel);
+extern void deparseAnalyzeTuplesSql(StringInfo buf, Relation rel);
+extern void deparseAnalyzeSql(StringInfo buf, Relation rel,
+				  PgFdwSamplingMethod sample_method,
+				  double sample_frac);
+extern bool deparseAnalyzeStatsSql(StringInfo buf, Relation rel);
+
+/* in shippable.c */
+extern bool is_builtin(Oid objectId);
+extern bool is_shippable(Oid objectId, Oid classId,
+			 PgFdwRelationInfo *fpinfo);
+
+/* in stats.c */
+extern void pgfdw_stats_init(void);
+extern PgFdwStats *pgfdw_get_stats(Oid serverid, Oid userid);
+extern void pgfdw_flush_stats(void);
+extern bool pgfdw_stats_shared(void);
 
 #endif   /* POSTGRES_FDW_H */
@@ -36,5 +36,7 @@ rm -rf %{buildroot}
 %files
 #%defattr(-,root,root,-)
 %{pginstdir}/lib/postgres_fdw.so
+%{pginstdir}/share/extension/postgres_fdw--1.1.sql
 %{pginstdir}/share/extension/postgres_fdw--1.0.sql
+%{pginstdir}/share/extension/postgres_fdw--1.0--1.1.sql
 %{pginstdir}/share/extension/postgres_fdw.control
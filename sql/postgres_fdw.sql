@@ -90,6 +90,9 @@ ALTER SERVER testserver1 OPTIONS (
 	use_remote_estimate 'false',
 	fdw_startup_cost '123.456',
 	fdw_tuple_cost '0.123',
+	fetch_size '100',
+	adaptive_fetch 'true',
+	fetch_memory '1024',
 	service 'value',
 	connect_timeout 'value',
 	dbname 'value',
@@ -290,3 +293,521 @@ explain (verbose, costs off) select * from ft3 where f1 COLLATE "POSIX" = 'foo';
 explain (verbose, costs off) select * from ft3 where f1 = 'foo' COLLATE "C";
 explain (verbose, costs off) select * from ft3 where f2 COLLATE "C" = 'foo';
 explain (verbose, costs off) select * from ft3 where f2 = 'foo' COLLATE "C";
+
+-- ===================================================================
+-- test fetch size options
+-- ===================================================================
+ALTER FOREIGN TABLE ft1 OPTIONS (ADD fetch_size '0');  -- ERROR
+ALTER FOREIGN TABLE ft1 OPTIONS (ADD adaptive_fetch 'maybe');  -- ERROR
+ALTER FOREIGN TABLE ft1 OPTIONS (ADD fetch_memory '-1');  -- ERROR
+ALTER FOREIGN TABLE ft1 OPTIONS (ADD fetch_size '7');
+SELECT count(*), sum(c1) FROM ft1;
+ALTER FOREIGN TABLE ft1 OPTIONS (ADD adaptive_fetch 'true', ADD fetch_memory '64');
+SELECT count(*), sum(c1) FROM ft1;
+ALTER FOREIGN TABLE ft1 OPTIONS (DROP fetch_size, DROP adaptive_fetch, DROP fetch_memory);
+
+-- ===================================================================
+-- test prefetching
+-- ===================================================================
+ALTER FOREIGN TABLE ft1 OPTIONS (ADD prefetch 'maybe');  -- ERROR
+ALTER FOREIGN TABLE ft1 OPTIONS (ADD fetch_size '7', ADD prefetch 'true');
+ALTER FOREIGN TABLE ft2 OPTIONS (ADD fetch_size '11', ADD prefetch 'true');
+SELECT count(*), sum(c1) FROM ft1;
+-- the inner scans share the connection with the outer one, whose next batch
+-- is in flight
+SELECT count(*), sum(cnt) FROM
+  (SELECT (SELECT count(*) FROM ft2 b WHERE b.c1 <= a.c1) cnt
+   FROM ft1 a WHERE a.c1 <= 20) s;
+ALTER FOREIGN TABLE ft1 OPTIONS (DROP fetch_size, DROP prefetch);
+ALTER FOREIGN TABLE ft2 OPTIONS (DROP fetch_size, DROP prefetch);
+
+-- ===================================================================
+-- test binary transfer
+-- ===================================================================
+ALTER FOREIGN TABLE ft1 OPTIONS (ADD binary_transfer 'maybe');  -- ERROR
+ALTER FOREIGN TABLE ft1 OPTIONS (ADD binary_transfer 'true');
+-- c8 is of a user-defined type, so it's retrieved as text
+EXPLAIN (VERBOSE, COSTS false) SELECT * FROM ft1 t1 WHERE t1.c1 = 101 AND t1.c6 = '1' AND t1.c7 >= '1';
+SELECT * FROM ft1 t1 WHERE t1.c1 = 101 AND t1.c6 = '1' AND t1.c7 >= '1';
+SELECT count(*), sum(c1), sum(c2), max(c3), max(c4), max(c8) FROM ft1;
+-- parameters can be sent in binary, too
+PREPARE st6(int) AS SELECT c1, c3, c4, c8 FROM ft1 t1 WHERE t1.c1 = $1;
+EXECUTE st6(1);
+EXECUTE st6(2);
+EXECUTE st6(3);
+EXECUTE st6(4);
+EXECUTE st6(5);
+EXPLAIN (VERBOSE, COSTS false) EXECUTE st6(6);
+EXECUTE st6(6);
+DEALLOCATE st6;
+ALTER FOREIGN TABLE ft1 OPTIONS (DROP binary_transfer);
+-- columns are cast to their local types, which may differ from the remote ones
+CREATE FOREIGN TABLE ft_bin (c1 int8, c2 int2) SERVER loopback
+  OPTIONS (schema_name 'S 1', table_name 'T 1', binary_transfer 'true');
+ALTER FOREIGN TABLE ft_bin ALTER COLUMN c1 OPTIONS (column_name 'C 1');
+EXPLAIN (VERBOSE, COSTS false) SELECT * FROM ft_bin WHERE c1 < 3;
+SELECT * FROM ft_bin WHERE c1 < 3 ORDER BY c1;
+DROP FOREIGN TABLE ft_bin;
+
+-- ===================================================================
+-- test COPY mode
+-- ===================================================================
+ALTER FOREIGN TABLE ft2 OPTIONS (ADD copy_threshold '-1');  -- ERROR
+ALTER FOREIGN TABLE ft2 OPTIONS (ADD copy_threshold '');  -- ERROR
+ALTER FOREIGN TABLE ft2 OPTIONS (ADD copy_threshold '50', ADD fetch_size '30');
+-- only scans expected to return enough rows use COPY
+EXPLAIN (VERBOSE, COSTS false) SELECT c1, c3 FROM ft2 WHERE c2 = 5;
+EXPLAIN (VERBOSE, COSTS false) SELECT c1, c3 FROM ft2 WHERE c1 < 10;
+SELECT count(*), sum(c1), max(c3) FROM ft2 WHERE c2 = 5;
+-- a COPY abandoned early must not disturb the remote transaction
+BEGIN;
+SELECT count(*) FROM (SELECT c1 FROM ft2 LIMIT 3) s;
+SELECT count(*) FROM ft2;
+COMMIT;
+-- the outer scan shares its connection with the inner ones, so it uses a
+-- cursor rather than COPY
+SELECT count(*), sum(cnt) FROM
+  (SELECT (SELECT count(*) FROM ft1 b WHERE b.c1 <= a.c1) cnt
+   FROM ft2 a WHERE a.c2 = 5) s;
+ALTER FOREIGN TABLE ft2 OPTIONS (DROP copy_threshold, DROP fetch_size);
+-- special characters must survive COPY's escaping
+create table loct4 (f1 int, f2 text, f3 text[]);
+insert into loct4 values
+  (1, E'tab\there', array['a b', 'c"d']),
+  (2, E'new\nline', array[E'back\\slash', NULL]),
+  (3, E'back\\slash', NULL),
+  (4, NULL, '{}'),
+  (5, E'\\N', array['\N', 'NULL']);
+create foreign table ft4 (f1 int, f2 text, f3 text[])
+  server loopback options (table_name 'loct4', copy_threshold '1');
+select count(*) from ft4;
+select * from ft4 except select * from loct4;
+-- tables without columns work, with a cursor and with COPY
+create foreign table ft_nocols () server loopback options (table_name 'loct4');
+select count(*) from ft_nocols;
+alter foreign table ft_nocols options (add copy_threshold '1');
+select count(*) from ft_nocols;
+drop foreign table ft_nocols;
+
+-- ===================================================================
+-- test virtual tuples
+-- ===================================================================
+-- system columns and whole-row references need the tuple materialized
+SELECT tableoid::regclass, c1 FROM ft1 t1 WHERE c1 = 1;
+SELECT t1 FROM ft1 t1 WHERE c1 = 2;
+
+-- ===================================================================
+-- test type-specialized decoders
+-- ===================================================================
+create table loct5 (f1 int2, f2 int4, f3 int8, f4 float8, f5 bool, f6 text,
+  f7 varchar(5), f8 date, f9 timestamp, f10 timestamp(0));
+insert into loct5 values
+  (1, 2, 3, 1.5, true, 'abc', 'abcde', '2000-02-29',
+   '2000-02-29 12:34:56.789', '2000-02-29 12:34:56'),
+  (-32768, -2147483648, -9223372036854775808, 'NaN', false, '', '',
+   '0044-03-15 BC', '0044-03-15 12:00:00 BC', 'infinity'),
+  (32767, 2147483647, 9223372036854775807, '-Infinity', NULL, 'xyz', 'ab',
+   'infinity', '-infinity', NULL),
+  (NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+create foreign table ft5 (f1 int2, f2 int4, f3 int8, f4 float8, f5 bool,
+  f6 text, f7 varchar(5), f8 date, f9 timestamp, f10 timestamp(0))
+  server loopback options (table_name 'loct5');
+select * from ft5 except select * from loct5;
+-- the columns not selected are skipped
+select f1, f6, f7, f5, f2, f3 from ft5 where f1 is not null order by f1;
+-- the same through COPY
+alter foreign table ft5 options (add copy_threshold '1');
+select * from ft5 except select * from loct5;
+alter foreign table ft5 options (drop copy_threshold);
+
+-- ===================================================================
+-- test parameterized foreign scans
+-- ===================================================================
+CREATE TABLE pt (k int);
+INSERT INTO pt VALUES (3), (7), (42), (2000);
+ANALYZE pt;
+ALTER SERVER loopback OPTIONS (ADD fdw_startup_cost '0');
+SET enable_hashjoin TO false;
+SET enable_mergejoin TO false;
+-- the join clause is sent to the remote server, with the outer value as $1
+EXPLAIN (VERBOSE, COSTS false) SELECT pt.k, ft2.c3 FROM pt JOIN ft2 ON (ft2.c1 = pt.k);
+SELECT pt.k, ft2.c3 FROM pt JOIN ft2 ON (ft2.c1 = pt.k) ORDER BY pt.k;
+RESET enable_hashjoin;
+RESET enable_mergejoin;
+ALTER SERVER loopback OPTIONS (DROP fdw_startup_cost);
+DROP TABLE pt;
+
+-- ===================================================================
+-- test prepared statements
+-- ===================================================================
+ALTER FOREIGN TABLE ft2 OPTIONS (ADD use_prepared_statements 'maybe');  -- ERROR
+-- small scans run as prepared statements, which get reused
+SELECT c1, c3 FROM ft2 WHERE c1 = 11;
+SELECT c1, c3 FROM ft2 WHERE c1 = 11;
+-- rescans with new parameter values run the statement again
+SELECT count(*) FROM ft1 t1
+  WHERE t1.c1 <= 10 AND EXISTS (SELECT 1 FROM ft2 t2 WHERE t2.c1 = t1.c1 + 1);
+ALTER FOREIGN TABLE ft2 OPTIONS (ADD use_prepared_statements 'false');
+SELECT c1, c3 FROM ft2 WHERE c1 = 11;
+ALTER FOREIGN TABLE ft2 OPTIONS (DROP use_prepared_statements);
+-- a scan returning more rows than expected switches over to a cursor
+ALTER FOREIGN TABLE ft2 OPTIONS (ADD fetch_size '30');
+SELECT count(*), sum(c1) FROM ft2 WHERE c1 % 10 = 5;
+ALTER FOREIGN TABLE ft2 OPTIONS (DROP fetch_size);
+-- a statement that can't run anymore is prepared again for the next query
+CREATE TABLE loct_prep (f1 int, f2 text);
+INSERT INTO loct_prep VALUES (1, 'one');
+CREATE FOREIGN TABLE ft_prep (f1 int, f2 text)
+  SERVER loopback OPTIONS (table_name 'loct_prep');
+SELECT * FROM ft_prep WHERE f1 = 1;
+ALTER TABLE loct_prep ALTER COLUMN f2 TYPE varchar(10);
+SELECT * FROM ft_prep WHERE f1 = 1;  -- ERROR
+SELECT * FROM ft_prep WHERE f1 = 1;
+DROP FOREIGN TABLE ft_prep;
+DROP TABLE loct_prep;
+
+-- ===================================================================
+-- test lookup cache
+-- ===================================================================
+CREATE TABLE pt (k int);
+INSERT INTO pt VALUES (3), (7), (3), (2000), (7), (3), (2000);
+ANALYZE pt;
+ALTER SERVER loopback OPTIONS (ADD fdw_startup_cost '0');
+SET enable_hashjoin TO false;
+SET enable_mergejoin TO false;
+-- repeated outer values, matching or not, are answered from the cache
+SELECT pt.k, ft2.c3 FROM pt LEFT JOIN ft2 ON (ft2.c1 = pt.k) ORDER BY pt.k;
+ALTER FOREIGN TABLE ft2 OPTIONS (ADD lookup_cache_memory '0');
+SELECT pt.k, ft2.c3 FROM pt LEFT JOIN ft2 ON (ft2.c1 = pt.k) ORDER BY pt.k;
+ALTER FOREIGN TABLE ft2 OPTIONS (DROP lookup_cache_memory);
+RESET enable_hashjoin;
+RESET enable_mergejoin;
+ALTER SERVER loopback OPTIONS (DROP fdw_startup_cost);
+DROP TABLE pt;
+
+-- ===================================================================
+-- test remote estimate cache
+-- ===================================================================
+ALTER FOREIGN TABLE ft2 OPTIONS (ADD estimate_cache_ttl '-1');  -- ERROR
+ALTER FOREIGN TABLE ft2 OPTIONS (ADD estimate_cache_ttl '');  -- ERROR
+ALTER FOREIGN TABLE ft2 OPTIONS (ADD estimate_cache_ttl '600');
+-- the second planning uses the cached estimate
+SELECT c1, c3 FROM ft2 WHERE c2 = 7 AND c1 < 30 ORDER BY c1;
+SELECT c1, c3 FROM ft2 WHERE c2 = 7 AND c1 < 30 ORDER BY c1;
+SELECT postgres_fdw_flush_estimates();
+SELECT c1, c3 FROM ft2 WHERE c2 = 7 AND c1 < 30 ORDER BY c1;
+ALTER FOREIGN TABLE ft2 OPTIONS (DROP estimate_cache_ttl);
+
+-- ===================================================================
+-- test importing remote statistics
+-- ===================================================================
+CREATE FOREIGN TABLE ft_stats (
+	c0 int,
+	c1 int NOT NULL,
+	c2 int NOT NULL,
+	c3 text
+) SERVER loopback OPTIONS (schema_name 'S 1', table_name 'T 1',
+	import_remote_stats 'true');
+ALTER FOREIGN TABLE ft_stats DROP COLUMN c0;
+ALTER FOREIGN TABLE ft_stats ALTER COLUMN c1 OPTIONS (column_name 'C 1');
+ANALYZE VERBOSE ft_stats;
+SELECT reltuples FROM pg_class WHERE relname = 'ft_stats';
+-- the local statistics must be exact copies of the remote ones
+SELECT l.attname,
+       l.null_frac = r.null_frac AS null_frac,
+       l.n_distinct = r.n_distinct AS n_distinct,
+       l.most_common_vals::text IS NOT DISTINCT FROM
+         r.most_common_vals::text AS mcv,
+       l.histogram_bounds::text IS NOT DISTINCT FROM
+         r.histogram_bounds::text AS histogram,
+       l.correlation = r.correlation AS correlation
+  FROM pg_stats l JOIN pg_stats r
+    ON r.schemaname = 'S 1' AND r.tablename = 'T 1'
+   AND r.attname = CASE l.attname WHEN 'c1' THEN 'C 1' ELSE l.attname END
+ WHERE l.tablename = 'ft_stats'
+ ORDER BY l.attname;
+-- a column type differing from the remote one makes ANALYZE sample instead
+ALTER FOREIGN TABLE ft_stats ALTER COLUMN c3 TYPE varchar;
+ANALYZE VERBOSE ft_stats;
+DROP FOREIGN TABLE ft_stats;
+
+-- ===================================================================
+-- test remote sampling during ANALYZE
+-- ===================================================================
+CREATE FOREIGN TABLE ft_sample (
+	c1 int NOT NULL,
+	c2 int NOT NULL
+) SERVER loopback OPTIONS (schema_name 'S 1', table_name 'T 1',
+	analyze_sampling 'random');
+ALTER FOREIGN TABLE ft_sample ALTER COLUMN c1 OPTIONS (column_name 'C 1');
+-- keep the sample target well below the remote table's size
+ALTER FOREIGN TABLE ft_sample ALTER COLUMN c1 SET STATISTICS 1;
+ALTER FOREIGN TABLE ft_sample ALTER COLUMN c2 SET STATISTICS 1;
+ANALYZE ft_sample;
+SELECT reltuples FROM pg_class WHERE relname = 'ft_sample';
+ALTER FOREIGN TABLE ft_sample OPTIONS (SET analyze_sampling 'bernoulli');
+ANALYZE ft_sample;  -- ERROR
+ALTER FOREIGN TABLE ft_sample OPTIONS (SET analyze_sampling 'always');  -- ERROR
+DROP FOREIGN TABLE ft_sample;
+
+-- ===================================================================
+-- test sorted foreign scans
+-- ===================================================================
+EXPLAIN (VERBOSE, COSTS false)
+SELECT c1, c2 FROM ft1 ORDER BY c2 DESC NULLS FIRST, c1 OFFSET 100 LIMIT 5;
+SELECT c1, c2 FROM ft1 ORDER BY c2 DESC NULLS FIRST, c1 OFFSET 100 LIMIT 5;
+-- non-default sort operators must be applied locally
+EXPLAIN (COSTS false) SELECT c3 FROM ft1 ORDER BY c3 USING ~<~ LIMIT 5;
+
+-- ===================================================================
+-- test LIMIT pushdown
+-- ===================================================================
+EXPLAIN (VERBOSE, COSTS false) SELECT c1, c2 FROM ft1 LIMIT 3;
+-- not if some conditions must be checked locally
+EXPLAIN (VERBOSE, COSTS false) SELECT c1, c2 FROM ft1 WHERE c8 = 'foo' LIMIT 3;
+
+-- ===================================================================
+-- test foreign tables defined by a remote query
+-- ===================================================================
+CREATE FOREIGN TABLE ft_query (
+	c2 int,
+	cnt bigint,
+	total bigint
+) SERVER loopback OPTIONS (query 'SELECT c2, count(*) AS cnt, sum("C 1") AS total FROM "S 1"."T 1" GROUP BY c2');
+-- quals and ORDER BY go around the remote query
+EXPLAIN (VERBOSE, COSTS false) SELECT * FROM ft_query WHERE c2 < 3 ORDER BY c2;
+SELECT * FROM ft_query WHERE c2 < 3 ORDER BY c2;
+ALTER FOREIGN TABLE ft_query OPTIONS (ADD table_name 'T 1');  -- ERROR
+DROP FOREIGN TABLE ft_query;
+
+-- ===================================================================
+-- test shippable extension objects
+-- ===================================================================
+-- make the user-defined function and operator from above extension members
+ALTER EXTENSION postgres_fdw ADD FUNCTION postgres_fdw_abs(int);
+ALTER EXTENSION postgres_fdw ADD OPERATOR === (int, int);
+-- they are still evaluated locally ...
+EXPLAIN (VERBOSE, COSTS false) SELECT c1, c2 FROM ft1 t1 WHERE t1.c1 === t1.c2;
+-- ... until the server is told that the remote side has the extension too
+ALTER SERVER loopback OPTIONS (ADD extensions 'postgres_fdw');
+EXPLAIN (VERBOSE, COSTS false) SELECT c1, c2 FROM ft1 t1 WHERE t1.c1 = postgres_fdw_abs(t1.c2);
+EXPLAIN (VERBOSE, COSTS false) SELECT c1, c2 FROM ft1 t1 WHERE t1.c1 === t1.c2;
+SELECT count(*) FROM ft1 t1 WHERE t1.c1 === t1.c2;
+ALTER SERVER loopback OPTIONS (SET extensions 'postgres_fdw, no_such_extension');  -- WARNING
+ALTER SERVER loopback OPTIONS (SET extensions '"postgres_fdw');  -- ERROR
+ALTER SERVER loopback OPTIONS (DROP extensions);
+ALTER EXTENSION postgres_fdw DROP FUNCTION postgres_fdw_abs(int);
+ALTER EXTENSION postgres_fdw DROP OPERATOR === (int, int);
+
+-- ===================================================================
+-- test pushdown of CASE, COALESCE, NULLIF, GREATEST/LEAST, boolean tests,
+-- row comparisons and I/O casts
+-- ===================================================================
+EXPLAIN (VERBOSE, COSTS false) SELECT c1 FROM ft1 t1 WHERE CASE c2 WHEN 1 THEN c1 ELSE 0 END > 990 AND CASE WHEN c1 > 900 THEN true ELSE false END;
+SELECT c1 FROM ft1 t1 WHERE CASE c2 WHEN 1 THEN c1 ELSE 0 END > 990 AND CASE WHEN c1 > 900 THEN true ELSE false END;
+EXPLAIN (VERBOSE, COSTS false) SELECT c1 FROM ft1 t1 WHERE COALESCE(c3, '') = '00001' AND NULLIF(c2, 0) IS NOT NULL AND GREATEST(c1, c2) < 5 AND (c1 > 0) IS TRUE;
+SELECT c1 FROM ft1 t1 WHERE COALESCE(c3, '') = '00001' AND NULLIF(c2, 0) IS NOT NULL AND GREATEST(c1, c2) < 5 AND (c1 > 0) IS TRUE;
+EXPLAIN (VERBOSE, COSTS false) SELECT count(*) FROM ft1 t1 WHERE (c1, c2) > (990, 5) AND c3::int < 1000;
+SELECT count(*) FROM ft1 t1 WHERE (c1, c2) > (990, 5) AND c3::int < 1000;
+-- casts between types whose text form depends on settings are not shipped
+EXPLAIN (VERBOSE, COSTS false) SELECT c1 FROM ft1 t1 WHERE c1::float8::text = '1';
+
+-- ===================================================================
+-- test connecting to several servers at once
+-- ===================================================================
+CREATE SERVER loopback2 FOREIGN DATA WRAPPER postgres_fdw
+  OPTIONS (dbname 'contrib_regression');
+CREATE USER MAPPING FOR CURRENT_USER SERVER loopback2;
+CREATE FOREIGN TABLE ft_other (
+	c1 int NOT NULL,
+	c2 text
+) SERVER loopback2 OPTIONS (schema_name 'S 1', table_name 'T 2');
+-- the connection to loopback2 is started while the scan of ft1 connects
+SELECT t1.c1, t2.c2 FROM ft1 t1 JOIN ft_other t2 ON t1.c1 = t2.c1 WHERE t1.c1 < 4 ORDER BY t1.c1;
+SET postgres_fdw.prewarm_servers = 'loopback, loopback2, no_such_server';
+SHOW postgres_fdw.prewarm_servers;
+RESET postgres_fdw.prewarm_servers;
+-- in a new session, the servers are connected to when postgres_fdw is first
+-- used, and the queries then use those connections instead of opening more
+\c -
+SET postgres_fdw.prewarm_servers = 'loopback, loopback2, no_such_server';
+SELECT count(*) FROM ft1 WHERE c1 < 3;
+SELECT srvname, connections_opened, connections_reused
+  FROM postgres_fdw_stats WHERE srvname IN ('loopback', 'loopback2')
+  ORDER BY srvname;
+SELECT count(*) FROM ft_other;
+SELECT srvname, connections_opened, connections_reused
+  FROM postgres_fdw_stats WHERE srvname IN ('loopback', 'loopback2')
+  ORDER BY srvname;
+RESET postgres_fdw.prewarm_servers;
+-- check the remote session settings
+CREATE FOREIGN TABLE ft_settings (name text, setting text)
+  SERVER loopback2 OPTIONS (schema_name 'pg_catalog', table_name 'pg_settings');
+SELECT name, setting FROM ft_settings
+  WHERE name IN ('DateStyle', 'IntervalStyle', 'TimeZone', 'extra_float_digits', 'search_path')
+  ORDER BY name COLLATE "C";
+
+-- ===================================================================
+-- test remote transaction started along with the first query
+-- ===================================================================
+BEGIN;
+SAVEPOINT a;
+SAVEPOINT b;
+SELECT c1, c2 FROM ft_other WHERE c1 = 1;
+ROLLBACK TO a;
+SELECT c1, c2 FROM ft_other WHERE c1 = 2;
+RELEASE a;
+SELECT c1, c2 FROM ft_other WHERE c1 = 3;
+COMMIT;
+
+-- ===================================================================
+-- test queries of several foreign scans started at once
+-- ===================================================================
+SELECT c1 FROM ft1 WHERE c1 < 3 UNION ALL SELECT c1 FROM ft_other WHERE c1 < 3 ORDER BY 1;
+-- the second scan is never read from
+SELECT c1 FROM ft1 WHERE c1 = 1 UNION ALL SELECT c1 FROM ft_other LIMIT 1;
+
+-- ===================================================================
+-- test scans split over several connections
+-- ===================================================================
+ALTER FOREIGN TABLE ft1 OPTIONS (ADD parallel_connections '0');  -- ERROR
+ALTER FOREIGN TABLE ft1 OPTIONS (ADD parallel_connections '3', ADD partition_column 'c3');
+SELECT count(*) FROM ft1;  -- ERROR
+ALTER FOREIGN TABLE ft1 OPTIONS (SET partition_column 'c1', ADD fetch_size '40');
+EXPLAIN (VERBOSE, COSTS false) SELECT count(*), sum(c1) FROM ft1 WHERE c2 = 5;
+SELECT count(*), sum(c1) FROM ft1 WHERE c2 = 5;
+SELECT count(*), sum(c1) FROM ft1;
+ALTER FOREIGN TABLE ft1 OPTIONS (DROP parallel_connections, DROP partition_column, DROP fetch_size);
+-- without local statistics, the slices split the remote range of the column
+ALTER FOREIGN TABLE ft_other OPTIONS (ADD parallel_connections '4', ADD partition_column 'c1');
+EXPLAIN (VERBOSE, COSTS false) SELECT count(*), sum(c1) FROM ft_other;
+SELECT count(*), sum(c1) FROM ft_other;
+ALTER FOREIGN TABLE ft_other OPTIONS (DROP parallel_connections, DROP partition_column);
+
+-- ===================================================================
+-- test ending remote transactions on several servers at once
+-- ===================================================================
+BEGIN;
+SAVEPOINT a;
+SELECT count(*) FROM ft1 t1 JOIN ft_other t2 ON t1.c1 = t2.c1;
+RELEASE a;
+SAVEPOINT b;
+SELECT c1 FROM ft1 WHERE c1 = 4 UNION ALL SELECT c1 FROM ft_other WHERE c1 = 5;
+ROLLBACK TO b;
+SELECT c1 FROM ft1 WHERE c1 = 6 UNION ALL SELECT c1 FROM ft_other WHERE c1 = 7;
+COMMIT;
+BEGIN;
+SELECT c1 FROM ft1 WHERE c1 = 8 UNION ALL SELECT c1 FROM ft_other WHERE c1 = 9;
+ROLLBACK;
+
+-- ===================================================================
+-- test result cache
+-- ===================================================================
+ALTER FOREIGN TABLE ft_other OPTIONS (ADD cache_ttl '-1');  -- ERROR
+ALTER FOREIGN TABLE ft_other OPTIONS (ADD cache_ttl '');  -- ERROR
+ALTER FOREIGN TABLE ft_other OPTIONS (ADD cache_ttl '3600');
+EXPLAIN (VERBOSE, COSTS false) SELECT c2 FROM ft_other WHERE c1 = 1;
+SELECT c2 FROM ft_other WHERE c1 = 1;
+UPDATE "S 1"."T 2" SET c2 = 'changed' WHERE c1 = 1;
+-- still the cached row
+SELECT c2 FROM ft_other WHERE c1 = 1;
+SELECT postgres_fdw_invalidate_cache('"S 1"."T 2"');  -- ERROR
+SELECT postgres_fdw_invalidate_cache(0::regclass);  -- ERROR
+SELECT postgres_fdw_invalidate_cache('ft_other');
+SELECT c2 FROM ft_other WHERE c1 = 1;
+UPDATE "S 1"."T 2" SET c2 = 'AAA001' WHERE c1 = 1;
+ALTER FOREIGN TABLE ft_other OPTIONS (DROP cache_ttl);
+SELECT c2 FROM ft_other WHERE c1 = 1;
+
+-- ===================================================================
+-- test spooling rows for rescans
+-- ===================================================================
+ALTER SERVER loopback OPTIONS (ADD spool_rescans 'maybe');  -- ERROR
+ALTER FOREIGN TABLE ft1 OPTIONS (ADD spool_rescans 'true', use_prepared_statements 'false');
+CREATE TABLE pt (k int);
+INSERT INTO pt VALUES (3), (150), (500), (3);
+-- the subplan is rescanned for each row of pt, partly read at times
+EXPLAIN (VERBOSE, COSTS false) SELECT k, k < ANY (SELECT c1 FROM ft1 WHERE c1 <= 200) FROM pt;
+SELECT k, k < ANY (SELECT c1 FROM ft1 WHERE c1 <= 200) FROM pt;
+ALTER FOREIGN TABLE ft1 OPTIONS (DROP spool_rescans, DROP use_prepared_statements);
+SELECT k, k < ANY (SELECT c1 FROM ft1 WHERE c1 <= 200) FROM pt;
+DROP TABLE pt;
+
+-- ===================================================================
+-- test checking local conditions before converting all columns
+-- ===================================================================
+-- the other columns are converted only for rows that pass, and whole
+-- batches of rows fail
+SELECT c1, c2, c3, c8 FROM ft1 WHERE postgres_fdw_abs(c1) > 996 ORDER BY c1;
+
+-- ===================================================================
+-- test remote I/O counters of EXPLAIN ANALYZE
+-- ===================================================================
+-- the run time varies, so leave it out
+CREATE FUNCTION explain_analyze(query text) RETURNS SETOF text AS $$
+DECLARE
+	ln text;
+BEGIN
+    FOR ln IN EXECUTE 'EXPLAIN (ANALYZE, TIMING off, COSTS off) ' || query
+    LOOP
+        IF ln NOT LIKE 'Total runtime:%' THEN
+            RETURN NEXT ln;
+        END IF;
+    END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+ALTER FOREIGN TABLE ft1 OPTIONS (ADD fetch_size '300');
+SELECT explain_analyze('SELECT * FROM ft1');
+-- COPY sends the rows without any FETCH
+ALTER FOREIGN TABLE ft1 OPTIONS (ADD copy_threshold '1');
+SELECT explain_analyze('SELECT * FROM ft1');
+ALTER FOREIGN TABLE ft1 OPTIONS (DROP fetch_size, DROP copy_threshold);
+DROP FUNCTION explain_analyze(text);
+
+-- ===================================================================
+-- test cumulative statistics
+-- ===================================================================
+SELECT postgres_fdw_stats_reset();
+SELECT count(*) FROM ft_other;
+SELECT srvname, rows_fetched, commits, aborts, errors
+  FROM postgres_fdw_stats WHERE srvname = 'loopback2';
+-- other roles see only the counters of their own user mappings
+CREATE ROLE regress_fdw_stats_user;
+SET ROLE regress_fdw_stats_user;
+SELECT count(*) FROM postgres_fdw_stats;
+RESET ROLE;
+DROP ROLE regress_fdw_stats_user;
+
+-- ===================================================================
+-- test cost calibration
+-- ===================================================================
+ALTER SERVER loopback2 OPTIONS (ADD calibrate_costs 'maybe');  -- ERROR
+ALTER SERVER loopback OPTIONS (ADD calibrate_costs 'true');
+-- the startup and total cost of the plan, from the first line of EXPLAIN
+CREATE FUNCTION explain_costs(query text, OUT startup numeric, OUT total numeric) AS $$
+DECLARE
+	ln text;
+BEGIN
+    EXECUTE 'EXPLAIN ' || query INTO ln;
+    startup := substring(ln from 'cost=([0-9.]+)\.\.')::numeric;
+    total := substring(ln from '\.\.([0-9.]+) rows=')::numeric;
+END;
+$$ LANGUAGE plpgsql;
+CREATE TEMP TABLE default_costs AS SELECT * FROM explain_costs('SELECT * FROM ft1');
+SELECT startup >= 100 AS default_startup FROM default_costs;
+-- a scan of 1000 rows measures the latency and the cost per row; in large
+-- units of cost, the latency comes to next to nothing, and the cost per row
+-- to its floor, cpu_tuple_cost, which is also the default fdw_tuple_cost
+SELECT count(*) FROM ft1;
+SET postgres_fdw.cost_unit_ms = 1000;
+SELECT d.startup - c.startup > 99 AS latency_measured,
+       c.total - c.startup = d.total - d.startup AS tuple_cost_floored
+  FROM explain_costs('SELECT * FROM ft1') c, default_costs d;
+-- forgetting the measurements brings back the defaults
+SELECT postgres_fdw_flush_estimates();
+SELECT c.startup = d.startup AS default_startup
+  FROM explain_costs('SELECT * FROM ft1') c, default_costs d;
+RESET postgres_fdw.cost_unit_ms;
+ALTER SERVER loopback OPTIONS (DROP calibrate_costs);
+DROP TABLE default_costs;
+DROP FUNCTION explain_costs(text);
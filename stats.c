@@ -0,0 +1,539 @@
+/*-------------------------------------------------------------------------
+ *
+ * stats.c
+ *		  Cumulative statistics of the remote activity of postgres_fdw.
+ *
+ * Each backend counts what it does on behalf of each foreign server and user
+ * mapping: connections opened and reused, commands sent, rows and bytes
+ * received, remote estimates, and the remote transactions it ended.  The
+ * counters are kept in a backend-local hash table, which is cheap to update,
+ * and added to a shared hash table at the end of each transaction, so that
+ * postgres_fdw_stats() can show the totals of all backends.
+ *
+ * The shared table needs postgres_fdw to be loaded by
+ * shared_preload_libraries.  Otherwise, each backend only ever sees its own
+ * counters.
+ *
+ * Portions Copyright (c) 2012-2013, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *		  contrib/postgres_fdw/stats.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "postgres_fdw.h"
+
+#include "access/htup.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_foreign_server.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/syscache.h"
+#include "utils/tuplestore.h"
+
+
+/*
+ * Entry of the backend-local table.  It's never removed, so that pointers to
+ * it can be kept in the connection cache.  The local table holds a single
+ * database's servers, so the key needn't include the database.
+ */
+typedef struct LocalStatsKey
+{
+	Oid			serverid;		/* OID of foreign server */
+	Oid			userid;			/* OID of local user whose mapping we use */
+} LocalStatsKey;
+
+typedef struct LocalStatsEntry
+{
+	LocalStatsKey key;			/* hash key (must be first) */
+	PgFdwStats	counters;		/* counts not yet added to the shared ones */
+} LocalStatsEntry;
+
+/*
+ * Entry of the shared table.  The table's lock protects the set of entries,
+ * and each entry's mutex its counters.
+ */
+typedef struct SharedStatsKey
+{
+	Oid			dbid;			/* OID of the database of the server */
+	Oid			serverid;		/* OID of foreign server */
+	Oid			userid;			/* OID of local user whose mapping we use */
+} SharedStatsKey;
+
+typedef struct SharedStatsEntry
+{
+	SharedStatsKey key;			/* hash key (must be first) */
+	slock_t		mutex;			/* protects the counters */
+	PgFdwStats	counters;
+} SharedStatsEntry;
+
+typedef struct SharedStatsState
+{
+	LWLockId	lock;			/* protects the hash table */
+} SharedStatsState;
+
+/* number of output columns of postgres_fdw_stats() */
+#define PGFDW_STATS_COLS	15
+
+static HTAB *LocalStats = NULL;
+static SharedStatsState *shared_state = NULL;
+static HTAB *SharedStats = NULL;
+
+/* maximum number of shared entries (a GUC) */
+static int	pgfdw_stats_max = 1000;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static Size stats_memsize(void);
+static void stats_shmem_startup(void);
+static void add_counters(PgFdwStats *total, const PgFdwStats *counters);
+static bool counters_are_zero(const PgFdwStats *counters);
+static bool stats_visible(Oid userid);
+static void report_stats(Tuplestorestate *tupstore, TupleDesc tupdesc,
+			 Oid serverid, Oid userid, const PgFdwStats *counters);
+
+extern Datum postgres_fdw_stats(PG_FUNCTION_ARGS);
+extern Datum postgres_fdw_stats_reset(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(postgres_fdw_stats);
+PG_FUNCTION_INFO_V1(postgres_fdw_stats_reset);
+
+
+/*
+ * Set up the shared table, if we're being loaded by shared_preload_libraries.
+ * Called from _PG_init.
+ */
+void
+pgfdw_stats_init(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable("postgres_fdw.stats_max",
+							"Sets the maximum number of foreign servers and user mappings tracked by postgres_fdw_stats.",
+							NULL,
+							&pgfdw_stats_max,
+							1000,
+							100,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	RequestAddinShmemSpace(stats_memsize());
+	RequestAddinLWLocks(1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = stats_shmem_startup;
+}
+
+/*
+ * Estimate the shared memory needed.
+ */
+static Size
+stats_memsize(void)
+{
+	Size		size;
+
+	size = MAXALIGN(sizeof(SharedStatsState));
+	size = add_size(size, hash_estimate_size(pgfdw_stats_max,
+											 sizeof(SharedStatsEntry)));
+
+	return size;
+}
+
+/*
+ * Allocate or attach to the shared table.
+ */
+static void
+stats_shmem_startup(void)
+{
+	HASHCTL		info;
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	shared_state = ShmemInitStruct("postgres_fdw stats",
+								   sizeof(SharedStatsState),
+								   &found);
+	if (!found)
+		shared_state->lock = LWLockAssign();
+
+	MemSet(&info, 0, sizeof(info));
+	info.keysize = sizeof(SharedStatsKey);
+	info.entrysize = sizeof(SharedStatsEntry);
+	info.hash = tag_hash;
+	SharedStats = ShmemInitHash("postgres_fdw stats hash",
+								pgfdw_stats_max, pgfdw_stats_max,
+								&info,
+								HASH_ELEM | HASH_FUNCTION);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Return the local counters of the given server and user mapping, which the
+ * caller may update directly.  The pointer stays valid for the life of the
+ * backend.
+ */
+PgFdwStats *
+pgfdw_get_stats(Oid serverid, Oid userid)
+{
+	LocalStatsEntry *entry;
+	LocalStatsKey key;
+	bool		found;
+
+	if (LocalStats == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(LocalStatsKey);
+		ctl.entrysize = sizeof(LocalStatsEntry);
+		ctl.hash = tag_hash;
+		ctl.hcxt = TopMemoryContext;
+		LocalStats = hash_create("postgres_fdw local stats", 8,
+								 &ctl,
+								 HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+	}
+
+	/* Assume no pad bytes in key struct */
+	key.serverid = serverid;
+	key.userid = userid;
+
+	entry = (LocalStatsEntry *) hash_search(LocalStats, &key,
+											HASH_ENTER, &found);
+	if (!found)
+		MemSet(&entry->counters, 0, sizeof(PgFdwStats));
+
+	return &entry->counters;
+}
+
+/*
+ * Add the local counters to the shared ones, and zero them.  Called at the
+ * end of each transaction that used postgres_fdw.
+ *
+ * If the shared table is full, the counts of servers it doesn't have yet are
+ * lost; that's better than failing the transaction.
+ */
+void
+pgfdw_flush_stats(void)
+{
+	HASH_SEQ_STATUS scan;
+	LocalStatsEntry *entry;
+
+	if (LocalStats == NULL || SharedStats == NULL)
+		return;
+
+	hash_seq_init(&scan, LocalStats);
+	while ((entry = (LocalStatsEntry *) hash_seq_search(&scan)))
+	{
+		SharedStatsKey key;
+		SharedStatsEntry *shared;
+
+		if (counters_are_zero(&entry->counters))
+			continue;
+
+		/* Assume no pad bytes in key struct */
+		key.dbid = MyDatabaseId;
+		key.serverid = entry->key.serverid;
+		key.userid = entry->key.userid;
+
+		/* Look the entry up with just a shared lock, as it's likely there */
+		LWLockAcquire(shared_state->lock, LW_SHARED);
+		shared = (SharedStatsEntry *) hash_search(SharedStats, &key,
+												  HASH_FIND, NULL);
+		if (shared == NULL)
+		{
+			bool		found;
+
+			LWLockRelease(shared_state->lock);
+			LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
+			shared = (SharedStatsEntry *) hash_search(SharedStats, &key,
+													  HASH_ENTER_NULL,
+													  &found);
+			if (shared != NULL && !found)
+			{
+				SpinLockInit(&shared->mutex);
+				MemSet(&shared->counters, 0, sizeof(PgFdwStats));
+			}
+		}
+
+		if (shared != NULL)
+		{
+			/* volatile, to keep the compiler from reordering the updates */
+			volatile SharedStatsEntry *e = shared;
+
+			SpinLockAcquire(&e->mutex);
+			add_counters((PgFdwStats *) &e->counters, &entry->counters);
+			SpinLockRelease(&e->mutex);
+		}
+		LWLockRelease(shared_state->lock);
+
+		MemSet(&entry->counters, 0, sizeof(PgFdwStats));
+	}
+}
+
+/*
+ * Are the counters being added up across backends?  Counting the bytes of
+ * scan results costs a pass over every batch, which we only bother with if
+ * so.
+ */
+bool
+pgfdw_stats_shared(void)
+{
+	return SharedStats != NULL;
+}
+
+/*
+ * Add counters to total.
+ */
+static void
+add_counters(PgFdwStats *total, const PgFdwStats *counters)
+{
+	total->connections_opened += counters->connections_opened;
+	total->connections_reused += counters->connections_reused;
+	total->round_trips += counters->round_trips;
+	total->rows_fetched += counters->rows_fetched;
+	total->bytes_fetched += counters->bytes_fetched;
+	total->remote_estimates += counters->remote_estimates;
+	total->commits += counters->commits;
+	total->commit_time += counters->commit_time;
+	total->aborts += counters->aborts;
+	total->abort_time += counters->abort_time;
+	total->errors += counters->errors;
+}
+
+/*
+ * Have the counters counted anything?
+ */
+static bool
+counters_are_zero(const PgFdwStats *counters)
+{
+	PgFdwStats	zero;
+
+	MemSet(&zero, 0, sizeof(PgFdwStats));
+	return memcmp(counters, &zero, sizeof(PgFdwStats)) == 0;
+}
+
+/*
+ * Can a role other than a superuser see the counters of a user mapping?
+ * Only those of its own mappings, and of the mappings for PUBLIC, which
+ * pg_user_mappings shows to everyone, too; the user names and activity of
+ * other roles are none of its business.
+ */
+static bool
+stats_visible(Oid userid)
+{
+	return userid == GetUserId() || !OidIsValid(userid);
+}
+
+/*
+ * Report the counters of the foreign servers of the current database, one
+ * row per server and user mapping: the totals of all backends if the shared
+ * table is available, else those of the current backend alone.  Roles other
+ * than superusers see only their own rows; see stats_visible.
+ */
+Datum
+postgres_fdw_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS scan;
+	bool		all_users;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	if (tupdesc->natts != PGFDW_STATS_COLS)
+		elog(ERROR, "incorrect number of output arguments");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Make our own activity so far visible */
+	pgfdw_flush_stats();
+
+	/* Other roles' activity is for superusers only */
+	all_users = superuser();
+
+	if (SharedStats != NULL)
+	{
+		SharedStatsEntry *entry;
+
+		LWLockAcquire(shared_state->lock, LW_SHARED);
+
+		hash_seq_init(&scan, SharedStats);
+		while ((entry = (SharedStatsEntry *) hash_seq_search(&scan)))
+		{
+			PgFdwStats	counters;
+
+			if (entry->key.dbid != MyDatabaseId)
+				continue;
+			if (!all_users && !stats_visible(entry->key.userid))
+				continue;
+
+			/* copy the counters, so as not to hold the mutex for long */
+			{
+				volatile SharedStatsEntry *e = entry;
+
+				SpinLockAcquire(&e->mutex);
+				counters = e->counters;
+				SpinLockRelease(&e->mutex);
+			}
+
+			report_stats(tupstore, tupdesc, entry->key.serverid,
+						 entry->key.userid, &counters);
+		}
+
+		LWLockRelease(shared_state->lock);
+	}
+	else if (LocalStats != NULL)
+	{
+		LocalStatsEntry *entry;
+
+		hash_seq_init(&scan, LocalStats);
+		while ((entry = (LocalStatsEntry *) hash_seq_search(&scan)))
+		{
+			if (counters_are_zero(&entry->counters))
+				continue;
+			if (!all_users && !stats_visible(entry->key.userid))
+				continue;
+			report_stats(tupstore, tupdesc, entry->key.serverid,
+						 entry->key.userid, &entry->counters);
+		}
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Add a row for one server and user mapping to the result of
+ * postgres_fdw_stats.  The names are null if the objects have been dropped
+ * since; a user mapping for PUBLIC shows userid 0 and no user name.
+ */
+static void
+report_stats(Tuplestorestate *tupstore, TupleDesc tupdesc,
+			 Oid serverid, Oid userid, const PgFdwStats *counters)
+{
+	Datum		values[PGFDW_STATS_COLS];
+	bool		nulls[PGFDW_STATS_COLS];
+	HeapTuple	tp;
+	int			i = 0;
+
+	memset(values, 0, sizeof(values));
+	memset(nulls, 0, sizeof(nulls));
+
+	values[i++] = ObjectIdGetDatum(serverid);
+	tp = SearchSysCache1(FOREIGNSERVEROID, ObjectIdGetDatum(serverid));
+	if (HeapTupleIsValid(tp))
+	{
+		values[i++] = CStringGetTextDatum(NameStr(((Form_pg_foreign_server) GETSTRUCT(tp))->srvname));
+		ReleaseSysCache(tp);
+	}
+	else
+		nulls[i++] = true;
+
+	values[i++] = ObjectIdGetDatum(userid);
+	tp = SearchSysCache1(AUTHOID, ObjectIdGetDatum(userid));
+	if (HeapTupleIsValid(tp))
+	{
+		values[i++] = CStringGetTextDatum(NameStr(((Form_pg_authid) GETSTRUCT(tp))->rolname));
+		ReleaseSysCache(tp);
+	}
+	else
+		nulls[i++] = true;
+
+	values[i++] = Int64GetDatum(counters->connections_opened);
+	values[i++] = Int64GetDatum(counters->connections_reused);
+	values[i++] = Int64GetDatum(counters->round_trips);
+	values[i++] = Int64GetDatum(counters->rows_fetched);
+	values[i++] = Int64GetDatum(counters->bytes_fetched);
+	values[i++] = Int64GetDatum(counters->remote_estimates);
+	values[i++] = Int64GetDatum(counters->commits);
+	values[i++] = Float8GetDatumFast(counters->commit_time);
+	values[i++] = Int64GetDatum(counters->aborts);
+	values[i++] = Float8GetDatumFast(counters->abort_time);
+	values[i++] = Int64GetDatum(counters->errors);
+
+	Assert(i == PGFDW_STATS_COLS);
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+/*
+ * Zero the counters of the foreign servers of the current database, both
+ * the shared ones and this backend's.  Other backends' counts not added to
+ * the shared table yet are kept.
+ */
+Datum
+postgres_fdw_stats_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS scan;
+
+	if (LocalStats != NULL)
+	{
+		LocalStatsEntry *entry;
+
+		hash_seq_init(&scan, LocalStats);
+		while ((entry = (LocalStatsEntry *) hash_seq_search(&scan)))
+			MemSet(&entry->counters, 0, sizeof(PgFdwStats));
+	}
+
+	if (SharedStats != NULL)
+	{
+		SharedStatsEntry *entry;
+
+		LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
+
+		hash_seq_init(&scan, SharedStats);
+		while ((entry = (SharedStatsEntry *) hash_seq_search(&scan)))
+		{
+			if (entry->key.dbid == MyDatabaseId)
+				hash_search(SharedStats, &entry->key, HASH_REMOVE, NULL);
+		}
+
+		LWLockRelease(shared_state->lock);
+	}
+
+	PG_RETURN_VOID();
+}